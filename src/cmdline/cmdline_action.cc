@@ -477,14 +477,12 @@ bool cmdline_applyaction(string s,
       printf(_("Note: selecting the task \"%s: %s\" for installation\n"),
 	     s.c_str(), t.shortdesc.c_str());
 
-      for(pkgCache::PkgIterator pkg=(*apt_cache_file)->PkgBegin();
-	  !pkg.end(); ++pkg)
-	{
-	  std::set<std::string> *tasks = get_tasks(pkg);
-
-	  for(std::set<std::string>::iterator i = tasks->begin();
-	      i!=tasks->end(); ++i)
-	    if(*i==s)
+      aptitude::apt::symbol_id task_id;
+      if(get_task_names().find(s, task_id))
+	for(pkgCache::PkgIterator pkg=(*apt_cache_file)->PkgBegin();
+	    !pkg.end(); ++pkg)
+	  {
+	    if(get_tasks(pkg).contains(task_id))
 	      rval=cmdline_applyaction(action, pkg,
 				       seen_virtual_packages,
 				       to_install, to_hold, to_remove, to_purge,
@@ -493,7 +491,7 @@ bool cmdline_applyaction(string s,
 				       policy, arch_only,
 				       allow_auto,
                                        term_metrics) && rval;
-	}
+	  }
 
       // break out.
       return rval;
@@ -34,8 +34,10 @@
 #include <generic/apt/apt.h>
 #include <generic/apt/config_signal.h>
 #include <generic/apt/download_install_manager.h>
+#include <generic/util/profile.h>
 
 #include <aptitude.h>
+#include <loggers.h>
 
 
 // System includes:
@@ -99,6 +101,8 @@ int cmdline_do_action(int argc, char *argv[],
 		      bool arch_only,
 		      bool queue_only, int verbose)
 {
+  aptitude::util::profile_phase phase("do-action", aptitude::Loggers::getAptitudeCmdline());
+
   shared_ptr<terminal_io> term = create_terminal();
 
   _error->DumpErrors();
@@ -222,6 +226,7 @@ int cmdline_do_action(int argc, char *argv[],
   // TODO: look for filenames and call dpkg directly if that's the case.
 
   {
+    aptitude::util::profile_phase mark_phase("mark-packages", aptitude::Loggers::getAptitudeCmdline());
     aptitudeDepCache::action_group group(*apt_cache_file, NULL);
 
   // If keep-all is the argument, we expect no patterns and keep all
@@ -375,12 +380,20 @@ int cmdline_do_action(int argc, char *argv[],
     }
   else
     {
-      if(!cmdline_do_prompt(upgrade_mode != no_upgrade,
-			    to_install, to_hold, to_remove, to_purge,
-			    showvers, showdeps, showsize, showwhy,
-			    always_prompt, verbose, assume_yes,
-			    !fix_broken,
-			    policy, arch_only, term))
+      bool confirmed;
+      {
+	// This includes the time spent waiting for the user to
+	// answer the prompt.
+	aptitude::util::profile_phase prompt_phase("prompt", aptitude::Loggers::getAptitudeCmdline());
+	confirmed = cmdline_do_prompt(upgrade_mode != no_upgrade,
+				      to_install, to_hold, to_remove, to_purge,
+				      showvers, showdeps, showsize, showwhy,
+				      always_prompt, verbose, assume_yes,
+				      !fix_broken,
+				      policy, arch_only, term);
+      }
+
+      if(!confirmed)
 	{
 	  printf(_("Abort.\n"));
 	  return 0;
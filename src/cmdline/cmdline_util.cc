@@ -28,6 +28,7 @@
 #include "terminal.h"
 
 #include <aptitude.h>
+#include <loggers.h>
 #include <ui.h>
 #include <progress.h>
 
@@ -38,6 +39,7 @@
 #include <generic/apt/matching/match.h>
 #include <generic/apt/matching/parse.h>
 #include <generic/apt/matching/pattern.h>
+#include <generic/util/profile.h>
 
 
 // System includes:
@@ -422,6 +424,8 @@ namespace
   {
     *target = val;
   }
+
+  aptitude::util::profile_counter bytes_downloaded("bytes-downloaded", "download");
 }
 
 download_manager::result cmdline_do_download(download_manager *m,
@@ -465,7 +469,14 @@ download_manager::result cmdline_do_download(download_manager *m,
 
   do
     {
-      pkgAcquire::RunResult download_res = m->do_download();
+      pkgAcquire::RunResult download_res;
+      {
+	aptitude::util::profile_phase phase("download", aptitude::Loggers::getAptitudeDownload());
+	download_res = m->do_download();
+	bytes_downloaded.add(static_cast<unsigned long long>(log->get_fetched_bytes()));
+      }
+
+      aptitude::util::profile_phase phase("finish", aptitude::Loggers::getAptitudeDownload());
       m->finish(download_res, progress.get(),
 		sigc::bind(sigc::ptr_fun(&assign<download_manager::result>),
 			   &finish_res));
@@ -721,11 +732,11 @@ namespace aptitude
 	      bool applicable = false;
 	      if(it->get_pattern().valid())
 		{
-		  if(matching::get_match(it->get_pattern(),
-					 pkg,
-					 search_info,
-					 *apt_cache_file,
-					 *apt_package_records).valid())
+		  if(matching::test_match(it->get_pattern(),
+					  pkg,
+					  search_info,
+					  *apt_cache_file,
+					  *apt_package_records))
 		    applicable = true;
 		}
 	      else
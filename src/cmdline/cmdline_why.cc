@@ -766,11 +766,11 @@ namespace aptitude
 	    for(std::vector<ref_ptr<pattern> >::const_iterator it = leaves.begin();
 		!reached_leaf && it != leaves.end(); ++it)
 	      {
-		if(get_match((*it),
-			     frontpkg, frontver,
-			     search_info,
-			     *apt_cache_file,
-			     *apt_package_records).valid())
+		if(test_match((*it),
+			      frontpkg, frontver,
+			      search_info,
+			      *apt_cache_file,
+			      *apt_package_records))
 		  reached_leaf = true;
 	      }
 	  if(reached_leaf)
@@ -27,7 +27,9 @@
 #include "aptitude_resolver_universe.h"
 #include "config_signal.h"
 #include "download_queue.h"
+#include "field_index.h"
 #include "pkg_hier.h"
+#include "record_scanner.h"
 #include "resolver_manager.h"
 #include "rev_dep_iterator.h"
 #include "tags.h"
@@ -37,6 +39,7 @@
 #include <cwidget/generic/util/transcode.h>
 
 #include <generic/util/file_cache.h>
+#include <generic/util/profile.h>
 #include <generic/util/util.h>
 
 #include <generic/util/undo.h>
@@ -49,6 +52,8 @@
 #include <apt-pkg/sourcelist.h>
 #include <apt-pkg/version.h>
 
+#include <boost/functional/hash.hpp>
+
 #include <fstream>
 
 #include <signal.h>
@@ -81,6 +86,9 @@ static bool apt_knows_about_rootdir;
 static Configuration *theme_config;
 static Configuration *user_config;
 
+// Counts the package records that are parsed to show descriptions.
+static aptitude::util::profile_counter records_looked_up("records-looked-up");
+
 sigc::signal0<void> cache_closed, cache_reloaded, cache_reload_failed;
 sigc::signal0<void> hier_reloaded;
 sigc::signal0<void> consume_errors;
@@ -367,6 +375,10 @@ void apt_close_cache()
 
   LOG_TRACE(logger, "Tasks reset.");
 
+  aptitude::apt::reset_field_index();
+
+  LOG_TRACE(logger, "Field index reset.");
+
   if(apt_package_records)
     {
       delete apt_package_records;
@@ -409,6 +421,7 @@ void apt_load_cache(OpProgress *progress_bar, bool do_initselections,
     }
 
   LOG_INFO(logger, "Loading apt cache.");
+  aptitude::util::profile_phase phase("load-cache", logger);
 
   aptitudeCacheFile *new_file=new aptitudeCacheFile;
 
@@ -427,10 +440,14 @@ void apt_load_cache(OpProgress *progress_bar, bool do_initselections,
 
   LOG_TRACE(logger, "Opening the apt cache.");
 
-  bool open_failed=!new_file->Open(*progress_bar, do_initselections,
-				   (getuid() == 0) && !simulate,
-				   status_fname)
-    || _error->PendingError();
+  bool open_failed;
+  {
+    aptitude::util::profile_phase open_phase("open-cache", logger);
+    open_failed=!new_file->Open(*progress_bar, do_initselections,
+				(getuid() == 0) && !simulate,
+				status_fname)
+      || _error->PendingError();
+  }
 
   if(open_failed && getuid() == 0)
     {
@@ -480,14 +497,34 @@ void apt_load_cache(OpProgress *progress_bar, bool do_initselections,
   // Um, good time to clear our undo info.
   apt_undos->clear_items();
 
+  LOG_TRACE(logger, "Reading tasks and tags from the package records.");
+  {
+    aptitude::util::profile_phase scan_phase("scan-records", logger);
+    aptitude::apt::record_scanner scanner;
+    scan_tasks(scanner);
+#ifndef HAVE_EPT
+    scan_tags(scanner);
+#endif
+    scanner.scan((*apt_cache_file)->GetCache(), *apt_package_records,
+		 *progress_bar);
+  }
   LOG_TRACE(logger, "Loading task information.");
-  load_tasks(*progress_bar);
+  {
+    aptitude::util::profile_phase tasks_phase("load-tasks", logger);
+    load_tasks(*progress_bar);
+  }
+#ifdef HAVE_EPT
   LOG_TRACE(logger, "Loading tags.");
-#ifndef HAVE_EPT
-  load_tags(*progress_bar);
-#else
-  aptitude::apt::load_tags();
+  {
+    aptitude::util::profile_phase tags_phase("load-tags", logger);
+    aptitude::apt::load_tags();
+  }
 #endif
+  LOG_TRACE(logger, "Loading the field index.");
+  {
+    aptitude::util::profile_phase field_index_phase("load-field-index", logger);
+    aptitude::apt::load_field_index(*progress_bar);
+  }
 
   if(user_pkg_hier)
     {
@@ -511,11 +548,14 @@ void apt_load_cache(OpProgress *progress_bar, bool do_initselections,
 	aptcfg->FindI(PACKAGE "::UI::DownloadCache::MemorySize", 512 * 1024);
       const int download_cache_disk_size   =
 	aptcfg->FindI(PACKAGE "::UI::DownloadCache::DiskSize", 10 * 1024 * 1024);
+      const int download_cache_compression_level =
+	aptcfg->FindI(PACKAGE "::UI::DownloadCache::CompressionLevel", 6);
       try
 	{
 	  download_cache = aptitude::util::file_cache::create(download_cache_file_name,
 							      download_cache_memory_size,
-							      download_cache_disk_size);
+							      download_cache_disk_size,
+							      download_cache_compression_level);
 	}
       catch(cwidget::util::Exception &ex)
 	{
@@ -1213,7 +1253,10 @@ std::wstring get_short_description(const pkgCache::VerIterator &ver,
   if(vf.end())
     return std::wstring();
   else
-    return cw::util::transcode(records->Lookup(vf).ShortDesc());
+    {
+      records_looked_up.increment();
+      return cw::util::transcode(records->Lookup(vf).ShortDesc());
+    }
 #else
   pkgCache::DescIterator d = ver.TranslatedDescription();
 
@@ -1228,7 +1271,10 @@ std::wstring get_short_description(const pkgCache::VerIterator &ver,
     // apt "helpfully" cw::util::transcodes the description for us, instead of
     // providing direct access to it.  So I need to assume that the
     // description is encoded in the current locale.
-    return cwidget::util::transcode(records->Lookup(df).ShortDesc());
+    {
+      records_looked_up.increment();
+      return cwidget::util::transcode(records->Lookup(df).ShortDesc());
+    }
 #endif
 }
 
@@ -1244,7 +1290,10 @@ std::wstring get_long_description(const pkgCache::VerIterator &ver,
   if(vf.end())
     return std::wstring();
   else
-    return cw::util::transcode(records->Lookup(vf).LongDesc());
+    {
+      records_looked_up.increment();
+      return cw::util::transcode(records->Lookup(vf).LongDesc());
+    }
 #else
   pkgCache::DescIterator d = ver.TranslatedDescription();
 
@@ -1256,7 +1305,10 @@ std::wstring get_long_description(const pkgCache::VerIterator &ver,
   if(df.end())
     return std::wstring();
   else
-    return cwidget::util::transcode(records->Lookup(df).LongDesc());
+    {
+      records_looked_up.increment();
+      return cwidget::util::transcode(records->Lookup(df).LongDesc());
+    }
 #endif
 }
 
@@ -1275,6 +1327,25 @@ namespace aptitude
 {
   namespace apt
   {
+    std::size_t hash_pkgcache(pkgCache &cache)
+    {
+      std::size_t rval = 0;
+
+      boost::hash_combine(rval, cache.Head().PackageCount);
+      boost::hash_combine(rval, cache.Head().VersionCount);
+      boost::hash_combine(rval, cache.Head().DependsCount);
+      boost::hash_combine(rval, cache.Head().ProvidesCount);
+
+      for(pkgCache::PkgFileIterator f = cache.FileList(); !f.end(); ++f)
+	{
+	  boost::hash_combine(rval, std::string(f.FileName()));
+	  boost::hash_combine(rval, f->Size);
+	  boost::hash_combine(rval, f->mtime);
+	}
+
+      return rval;
+    }
+
     bool is_full_replacement(const pkgCache::DepIterator &dep)
     {
       if(dep.end())
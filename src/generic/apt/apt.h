@@ -435,6 +435,15 @@ namespace aptitude
 {
   namespace apt
   {
+    /** \brief Hash the package cache itself: the index files it was
+     *  built from and its size.
+     *
+     *  Files derived from the cache (such as the resolver memo) store
+     *  this hash so that they can tell when the cache has changed
+     *  underneath them.
+     */
+    std::size_t hash_pkgcache(pkgCache &cache);
+
     /** \return \b true if the given dependency is a Replaces dependency
      *  and participates in a conflicts/provides/replaces relationship.
      *
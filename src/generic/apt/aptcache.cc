@@ -26,6 +26,7 @@
 #include "aptitude_resolver_universe.h"
 #include "aptitudepolicy.h"
 #include "config_signal.h"
+#include "pkgstates_sidecar.h"
 #include <generic/apt/matching/match.h>
 #include <generic/apt/matching/parse.h>
 #include <generic/apt/matching/pattern.h>
@@ -43,6 +44,8 @@
 #include <apt-pkg/policy.h>
 #include <apt-pkg/version.h>
 
+#include <algorithm>
+#include <memory>
 #include <vector>
 
 #include <unistd.h>
@@ -117,8 +120,8 @@ public:
 
     // make sure that everything is really set.
     owner->MarkAuto(pkg, (prev_flags & Flag::Auto));
-    owner->get_ext_state(pkg).remove_reason=prev_removereason;
-    owner->get_ext_state(pkg).forbidver=prev_forbidver;
+    owner->modify_ext_state(pkg).remove_reason=prev_removereason;
+    owner->modify_ext_state(pkg).forbidver=prev_forbidver;
   }
 };
 
@@ -193,6 +196,7 @@ aptitudeDepCache::action_group::~action_group()
 aptitudeDepCache::aptitudeDepCache(pkgCache *Cache, Policy *Plcy)
   :pkgDepCache(Cache, Plcy), dirty(false), read_only(true),
    package_states(NULL), lock(-1), group_level(0),
+   signalled_changed_packages(NULL),
    new_package_count(0), records(NULL)
 {
   // When the "install recommended packages" flag changes, collect garbage.
@@ -294,31 +298,85 @@ namespace
 	  }
       }
   }
+
+  void parse_user_tags(std::vector<std::string> &tags,
+		       const char *&start, const char *end,
+		       const std::string &package_name)
+  {
+    while(start != end)
+      {
+	while(start != end && isspace(*start))
+	  ++start;
+
+	std::string tag;
+	parse_user_tag(tag, start, end, package_name);
+	tags.push_back(tag);
+      }
+  }
 }
 
-void aptitudeDepCache::parse_user_tags(std::set<user_tag> &tags,
-				       const char *&start, const char *end,
-				       const std::string &package_name)
+aptitudeDepCache::user_tag aptitudeDepCache::intern_user_tag(const std::string &tag)
 {
-  while(start != end)
+  typedef std::map<std::string, user_tag_reference>::const_iterator
+    user_tags_index_iterator;
+  user_tags_index_iterator found = user_tags_index.find(tag);
+  if(found == user_tags_index.end())
     {
-      while(start != end && isspace(*start))
-	++start;
+      user_tag_reference loc(user_tags.size());
+      user_tags.push_back(tag);
+      std::pair<user_tags_index_iterator, bool> tmp(user_tags_index.insert(std::make_pair(tag, loc)));
+      found = tmp.first;
+    }
 
-      std::string tag;
-      parse_user_tag(tag, start, end, package_name);
+  return user_tag(found->second);
+}
 
-      typedef std::map<std::string, user_tag_reference>::const_iterator
-	user_tags_index_iterator;
-      user_tags_index_iterator found = user_tags_index.find(tag);
-      if(found == user_tags_index.end())
-	{
-	  user_tag_reference loc(user_tags.size());
-	  user_tags.push_back(tag);
-	  std::pair<user_tags_index_iterator, bool> tmp(user_tags_index.insert(std::make_pair(tag, loc)));
-	  found = tmp.first;
-	}
-      tags.insert(user_tag(found->second));
+void aptitudeDepCache::restore_ext_state(const PkgIterator &pkg,
+					 const aptitude::apt::saved_package_state &saved,
+					 bool do_dselect,
+					 bool do_initselections)
+{
+  aptitude_state &pkg_state=modify_ext_state(pkg);
+
+  pkg_state.new_package=saved.new_package;
+  pkg_state.upgrade=saved.upgrade;
+
+  if(saved.previously_auto)
+    pkg_state.previously_auto_package = true;
+
+  pkg_state.remove_reason=(changed_reason)saved.remove_reason;
+  pkg_state.selection_state=saved.selection_state;
+  pkg_state.candver=saved.candver;
+  pkg_state.forbidver=saved.forbidver;
+
+  for(std::vector<std::string>::const_iterator it = saved.user_tags.begin();
+      it != saved.user_tags.end(); ++it)
+    pkg_state.user_tags.insert(intern_user_tag(*it));
+
+  if(do_dselect && pkg->SelectedState != saved.dselect_state)
+    {
+      MarkFromDselect(pkg);
+      // dirty should be set to "true" so that we update
+      // the on-disk dselect state ASAP, even if no
+      // package states change as a result.
+      dirty=true;
+
+      // We need to update the package state from the
+      // dselect state regardless of whether we're doing
+      // initselections.  This is so that, e.g., if the
+      // user installed a package outside aptitude (so the
+      // dselect state says to install it), our internal
+      // state isn't left at "remove".  But if we aren't
+      // supposed to set up stored installs/removals, we
+      // should cancel this at the apt-get level (so the
+      // package doesn't get changed if dselect said to
+      // install it, but this isn't stored in our database
+      // for future runs).
+      //
+      // In the past, we skipped doing MarkFromDselect in
+      // this case.  BAD.
+      if(!do_initselections)
+	MarkKeep(pkg, false);
     }
 }
 
@@ -372,15 +430,17 @@ bool aptitudeDepCache::build_selection_list(OpProgress &Prog, bool WithLock,
     }
   // Errrrr, I think we need to do this first in case the stuff below
   // manages to trigger a mark operation.
-  duplicate_cache(&backup_state);
+  reset_backup_state();
 
   FileFd state_file;
 
   // Read in the states that we saved
-  if(status_fname==NULL)
-    state_file.Open(statedir+"pkgstates", FileFd::ReadOnly);
-  else
-    state_file.Open(status_fname, FileFd::ReadOnly);
+  const string statefile = status_fname == NULL ? statedir + "pkgstates" : string(status_fname);
+  state_file.Open(statefile, FileFd::ReadOnly);
+
+  // The sidecar is only kept next to the global state file.
+  const bool use_sidecar = status_fname == NULL &&
+    aptcfg->FindB(PACKAGE "::Pkgstates-Sidecar", true);
 
   // Have to make the file NOT read-only to set up the initial state.
   read_only = false;
@@ -402,106 +462,115 @@ bool aptitudeDepCache::build_selection_list(OpProgress &Prog, bool WithLock,
     }
   else
     {
-      int file_size=state_file.Size();
-      Prog.OverallProgress(0, file_size, 1, _("Reading extended state information"));
-
-      pkgTagFile tagfile(&state_file);
-      pkgTagSection section;
-      int amt=0;
       bool do_dselect=aptcfg->FindB(PACKAGE "::Track-Dselect-State", true);
-      while(tagfile.Step(section))
-	{
-	  std::string package_name(section.FindS("Package"));
-          std::string arch(section.FindS("Architecture"));
-	  PkgIterator pkg;
-          // TODO: Wheezy+n can assume that all sections will have the
-          // Architecture tag (probably ;-).
-          if(arch.empty())
-            pkg=FindPkg(package_name);
-          else
-            pkg=FindPkg(package_name, arch);
-	  if(!pkg.end() && !pkg.VersionList().end())
-	    // Silently ignore unknown packages and packages with no actual
-	    // version.
-	    {
-	      unsigned long tmp=0;
-	      string candver;
 
-	      aptitude_state &pkg_state=get_ext_state(pkg);
+      boost::shared_ptr<aptitude::apt::pkgstates_sidecar> sidecar;
+      if(use_sidecar)
+	sidecar = aptitude::apt::pkgstates_sidecar::open(statefile + ".bin",
+							 statefile,
+							 GetCache());
 
-	      section.FindFlag("Unseen", tmp, 1);
+      if(sidecar.get() != NULL)
+	{
+	  // The sidecar has the same contents as the text file,
+	  // already parsed and indexed by package.
+	  Prog.OverallProgress(0, Head().PackageCount, 1, _("Reading extended state information"));
 
-	      pkg_state.new_package=(tmp==1);
+	  aptitude::apt::saved_package_state saved;
+	  for(PkgIterator pkg=PkgBegin(); !pkg.end(); ++pkg)
+	    if(!pkg.VersionList().end() && sidecar->get(pkg, saved))
+	      restore_ext_state(pkg, saved, do_dselect, do_initselections);
 
-	      tmp=0;
-	      section.FindFlag("Upgrade", tmp, 1);
-	      pkg_state.upgrade=(tmp==1);
+	  Prog.OverallProgress(Head().PackageCount, Head().PackageCount, 1, _("Reading extended state information"));
+	  Prog.Done();
+	}
+      else
+	{
+	  int file_size=state_file.Size();
+	  Prog.OverallProgress(0, file_size, 1, _("Reading extended state information"));
+
+	  // Record what was read, so that the next run can use the
+	  // sidecar instead.
+	  std::auto_ptr<aptitude::apt::pkgstates_sidecar::writer> sidecar_writer;
+	  if(use_sidecar && lock != -1)
+	    sidecar_writer.reset(new aptitude::apt::pkgstates_sidecar::writer(GetCache()));
+
+	  pkgTagFile tagfile(&state_file);
+	  pkgTagSection section;
+	  int amt=0;
+	  while(tagfile.Step(section))
+	    {
+	      std::string package_name(section.FindS("Package"));
+	      std::string arch(section.FindS("Architecture"));
+	      PkgIterator pkg;
+	      // TODO: Wheezy+n can assume that all sections will have the
+	      // Architecture tag (probably ;-).
+	      if(arch.empty())
+		pkg=FindPkg(package_name);
+	      else
+		pkg=FindPkg(package_name, arch);
+	      if(!pkg.end() && !pkg.VersionList().end())
+		// Silently ignore unknown packages and packages with no actual
+		// version.
+		{
+		  aptitude::apt::saved_package_state saved;
+		  unsigned long tmp=0;
 
-	      unsigned long auto_new_install = 0;
-	      section.FindFlag("Auto-New-Install", auto_new_install, 1);
-	      if(auto_new_install)
-		pkg_state.previously_auto_package = true;
+		  section.FindFlag("Unseen", tmp, 1);
+		  saved.new_package=(tmp==1);
 
-	      // The install reason is much more important to preserve
-	      // from previous versions, so support the outdated name
-	      // for it.
-	      changed_reason install_reason=(changed_reason)
-		section.FindI("Install-Reason",
-			      section.FindI("Last-Change", manual));
+		  tmp=0;
+		  section.FindFlag("Upgrade", tmp, 1);
+		  saved.upgrade=(tmp==1);
 
-	      if(install_reason != manual)
-		pkg_state.previously_auto_package = true;
+		  unsigned long auto_new_install = 0;
+		  section.FindFlag("Auto-New-Install", auto_new_install, 1);
 
-	      pkg_state.remove_reason=(changed_reason)
-		section.FindI("Remove-Reason", manual);
+		  // The install reason is much more important to preserve
+		  // from previous versions, so support the outdated name
+		  // for it.
+		  changed_reason install_reason=(changed_reason)
+		    section.FindI("Install-Reason",
+				  section.FindI("Last-Change", manual));
 
-	      candver=section.FindS("Version");
+		  saved.previously_auto =
+		    (auto_new_install || install_reason != manual);
 
-	      pkg_state.selection_state=(pkgCache::State::PkgSelectedState) section.FindI("State", pkgCache::State::Unknown);
-	      pkgCache::State::PkgSelectedState last_dselect_state
-		= (pkgCache::State::PkgSelectedState)
+		  saved.remove_reason=section.FindI("Remove-Reason", manual);
+		  saved.candver=section.FindS("Version");
+		  saved.selection_state=(pkgCache::State::PkgSelectedState) section.FindI("State", pkgCache::State::Unknown);
+		  saved.dselect_state=(pkgCache::State::PkgSelectedState)
 		    section.FindI("Dselect-State", pkg->SelectedState);
-	      pkg_state.candver=candver;
-	      pkg_state.forbidver=section.FindS("ForbidVer");
+		  saved.forbidver=section.FindS("ForbidVer");
 
-	      {
-		const char *start, *end;
-		if(section.Find("User-Tags", start, end))
-		  parse_user_tags(pkg_state.user_tags, start, end,
-				  package_name);
-	      }
+		  {
+		    const char *start, *end;
+		    if(section.Find("User-Tags", start, end))
+		      parse_user_tags(saved.user_tags, start, end,
+				      package_name);
+		  }
 
-	      if(do_dselect && pkg->SelectedState != last_dselect_state)
-		{
-		  MarkFromDselect(pkg);
-		  // dirty should be set to "true" so that we update
-		  // the on-disk dselect state ASAP, even if no
-		  // package states change as a result.
-		  dirty=true;
-
-		  // We need to update the package state from the
-		  // dselect state regardless of whether we're doing
-		  // initselections.  This is so that, e.g., if the
-		  // user installed a package outside aptitude (so the
-		  // dselect state says to install it), our internal
-		  // state isn't left at "remove".  But if we aren't
-		  // supposed to set up stored installs/removals, we
-		  // should cancel this at the apt-get level (so the
-		  // package doesn't get changed if dselect said to
-		  // install it, but this isn't stored in our database
-		  // for future runs).
-		  //
-		  // In the past, we skipped doing MarkFromDselect in
-		  // this case.  BAD.
-		  if(!do_initselections)
-		    MarkKeep(pkg, false);
+		  // Without a Dselect-State field, the saved state
+		  // depends on the package's dselect state right now,
+		  // which the sidecar can't record.
+		  const char *dselect_start, *dselect_end;
+		  if(!section.Find("Dselect-State", dselect_start, dselect_end))
+		    sidecar_writer.reset();
+
+		  if(sidecar_writer.get() != NULL)
+		    sidecar_writer->set(pkg, saved);
+
+		  restore_ext_state(pkg, saved, do_dselect, do_initselections);
 		}
+	      amt+=section.size();
+	      Prog.OverallProgress(amt, file_size, 1, _("Reading extended state information"));
 	    }
-	  amt+=section.size();
-	  Prog.OverallProgress(amt, file_size, 1, _("Reading extended state information"));
+	  Prog.OverallProgress(file_size, file_size, 1, _("Reading extended state information"));
+	  Prog.Done();
+
+	  if(sidecar_writer.get() != NULL && !_error->PendingError())
+	    sidecar_writer->write(statefile + ".bin", statefile);
 	}
-      Prog.OverallProgress(file_size, file_size, 1, _("Reading extended state information"));
-      Prog.Done();
     }
 
   int num=0;
@@ -516,7 +585,7 @@ bool aptitudeDepCache::build_selection_list(OpProgress &Prog, bool WithLock,
   for(pkgCache::PkgIterator i=PkgBegin(); !i.end(); i++)
     {
       StateCache &state=(*this)[i];
-      aptitude_state &estate=get_ext_state(i);
+      aptitude_state &estate=modify_ext_state(i);
 
       if(initial_open) // Don't make everything "new".
 	estate.new_package=false;
@@ -593,7 +662,7 @@ bool aptitudeDepCache::build_selection_list(OpProgress &Prog, bool WithLock,
 
   Prog.OverallProgress(Head().PackageCount, Head().PackageCount, 1, _("Initializing package states"));
 
-  duplicate_cache(&backup_state);
+  reset_backup_state();
 
   if(aptcfg->FindB(PACKAGE "::Auto-Upgrade", false) && do_initselections)
     mark_all_upgradable(aptcfg->FindB(PACKAGE "::Auto-Install", true),
@@ -686,7 +755,7 @@ void aptitudeDepCache::get_upgradable(bool ignore_removed,
 	    {
 	      // This case shouldn't really happen:
 	    case pkgCache::State::Unknown:
-	      estate.selection_state = pkgCache::State::Install;
+	      modify_ext_state(p).selection_state = pkgCache::State::Install;
 	      LOG_WARN(logger, p.FullName(false) << " has not been seen before, but it should have been initialized on startup.");
 
 	      // Fall through
@@ -752,6 +821,11 @@ bool aptitudeDepCache::save_selection_list(OpProgress &prog,
     _error->Error(_("Cannot open Aptitude state file"));
   else
     {
+      // The sidecar is only kept next to the global state file.
+      std::auto_ptr<aptitude::apt::pkgstates_sidecar::writer> sidecar_writer;
+      if(!status_fname && aptcfg->FindB(PACKAGE "::Pkgstates-Sidecar", true))
+	sidecar_writer.reset(new aptitude::apt::pkgstates_sidecar::writer(GetCache()));
+
       int num=0;
       prog.OverallProgress(0, Head().PackageCount, 1, _("Writing extended state information"));
 
@@ -761,47 +835,62 @@ bool aptitudeDepCache::save_selection_list(OpProgress &prog,
 	    StateCache &state=(*this)[i];
 	    aptitude_state &estate=get_ext_state(i);
 
-	    string forbidstr=!estate.forbidver.empty()
-	      ? "ForbidVer: "+estate.forbidver+"\n":"";
+	    // Work out what a later run will read back from this
+	    // stanza; the stanza and the sidecar record are both
+	    // written from it.
+	    aptitude::apt::saved_package_state saved;
+	    saved.new_package=estate.new_package;
+	    saved.selection_state=estate.selection_state;
+	    saved.dselect_state=(pkgCache::State::PkgSelectedState) i->SelectedState;
+	    saved.remove_reason=estate.remove_reason;
+	    saved.forbidver=estate.forbidver;
 
-	    bool upgrade=(!i.CurrentVer().end()) && state.Install();
-	    string upgradestr=upgrade ? "Upgrade: yes\n" : "";
+	    saved.upgrade=(!i.CurrentVer().end()) && state.Install();
 
-	    bool auto_new_install = (i.CurrentVer().end() &&
+	    saved.previously_auto = (i.CurrentVer().end() &&
 				     state.Install() &&
 				     ((state.Flags & Flag::Auto) != 0));
-	    string autostr = auto_new_install ? "Auto-New-Install: yes\n" : "";
-
-	    string tailstr;
 
 	    if(state.Install() &&
 	       !estate.candver.empty() &&
 	       (GetCandidateVer(i).end() ||
 		GetCandidateVer(i).VerStr() != estate.candver))
-	      tailstr = "Version: " + estate.candver + "\n";
+	      saved.candver = estate.candver;
+
+	    // Put the usertags in sorted order so we get predictable
+	    // outputs.
+	    saved.user_tags.reserve(estate.user_tags.size());
+	    for(std::set<user_tag>::const_iterator it
+		  = estate.user_tags.begin(); it != estate.user_tags.end(); ++it)
+	      saved.user_tags.push_back(deref_user_tag(*it));
+	    std::sort(saved.user_tags.begin(), saved.user_tags.end());
+
+	    if(sidecar_writer.get() != NULL)
+	      sidecar_writer->set(i, saved);
+
+	    string forbidstr=!saved.forbidver.empty()
+	      ? "ForbidVer: "+saved.forbidver+"\n":"";
+
+	    string upgradestr=saved.upgrade ? "Upgrade: yes\n" : "";
+
+	    string autostr = saved.previously_auto ? "Auto-New-Install: yes\n" : "";
+
+	    string tailstr;
+
+	    if(!saved.candver.empty())
+	      tailstr = "Version: " + saved.candver + "\n";
 
 	    // Build the list of usertags for this package.
 	    std::string user_tags;
-	    if(!estate.user_tags.empty())
+	    if(!saved.user_tags.empty())
 	      {
 		user_tags = "User-Tags: ";
 
-		// Put the usertags in sorted order so we get
-		// predictable outputs.
-		std::vector<std::string> tmp;
-		tmp.reserve(estate.user_tags.size());
-
-		for(std::set<user_tag>::const_iterator it
-		      = estate.user_tags.begin(); it != estate.user_tags.end(); ++it)
-		  tmp.push_back(deref_user_tag(*it));
-
-		std::sort(tmp.begin(), tmp.end());
-
 		bool first = true;
 		// Append user tags to the field, using double-quotes
 		// if the tag contains spaces or double-quotes.
-		for(std::vector<std::string>::const_iterator it = tmp.begin();
-		    it != tmp.end(); ++it)
+		for(std::vector<std::string>::const_iterator it = saved.user_tags.begin();
+		    it != saved.user_tags.end(); ++it)
 		  {
 		    if(first)
 		      first = false;
@@ -839,10 +928,10 @@ bool aptitudeDepCache::save_selection_list(OpProgress &prog,
 	    std::string line(ssprintf("Package: %s\nArchitecture: %s\nUnseen: %s\nState: %i\nDselect-State: %i\nRemove-Reason: %i\n%s%s%s%s%s\n",
 				      i.Name(),
                                       i.Arch(),
-				      estate.new_package?"yes":"no",
-				      estate.selection_state,
-				      i->SelectedState,
-				      estate.remove_reason,
+				      saved.new_package?"yes":"no",
+				      saved.selection_state,
+				      saved.dselect_state,
+				      saved.remove_reason,
 				      upgradestr.c_str(),
 				      autostr.c_str(),
 				      forbidstr.c_str(),
@@ -905,6 +994,9 @@ bool aptitudeDepCache::save_selection_list(OpProgress &prog,
 	      prog.Done();
 	      return false;
 	    }
+
+	  if(sidecar_writer.get() != NULL)
+	    sidecar_writer->write(statefile + ".bin", statefile);
 	}
     }
 
@@ -922,7 +1014,7 @@ void aptitudeDepCache::set_new_flag(const pkgCache::PkgIterator &pkg,
       return;
     }
 
-  aptitude_state &estate=get_ext_state(pkg);
+  aptitude_state &estate=modify_ext_state(pkg);
 
   if(estate.new_package && !is_new)
     {
@@ -963,13 +1055,13 @@ void aptitudeDepCache::forget_new(undoable **undoer)
   else
     delete undo;
 
-  duplicate_cache(&backup_state);
+  reset_backup_state();
 
   // Umm, is this a hack? dunno.
   cache_reloaded();
 }
 
-undoable *aptitudeDepCache::state_restorer(PkgIterator pkg, StateCache &state, aptitude_state &ext_state)
+undoable *aptitudeDepCache::state_restorer(PkgIterator pkg, const StateCache &state, const aptitude_state &ext_state)
 {
   return new apt_undoer(pkg, state.Mode, state.Flags, state.iFlags,
 			ext_state.remove_reason,
@@ -989,23 +1081,47 @@ void aptitudeDepCache::cleanup_after_change(undo_group *undo,
   // don't know what the previous state was, so we can't possibly
   // build a collection of undoers to return to it or find out which
   // packages changed relative to it.
-  if(backup_state.PkgState == NULL ||
-     backup_state.DepState == NULL ||
-     backup_state.AptitudeState == NULL)
-    return;
+  if(backup_state.PkgState == NULL)
+    {
+      reset_backup_state();
+      return;
+    }
+
+  // Only packages whose apt state differs from the backup or whose
+  // extended state was modified can have changed.
+  std::vector<unsigned long> candidates;
+  find_changed_pkg_states(candidates);
+  for(std::vector<std::pair<unsigned long, aptitude_state> >::const_iterator
+	it = backup_ext_states.begin(); it != backup_ext_states.end(); ++it)
+    candidates.push_back(it->first);
+
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()),
+		   candidates.end());
 
-  for(pkgCache::PkgIterator pkg=PkgBegin(); !pkg.end(); pkg++)
+  for(std::vector<unsigned long>::const_iterator it = candidates.begin();
+      it != candidates.end(); ++it)
     {
+      const unsigned long id = *it;
+      pkgCache::PkgIterator pkg(GetCache(), GetCache().PkgP + id);
+
+      const StateCache &old_state = backup_state.PkgState[id];
+      // Copied, since package_states[id] is modified below.
+      const int ext_index = backup_ext_state_index[id];
+      const aptitude_state old_ext_state(ext_index < 0
+					 ? package_states[id]
+					 : backup_ext_states[ext_index].second);
+
       // Set to true if we should signal that this package's visible
       // state changed.
       bool visibly_changed = false;
 
-      if(PkgState[pkg->ID].Mode!=backup_state.PkgState[pkg->ID].Mode ||
-	 (PkgState[pkg->ID].Flags & pkgCache::Flag::Auto) != (backup_state.PkgState[pkg->ID].Flags & pkgCache::Flag::Auto) ||
-	 package_states[pkg->ID].selection_state!=backup_state.AptitudeState[pkg->ID].selection_state ||
-	 package_states[pkg->ID].reinstall!=backup_state.AptitudeState[pkg->ID].reinstall ||
-	 package_states[pkg->ID].remove_reason!=backup_state.AptitudeState[pkg->ID].remove_reason ||
-	 package_states[pkg->ID].forbidver!=backup_state.AptitudeState[pkg->ID].forbidver)
+      if(PkgState[id].Mode!=old_state.Mode ||
+	 (PkgState[id].Flags & pkgCache::Flag::Auto) != (old_state.Flags & pkgCache::Flag::Auto) ||
+	 package_states[id].selection_state!=old_ext_state.selection_state ||
+	 package_states[id].reinstall!=old_ext_state.reinstall ||
+	 package_states[id].remove_reason!=old_ext_state.remove_reason ||
+	 package_states[id].forbidver!=old_ext_state.forbidver)
 	{
 	  // Technically this could be invoked only when we're really
 	  // about to change a package's state, but placing it here
@@ -1019,41 +1135,34 @@ void aptitudeDepCache::cleanup_after_change(undo_group *undo,
 	  // hard to track down bugs like #432411.
 	  pre_package_state_changed();
 
-	  int n=pkg->ID;
-	  n=n;
-	  char curM=PkgState[pkg->ID].Mode;
-	  curM=curM;
-	  char oldM=backup_state.PkgState[pkg->ID].Mode;
-	  oldM=oldM;
-
 	  if(alter_stickies &&
-	     PkgState[pkg->ID].Mode!=backup_state.PkgState[pkg->ID].Mode &&
-	     package_states[pkg->ID].selection_state==backup_state.AptitudeState[pkg->ID].selection_state)
+	     PkgState[id].Mode!=old_state.Mode &&
+	     package_states[id].selection_state==old_ext_state.selection_state)
 	    // Catch packages which switched without altering their Aptitude
 	    // selection mode
 	    {
-	      switch(PkgState[pkg->ID].Mode)
+	      switch(PkgState[id].Mode)
 		{
 		case ModeDelete:
-		  if(package_states[pkg->ID].selection_state!=pkgCache::State::DeInstall)
+		  if(package_states[id].selection_state!=pkgCache::State::DeInstall)
 		    {
 		      if(!pkg.CurrentVer().end())
-			package_states[pkg->ID].remove_reason=libapt;
+			package_states[id].remove_reason=libapt;
 
-		      package_states[pkg->ID].selection_state=pkgCache::State::DeInstall;
+		      package_states[id].selection_state=pkgCache::State::DeInstall;
 		    }
 		  break;
 		case ModeKeep:
 		  if(!pkg.CurrentVer().end())
-		    package_states[pkg->ID].selection_state=pkgCache::State::Install;
+		    package_states[id].selection_state=pkgCache::State::Install;
 		  else if(pkg->CurrentState==pkgCache::State::NotInstalled)
-		    package_states[pkg->ID].selection_state=pkgCache::State::Purge;
+		    package_states[id].selection_state=pkgCache::State::Purge;
 		  else
-		    package_states[pkg->ID].selection_state=pkgCache::State::DeInstall;
+		    package_states[id].selection_state=pkgCache::State::DeInstall;
 		  break;
 		case ModeInstall:
-		  if(package_states[pkg->ID].selection_state!=pkgCache::State::Install)
-		    package_states[pkg->ID].selection_state=pkgCache::State::Install;
+		  if(package_states[id].selection_state!=pkgCache::State::Install)
+		    package_states[id].selection_state=pkgCache::State::Install;
 		  break;
 		}
 	    }
@@ -1061,25 +1170,33 @@ void aptitudeDepCache::cleanup_after_change(undo_group *undo,
 	  visibly_changed = true;
 
 	  if(undo)
-	    undo->add_item(state_restorer(pkg,
-					  backup_state.PkgState[pkg->ID],
-					  backup_state.AptitudeState[pkg->ID]));
+	    undo->add_item(state_restorer(pkg, old_state, old_ext_state));
 	}
       // Detect things like broken-ness and other changes that
       // shouldn't trigger undo but might trigger updating the
       // package's display.
-      else if(PkgState[pkg->ID].Flags != backup_state.PkgState[pkg->ID].Flags ||
-	      PkgState[pkg->ID].DepState != backup_state.PkgState[pkg->ID].DepState ||
-	      PkgState[pkg->ID].CandidateVer != backup_state.PkgState[pkg->ID].CandidateVer ||
-	      PkgState[pkg->ID].Marked != backup_state.PkgState[pkg->ID].Marked ||
-	      PkgState[pkg->ID].Garbage != backup_state.PkgState[pkg->ID].Garbage ||
-	      package_states[pkg->ID].user_tags != backup_state.AptitudeState[pkg->ID].user_tags ||
-	      package_states[pkg->ID].new_package != backup_state.AptitudeState[pkg->ID].new_package)
+      else if(PkgState[id].Flags != old_state.Flags ||
+	      PkgState[id].DepState != old_state.DepState ||
+	      PkgState[id].CandidateVer != old_state.CandidateVer ||
+	      PkgState[id].Marked != old_state.Marked ||
+	      PkgState[id].Garbage != old_state.Garbage ||
+	      package_states[id].user_tags != old_ext_state.user_tags ||
+	      package_states[id].new_package != old_ext_state.new_package)
 	visibly_changed = true;
 
       if(visibly_changed && changed_packages != NULL)
 	changed_packages->insert(pkg);
     }
+
+  // The candidates are the only packages whose backup is out of date.
+  for(std::vector<unsigned long>::const_iterator it = candidates.begin();
+      it != candidates.end(); ++it)
+    memcpy(&backup_state.PkgState[*it], &PkgState[*it], sizeof(StateCache));
+
+  for(std::vector<std::pair<unsigned long, aptitude_state> >::const_iterator
+	it = backup_ext_states.begin(); it != backup_ext_states.end(); ++it)
+    backup_ext_state_index[it->first] = -1;
+  backup_ext_states.clear();
 }
 
 void aptitudeDepCache::mark_install(const PkgIterator &Pkg,
@@ -1129,9 +1246,9 @@ void aptitudeDepCache::internal_mark_install(const PkgIterator &Pkg,
   if(set_to_manual)
     MarkAuto(Pkg, false);
 
-  get_ext_state(Pkg).selection_state=pkgCache::State::Install;
-  get_ext_state(Pkg).reinstall=ReInstall;
-  get_ext_state(Pkg).forbidver="";
+  modify_ext_state(Pkg).selection_state=pkgCache::State::Install;
+  modify_ext_state(Pkg).reinstall=ReInstall;
+  modify_ext_state(Pkg).forbidver="";
 }
 
 void aptitudeDepCache::mark_delete(const PkgIterator &Pkg,
@@ -1164,15 +1281,15 @@ void aptitudeDepCache::internal_mark_delete(const PkgIterator &Pkg,
   pkgDepCache::MarkDelete(Pkg, Purge);
   pkgDepCache::SetReInstall(Pkg, false);
 
-  get_ext_state(Pkg).selection_state=(Purge?pkgCache::State::Purge:pkgCache::State::DeInstall);
-  get_ext_state(Pkg).reinstall=false;
+  modify_ext_state(Pkg).selection_state=(Purge?pkgCache::State::Purge:pkgCache::State::DeInstall);
+  modify_ext_state(Pkg).reinstall=false;
 
   if(!previously_to_delete)
     {
       if(unused_delete)
-	get_ext_state(Pkg).remove_reason=unused;
+	modify_ext_state(Pkg).remove_reason=unused;
       else
-	get_ext_state(Pkg).remove_reason=manual;
+	modify_ext_state(Pkg).remove_reason=manual;
     }
 }
 
@@ -1212,19 +1329,19 @@ void aptitudeDepCache::internal_mark_keep(const PkgIterator &Pkg, bool Automatic
 
   pkgDepCache::MarkKeep(Pkg, false, !Automatic);
   pkgDepCache::SetReInstall(Pkg, false);
-  get_ext_state(Pkg).reinstall=false;
+  modify_ext_state(Pkg).reinstall=false;
 
   if(Pkg.CurrentVer().end())
     {
       if((*this)[Pkg].iFlags&Purge)
-	get_ext_state(Pkg).selection_state=pkgCache::State::Purge;
+	modify_ext_state(Pkg).selection_state=pkgCache::State::Purge;
       else
-	get_ext_state(Pkg).selection_state=pkgCache::State::DeInstall;
+	modify_ext_state(Pkg).selection_state=pkgCache::State::DeInstall;
     }
   else if(SetHold)
-    get_ext_state(Pkg).selection_state=pkgCache::State::Hold;
+    modify_ext_state(Pkg).selection_state=pkgCache::State::Hold;
   else
-    get_ext_state(Pkg).selection_state=pkgCache::State::Install;
+    modify_ext_state(Pkg).selection_state=pkgCache::State::Install;
 }
 
 void aptitudeDepCache::set_candidate_version(const VerIterator &ver,
@@ -1264,7 +1381,7 @@ void aptitudeDepCache::set_candidate_version(const VerIterator &ver,
       // that seems to store the currently to-be-installed version.
       VerIterator prev=(*this)[(ver.ParentPkg())].InstVerIter(GetCache());
 
-      aptitude_state &estate = get_ext_state(ver.ParentPkg());
+      aptitude_state &estate = modify_ext_state(ver.ParentPkg());
 
       if(ver!=GetCandidateVer(ver.ParentPkg()))
 	estate.candver=ver.VerStr();
@@ -1303,9 +1420,7 @@ void aptitudeDepCache::forbid_upgrade(const PkgIterator &pkg,
       return;
     }
 
-  aptitude_state &estate=get_ext_state(pkg);
-
-  if(verstr!=estate.forbidver)
+  if(verstr!=get_ext_state(pkg).forbidver)
     {
       action_group group(*this, undo);
 
@@ -1315,7 +1430,7 @@ void aptitudeDepCache::forbid_upgrade(const PkgIterator &pkg,
 
       dirty=true;
 
-      estate.forbidver=verstr;
+      modify_ext_state(pkg).forbidver=verstr;
       if(!candver.end() && candver.VerStr()==verstr && (*this)[pkg].Install())
 	MarkKeep(pkg, false);
     }
@@ -1436,7 +1551,7 @@ void aptitudeDepCache::attach_user_tag(const PkgIterator &pkg,
     }
 
   std::pair<std::set<user_tag>::const_iterator, bool> insert_result =
-    get_ext_state(pkg).user_tags.insert(user_tag(found->second));
+    modify_ext_state(pkg).user_tags.insert(user_tag(found->second));
 
   if(insert_result.second)
     {
@@ -1464,7 +1579,7 @@ void aptitudeDepCache::detach_user_tag(const PkgIterator &pkg,
     return;
 
   std::set<user_tag>::size_type num_erased =
-    get_ext_state(pkg).user_tags.erase(user_tag(found->second));
+    modify_ext_state(pkg).user_tags.erase(user_tag(found->second));
 
   if(num_erased > 0)
     {
@@ -1635,6 +1750,51 @@ void aptitudeDepCache::duplicate_cache(apt_state_snapshot *target)
   target->iBadCount=iBadCount;
 }
 
+void aptitudeDepCache::reset_backup_state()
+{
+  const unsigned long count = Head().PackageCount;
+
+  if(backup_state.PkgState == NULL)
+    backup_state.PkgState = new StateCache[count];
+
+  memcpy(backup_state.PkgState, PkgState, sizeof(StateCache) * count);
+
+  backup_ext_states.clear();
+  backup_ext_state_index.assign(count, -1);
+}
+
+void aptitudeDepCache::save_backup_ext_state(unsigned long id)
+{
+  backup_ext_state_index[id] = backup_ext_states.size();
+  backup_ext_states.push_back(std::make_pair(id, package_states[id]));
+}
+
+void aptitudeDepCache::find_changed_pkg_states(std::vector<unsigned long> &out)
+{
+  // Compare whole blocks of packages first: an action usually
+  // touches a handful of packages, and memcmp() skips over the
+  // unchanged blocks much faster than a field-by-field comparison.
+  // Differing bytes don't always mean a differing state (e.g., in
+  // padding), but cleanup_after_change() compares the fields of the
+  // packages found here anyway.
+  const unsigned long block_size = 64;
+  const unsigned long count = Head().PackageCount;
+
+  for(unsigned long block = 0; block < count; block += block_size)
+    {
+      const unsigned long block_end = std::min(count, block + block_size);
+
+      if(memcmp(PkgState + block, backup_state.PkgState + block,
+		sizeof(StateCache) * (block_end - block)) == 0)
+	continue;
+
+      for(unsigned long id = block; id < block_end; ++id)
+	if(memcmp(PkgState + id, backup_state.PkgState + id,
+		  sizeof(StateCache)) != 0)
+	  out.push_back(id);
+    }
+}
+
 // Helpers for aptitudeDepCache::sweep().
 namespace
 {
@@ -1890,9 +2050,10 @@ void aptitudeDepCache::sweep()
 
 		  pre_package_state_changed();
 		  MarkDelete(pkg, purge_unused);
-		  package_states[pkg->ID].selection_state =
+		  aptitude_state &estate = modify_ext_state(pkg);
+		  estate.selection_state =
 		    (purge_unused ? pkgCache::State::Purge : pkgCache::State::DeInstall);
-		  package_states[pkg->ID].remove_reason = unused;
+		  estate.remove_reason = unused;
 		}
 	    }
 	  else
@@ -1900,12 +2061,12 @@ void aptitudeDepCache::sweep()
 	      if(pkg.CurrentVer().end())
 		{
 		  if((*this)[pkg].iFlags & Purge)
-		    package_states[pkg->ID].selection_state = pkgCache::State::Purge;
+		    modify_ext_state(pkg).selection_state = pkgCache::State::Purge;
 		  else
-		    package_states[pkg->ID].selection_state = pkgCache::State::DeInstall;
+		    modify_ext_state(pkg).selection_state = pkgCache::State::DeInstall;
 		}
 	      else
-		package_states[pkg->ID].selection_state = pkgCache::State::Install;
+		modify_ext_state(pkg).selection_state = pkgCache::State::Install;
 	      pre_package_state_changed();
 
 	      if(!PkgState[pkg->ID].Keep())
@@ -1989,9 +2150,9 @@ void aptitudeDepCache::end_action_group(undo_group *undo)
 
       cleanup_after_change(undo, &changed_packages);
 
-      duplicate_cache(&backup_state);
-
+      signalled_changed_packages = &changed_packages;
       package_state_changed();
+      signalled_changed_packages = NULL;
       package_states_changed(&changed_packages);
     }
 
@@ -2020,8 +2181,8 @@ void aptitudeDepCache::restore_apt_state(const apt_state_snapshot *snapshot)
   // memcpy doesn't work here because the aptitude_state structure
   // contains a std::string.  (would it be worthwhile/possible to
   // change things so that it doesn't?)
-  for(unsigned int i=0; i<Head().PackageCount; ++i)
-    package_states[i]=snapshot->AptitudeState[i];
+  for(PkgIterator i=PkgBegin(); !i.end(); ++i)
+    modify_ext_state(i)=snapshot->AptitudeState[i->ID];
 
   iUsrSize=snapshot->iUsrSize;
   iDownloadSize=snapshot->iDownloadSize;
@@ -2112,7 +2273,7 @@ void aptitudeDepCache::apply_solution(const generic_solution<aptitude_universe>
 	  // removal.
 	  internal_mark_delete(pkg, false, false);
 	  if(is_auto && !curver.end())
-	    get_ext_state(pkg).remove_reason = from_resolver;
+	    modify_ext_state(pkg).remove_reason = from_resolver;
 	}
       else if(actionver == curver)
 	{
@@ -2303,7 +2464,7 @@ public:
   bool InRootSet(const pkgCache::PkgIterator &pkg)
   {
     pkgRecords &records(cache.get_records());
-    if(p.valid() && aptitude::matching::get_match(p, pkg, search_info, cache, records).valid())
+    if(p.valid() && aptitude::matching::test_match(p, pkg, search_info, cache, records))
       return true;
     else
       return chain != NULL && chain->InRootSet(pkg);
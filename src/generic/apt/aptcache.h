@@ -55,6 +55,14 @@ class pkgProblemResolver;
 class aptitude_universe;
 template<typename PackageUniverse> class generic_solution;
 
+namespace aptitude
+{
+  namespace apt
+  {
+    struct saved_package_state;
+  }
+}
+
 class aptitudeDepCache:public pkgDepCache, public sigc::trackable
 {
   typedef int user_tag_reference;
@@ -251,9 +259,19 @@ public:
     return user_tags[tag.tag_num];
   }
 private:
-  void parse_user_tags(std::set<user_tag> &tags,
-		       const char *&start, const char *end,
-		       const std::string &package_name);
+  /** \brief Look up the reference of a user tag, adding the tag to
+   *  the list of known tags if it is new.
+   */
+  user_tag intern_user_tag(const std::string &tag);
+
+  /** \brief Set up the extended state of a package from its saved
+   *  state, and bring its selection in line with dselect's if dselect
+   *  changed it since the state was saved.
+   */
+  void restore_ext_state(const PkgIterator &pkg,
+			 const aptitude::apt::saved_package_state &saved,
+			 bool do_dselect,
+			 bool do_initselections);
 
   aptitude_state *package_states;
   // To speed the program up and save memory, I only store one copy of
@@ -280,11 +298,36 @@ private:
   // The current 'group level' -- how many times start_action_group has been
   // called without a matching end_action_group.
 
+  /** \brief The packages that changed in the action group that is
+   *  being closed, while package_state_changed is emitted for it;
+   *  otherwise NULL.
+   */
+  const std::set<pkgCache::PkgIterator> *signalled_changed_packages;
+
   /** The number of "new" packages. */
   int new_package_count;
 
   apt_state_snapshot backup_state;
-  // Stores what the cache was like just before an action was performed
+  // Stores what the cache was like just before an action was performed.
+  // Only its PkgState is filled in; the extended states are kept in
+  // backup_ext_states.
+
+  /** \brief The extended states that packages had when backup_state
+   *  was taken, for each package whose extended state might have been
+   *  modified since then.
+   *
+   *  A package's state is saved here the first time
+   *  modify_ext_state() is invoked on it, so action groups only copy
+   *  and compare the extended states of packages they touch.
+   */
+  std::vector<std::pair<unsigned long, aptitude_state> > backup_ext_states;
+
+  /** \brief For each package ID, the index of its entry in
+   *  backup_ext_states, or -1 if it has none.
+   *
+   *  Empty until backup_state is first taken.
+   */
+  std::vector<int> backup_ext_state_index;
 
   pkgRecords *records;
 
@@ -299,7 +342,7 @@ private:
   /** Call whenever a new resolver should be instantiated. */
   void create_resolver();
 
-  undoable *state_restorer(PkgIterator pkg, StateCache &state, aptitude_state &ext_state);
+  undoable *state_restorer(PkgIterator pkg, const StateCache &state, const aptitude_state &ext_state);
   // Returns an 'undoable' object which will restore the given package to the
   // given state via {Mark,Set}* routines
 
@@ -307,11 +350,31 @@ private:
   // This makes the **ASSUMPTION** that if the target's tables aren't
   // NULL, they're properly sized..
 
+  /** \brief Make backup_state a copy of the current state of the
+   *  cache and forget which packages have been modified.
+   */
+  void reset_backup_state();
+
+  /** \brief Save the extended state of a package in
+   *  backup_ext_states before it is modified.
+   */
+  void save_backup_ext_state(unsigned long id);
+
+  /** \brief Find the packages whose apt state differs from their
+   *  state in backup_state.
+   *
+   *  \param out  The IDs of the packages are appended to this list
+   *               in ascending order.
+   */
+  void find_changed_pkg_states(std::vector<unsigned long> &out);
+
   void cleanup_after_change(undo_group *undo,
 			    std::set<pkgCache::PkgIterator> *changed_packages,
 			    bool alter_stickies=true);
   // Finds anything that magically changed and creates an undo item for it..
   // If alter_stickies is false, sticky states will be left alone.  (hack :( )
+  // Only packages that were modified since backup_state was taken are
+  // examined, and backup_state is brought up to date afterwards.
 
   void MarkFromDselect(const PkgIterator &Pkg);
   // Marks the package based on its current status and its dselect state,
@@ -370,9 +433,25 @@ public:
   /** Gets the number of new packages. */
   int get_new_package_count() const {return new_package_count;}
 
+  /** \brief Retrieve the extended state of a package.
+   *
+   *  Use modify_ext_state() instead to change the state; otherwise
+   *  the change is not noticed by undo and by package_states_changed.
+   */
   inline aptitude_state &get_ext_state(const PkgIterator &Pkg)
   {return package_states[Pkg->ID];}
 
+  /** \brief Retrieve the extended state of a package in order to
+   *  modify it.
+   */
+  inline aptitude_state &modify_ext_state(const PkgIterator &Pkg)
+  {
+    const unsigned long id = Pkg->ID;
+    if(id < backup_ext_state_index.size() && backup_ext_state_index[id] < 0)
+      save_backup_ext_state(id);
+    return package_states[id];
+  }
+
   bool save_selection_list(OpProgress &prog, const char *status_fname=NULL);
   // If the list isn't locked (or an fd isn't provided), is a NOP.
 
@@ -529,6 +608,19 @@ public:
    */
   sigc::signal1<void, const std::set<pkgCache::PkgIterator> *> package_states_changed;
 
+  /** \brief Get the packages whose states changed, if they are known.
+   *
+   *  While package_state_changed is being emitted at the end of an
+   *  action group, this returns the packages whose state changed in
+   *  that group (the set later passed to package_states_changed).
+   *  Otherwise, and in particular when package_state_changed is
+   *  emitted for some other reason, it returns NULL.
+   */
+  const std::set<pkgCache::PkgIterator> *get_changed_packages() const
+  {
+    return signalled_changed_packages;
+  }
+
   // Emitted when a package's categorization is potentially changed.
   // (in particular, when package "new" states are forgotten)
   sigc::signal0<void> package_category_changed;
@@ -39,6 +39,8 @@
 
 #include <loggers.h>
 
+#include <sys/time.h>
+
 using cwidget::util::ssprintf;
 
 namespace
@@ -51,6 +53,18 @@ namespace
   logging::LoggerPtr loggerScores(aptitude::Loggers::getAptitudeResolverScores());
   logging::LoggerPtr loggerCosts(aptitude::Loggers::getAptitudeResolverCosts());
 
+  /** \brief Return the number of milliseconds that have passed since
+   *  the given time.
+   */
+  unsigned long milliseconds_since(const timeval &start)
+  {
+    timeval now;
+    gettimeofday(&now, 0);
+
+    return (now.tv_sec - start.tv_sec) * 1000L
+      + (now.tv_usec - start.tv_usec) / 1000L;
+  }
+
   /** \brief If the given version is valid, find its maximum priority
    *  and return a raise-cost operation for that priority.
    */
@@ -718,14 +732,18 @@ aptitude_resolver::aptitude_resolver(int step_score,
 				     const aptitude_resolver_cost_settings &_cost_settings,
 				     const imm::map<aptitude_resolver_package, aptitude_resolver_version> &initial_installations,
 				     aptitudeDepCache *cache,
-				     pkgPolicy *_policy)
+				     pkgPolicy *_policy,
+				     int threads)
   :generic_problem_resolver<aptitude_universe>(step_score, broken_score, unfixed_soft_score, infinity, resolution_score,
                                                unfixed_soft_cost,
 					       future_horizon,
 					       initial_installations,
-					       aptitude_universe(cache)),
+					       aptitude_universe(cache),
+					       threads),
    policy(_policy),
-   cost_settings(_cost_settings)
+   cost_settings(_cost_settings),
+   have_action_settings(false),
+   current_action_scores(NULL)
 {
   using cwidget::util::ref_ptr;
   using aptitude::matching::pattern;
@@ -735,29 +753,37 @@ aptitude_resolver::aptitude_resolver(int step_score,
 	    << ", infinity = " << infinity << ", resolution_score = " << resolution_score
 	    << ", future_horizon = " << future_horizon << ".");
 
+  for(pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); ++i)
+    update_keep_all_choice(package(i, cache));
+
+  add_keep_all_promotion();
+}
+
+void aptitude_resolver::update_keep_all_choice(const package &p)
+{
+  aptitudeDepCache *cache(get_universe().get_cache());
+  const pkgCache::PkgIterator i(p.get_pkg());
+  version curr;
+  if(i->CurrentState != pkgCache::State::NotInstalled &&
+     i->CurrentState != pkgCache::State::ConfigFiles)
+    curr = version::make_install(i.CurrentVer(), cache);
+  else
+    curr = version::make_removal(i, cache);
+
+  const choice c(choice::make_install_version(curr, 0));
+  keep_all_solution.remove_overlaps(c);
+  if(get_initial_state().version_of(p) != curr)
+    keep_all_solution.insert_or_narrow(c);
+}
+
+void aptitude_resolver::add_keep_all_promotion()
+{
   aptitude_resolver_cost_settings::component safety_component =
     cost_settings.get_or_create_component("safety", aptitude_resolver_cost_settings::maximized);
 
   cfg_level keep_all_level(aptitude_universe::get_keep_all_level());
   cost keep_all_cost(apply_cfg_level(keep_all_level, cost_settings, safety_component));
 
-  for(pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); ++i)
-    {
-      package p(i, cache);
-      version curr;
-      if(i->CurrentState != pkgCache::State::NotInstalled &&
-	 i->CurrentState != pkgCache::State::ConfigFiles)
-	curr = version::make_install(i.CurrentVer(), cache);
-      else
-	curr = version::make_removal(i, cache);
-
-      if(get_initial_state().version_of(p) != curr)
-	{
-	  choice c(choice::make_install_version(curr, 0));
-	  keep_all_solution.insert_or_narrow(c);
-	}
-    }
-
   bool discardNullSolution = aptcfg->FindB(PACKAGE "::ProblemResolver::Discard-Null-Solution", false);
   if(keep_all_solution.size() > 0)
     {
@@ -957,7 +983,7 @@ void aptitude_resolver::add_full_replacement_score(const pkgCache::VerIterator &
 			<< target.FullName(false) << " " << target_ver.VerStr()
 			<< "  (" PACKAGE "::ProblemResolver::UndoFullReplacementScore)");
 
-	      add_joint_score(s, undo_full_replacement_score);
+	      add_action_joint_score(s, undo_full_replacement_score);
 	    }
 	}
     }
@@ -983,9 +1009,9 @@ void aptitude_resolver::add_full_replacement_score(const pkgCache::VerIterator &
 		    << ", which is replaced by "
 		    << src.ParentPkg().FullName(false) << " " << src.VerStr()
 		    << ", which is already installed.  (" PACKAGE "::ProblemResolver::FullReplacementScore)");
-	  add_version_score(version::make_removal(target,
-						  cache),
-			    full_replacement_score);
+	  add_action_score(version::make_removal(target,
+						 cache),
+			   full_replacement_score);
 
 	  // If we are working through a provides, find all versions
 	  // that don't provide the package being replaced and apply
@@ -1007,9 +1033,9 @@ void aptitude_resolver::add_full_replacement_score(const pkgCache::VerIterator &
 				<< src.ParentPkg().FullName(false) << " "
 				<< src.VerStr()
 				<< ", which is already installed).  (" PACKAGE "::ProblemResolver::FullReplacementScore)");
-		      add_version_score(version::make_install(target_ver,
-							      cache),
-					full_replacement_score);
+		      add_action_score(version::make_install(target_ver,
+							     cache),
+				       full_replacement_score);
 		    }
 		}
 	    }
@@ -1031,7 +1057,7 @@ void aptitude_resolver::add_full_replacement_score(const pkgCache::VerIterator &
 		      << src.ParentPkg().FullName(false) << " "
 		      << src.VerStr() << "  (" PACKAGE "::ProblemResolver::FullReplacementScore)");
 
-	    add_joint_score(s, full_replacement_score);
+	    add_action_joint_score(s, full_replacement_score);
 	  }
 
 	  // If we are working through a provides, find all versions
@@ -1060,7 +1086,7 @@ void aptitude_resolver::add_full_replacement_score(const pkgCache::VerIterator &
 				<< " (replaced by " << src.ParentPkg().FullName(false)
 				<< " " << src.VerStr() << ")   (" PACKAGE "::ProblemResolver::FullReplacementScore)");
 
-		      add_joint_score(s, full_replacement_score);
+		      add_action_joint_score(s, full_replacement_score);
 		    }
 		}
 	    }
@@ -1137,7 +1163,7 @@ void aptitude_resolver::add_default_resolution_score(const pkgCache::DepIterator
 		    << target_ver
 		    << "; it is the default apt resolution to the dependency \""
 		    << dep << "\" (" << source_ver << " is already installed)");
-	  add_version_score(source_ver, default_resolution_score);
+	  add_action_score(source_ver, default_resolution_score);
 	}
       else
 	{
@@ -1151,11 +1177,30 @@ void aptitude_resolver::add_default_resolution_score(const pkgCache::DepIterator
 	  imm::set<aptitude_universe::version> s;
 	  s.insert(source_ver);
 	  s.insert(target_ver);
-	  add_joint_score(s, default_resolution_score);
+	  add_action_joint_score(s, default_resolution_score);
 	}
     }
 }
 
+void aptitude_resolver::add_action_score(const version &v, int score)
+{
+  add_version_score(v, score);
+  current_action_scores->scores.push_back(std::make_pair(v, score));
+}
+
+void aptitude_resolver::add_action_joint_score(const imm::set<version> &versions,
+					       int score)
+{
+  add_joint_score(versions, score);
+  current_action_scores->joint_scores.push_back(std::make_pair(versions, score));
+}
+
+void aptitude_resolver::reject_action_version(const version &v)
+{
+  reject_version(v);
+  current_action_scores->rejections.push_back(v);
+}
+
 void aptitude_resolver::add_action_scores(int preserve_score, int auto_score,
 					  int remove_score, int keep_score,
 					  int install_score, int upgrade_score,
@@ -1168,12 +1213,30 @@ void aptitude_resolver::add_action_scores(int preserve_score, int auto_score,
 					  const std::map<package, bool> &initial_state_manual_flags,
 					  const std::vector<hint> &hints)
 {
-  cfg_level safe_level(aptitude_universe::get_safe_level());
-  cfg_level keep_all_level(aptitude_universe::get_keep_all_level());
-  cfg_level remove_level(aptitude_universe::get_remove_level());
-  cfg_level break_hold_level(aptitude_universe::get_break_hold_level());
-  cfg_level non_default_level(aptitude_universe::get_non_default_level());
-  cfg_level remove_essential_level(aptitude_universe::get_remove_essential_level());
+  action_score_settings &settings(action_settings);
+
+  settings.preserve_score = preserve_score;
+  settings.auto_score = auto_score;
+  settings.remove_score = remove_score;
+  settings.keep_score = keep_score;
+  settings.install_score = install_score;
+  settings.upgrade_score = upgrade_score;
+  settings.non_default_score = non_default_score;
+  settings.essential_remove = essential_remove;
+  settings.full_replacement_score = full_replacement_score;
+  settings.undo_full_replacement_score = undo_full_replacement_score;
+  settings.break_hold_score = break_hold_score;
+  settings.allow_break_holds_and_forbids = allow_break_holds_and_forbids;
+  settings.default_resolution_score = default_resolution_score;
+  settings.initial_state_manual_flags = initial_state_manual_flags;
+  settings.hints = hints;
+
+  settings.safe_level = aptitude_universe::get_safe_level();
+  settings.keep_all_level = aptitude_universe::get_keep_all_level();
+  settings.remove_level = aptitude_universe::get_remove_level();
+  settings.break_hold_level = aptitude_universe::get_break_hold_level();
+  settings.non_default_level = aptitude_universe::get_non_default_level();
+  settings.remove_essential_level = aptitude_universe::get_remove_essential_level();
 
   LOG_TRACE(loggerScores, "Setting up action scores; score parameters: preserver_score = " << preserve_score
 	    << ", auto_score = " << auto_score << ", remove_score = " << remove_score
@@ -1185,456 +1248,661 @@ void aptitude_resolver::add_action_scores(int preserve_score, int auto_score,
 	    << ", break_hold_score = " << break_hold_score
 	    << ", allow_break_holds_and_forbids = " << (allow_break_holds_and_forbids ? "true" : "false")
 	    << ", default_resolution_score = " << default_resolution_score);
-  LOG_TRACE(loggerCosts, "Setting up action scores; safety parameters: safe_level = " << safe_level
-	    << ", keep_all_level = " << keep_all_level << ", remove_level = " << remove_level
-	    << ", break_hold_level = " << break_hold_level << ", non_default_level = "
-	    << non_default_level << ", remove_essential_level = " << remove_essential_level << ".");
+  LOG_TRACE(loggerCosts, "Setting up action scores; safety parameters: safe_level = " << settings.safe_level
+	    << ", keep_all_level = " << settings.keep_all_level << ", remove_level = " << settings.remove_level
+	    << ", break_hold_level = " << settings.break_hold_level << ", non_default_level = "
+	    << settings.non_default_level << ", remove_essential_level = " << settings.remove_essential_level << ".");
 
-  cwidget::util::ref_ptr<aptitude::matching::search_cache>
-    search_info(aptitude::matching::search_cache::create());
   aptitudeDepCache *cache(get_universe().get_cache());
-  pkgRecords records(*cache);
-  const resolver_initial_state<aptitude_universe> &initial_state(get_initial_state());
 
-  aptitude_resolver_cost_settings::component
-    safety_component(cost_settings.get_or_create_component("safety", aptitude_resolver_cost_settings::maximized)),
-    priority_component(cost_settings.get_or_create_component("priority", aptitude_resolver_cost_settings::maximized)),
-    removals_component = cost_settings.get_or_create_component("removals", aptitude_resolver_cost_settings::additive),
-    removals_of_manual_component = cost_settings.get_or_create_component("removals-of-manual", aptitude_resolver_cost_settings::additive),
-    installs_component = cost_settings.get_or_create_component("installs", aptitude_resolver_cost_settings::additive),
-    upgrades_component = cost_settings.get_or_create_component("upgrades", aptitude_resolver_cost_settings::additive),
-    non_default_versions_component = cost_settings.get_or_create_component("non-default-versions", aptitude_resolver_cost_settings::additive),
-    broken_holds_component = cost_settings.get_or_create_component("broken-holds", aptitude_resolver_cost_settings::additive),
-    canceled_actions_component = cost_settings.get_or_create_component("canceled-actions", aptitude_resolver_cost_settings::additive);
+  settings.safety_component = cost_settings.get_or_create_component("safety", aptitude_resolver_cost_settings::maximized);
+  settings.priority_component = cost_settings.get_or_create_component("priority", aptitude_resolver_cost_settings::maximized);
+  settings.removals_component = cost_settings.get_or_create_component("removals", aptitude_resolver_cost_settings::additive);
+  settings.removals_of_manual_component = cost_settings.get_or_create_component("removals-of-manual", aptitude_resolver_cost_settings::additive);
+  settings.installs_component = cost_settings.get_or_create_component("installs", aptitude_resolver_cost_settings::additive);
+  settings.upgrades_component = cost_settings.get_or_create_component("upgrades", aptitude_resolver_cost_settings::additive);
+  settings.non_default_versions_component = cost_settings.get_or_create_component("non-default-versions", aptitude_resolver_cost_settings::additive);
+  settings.broken_holds_component = cost_settings.get_or_create_component("broken-holds", aptitude_resolver_cost_settings::additive);
+  settings.canceled_actions_component = cost_settings.get_or_create_component("canceled-actions", aptitude_resolver_cost_settings::additive);
 
   // Resolve the component of each hint into a side table (since hints
   // are supposed to be purely syntactic, it would be wrong to store
   // the component there when we can look it up here with little
   // cost).
-  std::vector<aptitude_resolver_cost_settings::component> hint_components;
+  settings.hint_components.clear();
   for(std::vector<hint>::const_iterator it = hints.begin(); it != hints.end(); ++it)
     {
       switch(it->get_type())
         {
         case hint::add_to_cost_component:
-          hint_components.push_back(cost_settings.get_or_create_component(it->get_component_name(), aptitude_resolver_cost_settings::additive));
+          settings.hint_components.push_back(cost_settings.get_or_create_component(it->get_component_name(), aptitude_resolver_cost_settings::additive));
           break;
 
         case hint::raise_cost_component:
-          hint_components.push_back(cost_settings.get_or_create_component(it->get_component_name(), aptitude_resolver_cost_settings::maximized));
+          settings.hint_components.push_back(cost_settings.get_or_create_component(it->get_component_name(), aptitude_resolver_cost_settings::maximized));
           break;
 
         default:
-          hint_components.push_back(aptitude_resolver_cost_settings::component());
+          settings.hint_components.push_back(aptitude_resolver_cost_settings::component());
           break;
         }
     }
 
+  timeval start;
+  gettimeofday(&start, 0);
+
+  // Find the versions that each hint applies to up front, so that
+  // scoring a version only has to check a bitmap.  Exact package
+  // names are looked up directly; other targets are tested in one
+  // pass over the universe, and only against versions that pass the
+  // version selection, which is much cheaper than the target.  The
+  // removal version of a package matches if the package itself does.
+  settings.hint_targets.clear();
+  settings.hint_targets.resize(hints.size());
+  {
+    cwidget::util::ref_ptr<aptitude::matching::search_cache>
+      search_info(aptitude::matching::search_cache::create());
+    pkgRecords records(*cache);
+
+    for(std::vector<hint>::size_type i = 0; i < hints.size(); ++i)
+      {
+	const hint &h(hints[i]);
+
+	// Bypass hints that are irrelevant.
+	switch(h.get_type())
+	  {
+	  case hint::add_to_cost_component:
+	  case hint::raise_cost_component:
+	    if(!cost_settings.is_component_relevant(settings.hint_components[i]))
+	      continue;
+	    break;
+
+	  default:
+	    break;
+	  }
+
+	std::vector<bool> &targets(settings.hint_targets[i]);
+	targets.resize(get_universe().get_version_count(), false);
+
+	// Most hints name a single package; look it up in the package
+	// hash table instead of testing the name against every package
+	// and version in the cache.
+	if(h.get_target()->get_type() == aptitude::matching::pattern::exact_name)
+	  {
+	    const pkgCache::GrpIterator
+	      grp(cache->GetCache().FindGrp(h.get_target()->get_exact_name_name()));
+
+	    int num_versions = 0;
+	    if(!grp.end())
+	      for(pkgCache::PkgIterator pkg = grp.PackageList();
+		  !pkg.end(); pkg = grp.NextPkg(pkg))
+		{
+		  const aptitude_resolver_version
+		    removal(aptitude_resolver_version::make_removal(pkg, cache));
+		  if(h.get_version_selection().matches(removal))
+		    {
+		      targets[removal.get_id()] = true;
+		      ++num_versions;
+		    }
+
+		  for(pkgCache::VerIterator ver = pkg.VersionList(); !ver.end(); ++ver)
+		    {
+		      const aptitude_resolver_version
+			install(aptitude_resolver_version::make_install(ver, cache));
+		      if(h.get_version_selection().matches(install))
+			{
+			  targets[install.get_id()] = true;
+			  ++num_versions;
+			}
+		    }
+		}
+
+	    LOG_TRACE(loggerHintsMatch, "The hint " << h
+		      << " names a package directly and applies to "
+		      << num_versions << " versions.");
+	    continue;
+	  }
+
+	int num_versions = 0;
+	for(aptitude_universe::package_iterator pi = get_universe().packages_begin();
+	    !pi.end(); ++pi)
+	  {
+	    const aptitude_universe::package p(*pi);
+
+	    for(aptitude_universe::package::version_iterator vi = p.versions_begin();
+		!vi.end(); ++vi)
+	      {
+		const aptitude_universe::version v(*vi);
+
+		if(!h.get_version_selection().matches(v))
+		  continue;
+
+		using aptitude::matching::test_match;
+		const pkgCache::VerIterator apt_ver(v.get_ver());
+		const bool matched = apt_ver.end()
+		  ? test_match(h.get_target(), p.get_pkg(),
+			       search_info, *cache, records)
+		  : test_match(h.get_target(), p.get_pkg(), apt_ver,
+			       search_info, *cache, records);
+
+		if(matched)
+		  {
+		    targets[v.get_id()] = true;
+		    ++num_versions;
+		  }
+	      }
+	  }
+
+	LOG_TRACE(loggerHintsMatch, "The hint " << h << " applies to "
+		  << num_versions << " versions.");
+      }
+  }
+
+  if(!hints.empty())
+    LOG_INFO(loggerScores, "Matched the targets of " << hints.size()
+	     << " hints in " << milliseconds_since(start) << " ms.");
+
+  have_action_settings = true;
+  action_scores.clear();
+  action_scores.resize(get_universe().get_package_count());
+
+  gettimeofday(&start, 0);
+
   // Should I stick with APT iterators instead?  This is a bit more
   // convenient, though..
   for(aptitude_universe::package_iterator pi = get_universe().packages_begin();
       !pi.end(); ++pi)
+    add_package_action_scores(*pi);
+
+  LOG_INFO(loggerScores, "Added action scores to " << action_scores.size()
+	   << " packages in " << milliseconds_since(start) << " ms.");
+}
+
+void aptitude_resolver::add_package_action_scores(const package &p)
+{
+  const action_score_settings &settings(action_settings);
+  aptitudeDepCache *cache(get_universe().get_cache());
+  const resolver_initial_state<aptitude_universe> &initial_state(get_initial_state());
+
+  current_action_scores = &action_scores[p.get_id()];
+
+  aptitudeDepCache::aptitude_state &state=cache->get_ext_state(p.get_pkg());
+  pkgDepCache::StateCache &apt_state = (*cache)[p.get_pkg()];
+
+  // Packages are considered "manual" either if they were manually
+  // installed, or if they are currently installed and were
+  // manually removed.
+  //
+  // There is NO PENALTY for any change to a non-manual package's
+  // state, other than the usual priority-based and non-default
+  // version weighting.
+  bool manual;
+
+  if(initial_state.version_of(p) == p.current_version())
     {
-      const aptitude_universe::package &p=*pi;
-      aptitudeDepCache::aptitude_state &state=cache->get_ext_state(p.get_pkg());
-      pkgDepCache::StateCache &apt_state = (*cache)[p.get_pkg()];
+      const bool was_manually_installed =
+	(!p.current_version().get_ver().end()) && ((apt_state.Flags & pkgCache::Flag::Auto) == 0);
 
-      // Packages are considered "manual" either if they were manually
-      // installed, or if they are currently installed and were
-      // manually removed.
-      //
-      // There is NO PENALTY for any change to a non-manual package's
-      // state, other than the usual priority-based and non-default
-      // version weighting.
-      bool manual;
+      const bool was_manually_removed =
+	p.current_version().get_ver().end() && (p.get_pkg().CurrentVer().end() || state.remove_reason == aptitudeDepCache::manual);
 
-      if(initial_state.version_of(p) == p.current_version())
+      if(was_manually_installed)
+	LOG_TRACE(loggerInitialManualFlags, "Marking " << p << " as manual: it was manually installed.");
+      else if(was_manually_removed)
+	{
+	  if(p.get_pkg().CurrentVer().end())
+	    LOG_TRACE(loggerInitialManualFlags, "Marking " << p << " as manual: it is not currently installed.");
+	  else
+	    LOG_TRACE(loggerInitialManualFlags, "Marking " << p << " as manual: it was manually marked for removal.");
+	}
+      else
+	LOG_TRACE(loggerInitialManualFlags, "Marking " << p << " as automatic: it was neither manually installed nor manually removed.");
+
+      manual =  was_manually_installed || was_manually_removed;
+    }
+  else
+    {
+      std::map<package, bool>::const_iterator found(settings.initial_state_manual_flags.find(p));
+      if(found != settings.initial_state_manual_flags.end())
+	{
+	  manual = found->second;
+	  LOG_TRACE(loggerInitialManualFlags,
+		    "Marking " << p
+		    << " as " << (manual ? "manual" : "automatic") << ", from the list of initial flags.");
+	}
+      else
 	{
-	  const bool was_manually_installed =
-	    (!p.current_version().get_ver().end()) && ((apt_state.Flags & pkgCache::Flag::Auto) == 0);
+	  manual = true;
+	  LOG_TRACE(loggerInitialManualFlags,
+		    "Marking " << p << " as manual: it is not mentioned in the list of initial flags.");
+	}
+    }
+
+  for(aptitude_universe::package::version_iterator vi=p.versions_begin(); !vi.end(); ++vi)
+    {
+      aptitude_universe::version v=*vi;
 
-	  const bool was_manually_removed =
-	    p.current_version().get_ver().end() && (p.get_pkg().CurrentVer().end() || state.remove_reason == aptitudeDepCache::manual);
+      LOG_TRACE(loggerScores, "Adding scores to " << v);
 
-	  if(was_manually_installed)
-	    LOG_TRACE(loggerInitialManualFlags, "Marking " << p << " as manual: it was manually installed.");
-	  else if(was_manually_removed)
+      pkgCache::VerIterator apt_ver(v.get_ver());
+
+      // Apply resolver hints.
+      for(std::vector<hint>::size_type i = 0; i < settings.hints.size(); ++i)
+	{
+	  const hint &h(settings.hints[i]);
+	  const aptitude_resolver_cost_settings::component
+	    &component = settings.hint_components[i];
+	  const std::vector<bool> &targets(settings.hint_targets[i]);
+
+	  // Bypass hints that are irrelevant or that don't apply to
+	  // this version.
+	  if(targets.empty() || !targets[v.get_id()])
+	    continue;
+
+	  // OK, apply the hint.
+	  switch(h.get_type())
 	    {
-	      if(p.get_pkg().CurrentVer().end())
-		LOG_TRACE(loggerInitialManualFlags, "Marking " << p << " as manual: it is not currently installed.");
-	      else
-		LOG_TRACE(loggerInitialManualFlags, "Marking " << p << " as manual: it was manually marked for removal.");
+	    case hint::add_to_cost_component:
+	      LOG_DEBUG(loggerScores, "** Adding " << h.get_amt() << " to the cost component \"" << h.get_component_name() << "\" for " << v);
+	      modify_version_cost(v, cost_settings.add_to_cost(component, h.get_amt()));
+	      break;
+
+	    case hint::discard:
+	      LOG_DEBUG(loggerScores, "** Discarding " << v);
+	      modify_version_cost(v, cost_limits::conflict_cost);
+	      break;
+
+	    case hint::raise_cost_component:
+	      LOG_DEBUG(loggerScores, "** Raising the cost component \"" << h.get_component_name() << "\" to " << h.get_amt() << " for " << v);
+	      modify_version_cost(v, cost_settings.raise_cost(component, h.get_amt()));
+	      break;
+
+	    case hint::reject:
+	      LOG_DEBUG(loggerScores, "** Rejecting " << v << " due to the hint " << h);
+	      reject_action_version(v);
+	      break;
+
+	    case hint::mandate:
+	      LOG_DEBUG(loggerScores, "** Mandating " << v << " due to the hint " << h);
+	      mandate_version(v);
+	      break;
+
+	    case hint::tweak_score:
+	      LOG_DEBUG(loggerScores, "** Score: " << std::showpos << h.get_amt() << std::noshowpos << " for " << v << " due to the hint " << h);
+	      add_action_score(v, h.get_amt());
+	      break;
+
+	    default:
+	      LOG_ERROR(loggerScores, "Bad resolver hint type " << h.get_type());
+	      _error->Error("Bad resolver hint type %d.", h.get_type());
+	      break;
 	    }
-	  else
-	    LOG_TRACE(loggerInitialManualFlags, "Marking " << p << " as automatic: it was neither manually installed nor manually removed.");
-
-	  manual =  was_manually_installed || was_manually_removed;
 	}
-      else
+
+      // We only raise the priority component if v is not the
+      // initial version of p, for two reasons: first and
+      // foremost, this was the old behavior, and I don't want to
+      // change the behavior of the code while I'm changing the
+      // mechanism used to set costs.  Less important but also a
+      // consideration: this is a small optimization (since
+      // there's no point in updating the cost of the initial
+      // version of a package).
+      if(v != initial_state.version_of(p))
+	modify_version_cost(v, raise_priority_op(cost_settings,
+						 v, policy,
+						 settings.priority_component));
+
+      // Remember, the initial version is the InstVer.
+      if(v == initial_state.version_of(p))
 	{
-	  std::map<package, bool>::const_iterator found(initial_state_manual_flags.find(p));
-	  if(found != initial_state_manual_flags.end())
+	  if(manual)
 	    {
-	      manual = found->second;
-	      LOG_TRACE(loggerInitialManualFlags,
-			"Marking " << p
-			<< " as " << (manual ? "manual" : "automatic") << ", from the list of initial flags.");
+	      LOG_DEBUG(loggerScores,
+			"** Score: " << std::showpos << settings.preserve_score
+			<< std::noshowpos << " for " << v
+			<< " because it is the to-be-installed version of a manually installed package (" PACKAGE "::ProblemResolver::PreserveManualScore).");
+	      add_action_score(v, settings.preserve_score);
 	    }
 	  else
 	    {
-	      manual = true;
-	      LOG_TRACE(loggerInitialManualFlags,
-			"Marking " << p << " as manual: it is not mentioned in the list of initial flags.");
+	      LOG_DEBUG(loggerScores,
+			"** Score: " << std::showpos << settings.auto_score
+			<< std::noshowpos << " for " << v
+			<< " because it is the to-be-installed version of an automatically installed package (" PACKAGE "::ProblemResolver::PreserveAutoScore).");
+	      add_action_score(v, settings.auto_score);
 	    }
-	}
 
-      for(aptitude_universe::package::version_iterator vi=p.versions_begin(); !vi.end(); ++vi)
+	  // No change to the cost in this case.
+	}
+      // Ok, if this version is selected it'll be a change.
+      else if(apt_ver == p.get_pkg().CurrentVer())
 	{
-	  aptitude_universe::version v=*vi;
-
-	  LOG_TRACE(loggerScores, "Adding scores to " << v);
-
-	  pkgCache::VerIterator apt_ver(v.get_ver());
-
-	  // Apply resolver hints.
-	  for(std::vector<hint>::const_iterator it = hints.begin();
-	      it != hints.end(); ++it)
+	  if(manual)
 	    {
-	      const hint &h(*it);
-              const aptitude_resolver_cost_settings::component
-                &component = hint_components[it - hints.begin()];
-
-              // Bypass hints that are irrelevant.
-              switch(h.get_type())
-                {
-                case hint::add_to_cost_component:
-                case hint::raise_cost_component:
-                  if(!cost_settings.is_component_relevant(component))
-                    continue;
-                  break;
-
-                default:
-                  break;
-                }
-
-	      using aptitude::matching::get_match;
-
-	      // Check the version selection.  This is quicker than
-	      // the target test, so we do it first.
-	      if(!h.get_version_selection().matches(v))
-		continue;
-
-	      // Now check the target.
-	      if(apt_ver.end())
-		{
-		  if(!get_match(h.get_target(), p.get_pkg(),
-				search_info, *cache,
-				records).valid())
-		    continue;
-		}
-	      else
-		{
-		  if(!get_match(h.get_target(), p.get_pkg(), v.get_ver(),
-				search_info, *cache,
-				records).valid())
-		    continue;
-		}
+	      LOG_DEBUG(loggerScores,
+			"** Score: " << std::showpos << settings.keep_score
+			<< std::noshowpos << " for " << v
+			<< " because it is the currently installed version of a manually installed package  (" PACKAGE "::ProblemResolver::KeepScore).");
+	      add_action_score(v, settings.keep_score);
+	    }
 
-	      // OK, apply the hint.
-	      switch(h.get_type())
-		{
-		case hint::add_to_cost_component:
-                  LOG_DEBUG(loggerScores, "** Adding " << h.get_amt() << " to the cost component \"" << h.get_component_name() << "\" for " << v);
-                  modify_version_cost(v, cost_settings.add_to_cost(component, h.get_amt()));
-                  break;
-
-                case hint::discard:
-                  LOG_DEBUG(loggerScores, "** Discarding " << v);
-                  modify_version_cost(v, cost_limits::conflict_cost);
-                  break;
-
-		case hint::raise_cost_component:
-                  LOG_DEBUG(loggerScores, "** Raising the cost component \"" << h.get_component_name() << "\" to " << h.get_amt() << " for " << v);
-                  modify_version_cost(v, cost_settings.raise_cost(component, h.get_amt()));
-		  break;
-
-		case hint::reject:
-		  LOG_DEBUG(loggerScores, "** Rejecting " << v << " due to the hint " << h);
-		  reject_version(v);
-		  break;
-
-		case hint::mandate:
-		  LOG_DEBUG(loggerScores, "** Mandating " << v << " due to the hint " << h);
-		  mandate_version(v);
-		  break;
-
-		case hint::tweak_score:
-		  LOG_DEBUG(loggerScores, "** Score: " << std::showpos << h.get_amt() << std::noshowpos << " for " << v << " due to the hint " << h);
-		  add_version_score(v, h.get_amt());
-		  break;
-
-		default:
-		  LOG_ERROR(loggerScores, "Bad resolver hint type " << h.get_type());
-		  _error->Error("Bad resolver hint type %d.", h.get_type());
-		  break;
-		}
+	  modify_version_cost(v,
+			      apply_cfg_level(settings.safe_level, cost_settings, settings.safety_component)
+			      + cost_settings.add_to_cost(settings.canceled_actions_component, 1));
+	  LOG_DEBUG(loggerCosts,
+		    "** Safety level raised to at least " << settings.safe_level << " for " << v
+		    << " because it is the currently installed version of a package  (" PACKAGE "::ProblemResolver::Safe-Level)");
+	}
+      else if(apt_ver.end())
+	{
+	  if(manual)
+	    {
+	      LOG_DEBUG(loggerScores,
+			"** Score: " << std::showpos << settings.remove_score
+			<< std::noshowpos << " for " << v
+			<< " because it represents the removal of a manually installed package  (" PACKAGE "::ProblemResolver::RemoveScore).");
+	      add_action_score(v, settings.remove_score);
+	      modify_version_cost(v,
+				  cost_settings.add_to_cost(settings.removals_of_manual_component, 1));
 	    }
 
-          // We only raise the priority component if v is not the
-          // initial version of p, for two reasons: first and
-          // foremost, this was the old behavior, and I don't want to
-          // change the behavior of the code while I'm changing the
-          // mechanism used to set costs.  Less important but also a
-          // consideration: this is a small optimization (since
-          // there's no point in updating the cost of the initial
-          // version of a package).
-          if(v != initial_state.version_of(p))
-            modify_version_cost(v, raise_priority_op(cost_settings,
-                                                     v, policy,
-                                                     priority_component));
-
-	  // Remember, the initial version is the InstVer.
-	  if(v == initial_state.version_of(p))
+	  modify_version_cost(v,
+			      apply_cfg_level(settings.remove_level, cost_settings, settings.safety_component)
+			      + cost_settings.add_to_cost(settings.removals_component, 1));
+	  LOG_DEBUG(loggerCosts,
+		    "** Safety level raised to at least " << settings.remove_level << " for " << v
+		    << " because it represents the removal of a package (" PACKAGE "::ProblemResolver::Removal-Level)");
+	}
+      else if(apt_ver == (*cache)[p.get_pkg()].CandidateVerIter(*cache))
+	{
+	  if(manual)
 	    {
-	      if(manual)
+	      // Could try harder not to break holds.
+	      if(p.get_pkg().CurrentVer().end())
 		{
 		  LOG_DEBUG(loggerScores,
-			    "** Score: " << std::showpos << preserve_score
+			    "** Score: " << std::showpos << settings.install_score
 			    << std::noshowpos << " for " << v
-			    << " because it is the to-be-installed version of a manually installed package (" PACKAGE "::ProblemResolver::PreserveManualScore).");
-		  add_version_score(v, preserve_score);
+			    << " because it is a new install (" PACKAGE "::ProblemResolver::InstallScore).");
+		  add_action_score(v, settings.install_score);
+		  modify_version_cost(v, cost_settings.add_to_cost(settings.installs_component, 1));
 		}
 	      else
 		{
 		  LOG_DEBUG(loggerScores,
-			    "** Score: " << std::showpos << auto_score
+			    "** Score: " << std::showpos << settings.upgrade_score
 			    << std::noshowpos << " for " << v
-			    << " because it is the to-be-installed version of an automatically installed package (" PACKAGE "::ProblemResolver::PreserveAutoScore).");
-		  add_version_score(v, auto_score);
+			    << " because it is an upgrade (" PACKAGE "::ProblemResolver::UpgradeScore).");
+		  add_action_score(v, settings.upgrade_score);
+		  modify_version_cost(v, cost_settings.add_to_cost(settings.upgrades_component, 1));
 		}
-
-	      // No change to the cost in this case.
 	    }
-	  // Ok, if this version is selected it'll be a change.
-	  else if(apt_ver == p.get_pkg().CurrentVer())
-	    {
-	      if(manual)
-		{
-		  LOG_DEBUG(loggerScores,
-			    "** Score: " << std::showpos << keep_score
-			    << std::noshowpos << " for " << v
-			    << " because it is the currently installed version of a manually installed package  (" PACKAGE "::ProblemResolver::KeepScore).");
-		  add_version_score(v, keep_score);
-		}
 
-              modify_version_cost(v,
-                                  apply_cfg_level(safe_level, cost_settings, safety_component)
-                                  + cost_settings.add_to_cost(canceled_actions_component, 1));
-	      LOG_DEBUG(loggerCosts,
-			"** Safety level raised to at least " << safe_level << " for " << v
-			<< " because it is the currently installed version of a package  (" PACKAGE "::ProblemResolver::Safe-Level)");
-	    }
-	  else if(apt_ver.end())
-	    {
-	      if(manual)
-		{
-		  LOG_DEBUG(loggerScores,
-			    "** Score: " << std::showpos << remove_score
-			    << std::noshowpos << " for " << v
-			    << " because it represents the removal of a manually installed package  (" PACKAGE "::ProblemResolver::RemoveScore).");
-		  add_version_score(v, remove_score);
-                  modify_version_cost(v,
-                                      cost_settings.add_to_cost(removals_of_manual_component, 1));
-		}
+	  modify_version_cost(v,
+			      apply_cfg_level(settings.safe_level, cost_settings, settings.safety_component));
+	  LOG_DEBUG(loggerCosts,
+		    "** Safety level raised to at least " << settings.safe_level << " for " << v
+		    << " because it is the default install version of a package (" PACKAGE "::ProblemResolver::Safe-Level).");
+	}
+      else
+	// We know that:
+	//  - this version wasn't requested by the user
+	//  - it's not the current version
+	//  - it's not the candidate version
+	//  - it's not a removal
+	//  - it follows that this is a non-default version.
+	{
+	  LOG_DEBUG(loggerScores,
+		    "** Score: " << std::showpos << settings.non_default_score
+		    << std::noshowpos << " for " << v
+		    << " because it is a non-default version (" PACKAGE "::ProblemResolver::NonDefaultScore).");
+	  add_action_score(v, settings.non_default_score);
+
+	  modify_version_cost(v,
+			      apply_cfg_level(settings.non_default_level, cost_settings, settings.safety_component)
+			      + cost_settings.add_to_cost(settings.non_default_versions_component, 1));
+	  LOG_DEBUG(loggerCosts,
+		    "** Safety level raised to at least " << settings.non_default_level << " for " << v
+		    << " because it is a non-default version (" PACKAGE "::ProblemResolver::Non-Default-Level).");
+	}
 
-              modify_version_cost(v,
-                                  apply_cfg_level(remove_level, cost_settings, safety_component)
-                                  + cost_settings.add_to_cost(removals_component, 1));
-	      LOG_DEBUG(loggerCosts,
-			"** Safety level raised to at least " << remove_level << " for " << v
-			<< " because it represents the removal of a package (" PACKAGE "::ProblemResolver::Removal-Level)");
+      // This logic is slightly duplicated in resolver_manger.cc,
+      // but it's not trivial to merge.
+      if(is_break_hold(v))
+	{
+	  LOG_DEBUG(loggerScores,
+		    "** Score: " << std::showpos << settings.break_hold_score
+		    << std::noshowpos << " for " << v
+		    << " because it breaks a hold/forbid (" PACKAGE "::ProblemResolver::BreakHoldScore).");
+	  add_action_score(v, settings.break_hold_score);
+	  if(!settings.allow_break_holds_and_forbids)
+	    {
+	      LOG_DEBUG(loggerScores,
+			"** Rejecting " << v << " because it breaks a hold/forbid (" PACKAGE "::ProblemResolver::Allow-Break-Holds).");
+	      reject_action_version(v);
 	    }
-	  else if(apt_ver == (*cache)[p.get_pkg()].CandidateVerIter(*cache))
+
+	  modify_version_cost(v,
+			      apply_cfg_level(settings.break_hold_level, cost_settings, settings.safety_component)
+			      + cost_settings.add_to_cost(settings.broken_holds_component, 1));
+	  LOG_DEBUG(loggerCosts,
+		    "** Safety level raised to at least " << settings.break_hold_level << " for " << v
+		    << " because it breaks a hold/forbid (" PACKAGE "::ProblemResolver::Break-Hold-Level).");
+	}
+
+      // In addition, add the essential-removal score:
+      if((p.get_pkg()->Flags & (pkgCache::Flag::Essential |
+				pkgCache::Flag::Important)) &&
+	 apt_ver.end())
+	{
+	  LOG_DEBUG(loggerScores,
+		    "** Score: " << std::showpos << settings.essential_remove
+		    << std::noshowpos << " for " << v
+		    << " because it represents removing an essential package (" PACKAGE "::ProblemResolver::EssentialRemoveScore).");
+	  add_action_score(v, settings.essential_remove);
+
+	  LOG_DEBUG(loggerScores,
+		    "** Rejecting " << v << " because it represents removing an essential package.");
+	  reject_action_version(v);
+
+	  modify_version_cost(v,
+			      apply_cfg_level(settings.remove_essential_level, cost_settings, settings.safety_component));
+	  LOG_DEBUG(loggerCosts,
+		    "** Safety level raised to at least " << settings.remove_essential_level << " for " << v
+		    << " because it represents removing an essential package.");
+	}
+
+      // Look for a conflicts/provides/replaces.
+      if(!apt_ver.end())
+	{
+	  std::set<pkgCache::PkgIterator> replaced_packages;
+	  // Set to true if we're at the first entry in an OR
+	  // group.
+	  bool is_or_head = true;
+	  for(pkgCache::DepIterator dep = apt_ver.DependsList();
+	      !dep.end(); ++dep)
 	    {
-	      if(manual)
+	      if(settings.default_resolution_score != 0 &&
+		 is_or_head && (dep->Type == pkgCache::Dep::Depends ||
+				dep->Type == pkgCache::Dep::Recommends))
 		{
-		  // Could try harder not to break holds.
-		  if(p.get_pkg().CurrentVer().end())
+		  aptitude_resolver_dep d(dep,
+					  pkgCache::PrvIterator(*cache,
+								0, (pkgCache::Version *) 0),
+					  cache);
+
+		  if(d.broken_under(initial_state))
 		    {
-		      LOG_DEBUG(loggerScores,
-				"** Score: " << std::showpos << install_score
-				<< std::noshowpos << " for " << v
-				<< " because it is a new install (" PACKAGE "::ProblemResolver::InstallScore).");
-		      add_version_score(v, install_score);
-                      modify_version_cost(v, cost_settings.add_to_cost(installs_component, 1));
+		      LOG_TRACE(loggerScores,
+				"Adjusting scores to promote a default resolution for \"" << dep << "\"");
+		      // If they aren't satisfied, then give a
+		      // bonus to having the depender and the
+		      // candidate version of the first entry in
+		      // the OR on the system at the same time.
+		      add_default_resolution_score(dep,
+						   settings.default_resolution_score);
 		    }
 		  else
 		    {
-		      LOG_DEBUG(loggerScores,
-				"** Score: " << std::showpos << upgrade_score
-				<< std::noshowpos << " for " << v
-				<< " because it is an upgrade (" PACKAGE "::ProblemResolver::UpgradeScore).");
-		      add_version_score(v, upgrade_score);
-                      modify_version_cost(v, cost_settings.add_to_cost(upgrades_component, 1));
+		      LOG_TRACE(loggerScores,
+				"Not adjusting scores to promote a default resolution for \"" << dep << "\": it is already satisfied.");
 		    }
 		}
 
-              modify_version_cost(v,
-                                  apply_cfg_level(safe_level, cost_settings, safety_component));
-	      LOG_DEBUG(loggerCosts,
-			"** Safety level raised to at least " << safe_level << " for " << v
-			<< " because it is the default install version of a package (" PACKAGE "::ProblemResolver::Safe-Level).");
-	    }
-	  else
-	    // We know that:
-	    //  - this version wasn't requested by the user
-	    //  - it's not the current version
-	    //  - it's not the candidate version
-	    //  - it's not a removal
-	    //  - it follows that this is a non-default version.
-	    {
-	      LOG_DEBUG(loggerScores,
-			"** Score: " << std::showpos << non_default_score
-			<< std::noshowpos << " for " << v
-			<< " because it is a non-default version (" PACKAGE "::ProblemResolver::NonDefaultScore).");
-	      add_version_score(v, non_default_score);
-
-              modify_version_cost(v,
-                                  apply_cfg_level(non_default_level, cost_settings, safety_component)
-                                  + cost_settings.add_to_cost(non_default_versions_component, 1));
-	      LOG_DEBUG(loggerCosts,
-			"** Safety level raised to at least " << non_default_level << " for " << v
-			<< " because it is a non-default version (" PACKAGE "::ProblemResolver::Non-Default-Level).");
-	    }
-
-	  // This logic is slightly duplicated in resolver_manger.cc,
-	  // but it's not trivial to merge.
-	  if(is_break_hold(v))
-	    {
-	      LOG_DEBUG(loggerScores,
-			"** Score: " << std::showpos << break_hold_score
-			<< std::noshowpos << " for " << v
-			<< " because it breaks a hold/forbid (" PACKAGE "::ProblemResolver::BreakHoldScore).");
-	      add_version_score(v, break_hold_score);
-	      if(!allow_break_holds_and_forbids)
+	      if(dep->Type == pkgCache::Dep::Replaces &&
+		 aptitude::apt::is_full_replacement(dep))
 		{
-		  LOG_DEBUG(loggerScores,
-			    "** Rejecting " << v << " because it breaks a hold/forbid (" PACKAGE "::ProblemResolver::Allow-Break-Holds).");
-		  reject_version(v);
-		}
-
-              modify_version_cost(v,
-                                  apply_cfg_level(break_hold_level, cost_settings, safety_component)
-                                  + cost_settings.add_to_cost(broken_holds_component, 1));
-	      LOG_DEBUG(loggerCosts,
-			"** Safety level raised to at least " << break_hold_level << " for " << v
-			<< " because it breaks a hold/forbid (" PACKAGE "::ProblemResolver::Break-Hold-Level).");
-	    }
-
-	  // In addition, add the essential-removal score:
-	  if((p.get_pkg()->Flags & (pkgCache::Flag::Essential |
-				    pkgCache::Flag::Important)) &&
-	     apt_ver.end())
-	    {
-	      LOG_DEBUG(loggerScores,
-			"** Score: " << std::showpos << essential_remove
-			<< std::noshowpos << " for " << v
-			<< " because it represents removing an essential package (" PACKAGE "::ProblemResolver::EssentialRemoveScore).");
-	      add_version_score(v, essential_remove);
-
-	      LOG_DEBUG(loggerScores,
-			"** Rejecting " << v << " because it represents removing an essential package.");
-	      reject_version(v);
-
-              modify_version_cost(v,
-                                  apply_cfg_level(remove_essential_level, cost_settings, safety_component));
-	      LOG_DEBUG(loggerCosts,
-			"** Safety level raised to at least " << remove_essential_level << " for " << v
-			<< " because it represents removing an essential package.");
-	    }
-
-	  // Look for a conflicts/provides/replaces.
-	  if(!apt_ver.end())
-	    {
-	      std::set<pkgCache::PkgIterator> replaced_packages;
-	      // Set to true if we're at the first entry in an OR
-	      // group.
-	      bool is_or_head = true;
-	      for(pkgCache::DepIterator dep = apt_ver.DependsList();
-		  !dep.end(); ++dep)
-		{
-		  if(default_resolution_score != 0 &&
-		     is_or_head && (dep->Type == pkgCache::Dep::Depends ||
-				    dep->Type == pkgCache::Dep::Recommends))
+		  pkgCache::PkgIterator target = dep.TargetPkg();
+		  // First replace the literal package the dep
+		  // names.
+		  if(replaced_packages.find(target) == replaced_packages.end())
 		    {
-		      aptitude_resolver_dep d(dep,
-					      pkgCache::PrvIterator(*cache,
-								    0, (pkgCache::Version *) 0),
-					      cache);
-
-		      if(d.broken_under(initial_state))
-			{
-			  LOG_TRACE(loggerScores,
-				    "Adjusting scores to promote a default resolution for \"" << dep << "\"");
-			  // If they aren't satisfied, then give a
-			  // bonus to having the depender and the
-			  // candidate version of the first entry in
-			  // the OR on the system at the same time.
-			  add_default_resolution_score(dep,
-						       default_resolution_score);
-			}
-		      else
-			{
-			  LOG_TRACE(loggerScores,
-				    "Not adjusting scores to promote a default resolution for \"" << dep << "\": it is already satisfied.");
-			}
+		      replaced_packages.insert(target);
+		      add_full_replacement_score(apt_ver,
+						 target,
+						 pkgCache::VerIterator(*cache),
+						 settings.full_replacement_score,
+						 settings.undo_full_replacement_score);
 		    }
 
-		  if(dep->Type == pkgCache::Dep::Replaces &&
-		     aptitude::apt::is_full_replacement(dep))
+		  // Now find the providers and replace them.  NB:
+		  // providers are versions, not packages; how do
+		  // I handle that?  Add scores to each version
+		  // not providing the given name?
+		  for(pkgCache::PrvIterator prv = target.ProvidesList();
+		      !prv.end(); ++prv)
 		    {
-		      pkgCache::PkgIterator target = dep.TargetPkg();
-		      // First replace the literal package the dep
-		      // names.
-		      if(replaced_packages.find(target) == replaced_packages.end())
+		      pkgCache::VerIterator provider = prv.OwnerVer();
+
+		      if(replaced_packages.find(provider.ParentPkg()) == replaced_packages.end())
 			{
-			  replaced_packages.insert(target);
+			  replaced_packages.insert(provider.ParentPkg());
 			  add_full_replacement_score(apt_ver,
 						     target,
-						     pkgCache::VerIterator(*cache),
-						     full_replacement_score,
-						     undo_full_replacement_score);
-			}
-
-		      // Now find the providers and replace them.  NB:
-		      // providers are versions, not packages; how do
-		      // I handle that?  Add scores to each version
-		      // not providing the given name?
-		      for(pkgCache::PrvIterator prv = target.ProvidesList();
-			  !prv.end(); ++prv)
-			{
-			  pkgCache::VerIterator provider = prv.OwnerVer();
-
-			  if(replaced_packages.find(provider.ParentPkg()) == replaced_packages.end())
-			    {
-			      replaced_packages.insert(provider.ParentPkg());
-			      add_full_replacement_score(apt_ver,
-							 target,
-							 provider,
-							 full_replacement_score,
-							 undo_full_replacement_score);
-			    }
+						     provider,
+						     settings.full_replacement_score,
+						     settings.undo_full_replacement_score);
 			}
 		    }
-
-		  // The next entry is an OR head iff this one terminates the OR list.
-		  is_or_head = (dep->CompareOp & pkgCache::Dep::Or) == 0;
 		}
+
+	      // The next entry is an OR head iff this one terminates the OR list.
+	      is_or_head = (dep->CompareOp & pkgCache::Dep::Or) == 0;
 	    }
 	}
     }
+  current_action_scores = NULL;
+}
 
-  LOG_TRACE(loggerScores, "Done adding action scores to packages.");
+namespace
+{
+  /** \brief Add the packages that have a dependency that pkg could
+   *  satisfy to the given set.
+   */
+  void add_dependers(const pkgCache::PkgIterator &pkg,
+		     aptitudeDepCache *cache,
+		     std::set<aptitude_resolver_package> &out)
+  {
+    for(pkgCache::DepIterator dep = pkg.RevDependsList(); !dep.end(); ++dep)
+      out.insert(aptitude_resolver_package(dep.ParentPkg(), cache));
+
+    for(pkgCache::VerIterator ver = pkg.VersionList(); !ver.end(); ++ver)
+      for(pkgCache::PrvIterator prv = ver.ProvidesList(); !prv.end(); ++prv)
+	for(pkgCache::DepIterator dep = prv.ParentPkg().RevDependsList();
+	    !dep.end(); ++dep)
+	  out.insert(aptitude_resolver_package(dep.ParentPkg(), cache));
+  }
+}
+
+bool aptitude_resolver::update_initial_state(const std::vector<package> &changed_packages)
+{
+  if(!have_action_settings)
+    {
+      LOG_DEBUG(loggerScores, "Not updating the resolver in place: no action scores were assigned.");
+      return false;
+    }
+  else if(!action_settings.hints.empty())
+    {
+      LOG_DEBUG(loggerScores, "Not updating the resolver in place: hints can depend on the state of any package.");
+      return false;
+    }
+
+  aptitudeDepCache *cache(get_universe().get_cache());
+
+  // The action scores of a package depend on its own state and on
+  // which of its dependencies are broken in the initial state, so
+  // they have to be recomputed for the packages that changed and for
+  // the packages that depend on them.
+  std::set<package> affected;
+  for(std::vector<package>::const_iterator it = changed_packages.begin();
+      it != changed_packages.end(); ++it)
+    {
+      affected.insert(*it);
+      add_dependers(it->get_pkg(), cache, affected);
+    }
+
+  LOG_DEBUG(loggerScores, "Updating the resolver in place: " << changed_packages.size()
+	    << " packages changed state, recomputing the action scores of "
+	    << affected.size() << " packages.");
+
+  // Conflicts that were found by searching only depend on the
+  // dependencies, unless a version was discarded because of its
+  // relationship to the initial state; in that case, throw all the
+  // promotions away.
+  const action_score_settings &settings(action_settings);
+  const bool keep_conflicts =
+    !aptcfg->FindB(PACKAGE "::ProblemResolver::Discard-Null-Solution", false) &&
+    !settings.safe_level.get_is_discard() &&
+    !settings.keep_all_level.get_is_discard() &&
+    !settings.remove_level.get_is_discard() &&
+    !settings.break_hold_level.get_is_discard() &&
+    !settings.non_default_level.get_is_discard() &&
+    !settings.remove_essential_level.get_is_discard();
+
+  restart(keep_conflicts);
+
+  for(std::set<package>::const_iterator it = affected.begin();
+      it != affected.end(); ++it)
+    {
+      package_action_scores &entry(action_scores[it->get_id()]);
+
+      for(std::vector<std::pair<version, int> >::const_iterator sIt = entry.scores.begin();
+	  sIt != entry.scores.end(); ++sIt)
+	add_version_score(sIt->first, -sIt->second);
+
+      entry = package_action_scores();
+
+      // Only the package's own entry modified the costs of its
+      // versions.
+      for(package::version_iterator vi = it->versions_begin(); !vi.end(); ++vi)
+	set_version_cost(*vi, cost());
+
+      add_package_action_scores(*it);
+    }
+
+  // restart() dropped the joint scores and the rejections; whether
+  // a joint score applies depends on the initial state, so they all
+  // have to be added again.
+  for(std::vector<package_action_scores>::const_iterator it = action_scores.begin();
+      it != action_scores.end(); ++it)
+    {
+      for(std::vector<std::pair<imm::set<version>, int> >::const_iterator jIt = it->joint_scores.begin();
+	  jIt != it->joint_scores.end(); ++jIt)
+	add_joint_score(jIt->first, jIt->second);
+
+      for(std::vector<version>::const_iterator rIt = it->rejections.begin();
+	  rIt != it->rejections.end(); ++rIt)
+	reject_version(*rIt);
+    }
+
+  update_initial_broken(changed_packages);
+
+  for(std::vector<package>::const_iterator it = changed_packages.begin();
+      it != changed_packages.end(); ++it)
+    update_keep_all_choice(*it);
+  add_keep_all_promotion();
+
+  return true;
 }
 
 void aptitude_resolver::add_priority_scores(int important,
@@ -67,6 +67,60 @@ class aptitude_resolver:public generic_problem_resolver<aptitude_universe>
 
   aptitude_resolver_cost_settings cost_settings;
 
+  /** \brief What add_action_scores() did on behalf of a single
+   *  package, apart from modifying the costs of its own versions.
+   *
+   *  Kept so that the package's contribution can be taken back when
+   *  its initial state changes.
+   */
+  struct package_action_scores
+  {
+    std::vector<std::pair<version, int> > scores;
+    std::vector<std::pair<imm::set<version>, int> > joint_scores;
+    std::vector<version> rejections;
+  };
+
+  /** \brief \b true once add_action_scores() has been invoked. */
+  bool have_action_settings;
+
+  /** \brief The contribution of each package to the scores, indexed
+   *  by package ID.
+   */
+  std::vector<package_action_scores> action_scores;
+
+  /** \brief The entry in action_scores that is being filled in, or
+   *  NULL.
+   */
+  package_action_scores *current_action_scores;
+
+  /** \brief Add to the score of a version on behalf of the package
+   *  whose action scores are being computed.
+   */
+  void add_action_score(const version &v, int score);
+
+  /** \brief Add a joint score on behalf of the package whose action
+   *  scores are being computed.
+   */
+  void add_action_joint_score(const imm::set<version> &versions, int score);
+
+  /** \brief Reject a version on behalf of the package whose action
+   *  scores are being computed.
+   */
+  void reject_action_version(const version &v);
+
+  /** \brief Assign the action scores and costs of a single package. */
+  void add_package_action_scores(const package &p);
+
+  /** \brief Bring the entry for p in the keep-all solution up to
+   *  date.
+   */
+  void update_keep_all_choice(const package &p);
+
+  /** \brief Give the keep-all solution the cost that it should have
+   *  according to the configuration.
+   */
+  void add_keep_all_promotion();
+
   void add_full_replacement_score(const pkgCache::VerIterator &src,
 				  const pkgCache::PkgIterator &real_target,
 				  const pkgCache::VerIterator &provider,
@@ -448,7 +502,8 @@ public:
 		    const aptitude_resolver_cost_settings &_cost_settings,
 		    const imm::map<aptitude_resolver_package, aptitude_resolver_version> &initial_installations,
 		    aptitudeDepCache *cache,
-		    pkgPolicy *_policy);
+		    pkgPolicy *_policy,
+		    int threads = 1);
 
   /** \brief Return \b true if the given version will break a hold or
    *  install a forbidden version.
@@ -542,10 +597,72 @@ public:
   void add_priority_scores(int important, int required, int standard,
 			   int optional, int extra);
 
+  /** \brief Bring the resolver up to date after the initial
+   *  versions of some packages changed, without rebuilding it.
+   *
+   *  The action scores and costs of the packages that changed, and
+   *  of the packages that depend on them, are recomputed; the
+   *  initially broken dependencies and the keep-all solution are
+   *  updated to match.  The search, the user's constraints, and any
+   *  promotions that might depend on the old state are thrown away,
+   *  as if the resolver had just been created.
+   *
+   *  Must not be invoked while the resolver is running.
+   *
+   *  \param changed_packages  Every package whose state might have
+   *                           changed since the resolver was created
+   *                           or last updated.
+   *
+   *  \return \b false if the resolver can't be updated in place
+   *  (because add_action_scores() was never invoked, or because it
+   *  was given hints, which might depend on the state of any
+   *  package); in that case nothing is changed and the caller
+   *  should create a new resolver.
+   */
+  bool update_initial_state(const std::vector<package> &changed_packages);
+
   /** \return the "keep-all" solution, the solution that cancels
    *  all of the user's planned actions.
    */
   choice_set get_keep_all_solution() const;
+
+private:
+  /** \brief The arguments to the last add_action_scores() call, with
+   *  the configuration and cost components it looked up.
+   */
+  struct action_score_settings
+  {
+    int preserve_score, auto_score;
+    int remove_score, keep_score;
+    int install_score, upgrade_score;
+    int non_default_score, essential_remove;
+    int full_replacement_score;
+    int undo_full_replacement_score;
+    int break_hold_score;
+    bool allow_break_holds_and_forbids;
+    int default_resolution_score;
+    std::map<package, bool> initial_state_manual_flags;
+    std::vector<hint> hints;
+
+    cfg_level safe_level, keep_all_level, remove_level;
+    cfg_level break_hold_level, non_default_level, remove_essential_level;
+
+    aptitude_resolver_cost_settings::component
+      safety_component, priority_component, removals_component,
+      removals_of_manual_component, installs_component,
+      upgrades_component, non_default_versions_component,
+      broken_holds_component, canceled_actions_component;
+
+    std::vector<aptitude_resolver_cost_settings::component> hint_components;
+
+    /** \brief For each hint, whether it applies to each version
+     *  (both its target and its version selection match), indexed
+     *  by the version's ID; empty for hints that are bypassed.
+     */
+    std::vector<std::vector<bool> > hint_targets;
+  };
+
+  action_score_settings action_settings;
 };
 
 std::ostream &operator<<(std::ostream &out, const aptitude_resolver::hint &hint);
@@ -12,8 +12,12 @@
 
 #include <apt-pkg/error.h>
 
+#include <cwidget/generic/threads/threads.h>
+#include <cwidget/generic/util/exception.h>
 #include <cwidget/generic/util/ssprintf.h>
 
+#include <boost/make_shared.hpp>
+
 #include <aptitude.h>
 #include <loggers.h>
 
@@ -486,7 +490,7 @@ bool aptitude_resolver_dep::solved_by(const aptitude_resolver_version &v) const
     }
 }
 
-aptitude_resolver_dep::solver_iterator &aptitude_resolver_dep::solver_iterator::operator++()
+void aptitude_resolver_dep::solver_iterator::advance()
 {
   eassert(!end());
 
@@ -504,8 +508,6 @@ aptitude_resolver_dep::solver_iterator &aptitude_resolver_dep::solver_iterator::
     finished=true;
 
   normalize();
-
-  return *this;
 }
 
 aptitude_resolver_version::dep_iterator &aptitude_resolver_version::dep_iterator::operator++()
@@ -518,7 +520,7 @@ aptitude_resolver_version::dep_iterator &aptitude_resolver_version::dep_iterator
   return *this;
 }
 
-aptitude_resolver_version aptitude_resolver_dep::solver_iterator::operator*() const
+aptitude_resolver_version aptitude_resolver_dep::solver_iterator::get_current() const
 {
   eassert(!end());
 
@@ -910,3 +912,261 @@ bool aptitude_universe::is_candidate_for_initial_set(const aptitude_resolver_dep
   // Return true only if the dependency is *currently* not broken.
   return (*cache)[d2] & pkgDepCache::DepGNow;
 }
+
+const aptitude_compiled_universe *aptitude_compiled_universe::active = NULL;
+
+/** \brief The solvers and reverse dependencies of a contiguous range
+ *  of versions, as collected by a single compiler.
+ */
+struct aptitude_compiled_universe::slice
+{
+  /** \brief The ID of each dependency whose solvers were collected,
+   *  paired with the number of solvers it has.
+   */
+  std::vector<std::pair<unsigned long, std::size_t> > solver_counts;
+  std::vector<aptitude_resolver_version> solvers;
+
+  /** \brief The ID of each version, paired with the number of reverse
+   *  dependencies it has.
+   */
+  std::vector<std::pair<unsigned long, std::size_t> > revdep_counts;
+  std::vector<aptitude_resolver_dep> revdeps;
+
+  /** \brief Set to \b true if the compiler threw an exception. */
+  bool failed;
+
+  slice()
+    : failed(false)
+  {
+  }
+};
+
+/** \brief Collects the solvers and reverse dependencies of a range of
+ *  versions into a slice.
+ *
+ *  Compilers only read the package cache and the memoization tables
+ *  of is_interesting_dep() and surrounding_or(), which compile()
+ *  fills in for every dependency before it starts them, so several
+ *  compilers can run at once on disjoint ranges.
+ */
+class aptitude_compiled_universe::compiler
+{
+  pkgDepCache *cache;
+  std::vector<pkgCache::Version *>::const_iterator begin, end;
+  slice &result;
+
+public:
+  compiler(pkgDepCache *_cache,
+	   std::vector<pkgCache::Version *>::const_iterator _begin,
+	   std::vector<pkgCache::Version *>::const_iterator _end,
+	   slice &_result)
+    : cache(_cache), begin(_begin), end(_end), result(_result)
+  {
+  }
+
+  void operator()() const
+  {
+    try
+      {
+	pkgCache &pcache(cache->GetCache());
+
+	for(std::vector<pkgCache::Version *>::const_iterator it = begin;
+	    it != end; ++it)
+	  {
+	    pkgCache::VerIterator ver(pcache, *it);
+
+	    // Only the first entry of each OR group is the start of an
+	    // aptitude_resolver_dep.
+	    bool in_or_group = false;
+	    for(pkgCache::DepIterator d = ver.DependsList(); !d.end(); ++d)
+	      {
+		const bool starts_group = !in_or_group;
+		in_or_group = (d->CompareOp & pkgCache::Dep::Or) != 0;
+
+		if(is_conflict(d->Type))
+		  add_solvers(d->ID,
+			      aptitude_resolver_dep::solver_iterator(d, NULL, cache));
+		else if(starts_group)
+		  add_solvers(d->ID,
+			      aptitude_resolver_dep::solver_iterator(d, cache));
+	      }
+
+	    const std::size_t first = result.revdeps.size();
+	    for(aptitude_resolver_version::revdep_iterator r(ver, cache);
+		!r.end(); ++r)
+	      result.revdeps.push_back(*r);
+	    result.revdep_counts.push_back(std::make_pair(static_cast<unsigned long>(ver->ID),
+							  result.revdeps.size() - first));
+	  }
+      }
+    catch(cwidget::util::Exception &)
+      {
+	result.failed = true;
+      }
+    catch(std::exception &)
+      {
+	result.failed = true;
+      }
+  }
+
+private:
+  void add_solvers(unsigned long id,
+		   aptitude_resolver_dep::solver_iterator si) const
+  {
+    const std::size_t first = result.solvers.size();
+    for( ; !si.end(); ++si)
+      result.solvers.push_back(*si);
+    result.solver_counts.push_back(std::make_pair(id, result.solvers.size() - first));
+  }
+};
+
+boost::shared_ptr<aptitude_compiled_universe>
+aptitude_compiled_universe::compile(pkgDepCache *cache, int num_threads)
+{
+  logging::LoggerPtr logger(Loggers::getAptitudeResolver());
+
+  eassert(get_active(cache) == NULL);
+
+  pkgCache &pcache(cache->GetCache());
+
+  std::vector<pkgCache::Version *> versions;
+  versions.reserve(pcache.Head().VersionCount);
+  for(pkgCache::PkgIterator p = pcache.PkgBegin(); !p.end(); ++p)
+    for(pkgCache::VerIterator v = p.VersionList(); !v.end(); ++v)
+      versions.push_back(v);
+
+  if(versions.empty())
+    return boost::shared_ptr<aptitude_compiled_universe>();
+
+  // is_interesting_dep() and surrounding_or() write their results
+  // into shared tables the first time they see a dependency.  Fill
+  // in both tables for every dependency before any compiler starts,
+  // so that the compilers only read them.
+  for(std::vector<pkgCache::Version *>::const_iterator it = versions.begin();
+      it != versions.end(); ++it)
+    for(pkgCache::DepIterator d = pkgCache::VerIterator(pcache, *it).DependsList();
+	!d.end(); ++d)
+      {
+	pkgCache::DepIterator start, end;
+	surrounding_or(d, start, end, &pcache);
+	is_interesting_dep(d, cache);
+      }
+
+  const std::size_t num_slices =
+    std::min<std::size_t>(std::max(num_threads, 1), versions.size());
+  const std::size_t slice_size =
+    (versions.size() + num_slices - 1) / num_slices;
+
+  LOG_DEBUG(logger, "Compiling the solvers and reverse dependencies of "
+	    << versions.size() << " versions in " << num_slices << " threads.");
+
+  std::vector<slice> slices(num_slices);
+  bool all_started = true;
+
+  {
+    std::vector<boost::shared_ptr<cwidget::threads::thread> > threads;
+    try
+      {
+	for(std::size_t i = 0; i < num_slices; ++i)
+	  {
+	    const std::size_t first = std::min(i * slice_size, versions.size());
+	    const std::size_t last = std::min(first + slice_size, versions.size());
+
+	    compiler c(cache,
+		       versions.begin() + first,
+		       versions.begin() + last,
+		       slices[i]);
+
+	    if(num_slices == 1)
+	      c();
+	    else
+	      threads.push_back(boost::make_shared<cwidget::threads::thread>(c));
+	  }
+      }
+    catch(cwidget::threads::ThreadCreateException &)
+      {
+	all_started = false;
+      }
+
+    for(std::vector<boost::shared_ptr<cwidget::threads::thread> >::const_iterator
+	  it = threads.begin(); it != threads.end(); ++it)
+      (*it)->join();
+  }
+
+  for(std::vector<slice>::const_iterator it = slices.begin();
+      all_started && it != slices.end(); ++it)
+    if(it->failed)
+      all_started = false;
+
+  if(!all_started)
+    {
+      LOG_WARN(logger, "Unable to compile the package universe; the resolver will compute solvers as it goes.");
+      return boost::shared_ptr<aptitude_compiled_universe>();
+    }
+
+  boost::shared_ptr<aptitude_compiled_universe>
+    rval(new aptitude_compiled_universe(cache));
+
+  // Lay out the entries in ID order: count, prefix-sum, then fill.
+  std::vector<std::size_t> solver_counts(pcache.Head().DependsCount, 0);
+  std::vector<std::size_t> revdep_counts(pcache.Head().VersionCount, 0);
+  std::size_t num_solvers = 0, num_revdeps = 0;
+
+  for(std::vector<slice>::const_iterator it = slices.begin();
+      it != slices.end(); ++it)
+    {
+      for(std::vector<std::pair<unsigned long, std::size_t> >::const_iterator
+	    c = it->solver_counts.begin(); c != it->solver_counts.end(); ++c)
+	solver_counts[c->first] = c->second;
+      for(std::vector<std::pair<unsigned long, std::size_t> >::const_iterator
+	    c = it->revdep_counts.begin(); c != it->revdep_counts.end(); ++c)
+	revdep_counts[c->first] = c->second;
+
+      num_solvers += it->solvers.size();
+      num_revdeps += it->revdeps.size();
+    }
+
+  rval->solver_offsets.resize(solver_counts.size() + 1, 0);
+  for(std::size_t i = 0; i < solver_counts.size(); ++i)
+    rval->solver_offsets[i + 1] = rval->solver_offsets[i] + solver_counts[i];
+
+  rval->revdep_offsets.resize(revdep_counts.size() + 1, 0);
+  for(std::size_t i = 0; i < revdep_counts.size(); ++i)
+    rval->revdep_offsets[i + 1] = rval->revdep_offsets[i] + revdep_counts[i];
+
+  rval->solvers.resize(num_solvers);
+  rval->revdeps.resize(num_revdeps);
+
+  for(std::vector<slice>::const_iterator it = slices.begin();
+      it != slices.end(); ++it)
+    {
+      std::vector<aptitude_resolver_version>::const_iterator
+	src_solver = it->solvers.begin();
+      for(std::vector<std::pair<unsigned long, std::size_t> >::const_iterator
+	    c = it->solver_counts.begin(); c != it->solver_counts.end(); ++c)
+	{
+	  std::copy(src_solver, src_solver + c->second,
+		    rval->solvers.begin() + rval->solver_offsets[c->first]);
+	  src_solver += c->second;
+	}
+
+      std::vector<aptitude_resolver_dep>::const_iterator
+	src_revdep = it->revdeps.begin();
+      for(std::vector<std::pair<unsigned long, std::size_t> >::const_iterator
+	    c = it->revdep_counts.begin(); c != it->revdep_counts.end(); ++c)
+	{
+	  std::copy(src_revdep, src_revdep + c->second,
+		    rval->revdeps.begin() + rval->revdep_offsets[c->first]);
+	  src_revdep += c->second;
+	}
+    }
+
+  LOG_INFO(logger, "Compiled the package universe: "
+	   << num_solvers << " solvers of "
+	   << solver_counts.size() << " dependencies, "
+	   << num_revdeps << " reverse dependencies of "
+	   << revdep_counts.size() << " versions ("
+	   << rval->get_memory_size() << " bytes).");
+
+  return rval;
+}
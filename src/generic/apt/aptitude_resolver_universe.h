@@ -27,6 +27,7 @@
 #include <cwidget/generic/util/eassert.h>
 
 #include <boost/functional/hash.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "apt.h"
 #include "aptcache.h"
@@ -35,6 +36,8 @@
 
 #include <limits.h>
 
+#include <vector>
+
 /** \file aptitude_resolver_universe.h
  */
 
@@ -536,6 +539,132 @@ inline std::size_t hash_value(const aptitude_resolver_dep &d)
   return d.get_hash_value();
 }
 
+/** \brief The solvers of every dependency and the reverse
+ *  dependencies of every version in a package cache, computed ahead
+ *  of time and stored in flat arrays.
+ *
+ *  Enumerating the solvers of a dependency or the reverse
+ *  dependencies of a version normally means walking APT's linked
+ *  lists, comparing version strings and screening out versions that
+ *  have disappeared, and the resolver does this over and over for
+ *  the same dependencies.  A compiled universe does that work once
+ *  for the whole cache; while it is active, the solver and reverse
+ *  dependency iterators read its arrays instead.
+ *
+ *  The arrays are stored in compressed-row form: the entries for the
+ *  dependency (or version) with ID i are entries[offsets[i]] through
+ *  entries[offsets[i+1] - 1], in the order that the uncompiled
+ *  iterators would produce them.  The solvers of a Conflicts/Breaks
+ *  that is projected through a Provides are not compiled: they are
+ *  cheap to compute, and there is a separate set for each provider.
+ *
+ *  The contents depend only on the package cache and on
+ *  APT::Install-Recommends, so one compiled universe can be shared by
+ *  every resolver that runs until the cache is reloaded.  At most one
+ *  compiled universe is active at a time, and it must not be
+ *  activated or deactivated while another thread is iterating over
+ *  dependencies; resolver_manager only does so while no resolver
+ *  exists.
+ */
+class aptitude_compiled_universe
+{
+  pkgDepCache *cache;
+
+  std::vector<std::size_t> solver_offsets;
+  std::vector<aptitude_resolver_version> solvers;
+
+  std::vector<std::size_t> revdep_offsets;
+  std::vector<aptitude_resolver_dep> revdeps;
+
+  static const aptitude_compiled_universe *active;
+
+  struct slice;
+  class compiler;
+
+  explicit aptitude_compiled_universe(pkgDepCache *_cache)
+    : cache(_cache)
+  {
+  }
+
+  template<typename T>
+  static void get_range(const std::vector<T> &entries,
+			const std::vector<std::size_t> &offsets,
+			unsigned long id,
+			const T *&begin, const T *&end)
+  {
+    if(entries.empty() || id + 1 >= offsets.size())
+      {
+	begin = end = NULL;
+	return;
+      }
+
+    begin = &entries[0] + offsets[id];
+    end = &entries[0] + offsets[id + 1];
+  }
+
+public:
+  /** \brief Compile a package cache.
+   *
+   *  \param cache        The cache to compile.
+   *  \param num_threads  The number of threads to divide the work
+   *                      between.
+   *
+   *  \return the new compiled universe, or a \b NULL pointer if it
+   *  could not be built.
+   */
+  static boost::shared_ptr<aptitude_compiled_universe>
+  compile(pkgDepCache *cache, int num_threads);
+
+  /** \brief Make the given compiled universe the active one, or
+   *  deactivate the active universe if it is \b NULL.
+   */
+  static void activate(const aptitude_compiled_universe *universe)
+  {
+    active = universe;
+  }
+
+  /** \brief Return the active compiled universe if it was built from
+   *  the given cache, or \b NULL otherwise.
+   */
+  static const aptitude_compiled_universe *get_active(const pkgDepCache *cache)
+  {
+    if(active != NULL && active->cache == cache)
+      return active;
+    else
+      return NULL;
+  }
+
+  /** \brief Retrieve the solvers of a dependency.
+   *
+   *  \param d  The dependency; either the first entry of an OR group
+   *            or a Conflicts/Breaks that is not projected through a
+   *            Provides.
+   */
+  void get_solvers(const pkgCache::Dependency *d,
+		   const aptitude_resolver_version *&begin,
+		   const aptitude_resolver_version *&end) const
+  {
+    get_range(solvers, solver_offsets, d->ID, begin, end);
+  }
+
+  /** \brief Retrieve the reverse dependencies of a version. */
+  void get_revdeps(const pkgCache::Version *v,
+		   const aptitude_resolver_dep *&begin,
+		   const aptitude_resolver_dep *&end) const
+  {
+    get_range(revdeps, revdep_offsets, v->ID, begin, end);
+  }
+
+  /** \return the number of bytes used by the arrays. */
+  std::size_t get_memory_size() const
+  {
+    return
+      (solver_offsets.size() + revdep_offsets.size()) * sizeof(std::size_t) +
+      solvers.size() * sizeof(aptitude_resolver_version) +
+      revdeps.size() * sizeof(aptitude_resolver_dep);
+  }
+};
+
 /** \brief Iterate over the versions of a package.
  *
  *  \sa aptitude_resolver_package, aptitude_resolver_version
@@ -650,6 +779,13 @@ class aptitude_resolver_version::revdep_iterator
   /** Whether we've started looking at provides yet. */
   bool provides_open;
 
+  /** If \b true, this iterator walks the range [compiled_cur,
+   *  compiled_end) of a compiled universe instead of the lists above.
+   */
+  bool compiled;
+  const aptitude_resolver_dep *compiled_cur;
+  const aptitude_resolver_dep *compiled_end;
+
   /** Advance to the next valid iterator. */
   void normalize();
 
@@ -678,7 +814,8 @@ public:
 		  pkgDepCache *_cache)
     :cache(_cache),
      prv_lst(*_cache, 0, (pkgCache::Package *) 0), ver(v),
-     provides_open(false)
+     provides_open(false),
+     compiled(false), compiled_cur(NULL), compiled_end(NULL)
   {
     // Note that if v is an end iterator, we present an empty list and
     // hence don't need to know its package.  This is safe because the
@@ -693,6 +830,21 @@ public:
     normalize();
   }
 
+  /** \brief Generate a revdep_iterator that walks a range of
+   *  precomputed reverse dependencies.
+   *
+   *  \sa aptitude_compiled_universe
+   */
+  revdep_iterator(const aptitude_resolver_dep *begin,
+		  const aptitude_resolver_dep *end,
+		  pkgDepCache *_cache)
+    :cache(_cache),
+     prv_lst(*_cache, 0, (pkgCache::Package *) 0),
+     provides_open(true),
+     compiled(true), compiled_cur(begin), compiled_end(end)
+  {
+  }
+
 //   bool operator==(const revdep_iterator &other) const
 //   {
 //     return dep == other.dep && ver == other.ver;
@@ -706,7 +858,10 @@ public:
   /** \brief Test whether this is an end iterator. */
   bool end() const
   {
-    return dep_lst.end();
+    if(compiled)
+      return compiled_cur == compiled_end;
+    else
+      return dep_lst.end();
   }
 
   /** \return The dependency at which this iterator currently
@@ -714,7 +869,10 @@ public:
    */
   aptitude_resolver_dep operator*() const
   {
-    return aptitude_resolver_dep(dep_lst, prv_lst, cache);
+    if(compiled)
+      return *compiled_cur;
+    else
+      return aptitude_resolver_dep(dep_lst, prv_lst, cache);
   }
 
   /** \brief Advance to the next entry in the list.
@@ -723,8 +881,13 @@ public:
    */
   revdep_iterator &operator++()
   {
-    ++dep_lst;
-    normalize();
+    if(compiled)
+      ++compiled_cur;
+    else
+      {
+	++dep_lst;
+	normalize();
+      }
 
     return *this;
   }
@@ -825,6 +988,19 @@ public:
 
 inline aptitude_resolver_version::revdep_iterator aptitude_resolver_version::revdeps_begin() const
 {
+  if(is_version)
+    {
+      const aptitude_compiled_universe *compiled =
+	aptitude_compiled_universe::get_active(cache);
+
+      if(compiled != NULL)
+	{
+	  const aptitude_resolver_dep *begin, *end;
+	  compiled->get_revdeps(cache->GetCache().VerP + offset, begin, end);
+	  return revdep_iterator(begin, end, cache);
+	}
+    }
+
   return revdep_iterator(get_ver(), cache);
 }
 
@@ -853,11 +1029,26 @@ class aptitude_resolver_dep::solver_iterator
    */
   bool finished;
 
+  /** If \b true, this iterator walks the range [compiled_cur,
+   *  compiled_end) of a compiled universe instead of the lists above.
+   */
+  bool compiled;
+  const aptitude_resolver_version *compiled_cur;
+  const aptitude_resolver_version *compiled_end;
+
   /** Advance to the next interesting version/provides -- i.e., skip
    *  uninteresting ones.
    */
   void normalize();
 
+  /** \brief Advance an iterator that isn't compiled. */
+  void advance();
+
+  /** \return the version that an iterator that isn't compiled
+   *  points at.
+   */
+  aptitude_resolver_version get_current() const;
+
 public:
   /** \brief Initialize a solution iterator for a dependency that is
    *  not a Conflicts/Breaks.
@@ -872,7 +1063,8 @@ public:
     :cache(_cache),
      dep_lst(*cache, const_cast<pkgCache::Dependency *>(start)),
      prv_lst(*cache, 0, (pkgCache::Package *) 0),
-     finished(dep_lst.end())
+     finished(dep_lst.end()),
+     compiled(false), compiled_cur(NULL), compiled_end(NULL)
   {
     if(!dep_lst.end())
       {
@@ -901,7 +1093,8 @@ public:
     :cache(_cache),
      dep_lst(_cache->GetCache(), const_cast<pkgCache::Dependency *>(d)),
      prv_lst(_cache->GetCache(), const_cast<pkgCache::Provides *>(p), (pkgCache::Package *)0),
-     finished(dep_lst.end())
+     finished(dep_lst.end()),
+     compiled(false), compiled_cur(NULL), compiled_end(NULL)
   {
     if(!dep_lst.end())
       {
@@ -917,6 +1110,21 @@ public:
     normalize();
   }
 
+  /** \brief Initialize a solution iterator that walks a range of
+   *  precomputed solvers.
+   *
+   *  \sa aptitude_compiled_universe
+   */
+  solver_iterator(const aptitude_resolver_version *begin,
+		  const aptitude_resolver_version *end,
+		  pkgDepCache *_cache)
+    :cache(_cache),
+     prv_lst(*_cache, 0, (pkgCache::Package *) 0),
+     finished(begin == end),
+     compiled(true), compiled_cur(begin), compiled_end(end)
+  {
+  }
+
 #if 0
   solver_iterator()
     :cache(0),
@@ -932,7 +1140,8 @@ public:
     return dep_lst == other.dep_lst &&
       ver_lst == other.ver_lst &&
       prv_lst == other.prv_lst &&
-      finished == other.finished;
+      finished == other.finished &&
+      compiled_cur == other.compiled_cur;
   }
 
   /** \brief Compare two solver iterators for equality. */
@@ -941,17 +1150,36 @@ public:
     return dep_lst != other.dep_lst ||
       ver_lst != other.ver_lst ||
       prv_lst != other.prv_lst ||
-      finished != other.finished;
+      finished != other.finished ||
+      compiled_cur != other.compiled_cur;
   }
 
   /** \brief Advance to the next solution.
    *
    *  \return a reference to this iterator.
    */
-  solver_iterator &operator++();
+  solver_iterator &operator++()
+  {
+    if(compiled)
+      {
+	eassert(!finished);
+	++compiled_cur;
+	finished = (compiled_cur == compiled_end);
+      }
+    else
+      advance();
+
+    return *this;
+  }
 
   /** \return The version at which this iterator currently points. */
-  aptitude_resolver_version operator*() const;
+  aptitude_resolver_version operator*() const
+  {
+    if(compiled)
+      return *compiled_cur;
+    else
+      return get_current();
+  }
 
   /** \brief Test whether this is an end iterator. */
   bool end() const
@@ -962,6 +1190,19 @@ public:
 
 inline aptitude_resolver_dep::solver_iterator aptitude_resolver_dep::solvers_begin() const
 {
+  if(!is_conflict(start->Type) || prv == NULL)
+    {
+      const aptitude_compiled_universe *compiled =
+	aptitude_compiled_universe::get_active(cache);
+
+      if(compiled != NULL)
+	{
+	  const aptitude_resolver_version *begin, *end;
+	  compiled->get_solvers(start, begin, end);
+	  return solver_iterator(begin, end, cache);
+	}
+    }
+
   if(!is_conflict(start->Type))
     return solver_iterator(start, cache);
   else
@@ -22,7 +22,10 @@
 
 #include "changelog_parse.h"
 
+#include <aptitude.h>
+
 #include "apt.h"
+#include "config_signal.h"
 #include "desc_render.h"
 
 #include <apt-pkg/fileutl.h>
@@ -31,6 +34,8 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
+
 #include <generic/util/temp.h>
 
 #include <cwidget/fragment.h>
@@ -274,33 +279,63 @@ namespace aptitude
 
 	  pkgTagSection sec;
 
-	  std::vector<cw::fragment *> fragments;
-
 	  while(tagfile.Step(sec))
-	    {
-	      std::string source(sec.FindS("Source"));
-	      std::string version(sec.FindS("Version"));
-	      std::string distribution(sec.FindS("Distribution"));
-	      std::string urgency(sec.FindS("Urgency"));
-	      std::string changes(sec.FindS("Changes"));
-	      std::string maintainer(sec.FindS("Maintainer"));
-	      std::string date(sec.FindS("Date"));
-
-	      cw::util::ref_ptr<changelog_element_list> changelog_elements =
-		parse_changes(changes);
-
-	      entries.push_back(changelog_entry::create(source,
-							version,
-							distribution,
-							urgency,
-							changes,
-							changelog_elements,
-							maintainer,
-							date));
-	    }
+	    add_entry(sec);
+	}
+    }
+
+    changelog::changelog(const std::string &digest)
+    {
+      // pkgTagSection only recognizes a section that is followed by a
+      // blank line.
+      std::string padded;
+      const std::string *text = &digest;
+      if(digest.size() < 2 || digest.compare(digest.size() - 2, 2, "\n\n") != 0)
+	{
+	  padded = digest + "\n\n";
+	  text = &padded;
+	}
+
+      const char *start = text->data();
+      const char * const end = start + text->size();
+      pkgTagSection sec;
+
+      while(true)
+	{
+	  while(start != end && (*start == '\n' || *start == '\r'))
+	    ++start;
+
+	  if(start == end || !sec.Scan(start, end - start))
+	    break;
+
+	  add_entry(sec);
+	  start += sec.size();
 	}
     }
 
+    void changelog::add_entry(const pkgTagSection &sec)
+    {
+      std::string source(sec.FindS("Source"));
+      std::string version(sec.FindS("Version"));
+      std::string distribution(sec.FindS("Distribution"));
+      std::string urgency(sec.FindS("Urgency"));
+      std::string changes(sec.FindS("Changes"));
+      std::string maintainer(sec.FindS("Maintainer"));
+      std::string date(sec.FindS("Date"));
+
+      cw::util::ref_ptr<changelog_element_list> changelog_elements =
+	parse_changes(changes);
+
+      entries.push_back(changelog_entry::create(source,
+						version,
+						distribution,
+						urgency,
+						changes,
+						changelog_elements,
+						maintainer,
+						date));
+    }
+
     cw::util::ref_ptr<changelog> parse_digested_changelog(const temp::name &digested)
     {
       if(!digested.valid())
@@ -316,6 +351,15 @@ namespace aptitude
 	}
     }
 
+    cw::util::ref_ptr<changelog>
+    parse_digested_changelog(const boost::shared_ptr<const std::string> &digested)
+    {
+      if(digested.get() == NULL)
+	return NULL;
+      else
+	return changelog::create(*digested);
+    }
+
     temp::name digest_changelog(const temp::name &changelog,
 				const std::string &from)
     {
@@ -365,6 +409,7 @@ namespace aptitude
       class parse_changelog_job
       {
 	temp::name name;
+	boost::shared_ptr<const std::string> contents;
 	safe_slot1<void, cw::util::ref_ptr<aptitude::apt::changelog> > slot;
 	const std::string from;
 	const std::string to;
@@ -387,8 +432,27 @@ namespace aptitude
 	{
 	}
 
-	/** \brief Return the temporary file name of the changelog. */
+	parse_changelog_job(const boost::shared_ptr<const std::string> &_contents,
+			    const safe_slot1<void, cw::util::ref_ptr<aptitude::apt::changelog> > &_slot,
+			    const std::string &_from,
+			    const std::string &_to,
+			    const std::string &_source_package,
+			    post_thunk_f _post_thunk)
+	  : contents(_contents), slot(_slot), from(_from),
+	    to(_to), source_package(_source_package),
+	    post_thunk(_post_thunk),
+	    digested(true)
+	{
+	}
+
+	/** \brief Return the temporary file name of the changelog, or
+	 *  an invalid name if the changelog is in memory.
+	 */
 	const temp::name &get_name() const { return name; }
+	/** \brief Return the digested changelog if it is in memory, or
+	 *  an invalid pointer if it is in a file.
+	 */
+	const boost::shared_ptr<const std::string> &get_contents() const { return contents; }
 	/** \brief Return the slot that should be invoked when the changelog is parsed. */
 	const safe_slot1<void, cw::util::ref_ptr<aptitude::apt::changelog> > &get_slot() const { return slot; }
 	/** \brief Return the earliest version that should be included in the parse. */
@@ -414,8 +478,12 @@ namespace aptitude
 
       std::ostream &operator<<(std::ostream &out, const boost::shared_ptr<parse_changelog_job> &job)
       {
+	if(job->get_contents().get() != NULL)
+	  out << "(" << job->get_contents()->size() << " bytes in memory";
+	else
+	  out << "(name=" << job->get_name().get_name();
+
 	return out
-	  << "(name=" << job->get_name().get_name()
 	  << ", from=" << job->get_from()
 	  << ", to=" << job->get_to()
 	  << ", source_package=" << job->get_source_package()
@@ -425,12 +493,13 @@ namespace aptitude
 
       /** \brief Parses a queue of changelogs in the background.
        *
-       *  The purpose of the queue is to ensure that aptitude only
-       *  parses one changelog at a time and doesn't waste a ton of time
-       *  starting new changelog parse threads and spawning copies of
-       *  parsechangelog.
+       *  The purpose of the queue is to limit how many changelogs
+       *  aptitude parses at once (see
+       *  Aptitude::Changelog-Parse-Threads), so that it doesn't waste
+       *  a ton of time starting new changelog parse threads and
+       *  spawning copies of parsechangelog.
        *
-       *  This is a self-terminating singleton thread.
+       *  The worker threads are self-terminating.
        */
       class parse_changelog_thread : public aptitude::util::job_queue_thread<parse_changelog_thread,
 									     boost::shared_ptr<parse_changelog_job> >
@@ -445,6 +514,11 @@ namespace aptitude
 	  return aptitude::Loggers::getAptitudeChangelogParse();
 	}
 
+	static unsigned int get_max_workers()
+	{
+	  return std::max(aptcfg->FindI(PACKAGE "::Changelog-Parse-Threads", 1), 1);
+	}
+
 	parse_changelog_thread()
 	{
 	  if(!signals_connected)
@@ -468,6 +542,15 @@ namespace aptitude
 				     job->get_from().c_str(),
 				     job->get_to().c_str());
 
+	  if(job->get_contents().get() != NULL)
+	    {
+	      cw::util::ref_ptr<aptitude::apt::changelog> parsed =
+		aptitude::apt::parse_digested_changelog(job->get_contents());
+	      job->get_post_thunk()(sigc::bind(sigc::ptr_fun(&invoke_safe_slot),
+					       safe_bind(job->get_slot(), parsed)));
+	      return;
+	    }
+
 	  temp::name digested;
 	  if(job->get_digested())
 	    digested = job->get_name();
@@ -512,5 +595,23 @@ namespace aptitude
 
       parse_changelog_thread::add_job(job);
     }
+
+    void parse_digested_changelog_background(const boost::shared_ptr<const std::string> &contents,
+					     safe_slot1<void, cw::util::ref_ptr<aptitude::apt::changelog> > slot,
+					     const std::string &from,
+					     const std::string &to,
+					     const std::string &source_package,
+					     post_thunk_f post_thunk)
+    {
+      boost::shared_ptr<parse_changelog_job> job =
+	boost::make_shared<parse_changelog_job>(contents,
+						slot,
+						from,
+						to,
+						source_package,
+						post_thunk);
+
+      parse_changelog_thread::add_job(job);
+    }
   }
 }
@@ -24,8 +24,11 @@
 
 #include <apt-pkg/pkgcache.h>
 
+#include <string>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+
 #include <cwidget/generic/util/ref_ptr.h>
 
 #include <generic/util/post_thunk.h>
@@ -36,6 +39,7 @@
  */
 
 class FileFd;
+class pkgTagSection;
 
 namespace cwidget
 {
@@ -207,6 +211,12 @@ namespace aptitude
       std::vector<cwidget::util::ref_ptr<changelog_entry> > entries;
 
       changelog(FileFd &file);
+      changelog(const std::string &digest);
+
+      /** \brief Add the entry described by one section of a digested
+       *  changelog.
+       */
+      void add_entry(const pkgTagSection &sec);
 
     public:
       static cwidget::util::ref_ptr<changelog> create(FileFd &file)
@@ -214,6 +224,12 @@ namespace aptitude
 	return new changelog(file);
       }
 
+      /** \brief Parse a digested changelog that is stored in memory. */
+      static cwidget::util::ref_ptr<changelog> create(const std::string &digest)
+      {
+	return new changelog(digest);
+      }
+
       /** \brief The type of an iterator over this changelog. */
       typedef std::vector<cwidget::util::ref_ptr<changelog_entry> >::const_iterator const_iterator;
       typedef std::vector<cwidget::util::ref_ptr<changelog_entry> >::size_type size_type;
@@ -234,6 +250,15 @@ namespace aptitude
      */
     cwidget::util::ref_ptr<changelog> parse_digested_changelog(const temp::name &digested);
 
+    /** \brief Parse a digested changelog that is stored in memory,
+     *  such as one returned by file_cache::getItemContents().
+     *
+     *  \return the parsed changelog, or \b NULL if digested is an
+     *  invalid pointer.
+     */
+    cwidget::util::ref_ptr<changelog>
+    parse_digested_changelog(const boost::shared_ptr<const std::string> &digested);
+
     /** Parse the contents of the given file as a Debian changelog.
      *  for some reason the file cannot be parsed, returns \b NULL.
      *
@@ -276,6 +301,21 @@ namespace aptitude
 				    const std::string &source_package,
 				    bool digested,
 				    post_thunk_f post_thunk);
+
+    /** \brief Start parsing a digested changelog that is stored in
+     *  memory in the background.
+     *
+     *  Like parse_changelog_background() with \b digested set, but
+     *  the changelog is never written to the filesystem.
+     *
+     *  \param contents The digested changelog.
+     */
+    void parse_digested_changelog_background(const boost::shared_ptr<const std::string> &contents,
+					     safe_slot1<void, cwidget::util::ref_ptr<aptitude::apt::changelog> > slot,
+					     const std::string &from,
+					     const std::string &to,
+					     const std::string &source_package,
+					     post_thunk_f post_thunk);
   }
 }
 
@@ -24,6 +24,9 @@
 #include "log.h"
 
 #include <aptitude.h>
+#include <loggers.h>
+
+#include <generic/util/profile.h>
 
 #include <apt-pkg/acquire-item.h>
 #include <apt-pkg/dpkgpm.h>
@@ -154,6 +157,8 @@ download_manager::result download_install_manager::finish_pre_dpkg(pkgAcquire::R
 
 pkgPackageManager::OrderResult download_install_manager::run_dpkg(int status_fd)
 {
+  aptitude::util::profile_phase phase("dpkg", aptitude::Loggers::getAptitudeDpkg());
+
   sigset_t allsignals;
   sigset_t oldsignals;
   sigfillset(&allsignals);
@@ -22,7 +22,10 @@
 
 #include <loggers.h>
 
+#include <aptitude.h>
+
 #include <generic/apt/apt.h>
+#include <generic/apt/config_signal.h>
 #include <generic/util/file_cache.h>
 #include <generic/util/job_queue_thread.h>
 
@@ -37,7 +40,10 @@
 #include <boost/unordered_map.hpp>
 #include <boost/weak_ptr.hpp>
 
+#include <algorithm>
+#include <fstream>
 #include <list>
+#include <vector>
 
 #include <sigc++/bind.h>
 
@@ -59,16 +65,40 @@ namespace aptitude
       std::string uri;
       std::string short_description;
       temp::name filename;
-      temp::name cached_filename;
+      // The cached value, or an invalid pointer if there isn't one.
+      boost::shared_ptr<const std::string> cached_contents;
       // The last-modified-time of the cached value.
       time_t last_modified_time;
 
-      typedef std::pair<boost::shared_ptr<download_callbacks>, post_thunk_f> listener;
+    public:
+      /** \brief A request that is waiting for this job. */
+      struct listener
+      {
+	boost::shared_ptr<download_callbacks> callbacks;
+	post_thunk_f post_thunk;
+	// Set as soon as the request is canceled, possibly from
+	// another thread; the listener hears nothing more after that,
+	// even before the download thread removes it.
+	boost::shared_ptr<util::job_handle> cancel_flag;
+
+	listener(const boost::shared_ptr<download_callbacks> &_callbacks,
+		 post_thunk_f _post_thunk,
+		 const boost::shared_ptr<util::job_handle> &_cancel_flag)
+	  : callbacks(_callbacks),
+	    post_thunk(_post_thunk),
+	    cancel_flag(_cancel_flag)
+	{
+	}
+
+	bool get_cancelled() const { return cancel_flag->get_cancelled(); }
+      };
+
+    private:
       // The registered listeners on this job.  When one is canceled,
       // it's pulled out of this list.  This is threadsafe: remember
       // that the actual cancel process takes place in the download
-      // thread, as do the processes of adding a new listener and
-      // invoking all the listeners.
+      // thread that owns this job, as do the processes of adding a
+      // new listener and invoking all the listeners.
       std::list<listener> listeners;
 
     public:
@@ -77,12 +107,12 @@ namespace aptitude
       download_job(const std::string &_uri,
 		   const std::string &_short_description,
 		   const temp::name &_filename,
-		   const temp::name &_cached_filename,
+		   const boost::shared_ptr<const std::string> &_cached_contents,
 		   time_t _last_modified_time)
 	: uri(_uri),
 	  short_description(_short_description),
 	  filename(_filename),
-	  cached_filename(_cached_filename),
+	  cached_contents(_cached_contents),
 	  last_modified_time(_last_modified_time)
       {
       }
@@ -90,16 +120,58 @@ namespace aptitude
       const std::string &get_uri() const { return uri; }
       const std::string &get_short_description() const { return short_description; }
       const temp::name &get_filename() const { return filename; }
-      const temp::name &get_cached_filename() const { return cached_filename; }
+      const boost::shared_ptr<const std::string> &get_cached_contents() const { return cached_contents; }
       time_t get_last_modified_time() const { return last_modified_time; }
 
+      /** \brief Write the cached value to a new temporary file.
+       *
+       *  The cache lookup keeps the value in memory, since it is
+       *  usually only needed to fill in the If-Modified-Since header;
+       *  the file is written once the cached value is actually
+       *  handed to the listeners.
+       *
+       *  \return the new file, or an invalid name if there is no
+       *  cached value or it can't be written.
+       */
+      temp::name write_cached_contents() const
+      {
+	if(cached_contents.get() == NULL)
+	  return temp::name();
+
+	try
+	  {
+	    temp::name rval("cached");
+
+	    std::ofstream out(rval.get_name().c_str(), std::ios::out | std::ios::binary);
+	    out.write(cached_contents->data(), cached_contents->size());
+	    out.close();
+
+	    if(out)
+	      return rval;
+
+	    LOG_WARN(Loggers::getAptitudeDownloadQueue(),
+		     "Can't write the cached value of " << uri
+		     << " to " << rval.get_name());
+	  }
+	catch(std::exception &ex)
+	  {
+	    LOG_WARN(Loggers::getAptitudeDownloadQueue(),
+		     "Can't write the cached value of " << uri
+		     << ": " << ex.what());
+	  }
+
+	return temp::name();
+      }
+
       /** \brief Return \b true if there are no listeners on this job. */
       bool listeners_empty() const { return listeners.empty(); }
 
       listener_connection add_listener(const boost::shared_ptr<download_callbacks> &callbacks,
-				       post_thunk_f post_thunk)
+				       post_thunk_f post_thunk,
+				       const boost::shared_ptr<util::job_handle> &cancel_flag)
       {
-	return listeners.insert(listeners.end(), listener(callbacks, post_thunk));
+	return listeners.insert(listeners.end(),
+				listener(callbacks, post_thunk, cancel_flag));
       }
 
       void remove_listener(listener_connection conn)
@@ -119,8 +191,11 @@ namespace aptitude
 	for(std::list<listener>::const_iterator
 	      it = listeners.begin(); it != listeners.end(); ++it)
 	  {
+	    if(it->get_cancelled())
+	      continue;
+
 	    sigc::slot<void> success_slot =
-	      sigc::bind(sigc::mem_fun(*it->first, &download_callbacks::success),
+	      sigc::bind(sigc::mem_fun(*it->callbacks, &download_callbacks::success),
 			 filename);
 
 	    // Note that we use a keepalive slot to ensure that the
@@ -128,7 +203,7 @@ namespace aptitude
 	    // fires off!  We need to do this because the last
 	    // reference to the callback could be dropped from any
 	    // thread.
-	    it->second(make_keepalive_slot(success_slot, it->first));
+	    it->post_thunk(make_keepalive_slot(success_slot, it->callbacks));
 	  }
       }
 
@@ -138,8 +213,11 @@ namespace aptitude
 	for(std::list<listener>::const_iterator
 	      it = listeners.begin(); it != listeners.end(); ++it)
 	  {
+	    if(it->get_cancelled())
+	      continue;
+
 	    sigc::slot<void> failure_slot =
-	      sigc::bind(sigc::mem_fun(*it->first, &download_callbacks::failure),
+	      sigc::bind(sigc::mem_fun(*it->callbacks, &download_callbacks::failure),
 			 msg);
 
 	    // Note that we use a keepalive slot to ensure that the
@@ -147,7 +225,7 @@ namespace aptitude
 	    // fires off!  We need to do this because the last
 	    // reference to the callback could be dropped from any
 	    // thread.
-	    it->second(make_keepalive_slot(failure_slot, it->first));
+	    it->post_thunk(make_keepalive_slot(failure_slot, it->callbacks));
 	  }
       }
 
@@ -159,8 +237,11 @@ namespace aptitude
 	for(std::list<listener>::const_iterator
 	      it = listeners.begin(); it != listeners.end(); ++it)
 	  {
+	    if(it->get_cancelled())
+	      continue;
+
 	    sigc::slot<void> partial_download_slot =
-	      sigc::bind(sigc::mem_fun(*it->first, &download_callbacks::partial_download),
+	      sigc::bind(sigc::mem_fun(*it->callbacks, &download_callbacks::partial_download),
 			 filename, currentSize, totalSize);
 
 	    // Note that we use a keepalive slot to ensure that the
@@ -168,26 +249,22 @@ namespace aptitude
 	    // fires off!  We need to do this because the last
 	    // reference to the callback could be dropped from any
 	    // thread.
-	    it->second(make_keepalive_slot(partial_download_slot, it->first));
+	    it->post_thunk(make_keepalive_slot(partial_download_slot, it->callbacks));
 	  }
       }
 
-      /** \brief Invoke the canceled callback on each listener. */
-      void invoke_canceled() const
+      /** \brief Invoke the canceled callback of a single listener. */
+      static void invoke_canceled(const boost::shared_ptr<download_callbacks> &callbacks,
+				  post_thunk_f post_thunk)
       {
-	for(std::list<listener>::const_iterator
-	      it = listeners.begin(); it != listeners.end(); ++it)
-	  {
-	    sigc::slot<void> canceled_slot =
-	      sigc::mem_fun(*it->first, &download_callbacks::canceled);
-
-	    // Note that we use a keepalive slot to ensure that the
-	    // callback object doesn't get deleted before the thunk
-	    // fires off!  We need to do this because the last
-	    // reference to the callback could be dropped from any
-	    // thread.
-	    it->second(make_keepalive_slot(canceled_slot, it->first));
-	  }
+	sigc::slot<void> canceled_slot =
+	  sigc::mem_fun(*callbacks, &download_callbacks::canceled);
+
+	// Note that we use a keepalive slot to ensure that the
+	// callback object doesn't get deleted before the thunk fires
+	// off!  We need to do this because the last reference to the
+	// callback could be dropped from any thread.
+	post_thunk(make_keepalive_slot(canceled_slot, callbacks));
       }
     };
 
@@ -204,14 +281,15 @@ namespace aptitude
       // fall back to cached values if they're available.
       void handle_failure(const std::string &msg)
       {
-	if(job->get_cached_filename().valid())
+	const temp::name cached_filename(job->write_cached_contents());
+	if(cached_filename.valid())
 	  {
 	    LOG_INFO(Loggers::getAptitudeDownloadQueue(),
 		     "Failed to download " << job->get_short_description()
 		     << " from the URI " << job->get_uri()
 		     << " (" << msg << "), falling back to cached values.");
 
-	    job->invoke_success(job->get_cached_filename());
+	    job->invoke_success(cached_filename);
 	  }
 	else
 	  {
@@ -327,7 +405,8 @@ namespace aptitude
 		     << lastModifiedTimeStr << "]) : "
 		     << LookupTag(Message, "Message"));
 
-	    download_cache->putItem(job->get_uri(), job->get_filename().get_name(), lastModifiedTime);
+	    if(download_cache)
+	      download_cache->putItem(job->get_uri(), job->get_filename().get_name(), lastModifiedTime);
 	    job->invoke_success(job->get_filename());
 	  }
 
@@ -349,6 +428,7 @@ namespace aptitude
       }
     };
 
+
     /** \brief Tracks information about an active download and a
      *  callback saying how to destroy it.
      */
@@ -356,16 +436,26 @@ namespace aptitude
     {
       boost::shared_ptr<download_job> job;
       sigc::slot<void> destroy;
+      // The slot whose thread runs the download.
+      std::size_t slot;
+      // The host the download is fetched from.
+      std::string host;
 
     public:
       active_download_info(const boost::shared_ptr<download_job> &_job,
-			   const sigc::slot<void> &_destroy)
+			   const sigc::slot<void> &_destroy,
+			   std::size_t _slot,
+			   const std::string &_host)
 	: job(_job),
-	  destroy(_destroy)
+	  destroy(_destroy),
+	  slot(_slot),
+	  host(_host)
       {
       }
 
       const boost::shared_ptr<download_job> &get_job() const { return job; }
+      std::size_t get_slot() const { return slot; }
+      const std::string &get_host() const { return host; }
       void destroy_item() { destroy(); }
     };
 
@@ -384,18 +474,21 @@ namespace aptitude
      *  an existing download, the request is filled in appropriately
      *  by the background thread.
      *
-     *  When the request is canceled, the request object is placed
-     *  into a queue of requests to cancel.  On each Pulse() call, the
-     *  background thread first processes requests that are being
-     *  added to the queue (as noted above), then processes cancel
-     *  requests.
+     *  When the request is canceled, its cancel flag is set at once,
+     *  which silences its callbacks.  If it hasn't reached a
+     *  download thread yet, it is simply dropped; otherwise it is
+     *  placed into the cancel queue of the thread that owns its
+     *  download.  On each Pulse() call, a download thread first
+     *  processes requests that are being added to the queue (as
+     *  noted above), then processes cancel requests.
      *
      *  The important thing about this protocol is that all the
-     *  manipulations of the download queue happen in a single thread;
+     *  manipulations of a download queue happen in a single thread;
      *  the frontend routines that are exposed to other modules just
      *  place requests into queues and return.  This is important
      *  because the Acquire code is not thread-safe, so we have to
-     *  ensure that it always runs in the same thread.
+     *  ensure that each Acquire object is only used by the thread
+     *  that created it.
      */
     class download_request_impl : public download_request,
 				  public boost::enable_shared_from_this<download_request_impl>
@@ -405,15 +498,43 @@ namespace aptitude
       // The handle used to cancel listening to events on this item.
       download_job::listener_connection connection;
 
+      // The download slot that owns parent.  Only meaningful once the
+      // request has been bound.
+      std::size_t slot;
+
+      // True once the request has been bound to a download.
+      bool bound;
+
       // True if this request has been canceled.  Used to avoid a race
       // condition if something cancels a request before it has been
       // filled in and added to the download queue.
       bool canceled;
 
+      // Set as soon as cancel() is invoked; shared with the listener
+      // that this request adds to its download.
+      boost::shared_ptr<util::job_handle> cancel_flag;
+
+      // The job that is looking the URI up in the download cache, if
+      // it hasn't finished yet.
+      boost::shared_ptr<util::job_handle> lookup_job;
+
+      // Where to send the canceled() callback if the request is
+      // canceled before it is bound.  This is a weak reference
+      // because download_request objects must not keep anything
+      // alive.
+      boost::weak_ptr<download_callbacks> callbacks;
+      post_thunk_f post_thunk;
+
     public:
       /** \brief Create an unconnected download request. */
-      download_request_impl()
-	: canceled(false)
+      download_request_impl(const boost::shared_ptr<download_callbacks> &_callbacks,
+			    post_thunk_f _post_thunk)
+	: slot(0),
+	  bound(false),
+	  canceled(false),
+	  cancel_flag(boost::make_shared<util::job_handle>()),
+	  callbacks(_callbacks),
+	  post_thunk(_post_thunk)
       {
       }
 
@@ -421,12 +542,32 @@ namespace aptitude
        *  download.
        */
       void bind(const boost::shared_ptr<download_job> &_parent,
-		download_job::listener_connection _connection)
+		download_job::listener_connection _connection,
+		std::size_t _slot)
       {
 	parent = _parent;
 	connection = _connection;
+	slot = _slot;
+	bound = true;
+      }
+
+      bool get_bound() const { return bound; }
+      std::size_t get_slot() const { return slot; }
+      const boost::shared_ptr<util::job_handle> &get_cancel_flag() const { return cancel_flag; }
+      bool get_cancelled() const { return cancel_flag->get_cancelled(); }
+
+      void set_lookup_job(const boost::shared_ptr<util::job_handle> &job)
+      {
+	lookup_job = job;
       }
 
+      /** \brief Cancel a request that never reached a download
+       *  thread.
+       *
+       *  Must be invoked with the download queue's state lock held.
+       */
+      void cancel_unbound();
+
       /** \brief Actually cancel this request.
        *
        *  To be safe, this must be invoked from the thread that owns
@@ -434,14 +575,22 @@ namespace aptitude
        */
       void do_cancel();
 
-      /** \brief Place this request into the parent queue's cancel
-       *  queue.
+      /** \brief Silence this request and remove it from the queue.
        */
       void cancel();
     };
 
     /** \brief Manages a collection of currently-running downloads and
-     *  a single background thread in which the downloads run.
+     *  the background threads in which the downloads run.
+     *
+     *  Downloads are spread over a number of "slots", each with its
+     *  own Acquire object running in its own thread.  An Acquire
+     *  object opens one connection to each host, so the number of
+     *  slots is the number of connections that may be open to a
+     *  host at once.  New URIs go to the slot with the fewest
+     *  downloads from the same host; a URI that is already being
+     *  downloaded goes to the slot that is downloading it, and
+     *  shares its download.
      *
      *  A second background thread is used to retrieve URIs from the
      *  download cache.
@@ -456,16 +605,16 @@ namespace aptitude
       class start_request
       {
 	std::string uri;
+	std::string host;
 	std::string short_description;
 	temp::name filename;
-	// A location where the last cached data is stored, or an
-	// invalid pointer if there isn't cached data.  (note: it's
-	// tempting to only store the last modification time here so
-	// as to avoid extracting files unnecessarily -- but if the
-	// file expires from the cache between when we check for it
-	// the first time and when we check again, you could have
-	// trouble)
-	temp::name cached_filename;
+	// The last cached data, or an invalid pointer if there isn't
+	// cached data.  (note: it's tempting to only store the last
+	// modification time here so as to avoid holding the data in
+	// memory -- but if the entry expires from the cache between
+	// when we check for it the first time and when we check
+	// again, you could have trouble)
+	boost::shared_ptr<const std::string> cached_contents;
 
 	boost::shared_ptr<download_callbacks> callbacks;
 	post_thunk_f post_thunk;
@@ -476,6 +625,8 @@ namespace aptitude
 	// download cache.
 	time_t last_modified_time;
 
+	download_priority priority;
+
 	/** \brief A blank request that should be bound to the new
 	 *  download object.
 	 */
@@ -487,38 +638,55 @@ namespace aptitude
 		      const temp::name &_filename,
 		      const boost::shared_ptr<download_callbacks> &_callbacks,
 		      post_thunk_f _post_thunk,
+		      download_priority _priority,
 		      const boost::shared_ptr<download_request_impl> &_request)
 	  : uri(_uri),
+	    host(::URI(_uri).Host),
 	    short_description(_short_description),
 	    filename(_filename),
 	    callbacks(_callbacks),
 	    post_thunk(_post_thunk),
 	    last_modified_time(0),
+	    priority(_priority),
 	    request(_request)
 	{
 	}
 
 	const std::string &get_uri() const { return uri; }
+	const std::string &get_host() const { return host; }
 	const std::string &get_short_description() const { return short_description; }
 	const temp::name &get_filename() const { return filename; }
-	const temp::name &get_cached_filename() const { return cached_filename; }
+	const boost::shared_ptr<const std::string> &get_cached_contents() const { return cached_contents; }
 	time_t get_last_modified_time() const { return last_modified_time; }
 	const boost::shared_ptr<download_callbacks> &get_callbacks() const { return callbacks; }
 	post_thunk_f get_post_thunk() const { return post_thunk; }
+	download_priority get_priority() const { return priority; }
 	const boost::shared_ptr<download_request_impl> &get_request() const { return request; }
 
-	void update_from_cache(const temp::name &new_filename,
+	void update_from_cache(const boost::shared_ptr<const std::string> &new_contents,
 			       time_t new_last_modified_time)
 	{
-	  cached_filename = new_filename;
+	  cached_contents = new_contents;
 	  last_modified_time = new_last_modified_time;
 	}
       };
 
+      /** \brief Sort start requests so that visible items come
+       *  first.
+       */
+      struct compare_start_request_priority
+      {
+	bool operator()(const boost::shared_ptr<start_request> &a,
+			const boost::shared_ptr<start_request> &b) const
+	{
+	  return a->get_priority() < b->get_priority();
+	}
+      };
+
       /** \brief A background thread that looks up files in the cache.
        *
-       *  Requests are passed along to the main download thread after
-       *  this thread finishes with them.
+       *  Requests are passed along to a download thread after this
+       *  thread finishes with them.
        *
        *  If a file is found, the request object is updated with its
        *  last modified time.
@@ -548,13 +716,16 @@ namespace aptitude
 
 	void process_job(const boost::shared_ptr<start_request> &job)
 	{
+	  if(job->get_request()->get_cancelled())
+	    return;
+
 	  if(download_cache)
 	    {
 	      time_t mtime;
-	      temp::name filename =
-		download_cache->getItem(job->get_uri(), mtime);
-	      if(filename.valid())
-		job->update_from_cache(filename, mtime);
+	      boost::shared_ptr<const std::string> contents =
+		download_cache->getItemContents(job->get_uri(), mtime);
+	      if(contents.get() != NULL)
+		job->update_from_cache(contents, mtime);
 	    }
 
 	  download_thread::queue_job(job);
@@ -562,10 +733,12 @@ namespace aptitude
       };
 
       /** \brief Hook into the download process; used to add new
-       *  downloads into the Acquire object.
+       *  downloads into the Acquire object of a slot.
        */
       class download_callback : public pkgAcquireStatus
       {
+	std::size_t slot;
+
 	// Invoked when the cached item for a job is confirmed to be
 	// up-to-date.
 	void IMSHit(pkgAcquire::ItemDesc &item)
@@ -578,9 +751,13 @@ namespace aptitude
 	    found = active_downloads.find(item.URI);
 	  if(found != active_downloads.end())
 	    {
-	      temp::name cached_filename =
-		found->second->get_job()->get_cached_filename();
-	      found->second->get_job()->invoke_success(cached_filename);
+	      const boost::shared_ptr<download_job> &job = found->second->get_job();
+	      temp::name cached_filename = job->write_cached_contents();
+	      if(cached_filename.valid())
+		job->invoke_success(cached_filename);
+	      else
+		job->invoke_failure((boost::format(_("Unable to extract the cached copy of %s."))
+				     % job->get_uri()).str());
 	    }
 	}
 
@@ -595,16 +772,10 @@ namespace aptitude
 	      return false;
 	    }
 
-	  for(std::deque<boost::shared_ptr<start_request> >::const_iterator it =
-		start_requests.begin();
-	      it != start_requests.end(); ++it)
-	    {
-	      const start_request &req(**it);
-
-	      process_start_request(req, *Owner);
-	    }
-	  start_requests.clear();
+	  process_start_requests(slot, *Owner);
 
+	  std::deque<boost::shared_ptr<download_request_impl> > &cancel_requests =
+	    slots[slot].cancel_requests;
 	  for(std::deque<boost::shared_ptr<download_request_impl> >::const_iterator it =
 		cancel_requests.begin(); it != cancel_requests.end(); ++it)
 	    {
@@ -646,82 +817,153 @@ namespace aptitude
 	  // Media changes will always abort.
 	  return false;
 	}
+
+      public:
+	explicit download_callback(std::size_t _slot)
+	  : slot(_slot)
+	{
+	}
+      };
+
+      /** \brief The state of one slot. */
+      struct download_slot
+      {
+	// A queue of requests for the slot's thread to start
+	// downloading URIs.
+	std::deque<boost::shared_ptr<start_request> > start_requests;
+
+	// A queue of requests for the slot's thread to stop
+	// downloading URIs.
+	std::deque<boost::shared_ptr<download_request_impl> > cancel_requests;
+
+	// The thread running the slot's downloads, or NULL if it isn't
+	// running.  Users of this member should make a strong copy
+	// while holding the state lock, since the thread clears it
+	// upon exit.
+	//
+	// The thread is never joined except at shutdown: it's
+	// perfectly safe for it to keep downloading while the cache
+	// is closed, for instance.
+	boost::shared_ptr<cw::threads::thread> thread;
       };
 
       // All these members are static because they are used by the
-      // singleton download thread, but might need to be populated
-      // before it starts processing items.
+      // download threads, but might need to be populated before they
+      // start processing items.
 
       // A mutex that serializes access to all of the state below.
       static cw::threads::mutex state_mutex;
 
-      // A queue of requests for the background thread to start
-      // downloading URIs.
-      static std::deque<boost::shared_ptr<start_request> > start_requests;
-
-      // A queue of requests for the background thread to stop
-      // downloading URIs.
-      static std::deque<boost::shared_ptr<download_request_impl> > cancel_requests;
+      // The download slots.  Slots are created on demand and never
+      // removed, and are always referred to by index.
+      static std::vector<download_slot> slots;
 
       // Tracks the active downloads, if any, for various URIs.
       static boost::unordered_map<std::string, boost::shared_ptr<active_download_info> > active_downloads;
 
-      // The single instance of this object (or NULL if there is no
-      // active thread).
-      //
-      // The thread itself isn't stored because we never need to
-      // join() it: it's perfectly safe for it to keep downloading
-      // while the cache is closed, for instance.
-      static boost::shared_ptr<download_thread> instance;
-
-      // Similarly, if the instance is still running, this is a thread
-      // object for the thread it's running in.  Users of this member
-      // should make a strong copy while holding the state lock, since
-      // the background thread clears it upon exit.
-      static boost::shared_ptr<cw::threads::thread> instancet;
-
       // Set to true to cancel any pending downloads in preparation
       // for shutting down the program.
       //
       // This doesn't attempt to leave things in any sort of "nice"
-      // state; it just asks the Acquire process to stop, nukes
+      // state; it just asks the Acquire processes to stop, nukes
       // everything in all the queues, and refuses to start a new
       // queue runner.
       static bool shutdown_queue;
 
-      /** \brief Used to invoke the download queue's run() from the
-       *  background thread.
+      /** \brief How often, in microseconds, a download thread looks
+       *  at its queues while it's downloading.
+       */
+      static const int pulse_interval = 100000;
+
+      /** \brief How many downloads a slot may be running before it
+       *  stops handing prefetches to its Acquire object.
        *
-       *  Note that because this object lives as long as operator()()
-       *  is executing, we know that the instance won't be destroyed
-       *  until run() completes.
+       *  Two keeps the connection busy while one item is being
+       *  answered, and bounds how long a visible item waits.
        */
+      static const std::size_t max_active_prefetches = 2;
+
+      /** \brief Used to invoke run() from a slot's thread. */
       class bootstrap
       {
-	boost::shared_ptr<download_thread> instance;
+	std::size_t slot;
 
       public:
-	bootstrap(const boost::shared_ptr<download_thread> &_instance)
-	  : instance(_instance)
+	explicit bootstrap(std::size_t _slot)
+	  : slot(_slot)
 	{
 	}
 
 	void operator()() const
 	{
-	  instance->run();
+	  download_thread::run(slot);
 	}
       };
 
-      /** \brief Start the background thread if it isn't running. */
-      static void ensure_background_thread()
+      /** \brief Start the thread of a slot if it isn't running. */
+      static void ensure_slot_thread(std::size_t slot)
       {
 	cw::threads::mutex::lock l(state_mutex);
 
-	if(instance.get() == NULL)
+	if(slots[slot].thread.get() == NULL)
+	  {
+	    LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+		      "Starting the thread of download slot " << slot);
+	    slots[slot].thread = boost::make_shared<cw::threads::thread>(bootstrap(slot));
+	  }
+      }
+
+      /** \brief Pick the slot that should download a URI.
+       *
+       *  Must be invoked with the state lock held.
+       */
+      static std::size_t choose_slot(const start_request &req)
+      {
+	const std::size_t num_slots =
+	  std::max(aptcfg->FindI(PACKAGE "::Download-Queue::Connections-Per-Host", 1), 1);
+	if(slots.size() < num_slots)
+	  slots.resize(num_slots);
+
+	// Count the downloads from the request's host, and all the
+	// downloads, in each slot.  If the URI is already on its way,
+	// it goes to the same slot.
+	std::vector<std::size_t> host_load(slots.size(), 0);
+	std::vector<std::size_t> total_load(slots.size(), 0);
+
+	boost::unordered_map<std::string, boost::shared_ptr<active_download_info> >::const_iterator
+	  active = active_downloads.find(req.get_uri());
+	if(active != active_downloads.end())
+	  return active->second->get_slot();
+
+	for(active = active_downloads.begin();
+	    active != active_downloads.end(); ++active)
 	  {
-	    instance = boost::make_shared<download_thread>();
-	    instancet = boost::make_shared<cw::threads::thread>(bootstrap(instance));
+	    const active_download_info &info = *active->second;
+	    ++total_load[info.get_slot()];
+	    if(info.get_host() == req.get_host())
+	      ++host_load[info.get_slot()];
 	  }
+
+	for(std::size_t i = 0; i < slots.size(); ++i)
+	  for(std::deque<boost::shared_ptr<start_request> >::const_iterator it =
+		slots[i].start_requests.begin();
+	      it != slots[i].start_requests.end(); ++it)
+	    {
+	      if((*it)->get_uri() == req.get_uri())
+		return i;
+
+	      ++total_load[i];
+	      if((*it)->get_host() == req.get_host())
+		++host_load[i];
+	    }
+
+	std::size_t rval = 0;
+	for(std::size_t i = 1; i < slots.size(); ++i)
+	  if(host_load[i] < host_load[rval] ||
+	     (host_load[i] == host_load[rval] && total_load[i] < total_load[rval]))
+	    rval = i;
+
+	return rval;
       }
 
       /** \brief Insert a job into the list of jobs to add.
@@ -734,8 +976,76 @@ namespace aptitude
       {
 	cw::threads::mutex::lock l(state_mutex);
 
-	start_requests.push_back(job);
-	ensure_background_thread();
+	if(shutdown_queue)
+	  {
+	    LOG_WARN(Loggers::getAptitudeDownloadQueue(),
+		     "Not queuing " << job->get_uri() << ": the queue is shut down.");
+	    return;
+	  }
+
+	if(job->get_request()->get_cancelled())
+	  {
+	    LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+		      "Not queuing " << job->get_uri() << ": it was canceled.");
+	    return;
+	  }
+
+	const std::size_t slot = choose_slot(*job);
+
+	LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+		  "Queuing " << job->get_uri() << " in download slot " << slot);
+
+	slots[slot].start_requests.push_back(job);
+	ensure_slot_thread(slot);
+      }
+
+      /** \brief Hand the start requests of a slot to its Acquire
+       *  object, visible items first.
+       *
+       *  Once an item is in the Acquire queue, it can't be moved, so
+       *  a visible item would have to wait behind every prefetch that
+       *  was handed over before it.  Prefetches are therefore only
+       *  handed over while the slot has fewer than
+       *  max_active_prefetches downloads running; the rest wait in
+       *  the slot's start requests, where a visible item can overtake
+       *  them.  Visible items are always handed over at once.
+       *
+       *  Must be invoked from the slot's thread.
+       */
+      static void process_start_requests(std::size_t slot,
+					 pkgAcquire &acquireQueue)
+      {
+	cw::threads::mutex::lock l(state_mutex);
+
+	std::deque<boost::shared_ptr<start_request> > &requests =
+	  slots[slot].start_requests;
+
+	std::stable_sort(requests.begin(), requests.end(),
+			 compare_start_request_priority());
+
+	std::size_t num_active = 0;
+	for(boost::unordered_map<std::string, boost::shared_ptr<active_download_info> >::const_iterator
+	      it = active_downloads.begin(); it != active_downloads.end(); ++it)
+	  if(it->second->get_slot() == slot)
+	    ++num_active;
+
+	while(!requests.empty())
+	  {
+	    const boost::shared_ptr<start_request> req(requests.front());
+	    if(req->get_priority() == download_priority_prefetch &&
+	       num_active >= max_active_prefetches)
+	      {
+		LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+			  "Holding back " << requests.size()
+			  << " prefetches in download slot " << slot
+			  << ": " << num_active << " downloads are running.");
+		break;
+	      }
+
+	    requests.pop_front();
+	    if(process_start_request(*req, acquireQueue, slot))
+	      ++num_active;
+	  }
       }
 
       /** \brief Actually process a start request and add it to the
@@ -743,54 +1053,142 @@ namespace aptitude
        *
        *  This creates a new download item, sets up the appropriate
        *  callbacks, and inserts the item into the set of active
-       *  downloads.
+       *  downloads.  If the URI is already being downloaded, the
+       *  request just listens to the existing download.
+       *
+       *  \return \b true if a new download was added to the Acquire
+       *  queue.
        */
-      static void process_start_request(const start_request &req,
-					pkgAcquire &acquireQueue)
+      static bool process_start_request(const start_request &req,
+					pkgAcquire &acquireQueue,
+					std::size_t slot)
       {
 	cw::threads::mutex::lock l(state_mutex);
 
-	LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
-		  "Creating a new download item for " << req.get_uri());
+	if(req.get_request()->get_cancelled())
+	  {
+	    LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+		      "Not downloading " << req.get_uri() << ": it was canceled.");
+	    return false;
+	  }
 
-	boost::shared_ptr<download_job> job =
-	  boost::make_shared<download_job>(req.get_uri(),
-					   req.get_short_description(),
-					   req.get_filename(),
-					   req.get_cached_filename(),
-					   req.get_last_modified_time());
+	boost::unordered_map<std::string, boost::shared_ptr<active_download_info> >::iterator
+	  found = active_downloads.find(req.get_uri());
 
-	// The next couple lines are only safe because we're
-	// holding a lock (otherwise someone could sneak in and
-	// delete the item in between them).
-	AcqQueuedFile *item = new AcqQueuedFile(&acquireQueue, job);
+	boost::shared_ptr<download_job> job;
+	bool rval = false;
 
-	boost::shared_ptr<active_download_info> download =
-	  boost::make_shared<active_download_info>(job, sigc::mem_fun(*item, &AcqQueuedFile::destroy));
+	if(found != active_downloads.end() && found->second->get_slot() == slot)
+	  {
+	    LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+		      "Merging a request for " << req.get_uri()
+		      << " into the download that is already running.");
 
-	active_downloads[req.get_uri()] = download;
+	    job = found->second->get_job();
+	  }
+	else
+	  {
+	    LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+		      "Creating a new download item for " << req.get_uri());
+
+	    job = boost::make_shared<download_job>(req.get_uri(),
+						   req.get_short_description(),
+						   req.get_filename(),
+						   req.get_cached_contents(),
+						   req.get_last_modified_time());
+
+	    // The next couple lines are only safe because we're
+	    // holding a lock (otherwise someone could sneak in and
+	    // delete the item in between them).
+	    AcqQueuedFile *item = new AcqQueuedFile(&acquireQueue, job);
+
+	    boost::shared_ptr<active_download_info> download =
+	      boost::make_shared<active_download_info>(job,
+						       sigc::mem_fun(*item, &AcqQueuedFile::destroy),
+						       slot,
+						       req.get_host());
+
+	    active_downloads[req.get_uri()] = download;
+	    rval = true;
+	  }
 
 	req.get_request()->bind(job,
 				job->add_listener(req.get_callbacks(),
-						  req.get_post_thunk()));
+						  req.get_post_thunk(),
+						  req.get_request()->get_cancel_flag()),
+				slot);
+
+	return rval;
       }
 
-    public:
-      download_thread()
+      /** \brief Run the downloads of a slot until it has no more
+       *  start requests.
+       */
+      static void run(std::size_t slot)
       {
+	cw::threads::mutex::lock l(state_mutex);
+
+	LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+		  "Download slot " << slot << " starting.");
+
+	while(!slots[slot].start_requests.empty() && !shutdown_queue)
+	  {
+	    {
+	      LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+			"Setting up the download process for download slot " << slot);
+
+	      download_callback cb(slot);
+	      pkgAcquire downloader;
+	      downloader.Setup(&cb);
+
+	      process_start_requests(slot, downloader);
+
+	      LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+			"Running the queue of download slot " << slot);
+
+	      l.release();
+
+	      downloader.Run(pulse_interval);
+
+	      l.acquire();
+	    }
+
+	    // Any download of this slot that's still listed was
+	    // destroyed with the Acquire object; forget it so that new
+	    // requests for its URI don't try to share it.
+	    for(boost::unordered_map<std::string, boost::shared_ptr<active_download_info> >::iterator
+		  it = active_downloads.begin(); it != active_downloads.end(); )
+	      {
+		if(it->second->get_slot() == slot)
+		  it = active_downloads.erase(it);
+		else
+		  ++it;
+	      }
+	  }
+
+	LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
+		  "No more download start requests, shutting down download slot " << slot);
+
+	// If we finished running and there were no more start
+	// requests, any cancel requests hanging out in the queue are
+	// useless.
+	slots[slot].cancel_requests.clear();
+	slots[slot].thread.reset();
       }
 
+    public:
       // The main frontend routine.
       static boost::shared_ptr<download_request>
       start_download_job(const std::string &uri,
 			 const std::string &short_description,
 			 const boost::shared_ptr<download_callbacks> &callbacks,
-			 post_thunk_f post_thunk)
+			 post_thunk_f post_thunk,
+			 download_priority priority)
       {
 	cw::threads::mutex::lock l(state_mutex);
 
 	boost::shared_ptr<download_request_impl> rval =
-	  boost::make_shared<download_request_impl>();
+	  boost::make_shared<download_request_impl>(callbacks, post_thunk);
 
 	if(shutdown_queue)
 	  {
@@ -806,17 +1204,22 @@ namespace aptitude
 					    temp::name("aptitudeDownload"),
 					    callbacks,
 					    post_thunk,
+					    priority,
 					    rval);
 
-	cache_lookup_thread::add_job(start);
-
-	ensure_background_thread();
+	rval->set_lookup_job(cache_lookup_thread::add_job(start,
+							  priority == download_priority_visible
+							  ? util::job_priority_high
+							  : util::job_priority_low));
 
 	return rval;
       }
 
-      /** \brief Insert a request to cancel the given
-       *  job into the cancel queue.
+      /** \brief Remove a canceled request from the queues.
+       *
+       *  Requests that haven't been handed to a download thread are
+       *  dropped right away; others are placed into the cancel queue
+       *  of the thread that owns their download.
        */
       static void cancel_job(const boost::shared_ptr<download_request_impl> &req)
       {
@@ -829,14 +1232,34 @@ namespace aptitude
 	    return;
 	  }
 
-	cancel_requests.push_back(req);
+	if(req->get_bound())
+	  {
+	    // If the slot's thread has exited, the download is already
+	    // finished and there's nothing to detach.
+	    download_slot &slot = slots[req->get_slot()];
+	    if(slot.thread.get() != NULL)
+	      slot.cancel_requests.push_back(req);
+
+	    return;
+	  }
+
+	for(std::vector<download_slot>::iterator slot_it = slots.begin();
+	    slot_it != slots.end(); ++slot_it)
+	  for(std::deque<boost::shared_ptr<start_request> >::iterator it =
+		slot_it->start_requests.begin();
+	      it != slot_it->start_requests.end(); ++it)
+	    if((*it)->get_request() == req)
+	      {
+		slot_it->start_requests.erase(it);
+		break;
+	      }
 
-	ensure_background_thread();
+	req->cancel_unbound();
       }
 
-      /** \brief Shut down the background thread and clear its data
-       *  structures; used to abort all processing when the program is
-       *  terminating.
+      /** \brief Shut down the background threads and clear their
+       *  data structures; used to abort all processing when the
+       *  program is terminating.
        *
        *  We need to do this because otherwise, the objects in the
        *  queue might be destroyed when global destructors are called,
@@ -854,29 +1277,32 @@ namespace aptitude
 
 	shutdown_queue = true;
 
-	if(instance.get() != NULL)
+	// Take strong copies in case the threads are destroyed while
+	// we're working on them.
+	std::vector<boost::shared_ptr<cw::threads::thread> > threads;
+	for(std::vector<download_slot>::const_iterator it = slots.begin();
+	    it != slots.end(); ++it)
+	  if(it->thread.get() != NULL)
+	    threads.push_back(it->thread);
+
+	if(!threads.empty())
 	  {
 	    LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
-		      "Waiting for the background download thread to terminate.");
-	    // Take a strong copy in case the instance thread is
-	    // destroyed while we're working on it.
-	    boost::shared_ptr<cw::threads::thread> instancet_copy(instancet);
+		      "Waiting for " << threads.size() << " download threads to terminate.");
 
 	    l.release();
-	    instancet_copy->join();
+	    for(std::vector<boost::shared_ptr<cw::threads::thread> >::const_iterator
+		  it = threads.begin(); it != threads.end(); ++it)
+	      (*it)->join();
 	    l.acquire();
 
 	    LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
-		      "The background thread has exited.");
+		      "The download threads have exited.");
 	  }
 
 	LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
-		  "Clearing the start request list.");
-	start_requests.clear();
-
-	LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
-		  "Clearing the cancel request list.");
-	cancel_requests.clear();
+		  "Clearing the start and cancel request lists.");
+	slots.clear();
 
 	LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
 		  "Clearing the active download map.");
@@ -889,7 +1315,8 @@ namespace aptitude
       /** \brief Stop any download for the given URI.
        *
        *  Use by do_cancel() to remove jobs with no listeners from the
-       *  download queue.  Must run in the background thread.
+       *  download queue.  Must run in the thread that owns the
+       *  download.
        */
       static void remove_job_by_uri(const std::string &uri)
       {
@@ -912,71 +1339,18 @@ namespace aptitude
 	    active_downloads.erase(found);
 	  }
       }
-
-      void run()
-      {
-	cw::threads::mutex::lock l(state_mutex);
-
-	LOG_TRACE(Loggers::getAptitudeDownloadQueue(), "Background download queue starting.");
-
-	while(!start_requests.empty() && !shutdown_queue)
-	  {
-	    LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
-		      "Setting up the download process for the background download queue.");
-
-	    download_callback cb;
-	    pkgAcquire downloader;
-            downloader.Setup(&cb);
-
-	    for(std::deque<boost::shared_ptr<start_request> >::const_iterator it =
-		  start_requests.begin();
-		it != start_requests.end(); ++it)
-	      {
-		const start_request &request = **it;
-
-		process_start_request(request, downloader);
-	      }
-
-	    start_requests.clear();
-
-	    LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
-		      "Running the current download queue.");
-
-	    l.release();
-
-	    downloader.Run();
-
-	    l.acquire();
-	  }
-
-	LOG_TRACE(Loggers::getAptitudeDownloadQueue(),
-		  "No more download start requests, shutting down thread.");
-
-	// If we finished running and there were no more start
-	// requests, any cancel requests hanging out in the queue are
-	// useless.
-	cancel_requests.clear();
-
-	instance.reset();
-	instancet.reset();
-      }
     };
 
     bool download_thread::cache_lookup_thread::signals_connected = false;
 
     cw::threads::mutex download_thread::state_mutex((cw::threads::mutex::attr(PTHREAD_MUTEX_RECURSIVE)));
 
-    std::deque<boost::shared_ptr<download_thread::start_request> > download_thread::start_requests;
-
-    std::deque<boost::shared_ptr<download_request_impl> > download_thread::cancel_requests;
+    std::vector<download_thread::download_slot> download_thread::slots;
 
     boost::unordered_map<std::string, boost::shared_ptr<active_download_info> > download_thread::active_downloads;
 
     bool download_thread::shutdown_queue = false;
 
-    boost::shared_ptr<download_thread> download_thread::instance;
-    boost::shared_ptr<cw::threads::thread> download_thread::instancet;
-
 
     void download_job::mark_finished()
     {
@@ -990,9 +1364,25 @@ namespace aptitude
 
     void download_request_impl::cancel()
     {
+      cancel_flag->cancel();
       download_thread::cancel_job(shared_from_this());
     }
 
+    void download_request_impl::cancel_unbound()
+    {
+      if(canceled)
+	return;
+
+      if(lookup_job.get() != NULL)
+	lookup_job->cancel();
+
+      boost::shared_ptr<download_callbacks> callbacks_copy(callbacks.lock());
+      if(callbacks_copy.get() != NULL)
+	download_job::invoke_canceled(callbacks_copy, post_thunk);
+
+      canceled = true;
+    }
+
     void download_request_impl::do_cancel()
     {
       // It's important to note that this runs in the download thread,
@@ -1005,10 +1395,12 @@ namespace aptitude
       boost::shared_ptr<download_job> job(parent.lock());
       if(job.get() != NULL)
 	{
+	  const download_job::listener l(*connection);
+
 	  job->remove_listener(connection);
 	  if(job->listeners_empty())
 	    download_thread::remove_job_by_uri(job->get_uri());
-	  job->invoke_canceled();
+	  download_job::invoke_canceled(l.callbacks, l.post_thunk);
 	}
 
       canceled = true;
@@ -1023,10 +1415,12 @@ namespace aptitude
   queue_download(const std::string &uri,
 		 const std::string &short_description,
 		 const boost::shared_ptr<download_callbacks> &callbacks,
-		 post_thunk_f post_thunk)
+		 post_thunk_f post_thunk,
+		 download_priority priority)
   {
     return download_thread::start_download_job(uri, short_description,
-					       callbacks, post_thunk);
+					       callbacks, post_thunk,
+					       priority);
   }
 
   void shutdown_download_queue()
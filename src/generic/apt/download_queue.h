@@ -82,6 +82,17 @@ namespace aptitude
     }
   };
 
+  /** \brief How soon the result of a download is needed. */
+  enum download_priority
+    {
+      /** \brief The user is waiting to see the item. */
+      download_priority_visible,
+      /** \brief The item is being fetched ahead of time and might
+       *  never be shown.
+       */
+      download_priority_prefetch
+    };
+
   /** \brief Handle to a screenshot download request; can be used to
    *  cancel the request after it has been enqueued.
    *
@@ -96,11 +107,13 @@ namespace aptitude
 
     /** \brief Cancel this download request.
      *
-     *  This is safe to call from any thread.  There is no guarantee
-     *  that the download won't complete anyway, but if it hasn't
-     *  completed by the next call to Pulse() (once a second or so),
-     *  it will be canceled.  Even if it does complete, the callbacks
-     *  won't be invoked.
+     *  This is safe to call from any thread.  Once it returns, no
+     *  callbacks other than canceled() will be posted for this
+     *  request.  A request that hasn't reached the downloader yet is
+     *  dropped at once; one that is being downloaded is detached by
+     *  the downloader within a fraction of a second, and the
+     *  download itself is stopped if nobody else wants the same
+     *  URI.
      */
     virtual void cancel() = 0;
   };
@@ -118,13 +131,26 @@ namespace aptitude
    *  \param post_thunk   A function used to pass download events to
    *                      the main thread.
    *
+   *  \param priority     How soon the item is needed.  Visible items
+   *                      are looked up and handed to the downloader
+   *                      before prefetches, and only a couple of
+   *                      prefetches are downloading at any time, so a
+   *                      visible item never waits behind a long
+   *                      queue of prefetches.
+   *
+   *  Requests for a URI that is already being downloaded share the
+   *  existing download.  Downloads are spread over up to
+   *  Aptitude::Download-Queue::Connections-Per-Host connections to
+   *  each server.
+   *
    *  \return a handle that can be used to cancel the download.
    */
   boost::shared_ptr<download_request>
   queue_download(const std::string &uri,
 		 const std::string &short_description,
 		 const boost::shared_ptr<download_callbacks> &callbacks,
-		 post_thunk_f post_thunk);
+		 post_thunk_f post_thunk,
+		 download_priority priority = download_priority_visible);
 
   /** \brief Shut down the background thread and clear its data
    *  structures; used to abort all processing when the program is
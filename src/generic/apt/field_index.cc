@@ -0,0 +1,516 @@
+// field_index.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#include "field_index.h"
+
+#include <aptitude.h>
+#include "apt.h"
+#include "aptcache.h"
+
+#include <loggers.h>
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/pkgrecords.h>
+#include <apt-pkg/progress.h>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <cwidget/generic/util/transcode.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <langinfo.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using aptitude::Loggers;
+
+namespace aptitude
+{
+  namespace apt
+  {
+    namespace
+    {
+      const char index_magic[8] = { 'A', 'p', 't', 'F', 'I', 'd', 'x', '\0' };
+
+      /** \brief The version of the index file format.
+       *
+       *  Bump this whenever the format changes or the meaning of a
+       *  column changes; indices with a different version are
+       *  rebuilt.
+       */
+      const unsigned int index_format_version = 2;
+
+      const std::size_t max_key_length = 64;
+
+      /** \brief The header at the start of the index file.
+       *
+       *  It is followed by the columns, one after another, then by
+       *  the identity of each version, and then by the strings the
+       *  columns point to.
+       */
+      struct index_header
+      {
+	char magic[8];
+	unsigned int format_version;
+	unsigned int num_versions;
+	char key[max_key_length];
+      };
+
+      /** \brief The field index of the global cache. */
+      boost::shared_ptr<field_index> global_field_index;
+
+      /** \brief Collects the strings of a new index, storing each
+       *  distinct string once.
+       */
+      class string_table
+      {
+	std::string strings;
+	boost::unordered_map<std::string, unsigned int> offsets;
+	std::size_t base;
+
+      public:
+	/** \brief Create an empty table.
+	 *
+	 *  \param _base  the offset in the file at which the strings
+	 *                will be written.
+	 */
+	explicit string_table(std::size_t _base)
+	  : base(_base)
+	{
+	}
+
+	/** \brief Add a string to the table.
+	 *
+	 *  \return its offset in the file, or field_index::missing if
+	 *  the file would become too large to address.
+	 */
+	unsigned int add(const std::string &s)
+	{
+	  boost::unordered_map<std::string, unsigned int>::const_iterator
+	    found = offsets.find(s);
+	  if(found != offsets.end())
+	    return found->second;
+
+	  const std::size_t offset = base + strings.size();
+	  if(offset + s.size() + 1 >= field_index::missing)
+	    return field_index::missing;
+
+	  strings.append(s);
+	  strings.push_back('\0');
+	  offsets[s] = offset;
+	  return offset;
+	}
+
+	const std::string &get_strings() const { return strings; }
+      };
+
+      /** \brief Return \b true if a file of the cache is the dpkg
+       *  status file.
+       *
+       *  The status file changes whenever a package is installed or
+       *  removed, so the index never depends on it.
+       */
+      bool is_status_file(const pkgCache::PkgFileIterator &f,
+			  const std::string &status_file)
+      {
+	return f.FileName() != NULL && status_file == f.FileName();
+      }
+
+      /** \brief Return the first file of a version that isn't the
+       *  dpkg status file, or an end iterator if there is none.
+       */
+      pkgCache::VerFileIterator first_list_file(const pkgCache::VerIterator &ver,
+						const std::string &status_file)
+      {
+	pkgCache::VerFileIterator vf = ver.FileList();
+	while(!vf.end() && is_status_file(vf.File(), status_file))
+	  ++vf;
+	return vf;
+      }
+
+      /** \brief Compute a value that identifies a version, so that
+       *  an index can tell whether a version ID still refers to the
+       *  version it was built for.
+       *
+       *  Never returns field_index::missing.
+       */
+      unsigned int version_identity(const pkgCache::VerIterator &ver)
+      {
+	std::size_t rval = 0;
+	boost::hash_combine(rval, std::string(ver.ParentPkg().Name()));
+	boost::hash_combine(rval, std::string(ver.VerStr()));
+	boost::hash_combine(rval, std::string(ver.Arch()));
+
+	const unsigned int identity = static_cast<unsigned int>(rval);
+	return identity == field_index::missing ? 0 : identity;
+      }
+
+      /** \brief Compute the source package that ?source-package
+       *  would match for a version, from its files other than the
+       *  dpkg status file.
+       *
+       *  \return \b false if those files disagree.
+       */
+      bool get_source_package(const pkgCache::VerIterator &ver,
+			      const std::string &status_file,
+			      pkgRecords &records,
+			      std::string &out)
+      {
+	bool found = false;
+
+	for(pkgCache::VerFileIterator vf = ver.FileList(); !vf.end(); ++vf)
+	  {
+	    if(is_status_file(vf.File(), status_file))
+	      continue;
+
+	    std::string source = records.Lookup(vf).SourcePkg();
+	    if(source.empty())
+	      source = ver.ParentPkg().Name();
+
+	    if(!found)
+	      {
+		out = source;
+		found = true;
+	      }
+	    else if(source != out)
+	      return false;
+	  }
+
+	return found;
+      }
+    }
+
+    const unsigned int field_index::missing;
+
+    field_index::field_index(const char *_data, std::size_t _size)
+      : data(_data), size(_size)
+    {
+      const index_header *header = reinterpret_cast<const index_header *>(data);
+      num_versions = header->num_versions;
+
+      const unsigned int *column_data =
+	reinterpret_cast<const unsigned int *>(data + sizeof(index_header));
+      for(int f = 0; f < num_fields; ++f)
+	columns[f] = column_data + f * num_versions;
+    }
+
+    field_index::~field_index()
+    {
+      munmap(const_cast<char *>(data), size);
+    }
+
+    std::string field_index::get_key(pkgCache &cache)
+    {
+      // Unlike hash_pkgcache(), leave out the dpkg status file and
+      // the number of versions and packages, which change whenever
+      // a package is installed or removed.  open() checks that the
+      // version IDs still refer to the same versions instead.
+      const std::string status_file(_config->FindFile("Dir::State::status"));
+      std::size_t rval = 0;
+      for(pkgCache::PkgFileIterator f = cache.FileList(); !f.end(); ++f)
+	{
+	  if(is_status_file(f, status_file))
+	    continue;
+
+	  boost::hash_combine(rval, std::string(f.FileName()));
+	  boost::hash_combine(rval, f->Size);
+	  boost::hash_combine(rval, f->mtime);
+	}
+
+      // Descriptions are translated according to the locale and the
+      // configured languages, and converted to the locale's
+      // encoding.
+      const char *locale = setlocale(LC_ALL, NULL);
+      boost::hash_combine(rval, std::string(locale == NULL ? "" : locale));
+      boost::hash_combine(rval, std::string(nl_langinfo(CODESET)));
+
+      const std::vector<std::string> languages =
+	aptcfg->FindVector("Acquire::Languages");
+      for(std::vector<std::string>::const_iterator it = languages.begin();
+	  it != languages.end(); ++it)
+	boost::hash_combine(rval, *it);
+
+      std::ostringstream out;
+      out << std::hex << rval;
+      return out.str();
+    }
+
+    boost::shared_ptr<field_index> field_index::open(const std::string &filename,
+						     const std::string &key,
+						     pkgCache &cache)
+    {
+      logging::LoggerPtr logger(Loggers::getAptitudeAptGlobals());
+
+      const int fd = ::open(filename.c_str(), O_RDONLY);
+      if(fd == -1)
+	{
+	  LOG_DEBUG(logger, "Can't open the field index \"" << filename
+		    << "\": " << strerror(errno));
+	  return boost::shared_ptr<field_index>();
+	}
+
+      struct stat buf;
+      if(fstat(fd, &buf) != 0 ||
+	 static_cast<std::size_t>(buf.st_size) < sizeof(index_header))
+	{
+	  LOG_DEBUG(logger, "Ignoring the field index \"" << filename
+		    << "\": it is truncated.");
+	  close(fd);
+	  return boost::shared_ptr<field_index>();
+	}
+
+      const std::size_t size = buf.st_size;
+      void *mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+
+      if(mapped == MAP_FAILED)
+	{
+	  LOG_WARN(logger, "Can't map the field index \"" << filename
+		   << "\": " << strerror(errno));
+	  return boost::shared_ptr<field_index>();
+	}
+
+      const char *data = static_cast<const char *>(mapped);
+      const index_header *header = reinterpret_cast<const index_header *>(data);
+
+      const char *problem = NULL;
+      if(memcmp(header->magic, index_magic, sizeof(index_magic)) != 0)
+	problem = "it is not a field index";
+      else if(header->format_version != index_format_version)
+	problem = "it has the wrong format version";
+      else if(strncmp(header->key, key.c_str(), max_key_length) != 0)
+	problem = "it was built for a different cache";
+      else
+	{
+	  // Check every offset once here, so that get() doesn't have
+	  // to.
+	  const std::size_t strings_begin = sizeof(index_header) +
+	    (num_fields + 1) * header->num_versions * sizeof(unsigned int);
+
+	  if(strings_begin > size || data[size - 1] != '\0')
+	    problem = "it is truncated";
+	  else
+	    {
+	      const unsigned int *offsets =
+		reinterpret_cast<const unsigned int *>(data + sizeof(index_header));
+	      const std::size_t num_offsets = num_fields * header->num_versions;
+
+	      for(std::size_t i = 0; problem == NULL && i < num_offsets; ++i)
+		if(offsets[i] != missing &&
+		   (offsets[i] < strings_begin || offsets[i] >= size))
+		  problem = "it is corrupt";
+
+	      // Installing or removing a package that isn't in the
+	      // package lists can renumber the versions without
+	      // changing the key.
+	      const unsigned int *identities = offsets + num_offsets;
+	      for(pkgCache::PkgIterator pkg = cache.PkgBegin();
+		  problem == NULL && !pkg.end(); ++pkg)
+		for(pkgCache::VerIterator ver = pkg.VersionList();
+		    problem == NULL && !ver.end(); ++ver)
+		  if(ver->ID < header->num_versions &&
+		     identities[ver->ID] != missing &&
+		     identities[ver->ID] != version_identity(ver))
+		    problem = "the versions in the cache have been renumbered";
+	    }
+	}
+
+      if(problem != NULL)
+	{
+	  LOG_INFO(logger, "Ignoring the field index \"" << filename
+		   << "\": " << problem << ".");
+	  munmap(mapped, size);
+	  return boost::shared_ptr<field_index>();
+	}
+
+      LOG_INFO(logger, "Loaded the field index \"" << filename << "\" ("
+	       << size << " bytes).");
+
+      return boost::shared_ptr<field_index>(new field_index(data, size));
+    }
+
+    bool field_index::build(const std::string &filename,
+			    const std::string &key,
+			    pkgCache &cache,
+			    pkgRecords &records,
+			    OpProgress &progress)
+    {
+      logging::LoggerPtr logger(Loggers::getAptitudeAptGlobals());
+
+      if(key.size() >= max_key_length)
+	{
+	  LOG_WARN(logger, "Not building a field index: the key \""
+		   << key << "\" is too long.");
+	  return false;
+	}
+
+      const std::size_t num_versions = cache.Head().VersionCount;
+      const std::size_t strings_begin = sizeof(index_header) +
+	(num_fields + 1) * num_versions * sizeof(unsigned int);
+
+      // The field columns, followed by the identity of each indexed
+      // version.
+      std::vector<unsigned int> column_data((num_fields + 1) * num_versions, missing);
+      string_table strings(strings_begin);
+
+      // Only versions from the package lists are indexed, so that
+      // the index stays valid when the dpkg status file changes;
+      // versions that are only installed fall back to the records.
+      //
+      // Read the records in the order they appear on disk, just like
+      // load_tasks() does.
+      const std::string status_file(_config->FindFile("Dir::State::status"));
+      std::vector<loc_pair> versionfiles;
+      for(pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end(); ++pkg)
+	for(pkgCache::VerIterator ver = pkg.VersionList(); !ver.end(); ++ver)
+	  {
+	    const pkgCache::VerFileIterator vf = first_list_file(ver, status_file);
+	    if(!vf.end())
+	      versionfiles.push_back(loc_pair(ver, vf));
+	  }
+
+      std::sort(versionfiles.begin(), versionfiles.end(), location_compare());
+
+      progress.OverallProgress(0, versionfiles.size(), 1,
+			       _("Building the field index"));
+
+      for(std::vector<loc_pair>::const_iterator it = versionfiles.begin();
+	  it != versionfiles.end(); ++it)
+	{
+	  const pkgCache::VerIterator &ver = it->first;
+	  unsigned int *row = &column_data[ver->ID];
+
+	  row[description * num_versions] =
+	    strings.add(cwidget::util::transcode(get_long_description(ver, &records)));
+	  row[maintainer * num_versions] =
+	    strings.add(records.Lookup(it->second).Maintainer());
+
+	  std::string source;
+	  if(get_source_package(ver, status_file, records, source))
+	    row[source_package * num_versions] = strings.add(source);
+
+	  row[num_fields * num_versions] = version_identity(ver);
+
+	  const std::size_t n = it - versionfiles.begin();
+	  if(n % 1000 == 0)
+	    progress.OverallProgress(n, versionfiles.size(), 1,
+				     _("Building the field index"));
+	}
+
+      progress.OverallProgress(versionfiles.size(), versionfiles.size(), 1,
+			       _("Building the field index"));
+      progress.Done();
+
+      index_header header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, index_magic, sizeof(index_magic));
+      header.format_version = index_format_version;
+      header.num_versions = num_versions;
+      strncpy(header.key, key.c_str(), max_key_length);
+
+      const std::string tmp_filename = filename + ".new";
+      {
+	std::ofstream out(tmp_filename.c_str(), std::ios::out | std::ios::binary);
+	if(!out)
+	  {
+	    LOG_WARN(logger, "Can't write the field index to \"" << tmp_filename << "\".");
+	    return false;
+	  }
+
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	if(!column_data.empty())
+	  out.write(reinterpret_cast<const char *>(&column_data[0]),
+		    column_data.size() * sizeof(unsigned int));
+	out.write(strings.get_strings().data(), strings.get_strings().size());
+
+	if(!out)
+	  {
+	    LOG_WARN(logger, "Error writing the field index to \"" << tmp_filename << "\".");
+	    unlink(tmp_filename.c_str());
+	    return false;
+	  }
+      }
+
+      if(rename(tmp_filename.c_str(), filename.c_str()) != 0)
+	{
+	  LOG_WARN(logger, "Can't rename \"" << tmp_filename << "\" to \""
+		   << filename << "\": " << strerror(errno));
+	  unlink(tmp_filename.c_str());
+	  return false;
+	}
+
+      LOG_INFO(logger, "Wrote the field index for " << versionfiles.size()
+	       << " versions to \"" << filename << "\".");
+
+      return true;
+    }
+
+    void load_field_index(OpProgress &progress)
+    {
+      logging::LoggerPtr logger(Loggers::getAptitudeAptGlobals());
+
+      global_field_index.reset();
+
+      if(!aptcfg->FindB(PACKAGE "::Field-Index", false))
+	{
+	  LOG_TRACE(logger, "Not loading the field index: " PACKAGE "::Field-Index is not set.");
+	  return;
+	}
+
+      const char *HOME = getenv("HOME");
+      if(HOME == NULL || apt_cache_file == NULL || apt_package_records == NULL)
+	return;
+
+      const std::string filename = std::string(HOME) + "/.aptitude/field-index";
+      pkgCache &cache = (*apt_cache_file)->GetCache();
+      const std::string key = field_index::get_key(cache);
+
+      global_field_index = field_index::open(filename, key, cache);
+      if(global_field_index.get() != NULL)
+	return;
+
+      LOG_INFO(logger, "Rebuilding the field index \"" << filename << "\".");
+
+      if(field_index::build(filename, key, cache, *apt_package_records, progress))
+	global_field_index = field_index::open(filename, key, cache);
+    }
+
+    void reset_field_index()
+    {
+      global_field_index.reset();
+    }
+
+    const field_index *get_field_index()
+    {
+      return global_field_index.get();
+    }
+  }
+}
@@ -0,0 +1,205 @@
+// field_index.h                                     -*-c++-*-
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#ifndef FIELD_INDEX_H
+#define FIELD_INDEX_H
+
+#include <apt-pkg/pkgcache.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+
+/** \brief An on-disk copy of the package record fields that searches
+ *  match against.
+ *
+ *  Matching ?description, ?maintainer or ?source-package (and ?term
+ *  when there's no Xapian database) against the package records means
+ *  a pkgRecords::Lookup() for every version, which seeks around the
+ *  Packages files, and for descriptions a conversion to a wide
+ *  string and back.  The field index stores the strings those
+ *  patterns would see, in the form they would see them, so that a
+ *  search can read them from a memory-mapped file instead.
+ *
+ *  The index is a single file in the machine's native byte order.
+ *  It starts with a fixed-size header: an 8-byte magic string, the
+ *  32-bit format version, the 32-bit number of versions in the cache
+ *  and a NUL-padded 64-byte key.  The columns follow the header
+ *  directly, one after another in the order of the field enum; each
+ *  one is an array of 32-bit entries indexed by version ID, so its
+ *  position is computed from the number of versions rather than
+ *  stored.  Each entry is the offset, from the start of the file, of
+ *  a NUL-terminated string in the region that follows the last
+ *  column; identical strings are stored once.  Versions whose value
+ *  couldn't be computed once and for all, or that only appear in the
+ *  dpkg status file, have the entry field_index::missing, and
+ *  callers fall back to the package records for them.  After the
+ *  field columns comes one more array holding a hash of the name,
+ *  version and architecture of each indexed version.
+ *
+ *  The key combines a hash of the package lists with the locale and
+ *  the description languages, so an index that was built for
+ *  different lists or a different translation is never used.  The
+ *  dpkg status file is left out of the key, so installing or
+ *  removing packages doesn't force a rebuild; instead, opening the
+ *  index checks that each indexed version ID still refers to the
+ *  same version.
+ *
+ *  Fields that already live in the package cache (names, sections)
+ *  aren't indexed: they are as cheap to read as anything in the
+ *  index would be.
+ *
+ *  \file field_index.h
+ */
+
+class OpProgress;
+class pkgRecords;
+
+namespace aptitude
+{
+  namespace apt
+  {
+    class field_index
+    {
+    public:
+      /** \brief The columns of the index. */
+      enum field
+	{
+	  /** \brief The long description, exactly as returned by
+	   *  get_long_description() and transcoded back to a
+	   *  multibyte string.
+	   */
+	  description,
+	  /** \brief The Maintainer field of the version's first file. */
+	  maintainer,
+	  /** \brief The source package of the version, or the name of
+	   *  its package if it has no Source field.
+	   *
+	   *  Only present if all the files of the version agree on it.
+	   */
+	  source_package,
+	  num_fields
+	};
+
+    private:
+      /** \brief The start of the mapped file. */
+      const char *data;
+      /** \brief The size of the mapped file. */
+      std::size_t size;
+
+      /** \brief The number of versions in each column. */
+      unsigned long num_versions;
+
+      /** \brief The offset tables, one per field. */
+      const unsigned int *columns[num_fields];
+
+      field_index(const char *_data, std::size_t _size);
+
+      // Not copyable: the index owns its mapping.
+      field_index(const field_index &);
+      field_index &operator=(const field_index &);
+
+    public:
+      ~field_index();
+
+      /** \brief Compute the key that an index for the given cache
+       *  must have.
+       */
+      static std::string get_key(pkgCache &cache);
+
+      /** \brief Open an existing index.
+       *
+       *  \param filename  the file containing the index.
+       *  \param key       the key the index must have, as returned
+       *                   by get_key().
+       *  \param cache     the cache the index must describe.
+       *
+       *  \return the index, or an invalid pointer if the file
+       *  doesn't exist, can't be read, was built for different
+       *  package lists, or its version IDs have been reassigned.
+       */
+      static boost::shared_ptr<field_index> open(const std::string &filename,
+						 const std::string &key,
+						 pkgCache &cache);
+
+      /** \brief Build a new index from the package records.
+       *
+       *  The index is written to a temporary file that is renamed
+       *  over the old index, so a reader never sees a partially
+       *  written file.  Records are read in the order they appear on
+       *  disk.
+       *
+       *  \param filename  the file to write the index to.
+       *  \param key       the key of the index, as returned by
+       *                   get_key().
+       *  \param cache     the cache to index.
+       *  \param records   the package records of the cache.
+       *  \param progress  a progress bar to update while the records
+       *                   are read.
+       *
+       *  \return \b true if the index was written.
+       */
+      static bool build(const std::string &filename,
+			const std::string &key,
+			pkgCache &cache,
+			pkgRecords &records,
+			OpProgress &progress);
+
+      /** \brief Look up a field of a version.
+       *
+       *  \return the value of the field, or \b NULL if it isn't in
+       *  the index; the caller should then compute it from the
+       *  package records.
+       */
+      const char *get(field f, const pkgCache::VerIterator &ver) const
+      {
+	if(ver.end() || ver->ID >= num_versions)
+	  return NULL;
+
+	const unsigned int offset = columns[f][ver->ID];
+	if(offset == missing)
+	  return NULL;
+	else
+	  return data + offset;
+      }
+
+      /** \brief The offset that marks a missing value. */
+      static const unsigned int missing = 0xffffffffU;
+    };
+
+    /** \brief Load the field index of the global cache, building it
+     *  if it is missing or out of date.
+     *
+     *  Does nothing unless Aptitude::Field-Index is set.
+     */
+    void load_field_index(OpProgress &progress);
+
+    /** \brief Discard the field index of the global cache. */
+    void reset_field_index();
+
+    /** \brief Retrieve the field index of the global cache.
+     *
+     *  \return the index, or \b NULL if there is none.  The pointer is
+     *  valid until the cache is closed.
+     */
+    const field_index *get_field_index();
+  }
+}
+
+#endif // FIELD_INDEX_H
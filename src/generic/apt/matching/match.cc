@@ -22,8 +22,11 @@
 #include <aptitude.h>
 
 #include <generic/apt/apt.h>
+#include <generic/apt/field_index.h>
+#include <generic/apt/symbol_table.h>
 #include <generic/apt/tags.h>
 #include <generic/apt/tasks.h>
+#include <generic/util/profile.h>
 #include <generic/util/progress_info.h>
 #include <generic/util/util.h>
 
@@ -32,6 +35,7 @@
 #include <apt-pkg/pkgsystem.h>
 #include <apt-pkg/version.h>
 
+#include <cwidget/generic/threads/threads.h>
 #include <cwidget/generic/util/transcode.h>
 
 #ifdef HAVE_EPT_TEXTSEARCH
@@ -48,11 +52,13 @@
 
 #include <algorithm>
 
+#include <boost/make_shared.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 #include "serialize.h"
 
+using aptitude::apt::field_index;
 using aptitude::util::progress_info;
 using boost::unordered_map;
 using cwidget::util::transcode;
@@ -64,6 +70,8 @@ namespace aptitude
   {
     namespace
     {
+      aptitude::util::profile_counter records_looked_up("records-looked-up");
+
 #ifdef HAVE_EPT_TEXTSEARCH
       typedef ept::textsearch::TextSearch debtags_db;
 
@@ -101,6 +109,21 @@ namespace aptitude
       }
 #endif
 
+      /** \brief Look up a field of a version in the field index.
+       *
+       *  \return the value of the field, or \b NULL if there is no
+       *  field index or the version isn't in it.
+       */
+      const char *get_indexed_field(field_index::field f,
+				    const pkgCache::VerIterator &ver)
+      {
+	const field_index *index = aptitude::apt::get_field_index();
+	if(index == NULL)
+	  return NULL;
+	else
+	  return index->get(f, ver);
+      }
+
       /** \brief Evaluate any regular expression-based pattern.
        *
        *  \param p      The pattern to evaluate.
@@ -304,6 +327,11 @@ namespace aptitude
 	}
     }
 
+    namespace
+    {
+      class pattern_program;
+    }
+
     // We could try a fancy scheme where arbitrary values are attached
     // to each pattern and downcast using dynamic_cast, but I opted
     // for just explicitly listing all the possible caches in one
@@ -325,6 +353,56 @@ namespace aptitude
 	}
       };
 
+      /** \brief The memoized result of matching a ?task or ?tag
+       *  pattern against one symbol.
+       */
+      struct symbol_match
+      {
+	bool evaluated;
+	ref_ptr<match> m;
+
+	symbol_match()
+	  : evaluated(false)
+	{
+	}
+      };
+
+      /** \brief Maps each ?task or ?tag pattern to its result for
+       *  each symbol, indexed by symbol ID.
+       */
+      typedef std::map<ref_ptr<pattern>, std::vector<symbol_match> > symbol_match_map;
+
+      symbol_match_map task_matches;
+      symbol_match_map tag_matches;
+
+      // Assigns IDs to the debtags tags seen by ?tag, so that its
+      // results can be memoized like those of ?task.
+      aptitude::apt::symbol_table tag_names;
+
+      /** \brief Match a regular expression pattern against a symbol,
+       *  memoizing the result in the given map.
+       */
+      ref_ptr<match> find_symbol_match(symbol_match_map &matches,
+				       const ref_ptr<pattern> &p,
+				       const pattern::regex_info &inf,
+				       aptitude::apt::symbol_id id,
+				       const std::string &name,
+				       bool debug)
+      {
+	std::vector<symbol_match> &results = matches[p];
+	if(id >= results.size())
+	  results.resize(id + 1);
+
+	symbol_match &result = results[id];
+	if(!result.evaluated)
+	  {
+	    result.m = evaluate_regexp(p, inf, name.c_str(), debug);
+	    result.evaluated = true;
+	  }
+
+	return result.m;
+      }
+
       // Either a pointer to the debtags database, or NULL if it
       // couldn't be initialized.
       boost::scoped_ptr<debtags_db> db;
@@ -335,6 +413,11 @@ namespace aptitude
       // top-level term is filled in the first time it's encountered.
       std::map<ref_ptr<pattern>, xapian_info> toplevel_xapian_info;
 
+      // Maps patterns passed to test_match() to their compiled
+      // programs.  Each program is compiled the first time its
+      // pattern is tested.
+      std::map<ref_ptr<pattern>, boost::shared_ptr<pattern_program> > programs;
+
       // Maps each term that has been looked up to a sorted list of
       // the packages it matches.
       std::map<std::string, std::vector<Xapian::docid> > matched_terms;
@@ -450,6 +533,32 @@ namespace aptitude
 	  return cached_match->second;
       }
 
+      /** \brief Return a match of the given task to the given
+       *  pattern, which must be a ?task pattern.
+       */
+      ref_ptr<match> find_task_match(const ref_ptr<pattern> &p,
+				     aptitude::apt::symbol_id task_id,
+				     bool debug)
+      {
+	return find_symbol_match(task_matches, p,
+				 p->get_task_regex_info(),
+				 task_id, get_task_names().get_name(task_id),
+				 debug);
+      }
+
+      /** \brief Return a match of the given debtags tag to the given
+       *  pattern, which must be a ?tag pattern.
+       */
+      ref_ptr<match> find_tag_match(const ref_ptr<pattern> &p,
+				    const std::string &tag,
+				    bool debug)
+      {
+	return find_symbol_match(tag_matches, p,
+				 p->get_tag_regex_info(),
+				 tag_names.intern(tag), tag,
+				 debug);
+      }
+
       bool term_prefix_matches(const matchable &target,
                                const std::string &prefix,
                                aptitudeDepCache &cache,
@@ -477,6 +586,9 @@ namespace aptitude
         else
           {
             pkgCache::VerIterator ver = target.get_version_iterator(cache);
+            const char *indexed = get_indexed_field(field_index::description, ver);
+            if(indexed != NULL)
+              return term_prefix_regex->exec(indexed);
 
             return term_prefix_regex->exec(transcode(get_long_description(ver, &records)));
           }
@@ -580,6 +692,9 @@ namespace aptitude
         else
           {
             pkgCache::VerIterator ver = target.get_version_iterator(cache);
+            const char *indexed = get_indexed_field(field_index::description, ver);
+            if(indexed != NULL)
+              return term_regex->exec(indexed);
 
             return term_regex->exec(transcode(get_long_description(ver, &records)));
           }
@@ -665,6 +780,11 @@ namespace aptitude
 	else
 	  return found->second;
       }
+
+      /** \brief Get the compiled program for the given pattern,
+       *  compiling it if necessary.
+       */
+      const pattern_program &get_program(const ref_ptr<pattern> &p);
     };
  
     search_cache::search_cache()
@@ -1114,6 +1234,13 @@ namespace aptitude
 	    else
 	      {
 		pkgCache::VerIterator ver(target.get_version_iterator(cache));
+		const char *indexed = get_indexed_field(field_index::description, ver);
+		if(indexed != NULL)
+		  return evaluate_regexp(p,
+					 p->get_description_regex_info(),
+					 indexed,
+					 debug);
+
 		return evaluate_regexp(p,
 				       p->get_description_regex_info(),
 				       transcode(get_long_description(ver, &records)).c_str(),
@@ -1192,6 +1319,14 @@ namespace aptitude
 	    else
 	      {
 		pkgCache::VerIterator ver(target.get_version_iterator(cache));
+		const char *indexed = get_indexed_field(field_index::maintainer, ver);
+		if(indexed != NULL)
+		  return evaluate_regexp(p,
+					 p->get_maintainer_regex_info(),
+					 indexed,
+					 debug);
+
+		records_looked_up.increment();
 		pkgRecords::Parser &rec(records.Lookup(ver.FileList()));
 
 		return evaluate_regexp(p,
@@ -1527,9 +1662,19 @@ namespace aptitude
 	      pkgCache::PkgIterator pkg(target.get_package_iterator(cache));
 	      pkgCache::VerIterator ver(target.get_version_iterator(cache));
 
+	      // The index only has an entry if every file agrees on the
+	      // source package, so it's the only string to test.
+	      const char *indexed = get_indexed_field(field_index::source_package, ver);
+	      if(indexed != NULL)
+		return evaluate_regexp(p,
+				       p->get_source_package_regex_info(),
+				       indexed,
+				       debug);
+
 	      for(pkgCache::VerFileIterator vf = ver.FileList();
 		  !vf.end(); ++vf)
 		{
+		  records_looked_up.increment();
 		  pkgRecords::Parser &rec = records.Lookup(vf);
 
 		  if(rec.SourcePkg().empty())
@@ -1576,6 +1721,7 @@ namespace aptitude
 	      for(pkgCache::VerFileIterator vf = ver.FileList();
 		  !vf.end(); ++vf)
 		{
+		  records_looked_up.increment();
 		  pkgRecords::Parser &rec = records.Lookup(vf);
 
 		  if(rec.SourceVer().empty())
@@ -1637,10 +1783,7 @@ namespace aptitude
 		  const std::string name = i->str().c_str();
 #endif
 		  ref_ptr<match> rval =
-		    evaluate_regexp(p,
-				    p->get_tag_regex_info(),
-				    name.c_str(),
-				    debug);
+		    search_info->find_tag_match(p, name, debug);
 
 		  if(rval.valid())
 		    return rval;
@@ -1654,20 +1797,14 @@ namespace aptitude
 	    {
 	      pkgCache::PkgIterator pkg(target.get_package_iterator(cache));
 
-	      std::set<string> *l = get_tasks(pkg);
-
-	      if(!l)
-		return NULL;
+	      const aptitude::apt::symbol_set tasks = get_tasks(pkg);
 
-	      for(std::set<string>::iterator i = l->begin();
-		  i != l->end();
+	      for(aptitude::apt::symbol_set::const_iterator i = tasks.begin();
+		  i != tasks.end();
 		  ++i)
 		{
 		  ref_ptr<match> m =
-		    evaluate_regexp(p,
-				    p->get_task_regex_info(),
-				    i->c_str(),
-				    debug);
+		    search_info->find_task_match(p, *i, debug);
 
 		  if(m.valid())
 		    return m;
@@ -2204,156 +2341,903 @@ namespace aptitude
 				   filtered_pool, cache, records, debug);
       }
 
-      // is_pure_xapian returns "true" if we can identify a Xapian
-      // term that matches if AND ONLY IF the pattern matches.  In
-      // other words: it contains only structural patterns combined
-      // with Boolean operators (and version-manipulation operators,
-      // which we ignore).
-      bool is_pure_xapian(const ref_ptr<pattern> &p)
+      /** \brief A pattern compiled into a flat program that tests
+       *  whether a package matches, without describing the match.
+       *
+       *  get_match() builds a structural_match for every node of the
+       *  pattern, which is wasted work when the caller only wants to
+       *  know whether there was a match.  A program stores the
+       *  pattern's nodes in prefix order; each instruction records
+       *  where its operands end, so an operator can skip the operands
+       *  it doesn't need to evaluate.  While compiling:
+       *
+       *   - Constant subterms (?true, ?false and anything they
+       *     decide) are folded away.
+       *
+       *   - The operands of ?and and ?or are ordered by an estimate
+       *     of how expensive they are to evaluate, so that cheap
+       *     tests that can decide the result run first.
+       *
+       *   - The common atomic tests are evaluated directly, without
+       *     allocating anything.  Other atomic tests, and the
+       *     structural operators that build new pools of versions,
+       *     are handed to the ordinary evaluator.
+       *
+       *  Every pool that the program itself evaluates is either the
+       *  package's initial pool or a single version from it, so pools
+       *  are never empty; this is what makes constant folding valid.
+       *  Patterns that use variables (?for, ?bind and ?=) are not
+       *  compiled at all: the whole pattern is handed to the ordinary
+       *  evaluator.
+       */
+      class pattern_program
       {
-	switch(p->get_type())
+      public:
+	enum opcode
 	  {
-	  case pattern::all_versions:
-	    return is_pure_xapian(p->get_all_versions_pattern());
+	    /** \brief Always matches. */
+	    op_true,
+	    /** \brief Never matches. */
+	    op_false,
+	    /** \brief Matches if all the operands match. */
+	    op_and,
+	    /** \brief Matches if any operand matches. */
+	    op_or,
+	    /** \brief Matches if the single operand doesn't match. */
+	    op_not,
+	    /** \brief Matches if the operand matches any single version
+	     *  in the pool.
+	     */
+	    op_any_version,
+	    /** \brief Matches if the operand matches every version in
+	     *  the pool.
+	     */
+	    op_all_versions,
+	    /** \brief An atomic test that is evaluated directly. */
+	    op_test,
+	    /** \brief An atomic test that is passed to
+	     *  evaluate_atomic().
+	     */
+	    op_atomic,
+	    /** \brief A subpattern that is passed to
+	     *  evaluate_structural().
+	     */
+	    op_structural
+	  };
+
+	struct instruction
+	{
+	  opcode op;
 
-	  case pattern::and_tp:
-	    {
-	      const std::vector<ref_ptr<pattern> > &
-		sub_patterns(p->get_and_patterns());
+	  /** \brief The index of the first instruction after this
+	   *  instruction's operands.
+	   */
+	  std::size_t next;
 
-	      if(sub_patterns.size() == 0)
-		return true;
+	  /** \brief The pattern tested by op_test, op_atomic and
+	   *  op_structural.
+	   */
+	  ref_ptr<pattern> p;
 
-	      for(std::vector<ref_ptr<pattern> >::const_iterator it =
-		    sub_patterns.begin(); it != sub_patterns.end(); ++it)
-		{
-		  if(!is_pure_xapian(*it))
-		    return false;
-		}
+	  /** \brief The estimated cost of evaluating this instruction
+	   *  and its operands.
+	   */
+	  int cost;
 
-	      return true;
-	    }
+	  instruction(opcode _op, const ref_ptr<pattern> &_p, int _cost)
+	    : op(_op), next(0), p(_p), cost(_cost)
+	  {
+	  }
+	};
 
-	  case pattern::any_version:
-	    return is_pure_xapian(p->get_any_version_pattern());
+      private:
+	std::vector<instruction> instructions;
 
-	  case pattern::exact_name:
-	    // Names are indexed by apt-xapian-index under the prefix
-	    // "XP".
-	    return true;
+	/** \brief The versions of a package that an instruction is
+	 *  evaluated against: either the single version ver, or (if
+	 *  ver is an end iterator) every version of pkg, or pkg itself
+	 *  if it has no versions.
+	 */
+	struct pool_ref
+	{
+	  pkgCache::PkgIterator pkg;
+	  pkgCache::VerIterator ver;
+
+	  pool_ref(const pkgCache::PkgIterator &_pkg,
+		   const pkgCache::VerIterator &_ver)
+	    : pkg(_pkg), ver(_ver)
+	  {
+	  }
+
+	  bool is_single() const
+	  {
+	    return !ver.end() || pkg.VersionList().end();
+	  }
+
+	  matchable get_single() const
+	  {
+	    if(ver.end())
+	      return matchable(pkg);
+	    else
+	      return matchable(pkg, ver);
+	  }
+
+	  /** \brief Build the pool as the ordinary evaluator sees it. */
+	  void get_pool(std::vector<matchable> &out) const
+	  {
+	    if(is_single())
+	      out.push_back(get_single());
+	    else
+	      {
+		for(pkgCache::VerIterator v = pkg.VersionList();
+		    !v.end(); ++v)
+		  out.push_back(matchable(pkg, v));
+
+		std::sort(out.begin(), out.end());
+	      }
+	  }
+	};
+
+	/** \brief The state shared by one evaluation of a program. */
+	struct context
+	{
+	  const pool_ref &toplevel;
+	  const ref_ptr<search_cache::implementation> &search_info;
+	  aptitudeDepCache &cache;
+	  pkgRecords &records;
+
+	  // The initial pool and evaluation stack that get_match()
+	  // would have used; built the first time the ordinary
+	  // evaluator is invoked.
+	  std::vector<matchable> toplevel_pool;
+	  stack the_stack;
+
+	  context(const pool_ref &_toplevel,
+		  const ref_ptr<search_cache::implementation> &_search_info,
+		  aptitudeDepCache &_cache,
+		  pkgRecords &_records)
+	    : toplevel(_toplevel), search_info(_search_info),
+	      cache(_cache), records(_records)
+	  {
+	  }
+
+	  stack &get_stack()
+	  {
+	    if(the_stack.empty())
+	      {
+		toplevel.get_pool(toplevel_pool);
+		the_stack.push_back(&toplevel_pool);
+	      }
+
+	    return the_stack;
+	  }
+	};
+
+	static bool uses_variables(const ref_ptr<pattern> &p);
+	static bool is_direct_test(const ref_ptr<pattern> &p);
+	static int get_test_cost(const ref_ptr<pattern> &p);
+	static void compile(const ref_ptr<pattern> &p,
+			    std::vector<instruction> &out);
+	static void compile_junction(const ref_ptr<pattern> &p,
+				     const std::vector<ref_ptr<pattern> > &sub_patterns,
+				     bool is_and,
+				     std::vector<instruction> &out);
+	static void append(std::vector<instruction> &out,
+			   const std::vector<instruction> &program);
+
+	static bool test(const ref_ptr<pattern> &p,
+			 const matchable &target,
+			 context &ctx);
+
+	bool evaluate(std::size_t pc,
+		      const pool_ref &pool,
+		      structural_eval_mode mode,
+		      context &ctx) const;
+
+	bool evaluate_leaf(const instruction &inst,
+			   const matchable &target,
+			   context &ctx) const;
+
+      public:
+	explicit pattern_program(const ref_ptr<pattern> &p);
+
+	/** \brief Test whether a package or version matches the
+	 *  program's pattern; the arguments are as for get_match().
+	 */
+	bool run(const pkgCache::PkgIterator &pkg,
+		 const pkgCache::VerIterator &ver,
+		 const ref_ptr<search_cache::implementation> &search_info,
+		 aptitudeDepCache &cache,
+		 pkgRecords &records) const;
+      };
 
+      bool pattern_program::uses_variables(const ref_ptr<pattern> &p)
+      {
+	switch(p->get_type())
+	  {
+	  case pattern::bind:
+	  case pattern::equal:
 	  case pattern::for_tp:
-	    return is_pure_xapian(p->get_for_pattern());
+	    return true;
 
-	  case pattern::narrow:
-	    return
-	      is_pure_xapian(p->get_narrow_filter()) &&
-	      is_pure_xapian(p->get_narrow_pattern());
+	  case pattern::all_versions:
+	    return uses_variables(p->get_all_versions_pattern());
 
-	  case pattern::not_tp:
-	    return is_pure_xapian(p->get_not_pattern());
+	  case pattern::any_version:
+	    return uses_variables(p->get_any_version_pattern());
 
+	  case pattern::and_tp:
 	  case pattern::or_tp:
 	    {
-	      const std::vector<ref_ptr<pattern> > &
-		sub_patterns(p->get_or_patterns());
-
-	      if(sub_patterns.size() == 0)
-		return true;
+	      const std::vector<ref_ptr<pattern> > &sub_patterns =
+		p->get_type() == pattern::and_tp
+		  ? p->get_and_patterns()
+		  : p->get_or_patterns();
 
 	      for(std::vector<ref_ptr<pattern> >::const_iterator it =
 		    sub_patterns.begin(); it != sub_patterns.end(); ++it)
-		{
-		  if(!is_pure_xapian(*it))
-		    return false;
-		}
+		if(uses_variables(*it))
+		  return true;
 
-	      return true;
+	      return false;
 	    }
 
-	  case pattern::widen:
-	    return is_pure_xapian(p->get_widen_pattern());
+	  case pattern::depends:
+	    return uses_variables(p->get_depends_pattern());
 
-	  case pattern::term:
-	    return true;
+	  case pattern::narrow:
+	    return
+	      uses_variables(p->get_narrow_filter()) ||
+	      uses_variables(p->get_narrow_pattern());
 
-	  case pattern::term_prefix:
-	    return true;
+	  case pattern::not_tp:
+	    return uses_variables(p->get_not_pattern());
 
-	    // Various non-Xapian terms.  All of these return false.
+	  case pattern::provides:
+	    return uses_variables(p->get_provides_pattern());
 
-	  case pattern::archive:
-	  case pattern::action:
+	  case pattern::reverse_depends:
+	    return uses_variables(p->get_reverse_depends_pattern());
+
+	  case pattern::reverse_provides:
+	    return uses_variables(p->get_reverse_provides_pattern());
+
+	  case pattern::widen:
+	    return uses_variables(p->get_widen_pattern());
+
+	  default:
+	    return false;
+	  }
+      }
+
+      bool pattern_program::is_direct_test(const ref_ptr<pattern> &p)
+      {
+	switch(p->get_type())
+	  {
 	  case pattern::architecture:
 	  case pattern::automatic:
-	  case pattern::bind:
 	  case pattern::broken:
-	  case pattern::broken_type:
 	  case pattern::candidate_version:
 	  case pattern::config_files:
 	  case pattern::current_version:
-	  case pattern::depends:
-	  case pattern::description:
 	  case pattern::essential:
-	  case pattern::equal:
-	  case pattern::false_tp:
+	  case pattern::exact_name:
 	  case pattern::garbage:
 	  case pattern::install_version:
 	  case pattern::installed:
-	  case pattern::maintainer:
-	  case pattern::multiarch:
 	  case pattern::name:
 	  case pattern::new_tp:
 	  case pattern::obsolete:
-	  case pattern::origin:
 	  case pattern::priority:
-	  case pattern::provides:
-	  case pattern::reverse_depends:
-	  case pattern::reverse_provides:
 	  case pattern::section:
-	  case pattern::source_package:
-	  case pattern::source_version:
-	  case pattern::tag:
-	  case pattern::task:
-	  case pattern::true_tp:
 	  case pattern::upgradable:
-	  case pattern::user_tag:
 	  case pattern::version:
 	  case pattern::virtual_tp:
-	    return false;
+	    return true;
+
 	  default:
-	    throw MatchingException("Internal error: unhandled pattern type in is_pure_xapian()");
+	    return false;
 	  }
       }
 
-      // is_xapian_dependent returns "true" if we can always identify
-      // a Xapian term that must match for the pattern to match.
-      bool is_xapian_dependent(const ref_ptr<pattern> &p)
+      int pattern_program::get_test_cost(const ref_ptr<pattern> &p)
       {
 	switch(p->get_type())
 	  {
-	  case pattern::all_versions:
-	    return is_xapian_dependent(p->get_all_versions_pattern());
-
-	  case pattern::and_tp:
-	    {
-	      const std::vector<ref_ptr<pattern> > &
-		sub_patterns(p->get_and_patterns());
+	    // Flag and pointer comparisons.
+	  case pattern::automatic:
+	  case pattern::broken:
+	  case pattern::candidate_version:
+	  case pattern::config_files:
+	  case pattern::current_version:
+	  case pattern::essential:
+	  case pattern::garbage:
+	  case pattern::install_version:
+	  case pattern::installed:
+	  case pattern::multiarch:
+	  case pattern::new_tp:
+	  case pattern::priority:
+	  case pattern::upgradable:
+	  case pattern::virtual_tp:
+	    return 1;
 
-	      if(sub_patterns.size() == 0)
-		return false;
+	  case pattern::action:
+	  case pattern::broken_type:
+	  case pattern::exact_name:
+	  case pattern::obsolete:
+	    return 2;
 
-	      // The AND is fine if it has at least one positive
-	      // Xapian-dependent term.  NB: since negative terms are
-	      // not Xapian-dependent, checking both conditions is
-	      // redundant, so we just check that each sub-term is
-	      // Xapian-dependent.
-	      for(std::vector<ref_ptr<pattern> >::const_iterator it =
-		    sub_patterns.begin(); it != sub_patterns.end(); ++it)
-		{
-		  if(is_xapian_dependent(*it))
-		    return true;
-		}
+	    // Regular expressions on strings in the cache.
+	  case pattern::architecture:
+	  case pattern::archive:
+	  case pattern::name:
+	  case pattern::origin:
+	  case pattern::section:
+	  case pattern::version:
+	    return 5;
+
+	  case pattern::tag:
+	  case pattern::task:
+	  case pattern::term:
+	  case pattern::term_prefix:
+	  case pattern::user_tag:
+	    return 10;
+
+	    // Regular expressions on the package records.
+	  case pattern::description:
+	  case pattern::maintainer:
+	  case pattern::source_package:
+	  case pattern::source_version:
+	    return 20;
+
+	    // Patterns that search other packages.
+	  default:
+	    return 100;
+	  }
+      }
+
+      void pattern_program::append(std::vector<instruction> &out,
+				   const std::vector<instruction> &program)
+      {
+	const std::size_t offset = out.size();
+	for(std::vector<instruction>::const_iterator it = program.begin();
+	    it != program.end(); ++it)
+	  {
+	    out.push_back(*it);
+	    out.back().next += offset;
+	  }
+      }
+
+      struct instruction_program_cost_lt
+      {
+	bool operator()(const std::vector<pattern_program::instruction> &p1,
+			const std::vector<pattern_program::instruction> &p2) const
+	{
+	  return p1.front().cost < p2.front().cost;
+	}
+      };
+
+      void pattern_program::compile_junction(const ref_ptr<pattern> &p,
+					     const std::vector<ref_ptr<pattern> > &sub_patterns,
+					     bool is_and,
+					     std::vector<instruction> &out)
+      {
+	// The constant that decides the junction, and the one that
+	// the junction of no operands evaluates to.
+	const opcode dominant = is_and ? op_false : op_true;
+	const opcode identity = is_and ? op_true : op_false;
+
+	std::vector<std::vector<instruction> > operands;
+	for(std::vector<ref_ptr<pattern> >::const_iterator it =
+	      sub_patterns.begin(); it != sub_patterns.end(); ++it)
+	  {
+	    std::vector<instruction> operand;
+	    compile(*it, operand);
+
+	    if(operand.front().op == dominant)
+	      {
+		out.push_back(instruction(dominant, p, 0));
+		out.back().next = out.size();
+		return;
+	      }
+	    else if(operand.front().op != identity)
+	      operands.push_back(operand);
+	  }
+
+	if(operands.empty())
+	  {
+	    out.push_back(instruction(identity, p, 0));
+	    out.back().next = out.size();
+	    return;
+	  }
+	else if(operands.size() == 1)
+	  {
+	    append(out, operands.front());
+	    return;
+	  }
+
+	// Sort the operands so that the cheapest ones are evaluated
+	// first.  This is safe because evaluating a program has no
+	// side effects; stable_sort keeps the user's order among
+	// operands of equal cost.
+	std::stable_sort(operands.begin(), operands.end(),
+			 instruction_program_cost_lt());
+
+	int cost = 1;
+	for(std::vector<std::vector<instruction> >::const_iterator it =
+	      operands.begin(); it != operands.end(); ++it)
+	  cost += it->front().cost;
+
+	const std::size_t start = out.size();
+	out.push_back(instruction(is_and ? op_and : op_or, p, cost));
+	for(std::vector<std::vector<instruction> >::const_iterator it =
+	      operands.begin(); it != operands.end(); ++it)
+	  append(out, *it);
+	out[start].next = out.size();
+      }
+
+      void pattern_program::compile(const ref_ptr<pattern> &p,
+				    std::vector<instruction> &out)
+      {
+	const std::size_t start = out.size();
+
+	switch(p->get_type())
+	  {
+	  case pattern::true_tp:
+	    out.push_back(instruction(op_true, p, 0));
+	    break;
+
+	  case pattern::false_tp:
+	    out.push_back(instruction(op_false, p, 0));
+	    break;
+
+	  case pattern::and_tp:
+	    compile_junction(p, p->get_and_patterns(), true, out);
+	    return;
+
+	  case pattern::or_tp:
+	    compile_junction(p, p->get_or_patterns(), false, out);
+	    return;
+
+	  case pattern::not_tp:
+	  case pattern::any_version:
+	  case pattern::all_versions:
+	    {
+	      std::vector<instruction> operand;
+	      const opcode op =
+		p->get_type() == pattern::not_tp ? op_not
+		: p->get_type() == pattern::any_version ? op_any_version
+		: op_all_versions;
+
+	      compile(p->get_type() == pattern::not_tp ? p->get_not_pattern()
+		      : p->get_type() == pattern::any_version ? p->get_any_version_pattern()
+		      : p->get_all_versions_pattern(),
+		      operand);
+
+	      const opcode operand_op = operand.front().op;
+	      if(operand_op == op_true || operand_op == op_false)
+		{
+		  // The pool is never empty, so the version operators
+		  // pass constants through unchanged.
+		  const bool value = (operand_op == op_true) != (op == op_not);
+		  out.push_back(instruction(value ? op_true : op_false, p, 0));
+		}
+	      else
+		{
+		  out.push_back(instruction(op, p, operand.front().cost + 1));
+		  append(out, operand);
+		}
+	    }
+	    break;
+
+	  case pattern::narrow:
+	  case pattern::widen:
+	    out.push_back(instruction(op_structural, p, 100));
+	    break;
+
+	  default:
+	    out.push_back(instruction(is_direct_test(p) ? op_test : op_atomic,
+				      p, get_test_cost(p)));
+	    break;
+	  }
+
+	out[start].next = out.size();
+      }
+
+      pattern_program::pattern_program(const ref_ptr<pattern> &p)
+      {
+	if(uses_variables(p))
+	  {
+	    instructions.push_back(instruction(op_structural, p, 0));
+	    instructions.back().next = 1;
+	  }
+	else
+	  compile(p, instructions);
+      }
+
+      bool pattern_program::test(const ref_ptr<pattern> &p,
+				 const matchable &target,
+				 context &ctx)
+      {
+	aptitudeDepCache &cache(ctx.cache);
+
+	// Each case must agree with the corresponding case in
+	// evaluate_atomic().
+	switch(p->get_type())
+	  {
+	  case pattern::architecture:
+	    return
+	      target.get_has_version() &&
+	      p->get_architecture_regex_info().get_regex_group()->exec(target.get_version_iterator(cache).Arch());
+
+	  case pattern::automatic:
+	    {
+	      pkgCache::PkgIterator pkg(target.get_package_iterator(cache));
+
+	      return
+		(!pkg.CurrentVer().end() || cache[pkg].Install()) &&
+		(cache[pkg].Flags & pkgCache::Flag::Auto);
+	    }
+
+	  case pattern::broken:
+	    if(!target.get_has_version())
+	      return false;
+	    else
+	      {
+		aptitudeDepCache::StateCache &state =
+		  cache[target.get_package_iterator(cache)];
+
+		return state.NowBroken() || state.InstBroken();
+	      }
+
+	  case pattern::candidate_version:
+	    return
+	      target.get_has_version() &&
+	      target.get_version_iterator(cache) ==
+	        cache[target.get_package_iterator(cache)].CandidateVerIter(cache);
+
+	  case pattern::config_files:
+	    return target.get_pkg()->CurrentState == pkgCache::State::ConfigFiles;
+
+	  case pattern::current_version:
+	  case pattern::installed:
+	    return
+	      target.get_has_version() &&
+	      target.get_version_iterator(cache) == target.get_package_iterator(cache).CurrentVer();
+
+	  case pattern::essential:
+	    {
+	      const pkgCache::Package *pkg = target.get_pkg();
+
+	      return
+		((pkg->Flags & pkgCache::Flag::Essential) == pkgCache::Flag::Essential) ||
+		((pkg->Flags & pkgCache::Flag::Important) == pkgCache::Flag::Important);
+	    }
+
+	  case pattern::exact_name:
+	    return p->get_exact_name_name() == target.get_package_iterator(cache).Name();
+
+	  case pattern::garbage:
+	    return
+	      target.get_has_version() &&
+	      cache[target.get_package_iterator(cache)].Garbage;
+
+	  case pattern::install_version:
+	    return
+	      target.get_has_version() &&
+	      target.get_ver() == cache[target.get_package_iterator(cache)].InstallVer;
+
+	  case pattern::name:
+	    return p->get_name_regex_info().get_regex_group()->exec(target.get_package_iterator(cache).Name());
+
+	  case pattern::new_tp:
+	    return
+	      target.get_has_version() &&
+	      cache.get_ext_state(target.get_package_iterator(cache)).new_package;
+
+	  case pattern::obsolete:
+	    return pkg_obsolete(target.get_package_iterator(cache));
+
+	  case pattern::priority:
+	    return
+	      target.get_has_version() &&
+	      target.get_ver()->Priority == p->get_priority_priority();
+
+	  case pattern::section:
+	    {
+	      const ref_ptr<regex> &r(p->get_section_regex_info().get_regex_group());
+
+	      if(target.get_has_version())
+		{
+		  const char *ver_section = target.get_version_iterator(cache).Section();
+		  if(ver_section != NULL && r->exec(ver_section))
+		    return true;
+		}
+
+	      const char *pkg_section = target.get_package_iterator(cache).Section();
+	      return pkg_section != NULL && r->exec(pkg_section);
+	    }
+
+	  case pattern::upgradable:
+	    {
+	      pkgCache::PkgIterator pkg(target.get_package_iterator(cache));
+
+	      return
+		!pkg.CurrentVer().end() &&
+		cache[pkg].CandidateVer != NULL &&
+		cache[pkg].Upgradable();
+	    }
+
+	  case pattern::version:
+	    return
+	      target.get_has_version() &&
+	      p->get_version_regex_info().get_regex_group()->exec(target.get_version_iterator(cache).VerStr());
+
+	  case pattern::virtual_tp:
+	    return target.get_package_iterator(cache).VersionList().end();
+
+	  default:
+	    throw MatchingException("Internal error: pattern_program::test() invoked on an unsupported pattern.");
+	  }
+      }
+
+      bool pattern_program::evaluate_leaf(const instruction &inst,
+					  const matchable &target,
+					  context &ctx) const
+      {
+	if(inst.op == op_test)
+	  return test(inst.p, target, ctx);
+	else
+	  return evaluate_atomic(inst.p, target, ctx.get_stack(),
+				 ctx.search_info, ctx.cache, ctx.records,
+				 false).valid();
+      }
+
+      bool pattern_program::evaluate(std::size_t pc,
+				     const pool_ref &pool,
+				     structural_eval_mode mode,
+				     context &ctx) const
+      {
+	const instruction &inst(instructions[pc]);
+
+	switch(inst.op)
+	  {
+	  case op_true:
+	    return true;
+
+	  case op_false:
+	    return false;
+
+	  case op_and:
+	    for(std::size_t operand = pc + 1; operand < inst.next;
+		operand = instructions[operand].next)
+	      if(!evaluate(operand, pool, mode, ctx))
+		return false;
+	    return true;
+
+	  case op_or:
+	    for(std::size_t operand = pc + 1; operand < inst.next;
+		operand = instructions[operand].next)
+	      if(evaluate(operand, pool, mode, ctx))
+		return true;
+	    return false;
+
+	  case op_not:
+	    return !evaluate(pc + 1, pool, mode, ctx);
+
+	  case op_all_versions:
+	    return evaluate(pc + 1, pool, structural_eval_all, ctx);
+
+	  case op_any_version:
+	    if(pool.is_single())
+	      return evaluate(pc + 1, pool, mode, ctx);
+
+	    for(pkgCache::VerIterator ver = pool.pkg.VersionList();
+		!ver.end(); ++ver)
+	      if(evaluate(pc + 1, pool_ref(pool.pkg, ver), mode, ctx))
+		return true;
+	    return false;
+
+	  case op_test:
+	  case op_atomic:
+	    if(pool.is_single())
+	      return evaluate_leaf(inst, pool.get_single(), ctx);
+
+	    for(pkgCache::VerIterator ver = pool.pkg.VersionList();
+		!ver.end(); ++ver)
+	      {
+		const bool matched =
+		  evaluate_leaf(inst, matchable(pool.pkg, ver), ctx);
+
+		if(matched && mode == structural_eval_any)
+		  return true;
+		else if(!matched && mode == structural_eval_all)
+		  return false;
+	      }
+	    return mode == structural_eval_all;
+
+	  case op_structural:
+	    {
+	      std::vector<matchable> current_pool;
+	      pool.get_pool(current_pool);
+
+	      // The ordinary evaluator may push onto the stack, so give
+	      // it a copy.
+	      stack the_stack(ctx.get_stack());
+
+	      return evaluate_structural(mode, inst.p, the_stack,
+					 ctx.search_info, current_pool,
+					 ctx.cache, ctx.records,
+					 false).valid();
+	    }
+
+	  default:
+	    throw MatchingException("Internal error: bad opcode in a compiled pattern.");
+	  }
+      }
+
+      bool pattern_program::run(const pkgCache::PkgIterator &pkg,
+				const pkgCache::VerIterator &ver,
+				const ref_ptr<search_cache::implementation> &search_info,
+				aptitudeDepCache &cache,
+				pkgRecords &records) const
+      {
+	const pool_ref toplevel(pkg, ver);
+	context ctx(toplevel, search_info, cache, records);
+
+	return evaluate(0, toplevel, structural_eval_any, ctx);
+      }
+
+      // is_pure_xapian returns "true" if we can identify a Xapian
+      // term that matches if AND ONLY IF the pattern matches.  In
+      // other words: it contains only structural patterns combined
+      // with Boolean operators (and version-manipulation operators,
+      // which we ignore).
+      bool is_pure_xapian(const ref_ptr<pattern> &p)
+      {
+	switch(p->get_type())
+	  {
+	  case pattern::all_versions:
+	    return is_pure_xapian(p->get_all_versions_pattern());
+
+	  case pattern::and_tp:
+	    {
+	      const std::vector<ref_ptr<pattern> > &
+		sub_patterns(p->get_and_patterns());
+
+	      if(sub_patterns.size() == 0)
+		return true;
+
+	      for(std::vector<ref_ptr<pattern> >::const_iterator it =
+		    sub_patterns.begin(); it != sub_patterns.end(); ++it)
+		{
+		  if(!is_pure_xapian(*it))
+		    return false;
+		}
+
+	      return true;
+	    }
+
+	  case pattern::any_version:
+	    return is_pure_xapian(p->get_any_version_pattern());
+
+	  case pattern::exact_name:
+	    // Names are indexed by apt-xapian-index under the prefix
+	    // "XP".
+	    return true;
+
+	  case pattern::for_tp:
+	    return is_pure_xapian(p->get_for_pattern());
+
+	  case pattern::narrow:
+	    return
+	      is_pure_xapian(p->get_narrow_filter()) &&
+	      is_pure_xapian(p->get_narrow_pattern());
+
+	  case pattern::not_tp:
+	    return is_pure_xapian(p->get_not_pattern());
+
+	  case pattern::or_tp:
+	    {
+	      const std::vector<ref_ptr<pattern> > &
+		sub_patterns(p->get_or_patterns());
+
+	      if(sub_patterns.size() == 0)
+		return true;
+
+	      for(std::vector<ref_ptr<pattern> >::const_iterator it =
+		    sub_patterns.begin(); it != sub_patterns.end(); ++it)
+		{
+		  if(!is_pure_xapian(*it))
+		    return false;
+		}
+
+	      return true;
+	    }
+
+	  case pattern::widen:
+	    return is_pure_xapian(p->get_widen_pattern());
+
+	  case pattern::term:
+	    return true;
+
+	  case pattern::term_prefix:
+	    return true;
+
+	    // Various non-Xapian terms.  All of these return false.
+
+	  case pattern::archive:
+	  case pattern::action:
+	  case pattern::architecture:
+	  case pattern::automatic:
+	  case pattern::bind:
+	  case pattern::broken:
+	  case pattern::broken_type:
+	  case pattern::candidate_version:
+	  case pattern::config_files:
+	  case pattern::current_version:
+	  case pattern::depends:
+	  case pattern::description:
+	  case pattern::essential:
+	  case pattern::equal:
+	  case pattern::false_tp:
+	  case pattern::garbage:
+	  case pattern::install_version:
+	  case pattern::installed:
+	  case pattern::maintainer:
+	  case pattern::multiarch:
+	  case pattern::name:
+	  case pattern::new_tp:
+	  case pattern::obsolete:
+	  case pattern::origin:
+	  case pattern::priority:
+	  case pattern::provides:
+	  case pattern::reverse_depends:
+	  case pattern::reverse_provides:
+	  case pattern::section:
+	  case pattern::source_package:
+	  case pattern::source_version:
+	  case pattern::tag:
+	  case pattern::task:
+	  case pattern::true_tp:
+	  case pattern::upgradable:
+	  case pattern::user_tag:
+	  case pattern::version:
+	  case pattern::virtual_tp:
+	    return false;
+	  default:
+	    throw MatchingException("Internal error: unhandled pattern type in is_pure_xapian()");
+	  }
+      }
+
+      // is_xapian_dependent returns "true" if we can always identify
+      // a Xapian term that must match for the pattern to match.
+      bool is_xapian_dependent(const ref_ptr<pattern> &p)
+      {
+	switch(p->get_type())
+	  {
+	  case pattern::all_versions:
+	    return is_xapian_dependent(p->get_all_versions_pattern());
+
+	  case pattern::and_tp:
+	    {
+	      const std::vector<ref_ptr<pattern> > &
+		sub_patterns(p->get_and_patterns());
+
+	      if(sub_patterns.size() == 0)
+		return false;
+
+	      // The AND is fine if it has at least one positive
+	      // Xapian-dependent term.  NB: since negative terms are
+	      // not Xapian-dependent, checking both conditions is
+	      // redundant, so we just check that each sub-term is
+	      // Xapian-dependent.
+	      for(std::vector<ref_ptr<pattern> >::const_iterator it =
+		    sub_patterns.begin(); it != sub_patterns.end(); ++it)
+		{
+		  if(is_xapian_dependent(*it))
+		    return true;
+		}
 
 	      return false;
 	    }
@@ -3001,6 +3885,47 @@ namespace aptitude
 		       search_info, cache, records, debug);
     }
 
+    const pattern_program &
+    search_cache::implementation::get_program(const ref_ptr<pattern> &p)
+    {
+      boost::shared_ptr<pattern_program> &program(programs[p]);
+      if(program.get() == NULL)
+	program = boost::make_shared<pattern_program>(p);
+
+      return *program;
+    }
+
+    bool test_match(const ref_ptr<pattern> &p,
+		    const pkgCache::PkgIterator &pkg,
+		    const pkgCache::VerIterator &ver,
+		    const cwidget::util::ref_ptr<search_cache> &search_info,
+		    aptitudeDepCache &cache,
+		    pkgRecords &records)
+    {
+      eassert(p.valid());
+      eassert(search_info.valid());
+      eassert(ver.end() || ver.ParentPkg() == pkg);
+
+      ref_ptr<search_cache::implementation> search_info_imp =
+	search_info.dyn_downcast<search_cache::implementation>();
+      eassert(search_info_imp.valid());
+
+      return search_info_imp->get_program(p).run(pkg, ver,
+						 search_info_imp,
+						 cache, records);
+    }
+
+    bool test_match(const ref_ptr<pattern> &p,
+		    const pkgCache::PkgIterator &pkg,
+		    const cwidget::util::ref_ptr<search_cache> &search_info,
+		    aptitudeDepCache &cache,
+		    pkgRecords &records)
+    {
+      return test_match(p, pkg,
+			pkgCache::VerIterator(cache),
+			search_info, cache, records);
+    }
+
     void xapian_info::setup(const Xapian::Database &db,
 			    const ref_ptr<pattern> &p,
 			    bool debug)
@@ -3052,6 +3977,273 @@ namespace aptitude
 	}
     }
 
+    namespace
+    {
+      /** \brief The matches found by a single search_worker. */
+      struct search_slice
+      {
+	std::vector<std::pair<pkgCache::PkgIterator, ref_ptr<structural_match> > > package_matches;
+	std::vector<std::pair<pkgCache::VerIterator, ref_ptr<structural_match> > > version_matches;
+
+	/** \brief The message of the exception that stopped the
+	 *  worker, or an empty string if it ran to completion.
+	 */
+	std::string error;
+      };
+
+      /** \brief Tests a contiguous range of packages against a
+       *  pattern when the search can't be answered from Xapian.
+       *
+       *  Matching only reads the package cache, so several workers can
+       *  run at once on disjoint ranges as long as each one has its own
+       *  pkgRecords and search_cache; a worker that isn't given them
+       *  creates its own.  Each worker writes to its own slice, which
+       *  is merged by the thread that started it.
+       *
+       *  The worker that runs in the calling thread is given the
+       *  progress slot and reports the progress of all the workers,
+       *  which count the packages they've finished in packages_done.
+       */
+      class search_worker
+      {
+	ref_ptr<pattern> p;
+	std::vector<pkgCache::PkgIterator>::const_iterator begin, end;
+	aptitudeDepCache &cache;
+	pkgRecords *records;
+	ref_ptr<search_cache> search_info;
+	bool versions;
+	bool debug;
+	std::size_t *packages_done;
+	std::size_t num_packages;
+	const sigc::slot<void, progress_info> *progress_slot;
+	search_slice &result;
+
+	void search_range(pkgRecords &range_records,
+			  const ref_ptr<search_cache> &range_search_info) const
+	{
+	  progress_info progress =
+	    progress_info::bar(0, _("Filtering packages"));
+
+	  for(std::vector<pkgCache::PkgIterator>::const_iterator it = begin;
+	      it != end; ++it)
+	    {
+	      const pkgCache::PkgIterator &pkg(*it);
+
+	      // Only describe the packages that match; debug searches
+	      // skip the test so that every package is traced.
+	      if(!versions)
+		{
+		  if(debug || test_match(p, pkg, range_search_info,
+					 cache, range_records))
+		    {
+		      ref_ptr<structural_match> m(get_match(p, pkg,
+							    range_search_info,
+							    cache,
+							    range_records,
+							    debug));
+
+		      if(m.valid())
+			result.package_matches.push_back(std::make_pair(pkg, m));
+		    }
+		}
+	      else
+		for(pkgCache::VerIterator ver = pkg.VersionList();
+		    !ver.end(); ++ver)
+		  {
+		    if(!debug && !test_match(p, pkg, ver, range_search_info,
+					     cache, range_records))
+		      continue;
+
+		    ref_ptr<structural_match> m(get_match(p,
+							  pkg, ver,
+							  range_search_info,
+							  cache,
+							  range_records,
+							  debug));
+
+		    if(m.valid())
+		      result.version_matches.push_back(std::make_pair(ver, m));
+		  }
+
+	      const std::size_t done = __sync_add_and_fetch(packages_done, 1);
+	      if(progress_slot != NULL)
+		{
+		  progress.set_progress_fraction(((double)done) / ((double)num_packages));
+		  (*progress_slot)(progress);
+		}
+	    }
+	}
+
+      public:
+	search_worker(const ref_ptr<pattern> &_p,
+		      std::vector<pkgCache::PkgIterator>::const_iterator _begin,
+		      std::vector<pkgCache::PkgIterator>::const_iterator _end,
+		      aptitudeDepCache &_cache,
+		      pkgRecords *_records,
+		      const ref_ptr<search_cache> &_search_info,
+		      bool _versions,
+		      bool _debug,
+		      std::size_t *_packages_done,
+		      std::size_t _num_packages,
+		      const sigc::slot<void, progress_info> *_progress_slot,
+		      search_slice &_result)
+	  : p(_p), begin(_begin), end(_end), cache(_cache),
+	    records(_records), search_info(_search_info),
+	    versions(_versions), debug(_debug),
+	    packages_done(_packages_done),
+	    num_packages(_num_packages), progress_slot(_progress_slot),
+	    result(_result)
+	{
+	}
+
+	void operator()() const
+	{
+	  try
+	    {
+	      if(records != NULL)
+		search_range(*records, search_info);
+	      else
+		{
+		  pkgRecords thread_records(cache);
+		  search_range(thread_records, search_cache::create());
+		}
+	    }
+	  catch(cwidget::util::Exception &e)
+	    {
+	      result.error = e.errmsg();
+	    }
+	  catch(std::exception &e)
+	    {
+	      result.error = e.what();
+	    }
+	  catch(Xapian::Error &e)
+	    {
+	      result.error = e.get_msg();
+	    }
+	}
+      };
+
+      /** \brief Test every package in the cache against a pattern,
+       *  splitting the packages between the number of threads given by
+       *  Aptitude::Search-Threads.
+       *
+       *  The calling thread searches the first slice of packages with
+       *  the given records and search cache and reports progress; the
+       *  matches of all the slices are merged in package order, so the
+       *  result is the same as a serial search.
+       *
+       *  \param versions  if \b true, test each version and store the
+       *                   matches in version_matches; otherwise test
+       *                   each package and store the matches in
+       *                   package_matches.
+       */
+      void search_all_packages(const ref_ptr<pattern> &p,
+			       const ref_ptr<search_cache> &search_info,
+			       std::vector<std::pair<pkgCache::PkgIterator, ref_ptr<structural_match> > > &package_matches,
+			       std::vector<std::pair<pkgCache::VerIterator, ref_ptr<structural_match> > > &version_matches,
+			       bool versions,
+			       aptitudeDepCache &cache,
+			       pkgRecords &records,
+			       bool debug,
+			       const sigc::slot<void, progress_info> &progress_slot)
+      {
+	std::vector<pkgCache::PkgIterator> packages;
+	packages.reserve(cache.Head().PackageCount);
+	for(pkgCache::PkgIterator pkg = cache.PkgBegin();
+	    !pkg.end(); ++pkg)
+	  {
+	    // The package search skips packages that have no versions
+	    // and aren't provided; they can't match anything.
+	    if(!versions && pkg.VersionList().end() && pkg.ProvidesList().end())
+	      continue;
+
+	    packages.push_back(pkg);
+	  }
+
+	// Debugging output from several threads would be interleaved,
+	// so debug searches always run serially.
+	const int num_threads = debug ? 1 : aptcfg->FindI(PACKAGE "::Search-Threads", 1);
+	const std::size_t num_slices =
+	  std::max<std::size_t>(1, std::min<std::size_t>(std::max(num_threads, 1),
+							 packages.size()));
+	const std::size_t slice_size =
+	  (packages.size() + num_slices - 1) / num_slices;
+
+	std::vector<search_slice> slices(num_slices);
+	std::size_t packages_done = 0;
+
+	{
+	  std::vector<boost::shared_ptr<cwidget::threads::thread> > threads;
+	  // Slices that couldn't be given a thread are searched in the
+	  // calling thread after the first one.
+	  std::size_t first_unstarted = num_slices;
+
+	  try
+	    {
+	      for(std::size_t i = 1; i < num_slices; ++i)
+		{
+		  first_unstarted = i;
+
+		  const std::size_t first = std::min(i * slice_size, packages.size());
+		  const std::size_t last = std::min(first + slice_size, packages.size());
+
+		  search_worker worker(p,
+				       packages.begin() + first,
+				       packages.begin() + last,
+				       cache, NULL, ref_ptr<search_cache>(),
+				       versions, debug,
+				       &packages_done, packages.size(),
+				       NULL, slices[i]);
+		  threads.push_back(boost::make_shared<cwidget::threads::thread>(worker));
+		}
+
+	      first_unstarted = num_slices;
+	    }
+	  catch(cwidget::threads::ThreadCreateException &)
+	    {
+	    }
+
+	  for(std::size_t i = 0; i < num_slices; ++i)
+	    {
+	      if(i != 0 && i < first_unstarted)
+		continue;
+
+	      const std::size_t first = std::min(i * slice_size, packages.size());
+	      const std::size_t last = std::min(first + slice_size, packages.size());
+
+	      search_worker(p,
+			    packages.begin() + first,
+			    packages.begin() + last,
+			    cache, &records, search_info,
+			    versions, debug,
+			    &packages_done, packages.size(),
+			    &progress_slot, slices[i])();
+	    }
+
+	  for(std::vector<boost::shared_ptr<cwidget::threads::thread> >::const_iterator
+		it = threads.begin(); it != threads.end(); ++it)
+	    (*it)->join();
+	}
+
+	for(std::vector<search_slice>::const_iterator it = slices.begin();
+	    it != slices.end(); ++it)
+	  {
+	    if(!it->error.empty())
+	      {
+		_error->Error("%s", it->error.c_str());
+		continue;
+	      }
+
+	    package_matches.insert(package_matches.end(),
+				   it->package_matches.begin(),
+				   it->package_matches.end());
+	    version_matches.insert(version_matches.end(),
+				   it->version_matches.begin(),
+				   it->version_matches.end());
+	  }
+      }
+    }
+
     void search(const ref_ptr<pattern> &p,
 		const ref_ptr<search_cache> &search_info,
 		std::vector<std::pair<pkgCache::PkgIterator, ref_ptr<structural_match> > > &matches,
@@ -3079,36 +4271,17 @@ namespace aptitude
 		std::cout << "Failed to build a Xapian query for this search." << std::endl
 			  << "Falling back to testing each package." << std::endl;
 
-              progress_info progress = progress_info::bar(0, filter_msg);
-              progress_slot(progress);
-
-              int i = 0;
-	      for(pkgCache::PkgIterator pkg = cache.PkgBegin();
-		  !pkg.end(); ++pkg)
-		{
-		  if(pkg.VersionList().end() && pkg.ProvidesList().end())
-		    continue;
-
-		  // TODO: how do I make sure the sub-patterns are
-		  // searched using the right xapian_info?  I could thread
-		  // the current top-level or the current xapian_info
-		  // through, I suppose.  Or I could use a global list of
-		  // term postings and only store match sets on a
-		  // per-toplevel basis (that might work, actually?).
-
-		  ref_ptr<structural_match> m(get_match(p, pkg,
-							info,
-							cache,
-							records,
-							debug));
-
-		  if(m.valid())
-		    matches.push_back(std::make_pair(pkg, m));
-
-                  ++i;
-                  progress.set_progress_fraction(((double)i) / ((double)cache.Head().PackageCount));
-                  progress_slot(progress);
-		}
+              progress_slot(progress_info::bar(0, filter_msg));
+
+	      // TODO: how do I make sure the sub-patterns are searched
+	      // using the right xapian_info?  I could thread the current
+	      // top-level or the current xapian_info through, I suppose.
+	      // Or I could use a global list of term postings and only
+	      // store match sets on a per-toplevel basis (that might
+	      // work, actually?).
+	      std::vector<std::pair<pkgCache::VerIterator, ref_ptr<structural_match> > > unused;
+	      search_all_packages(p, info, matches, unused, false,
+				  cache, records, debug, progress_slot);
 	    }
 	  else
 	    {
@@ -3133,7 +4306,8 @@ namespace aptitude
 			std::cout << "W: unable to find the package " << name
 				  << std::endl;
 		    }
-		  else if(!(pkg.VersionList().end() && pkg.ProvidesList().end()))
+		  else if(!(pkg.VersionList().end() && pkg.ProvidesList().end()) &&
+			  (debug || test_match(p, pkg, info, cache, records)))
 		    {
 		      ref_ptr<structural_match> m(get_match(p, pkg,
 							    info,
@@ -3194,32 +4368,11 @@ namespace aptitude
 		std::cout << "Failed to build a Xapian query for this search." << std::endl
 			  << "Falling back to testing each package." << std::endl;
 
-              progress_info progress = progress_info::bar(0, filter_msg);
-              progress_slot(progress);
-
-
-              int i = 0;
-	      for(pkgCache::PkgIterator pkg = cache.PkgBegin();
-		  !pkg.end(); ++pkg)
-                {
-                  for(pkgCache::VerIterator ver = pkg.VersionList();
-                      !ver.end(); ++ver)
-                    {
-                      ref_ptr<structural_match> m(get_match(p,
-                                                            pkg, ver,
-                                                            info,
-                                                            cache,
-                                                            records,
-                                                            debug));
-
-                      if(m.valid())
-                        matches.push_back(std::make_pair(ver, m));
-                    }
-
-                  ++i;
-                  progress.set_progress_fraction(((double)i) / ((double)cache.Head().PackageCount));
-                  progress_slot(progress);
-                }
+              progress_slot(progress_info::bar(0, filter_msg));
+
+	      std::vector<std::pair<pkgCache::PkgIterator, ref_ptr<structural_match> > > unused;
+	      search_all_packages(p, info, unused, matches, true,
+				  cache, records, debug, progress_slot);
 	    }
 	  else
 	    {
@@ -3248,6 +4401,9 @@ namespace aptitude
                     for(pkgCache::VerIterator ver = pkg.VersionList();
                         !ver.end(); ++ver)
                       {
+                        if(!debug && !test_match(p, pkg, ver, info, cache, records))
+                          continue;
+
                         ref_ptr<structural_match> m(get_match(p,
                                                               pkg, ver,
                                                               info,
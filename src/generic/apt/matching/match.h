@@ -675,6 +675,43 @@ namespace aptitude
 	      pkgRecords &records,
 	      bool debug = false);
 
+    /** \brief Test whether a version of a package matches a pattern.
+     *
+     *  This returns the same result as get_match(p, pkg, ver, ...).valid(),
+     *  but it doesn't describe the match.  The pattern is compiled
+     *  into a program the first time it's tested, and the program is
+     *  stored in search_info; for most patterns, running it allocates
+     *  nothing.
+     *
+     *  \param p   The pattern to execute.
+     *  \param pkg The package to compare.
+     *  \param ver The version of pkg to compare, or an end iterator to match the
+     *             package itself.
+     *  \param search_info  Where to store "side information"
+     *                      associated with this search.
+     *  \param cache   The cache in which to search.
+     *  \param records The package records with which to perform the match.
+     *
+     *  \return \b true if the package matches.
+     */
+    bool test_match(const cwidget::util::ref_ptr<pattern> &p,
+		    const pkgCache::PkgIterator &pkg,
+		    const pkgCache::VerIterator &ver,
+		    const cwidget::util::ref_ptr<search_cache> &search_info,
+		    aptitudeDepCache &cache,
+		    pkgRecords &records);
+
+    /** \brief Test whether a package matches a pattern.
+     *
+     *  This returns the same result as get_match(p, pkg, ...).valid();
+     *  see the other overload for details.
+     */
+    bool test_match(const cwidget::util::ref_ptr<pattern> &p,
+		    const pkgCache::PkgIterator &pkg,
+		    const cwidget::util::ref_ptr<search_cache> &search_info,
+		    aptitudeDepCache &cache,
+		    pkgRecords &records);
+
     /** \brief Retrieve all the packages matching the given pattern.
      *
      *  This may use Xapian or other indices to accelerate the search
@@ -149,6 +149,10 @@ namespace aptitude
 	// The current download, if any.
 	boost::shared_ptr<download_request> current_download;
 
+	// The job that is looking for the changelog before it's
+	// downloaded, if it hasn't finished yet.
+	boost::shared_ptr<util::job_handle> preprocess_job;
+
 	// The URIs to fetch.
 	std::deque<std::string> uris;
 
@@ -166,6 +170,10 @@ namespace aptitude
 	// How to send thunks to the main thread.
 	post_thunk_f post_thunk;
 
+	// How soon the changelog is needed; passed on to every URI
+	// that is queued for it.
+	download_priority priority;
+
 	// A brief description of the changelog being downloaded by this
 	// object.
 	std::string short_description;
@@ -173,14 +181,26 @@ namespace aptitude
       public:
 	changelog_download(const boost::shared_ptr<download_callbacks> &_parent,
 			   post_thunk_f _post_thunk,
+			   download_priority _priority,
 			   const std::string &_short_description)
 	  : parent(_parent),
 	    started(false), finished(false),
 	    post_thunk(_post_thunk),
+	    priority(_priority),
 	    short_description(_short_description)
 	{
 	}
 
+	/** \brief Remember the job that is preprocessing this
+	 *  download, so that canceling the download cancels it too.
+	 */
+	void set_preprocess_job(const boost::shared_ptr<util::job_handle> &job)
+	{
+	  cw::threads::mutex::lock l(state_mutex);
+
+	  preprocess_job = job;
+	}
+
 	void push_back(const std::string &uri)
 	{
 	  cw::threads::mutex::lock l(state_mutex);
@@ -203,6 +223,8 @@ namespace aptitude
 	{
 	  cw::threads::mutex::lock l(state_mutex);
 
+	  preprocess_job.reset();
+
 	  if(started)
 	    LOG_TRACE(Loggers::getAptitudeChangelog(),
 		      "Not starting to download " << short_description
@@ -221,7 +243,8 @@ namespace aptitude
 
 	      current_download = queue_download(uri, short_description,
 						shared_from_this(),
-						post_thunk);
+						post_thunk,
+						priority);
 	      started = true;
 	    }
 	}
@@ -295,7 +318,8 @@ namespace aptitude
 
 		current_download = queue_download(uri, short_description,
 						  shared_from_this(),
-						  post_thunk);
+						  post_thunk,
+						  priority);
 	      }
 
 	      uris.pop_front();
@@ -341,6 +365,12 @@ namespace aptitude
 	      LOG_TRACE(Loggers::getAptitudeChangelog(),
 			"Canceling the download of " << short_description);
 
+	      if(preprocess_job.get() != NULL)
+		{
+		  preprocess_job->cancel();
+		  preprocess_job.reset();
+		}
+
 	      if(current_download.get() != NULL)
 		{
 		  current_download->cancel();
@@ -431,6 +461,14 @@ namespace aptitude
 	{
 	  logging::LoggerPtr logger(get_log_category());
 
+	  // Don't bother looking for the changelog if the download was
+	  // canceled after this job started.
+	  if(get_job_cancelled())
+	    {
+	      LOG_TRACE(logger, "Not preprocessing " << req << ": it was canceled.");
+	      return;
+	    }
+
 	  const changelog_info &info = *req.get_info();
 	  changelog_download &download = *req.get_download();
 
@@ -583,15 +621,17 @@ namespace aptitude
   boost::shared_ptr<download_request>
   get_changelog(const boost::shared_ptr<changelog_info> &info,
 		const boost::shared_ptr<download_callbacks> &callbacks,
-		post_thunk_f post_thunk)
+		post_thunk_f post_thunk,
+		download_priority priority)
   {
     const std::string short_description =
       cw::util::ssprintf(_("Changelog of %s"), info->get_display_name().c_str());
 
     boost::shared_ptr<changelog_download> rval =
-      boost::make_shared<changelog_download>(callbacks, post_thunk, short_description);
+      boost::make_shared<changelog_download>(callbacks, post_thunk, priority,
+					     short_description);
 
-    preprocess_changelogs_thread::add_job(preprocess_changelogs_request(info, rval));
+    rval->set_preprocess_job(preprocess_changelogs_thread::add_job(preprocess_changelogs_request(info, rval)));
 
     return rval;
   }
@@ -25,6 +25,7 @@
 #include <map>
 #include <string>
 
+#include <generic/apt/download_queue.h>
 #include <generic/util/post_thunk.h>
 #include <generic/util/temp.h>
 
@@ -44,9 +45,6 @@ class download_manager;
 
 namespace aptitude
 {
-  class download_callbacks;
-  class download_request;
-
   namespace apt
   {
     /** \brief Carries information about which changelog is to be
@@ -111,11 +109,15 @@ namespace aptitude
      *  \param info       The changelog that is to be fetched.
      *  \param callbacks  The callbacks to invoke for download events.
      *  \param post_thunk How to post thunks to the foreground thread.
+     *  \param priority   How soon the changelog is needed; changelogs
+     *                    that are fetched before anyone asked to see
+     *                    them should use download_priority_prefetch.
      */
     boost::shared_ptr<download_request>
     get_changelog(const boost::shared_ptr<changelog_info> &info,
 		  const boost::shared_ptr<download_callbacks> &callbacks,
-		  post_thunk_f post_thunk);
+		  post_thunk_f post_thunk,
+		  download_priority priority = download_priority_visible);
 
     /** \brief Convenience code to download a version's changelog.
      *
@@ -0,0 +1,396 @@
+// pkgstates_sidecar.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#include "pkgstates_sidecar.h"
+
+#include "apt.h"
+
+#include <loggers.h>
+
+#include <fstream>
+#include <sstream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using aptitude::Loggers;
+
+namespace aptitude
+{
+  namespace apt
+  {
+    namespace
+    {
+      const char sidecar_magic[8] = { 'A', 'p', 't', 'P', 'S', 't', 's', '\0' };
+
+      /** \brief The version of the sidecar file format.
+       *
+       *  Bump this whenever the format changes or the meaning of a
+       *  field changes; sidecars with a different version are
+       *  ignored.
+       */
+      const unsigned int sidecar_format_version = 1;
+
+      const std::size_t max_key_length = 64;
+
+      /** \brief The header at the start of the sidecar.
+       *
+       *  It is followed by one record per package, and then by the
+       *  strings that the records point to.
+       */
+      struct sidecar_header
+      {
+	char magic[8];
+	unsigned int format_version;
+	unsigned int num_packages;
+	unsigned int strings_size;
+	unsigned int reserved;
+	/** \brief The size of the pkgstates file this was written with. */
+	unsigned long long text_size;
+	/** \brief The modification time of that pkgstates file. */
+	unsigned long long text_mtime;
+	/** \brief The inode of that pkgstates file. */
+	unsigned long long text_inode;
+	char key[max_key_length];
+      };
+
+      enum record_flags
+	{
+	  /** \brief The package has a stanza in pkgstates. */
+	  record_present = 1,
+	  record_new_package = 2,
+	  record_upgrade = 4,
+	  record_previously_auto = 8
+	};
+
+      /** \brief The saved state of one package.
+       *
+       *  The string fields are offsets into the string region; the
+       *  region starts with an empty string, so an offset of 0 is an
+       *  empty string.  user_tags points to a list of strings ending
+       *  with an empty string.
+       */
+      struct sidecar_record
+      {
+	unsigned int name_hash;
+	unsigned char flags;
+	unsigned char selection_state;
+	unsigned char dselect_state;
+	unsigned char remove_reason;
+	unsigned int candver;
+	unsigned int forbidver;
+	unsigned int user_tags;
+      };
+
+      /** \brief Compute the hash that identifies a package in its
+       *  record (32-bit FNV-1a of its name and architecture).
+       */
+      unsigned int hash_package(const pkgCache::PkgIterator &pkg)
+      {
+	unsigned int rval = 2166136261U;
+
+	for(const char *s = pkg.Name(); *s != '\0'; ++s)
+	  rval = (rval ^ static_cast<unsigned char>(*s)) * 16777619U;
+	rval = rval * 16777619U;
+	for(const char *s = pkg.Arch(); *s != '\0'; ++s)
+	  rval = (rval ^ static_cast<unsigned char>(*s)) * 16777619U;
+
+	return rval;
+      }
+
+      std::string get_key(pkgCache &cache)
+      {
+	std::ostringstream out;
+	out << std::hex << hash_pkgcache(cache);
+	return out.str();
+      }
+    }
+
+    saved_package_state::saved_package_state()
+      : selection_state(pkgCache::State::Unknown),
+	dselect_state(pkgCache::State::Unknown),
+	remove_reason(0),
+	new_package(false),
+	upgrade(false),
+	previously_auto(false)
+    {
+    }
+
+    pkgstates_sidecar::pkgstates_sidecar(const char *_data, std::size_t _size)
+      : data(_data), size(_size)
+    {
+    }
+
+    pkgstates_sidecar::~pkgstates_sidecar()
+    {
+      munmap(const_cast<char *>(data), size);
+    }
+
+    boost::shared_ptr<pkgstates_sidecar>
+    pkgstates_sidecar::open(const std::string &filename,
+			    const std::string &text_filename,
+			    pkgCache &cache)
+    {
+      logging::LoggerPtr logger(Loggers::getAptitudeAptCache());
+
+      struct stat text_buf;
+      if(stat(text_filename.c_str(), &text_buf) != 0)
+	return boost::shared_ptr<pkgstates_sidecar>();
+
+      const int fd = ::open(filename.c_str(), O_RDONLY);
+      if(fd == -1)
+	{
+	  LOG_DEBUG(logger, "Can't open the state sidecar \"" << filename
+		    << "\": " << strerror(errno));
+	  return boost::shared_ptr<pkgstates_sidecar>();
+	}
+
+      struct stat buf;
+      if(fstat(fd, &buf) != 0 ||
+	 static_cast<std::size_t>(buf.st_size) < sizeof(sidecar_header))
+	{
+	  LOG_DEBUG(logger, "Ignoring the state sidecar \"" << filename
+		    << "\": it is truncated.");
+	  close(fd);
+	  return boost::shared_ptr<pkgstates_sidecar>();
+	}
+
+      const std::size_t size = buf.st_size;
+      void *mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+
+      if(mapped == MAP_FAILED)
+	{
+	  LOG_WARN(logger, "Can't map the state sidecar \"" << filename
+		   << "\": " << strerror(errno));
+	  return boost::shared_ptr<pkgstates_sidecar>();
+	}
+
+      const char *data = static_cast<const char *>(mapped);
+      const sidecar_header *header = reinterpret_cast<const sidecar_header *>(data);
+      const std::size_t strings_begin = sizeof(sidecar_header) +
+	header->num_packages * sizeof(sidecar_record);
+
+      const char *problem = NULL;
+      if(memcmp(header->magic, sidecar_magic, sizeof(sidecar_magic)) != 0)
+	problem = "it is not a state sidecar";
+      else if(header->format_version != sidecar_format_version)
+	problem = "it has the wrong format version";
+      else if(header->text_size != static_cast<unsigned long long>(text_buf.st_size) ||
+	      header->text_mtime != static_cast<unsigned long long>(text_buf.st_mtime) ||
+	      header->text_inode != static_cast<unsigned long long>(text_buf.st_ino))
+	problem = "the state file was modified after it was written";
+      else if(header->num_packages != cache.Head().PackageCount)
+	problem = "it has the wrong number of packages";
+      else if(strncmp(header->key, get_key(cache).c_str(), max_key_length) != 0)
+	problem = "it was written for a different cache";
+      else if(header->strings_size == 0 ||
+	      strings_begin + header->strings_size != size ||
+	      data[size - 1] != '\0')
+	problem = "it is truncated";
+      else
+	{
+	  // Check every offset once here, so that get() doesn't have
+	  // to.
+	  const sidecar_record *records =
+	    reinterpret_cast<const sidecar_record *>(data + sizeof(sidecar_header));
+
+	  for(unsigned int i = 0; problem == NULL && i < header->num_packages; ++i)
+	    if(records[i].candver >= header->strings_size ||
+	       records[i].forbidver >= header->strings_size ||
+	       records[i].user_tags >= header->strings_size)
+	      problem = "it is corrupt";
+	}
+
+      if(problem != NULL)
+	{
+	  LOG_INFO(logger, "Ignoring the state sidecar \"" << filename
+		   << "\": " << problem << ".");
+	  munmap(mapped, size);
+	  return boost::shared_ptr<pkgstates_sidecar>();
+	}
+
+      LOG_INFO(logger, "Loaded the state sidecar \"" << filename << "\" ("
+	       << size << " bytes).");
+
+      return boost::shared_ptr<pkgstates_sidecar>(new pkgstates_sidecar(data, size));
+    }
+
+    bool pkgstates_sidecar::get(const pkgCache::PkgIterator &pkg,
+				saved_package_state &out) const
+    {
+      const sidecar_header *header = reinterpret_cast<const sidecar_header *>(data);
+      if(pkg->ID >= header->num_packages)
+	return false;
+
+      const sidecar_record &record =
+	reinterpret_cast<const sidecar_record *>(data + sizeof(sidecar_header))[pkg->ID];
+      if((record.flags & record_present) == 0 ||
+	 record.name_hash != hash_package(pkg))
+	return false;
+
+      const char * const strings = data + size - header->strings_size;
+      const char * const strings_end = data + size;
+
+      out.selection_state = static_cast<pkgCache::State::PkgSelectedState>(record.selection_state);
+      out.dselect_state = static_cast<pkgCache::State::PkgSelectedState>(record.dselect_state);
+      out.remove_reason = record.remove_reason;
+      out.new_package = (record.flags & record_new_package) != 0;
+      out.upgrade = (record.flags & record_upgrade) != 0;
+      out.previously_auto = (record.flags & record_previously_auto) != 0;
+      out.candver = strings + record.candver;
+      out.forbidver = strings + record.forbidver;
+
+      out.user_tags.clear();
+      if(record.user_tags != 0)
+	for(const char *tag = strings + record.user_tags;
+	    tag < strings_end && *tag != '\0'; tag += strlen(tag) + 1)
+	  out.user_tags.push_back(tag);
+
+      return true;
+    }
+
+    pkgstates_sidecar::writer::writer(pkgCache &cache)
+      : records(cache.Head().PackageCount * sizeof(sidecar_record), '\0'),
+	strings(1, '\0'),
+	key(get_key(cache))
+    {
+    }
+
+    void pkgstates_sidecar::writer::set(const pkgCache::PkgIterator &pkg,
+					const saved_package_state &state)
+    {
+      if(pkg->ID * sizeof(sidecar_record) >= records.size())
+	return;
+
+      sidecar_record record;
+      memset(&record, 0, sizeof(record));
+
+      record.name_hash = hash_package(pkg);
+      record.flags = record_present;
+      if(state.new_package)
+	record.flags |= record_new_package;
+      if(state.upgrade)
+	record.flags |= record_upgrade;
+      if(state.previously_auto)
+	record.flags |= record_previously_auto;
+      record.selection_state = state.selection_state;
+      record.dselect_state = state.dselect_state;
+      record.remove_reason = state.remove_reason;
+
+      if(!state.candver.empty())
+	{
+	  record.candver = strings.size();
+	  strings.append(state.candver.c_str(), state.candver.size() + 1);
+	}
+
+      if(!state.forbidver.empty())
+	{
+	  record.forbidver = strings.size();
+	  strings.append(state.forbidver.c_str(), state.forbidver.size() + 1);
+	}
+
+      if(!state.user_tags.empty())
+	{
+	  record.user_tags = strings.size();
+	  for(std::vector<std::string>::const_iterator it = state.user_tags.begin();
+	      it != state.user_tags.end(); ++it)
+	    // An empty tag would end the list early.
+	    if(!it->empty())
+	      strings.append(it->c_str(), it->size() + 1);
+	  strings.push_back('\0');
+	}
+
+      records.replace(pkg->ID * sizeof(sidecar_record), sizeof(sidecar_record),
+		      reinterpret_cast<const char *>(&record), sizeof(record));
+    }
+
+    bool pkgstates_sidecar::writer::write(const std::string &filename,
+					  const std::string &text_filename) const
+    {
+      logging::LoggerPtr logger(Loggers::getAptitudeAptCache());
+
+      if(key.size() >= max_key_length)
+	{
+	  LOG_WARN(logger, "Not writing a state sidecar: the key \""
+		   << key << "\" is too long.");
+	  return false;
+	}
+
+      struct stat text_buf;
+      if(stat(text_filename.c_str(), &text_buf) != 0)
+	{
+	  LOG_WARN(logger, "Not writing a state sidecar: can't stat \""
+		   << text_filename << "\": " << strerror(errno));
+	  return false;
+	}
+
+      sidecar_header header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, sidecar_magic, sizeof(sidecar_magic));
+      header.format_version = sidecar_format_version;
+      header.num_packages = records.size() / sizeof(sidecar_record);
+      header.strings_size = strings.size();
+      header.text_size = text_buf.st_size;
+      header.text_mtime = text_buf.st_mtime;
+      header.text_inode = text_buf.st_ino;
+      strncpy(header.key, key.c_str(), max_key_length);
+
+      const std::string tmp_filename = filename + ".new";
+      {
+	std::ofstream out(tmp_filename.c_str(), std::ios::out | std::ios::binary);
+	if(!out)
+	  {
+	    LOG_WARN(logger, "Can't write the state sidecar to \"" << tmp_filename << "\".");
+	    return false;
+	  }
+
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	out.write(records.data(), records.size());
+	out.write(strings.data(), strings.size());
+
+	if(!out)
+	  {
+	    LOG_WARN(logger, "Error writing the state sidecar to \"" << tmp_filename << "\".");
+	    unlink(tmp_filename.c_str());
+	    return false;
+	  }
+      }
+
+      chmod(tmp_filename.c_str(), 0644);
+
+      if(rename(tmp_filename.c_str(), filename.c_str()) != 0)
+	{
+	  LOG_WARN(logger, "Can't rename \"" << tmp_filename << "\" to \""
+		   << filename << "\": " << strerror(errno));
+	  unlink(tmp_filename.c_str());
+	  return false;
+	}
+
+      LOG_INFO(logger, "Wrote the state sidecar \"" << filename << "\".");
+
+      return true;
+    }
+  }
+}
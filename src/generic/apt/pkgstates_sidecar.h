@@ -0,0 +1,161 @@
+// pkgstates_sidecar.h                               -*-c++-*-
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#ifndef PKGSTATES_SIDECAR_H
+#define PKGSTATES_SIDECAR_H
+
+#include <apt-pkg/pkgcache.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+#include <vector>
+
+/** \brief A binary copy of the pkgstates file that can be loaded
+ *  without parsing it.
+ *
+ *  Reading pkgstates means tokenizing a stanza and looking up a
+ *  package by name for every package that aptitude has ever seen.
+ *  The sidecar stores the same information as one fixed-size record
+ *  per package, indexed by package ID, so loading it is a single
+ *  mmap() and a pass over the packages of the cache.
+ *
+ *  Package IDs are only meaningful for one cache, so the sidecar
+ *  records a hash of the cache it was written for, and each record
+ *  holds a hash of its package's name and architecture.  It also
+ *  records the size, modification time and inode of the pkgstates
+ *  file it was written with; if anything else has rewritten
+ *  pkgstates since then, the sidecar is ignored and the text file is
+ *  parsed as usual.
+ *
+ *  \file pkgstates_sidecar.h
+ */
+
+namespace aptitude
+{
+  namespace apt
+  {
+    /** \brief The contents of one package's stanza in pkgstates, as
+     *  aptitudeDepCache interprets them.
+     */
+    struct saved_package_state
+    {
+      /** \brief The State field. */
+      pkgCache::State::PkgSelectedState selection_state;
+      /** \brief The Dselect-State field, or the dselect state the
+       *  package had when pkgstates was read if it was missing.
+       */
+      pkgCache::State::PkgSelectedState dselect_state;
+      /** \brief The Remove-Reason field. */
+      int remove_reason;
+      /** \brief The Unseen field. */
+      bool new_package;
+      /** \brief The Upgrade field. */
+      bool upgrade;
+      /** \brief \b true if Auto-New-Install was set or the
+       *  Install-Reason wasn't "manual".
+       */
+      bool previously_auto;
+      /** \brief The Version field. */
+      std::string candver;
+      /** \brief The ForbidVer field. */
+      std::string forbidver;
+      /** \brief The User-Tags field, split into tags. */
+      std::vector<std::string> user_tags;
+
+      saved_package_state();
+    };
+
+    class pkgstates_sidecar
+    {
+      /** \brief The start of the mapped file. */
+      const char *data;
+      /** \brief The size of the mapped file. */
+      std::size_t size;
+
+      pkgstates_sidecar(const char *_data, std::size_t _size);
+
+      // Not copyable: the sidecar owns its mapping.
+      pkgstates_sidecar(const pkgstates_sidecar &);
+      pkgstates_sidecar &operator=(const pkgstates_sidecar &);
+
+    public:
+      ~pkgstates_sidecar();
+
+      /** \brief Open the sidecar of a pkgstates file.
+       *
+       *  \param filename       the file containing the sidecar.
+       *  \param text_filename  the pkgstates file that the sidecar
+       *                        must have been written with.
+       *  \param cache          the cache the sidecar must describe.
+       *
+       *  \return the sidecar, or an invalid pointer if it doesn't
+       *  exist, is damaged, or doesn't match the cache or the text
+       *  file.
+       */
+      static boost::shared_ptr<pkgstates_sidecar> open(const std::string &filename,
+						       const std::string &text_filename,
+						       pkgCache &cache);
+
+      /** \brief Retrieve the saved state of a package.
+       *
+       *  \return \b false if the package has no stanza in pkgstates.
+       */
+      bool get(const pkgCache::PkgIterator &pkg, saved_package_state &out) const;
+
+      /** \brief Accumulates the records of a new sidecar. */
+      class writer
+      {
+	/** \brief The records, one per package. */
+	std::string records;
+	/** \brief The strings that the records point to. */
+	std::string strings;
+	/** \brief A hash of the cache the records describe. */
+	std::string key;
+
+      public:
+	/** \brief Create a writer for a sidecar of the given cache.
+	 *
+	 *  Initially no package has a record.
+	 */
+	explicit writer(pkgCache &cache);
+
+	/** \brief Set the record of a package. */
+	void set(const pkgCache::PkgIterator &pkg, const saved_package_state &state);
+
+	/** \brief Write the sidecar.
+	 *
+	 *  The sidecar is written to a temporary file that is renamed
+	 *  over the old sidecar.  Failures are logged, not reported
+	 *  as errors: without a sidecar, pkgstates is simply parsed.
+	 *
+	 *  \param filename       the file to write the sidecar to.
+	 *  \param text_filename  the pkgstates file that was written
+	 *                        with the same contents.
+	 *
+	 *  \return \b true if the sidecar was written.
+	 */
+	bool write(const std::string &filename,
+		   const std::string &text_filename) const;
+      };
+    };
+  }
+}
+
+#endif // PKGSTATES_SIDECAR_H
@@ -0,0 +1,284 @@
+// record_scanner.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#include "record_scanner.h"
+
+#include <aptitude.h>
+#include "apt.h"
+
+#include <loggers.h>
+
+#include <generic/util/profile.h>
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/pkgrecords.h>
+#include <apt-pkg/progress.h>
+#include <apt-pkg/tagfile.h>
+
+#include <boost/make_shared.hpp>
+#include <boost/ref.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <cwidget/generic/threads/threads.h>
+
+#include <algorithm>
+
+namespace cw = cwidget;
+
+namespace aptitude
+{
+  namespace apt
+  {
+    namespace
+    {
+      aptitude::util::profile_counter records_looked_up("records-looked-up");
+
+      /** \brief A field found in a record. */
+      struct found_field
+      {
+	pkgCache::VerIterator ver;
+	/** \brief The index of the field in record_scanner::fields. */
+	std::size_t field;
+	std::string value;
+
+	found_field(const pkgCache::VerIterator &_ver,
+		    std::size_t _field,
+		    const std::string &_value)
+	  : ver(_ver), field(_field), value(_value)
+	{
+	}
+      };
+
+      /** \brief The records of one package list, and the fields
+       *  found in them.
+       */
+      struct list_scan
+      {
+	/** \brief The records of the list, sorted by location. */
+	std::vector<loc_pair> records;
+	/** \brief The fields found in the records, in the same order. */
+	std::vector<found_field> found;
+      };
+
+      /** \brief Reads the records of a group of package lists.
+       *
+       *  Each list is read by exactly one worker, so workers never
+       *  touch the same list_scan.  The workers running in other
+       *  threads get their own pkgRecords; the one running in the
+       *  calling thread reports progress.
+       */
+      class scan_worker
+      {
+	const std::vector<std::string> &fields;
+	const std::vector<list_scan *> &lists;
+	pkgRecords &records;
+	std::size_t *records_done;
+	std::size_t num_records;
+	OpProgress *progress;
+
+      public:
+	scan_worker(const std::vector<std::string> &_fields,
+		    const std::vector<list_scan *> &_lists,
+		    pkgRecords &_records,
+		    std::size_t *_records_done,
+		    std::size_t _num_records,
+		    OpProgress *_progress)
+	  : fields(_fields),
+	    lists(_lists),
+	    records(_records),
+	    records_done(_records_done),
+	    num_records(_num_records),
+	    progress(_progress)
+	{
+	}
+
+	void operator()() const
+	{
+	  pkgTagSection section;
+
+	  for(std::vector<list_scan *>::const_iterator list_it = lists.begin();
+	      list_it != lists.end(); ++list_it)
+	    {
+	      list_scan &list = **list_it;
+
+	      for(std::vector<loc_pair>::const_iterator it = list.records.begin();
+		  it != list.records.end(); ++it)
+		{
+		  const char *start = NULL, *stop = NULL;
+		  records.Lookup(it->second).GetRec(start, stop);
+
+		  if(start != NULL && stop != NULL &&
+		     section.Scan(start, stop - start + 1))
+		    for(std::size_t i = 0; i < fields.size(); ++i)
+		      {
+			const char *field_start, *field_end;
+			if(section.Find(fields[i].c_str(), field_start, field_end))
+			  list.found.push_back(found_field(it->first, i,
+							   std::string(field_start, field_end)));
+		      }
+
+		  const std::size_t done = __sync_add_and_fetch(records_done, 1);
+		  if(progress != NULL && done % 1000 == 0)
+		    progress->OverallProgress(done, num_records, 1,
+					      _("Reading package records"));
+		}
+
+	      records_looked_up.add(list.records.size());
+	    }
+	}
+      };
+
+      /** \brief Sort package lists by decreasing number of records. */
+      struct larger_list
+      {
+	bool operator()(const list_scan *a, const list_scan *b) const
+	{
+	  return a->records.size() > b->records.size();
+	}
+      };
+    }
+
+    void record_scanner::add_field(const std::string &field,
+				   const field_slot &slot)
+    {
+      fields.push_back(field);
+      slots.push_back(slot);
+    }
+
+    void record_scanner::scan(pkgCache &cache, pkgRecords &records,
+			      OpProgress &progress) const
+    {
+      logging::LoggerPtr logger(Loggers::getAptitudeAptGlobals());
+
+      if(fields.empty())
+	{
+	  finished();
+	  return;
+	}
+
+      // Group the records by package list.  Sorting each list by
+      // location is *critical* -- otherwise, reading the records
+      // will take ages.
+      std::vector<list_scan> lists(cache.Head().PackageFileCount);
+      std::size_t num_records = 0;
+      for(pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end(); ++pkg)
+	for(pkgCache::VerIterator ver = pkg.VersionList(); !ver.end(); ++ver)
+	  for(pkgCache::VerFileIterator vf = ver.FileList(); !vf.end(); ++vf)
+	    {
+	      lists[vf.File()->ID].records.push_back(loc_pair(ver, vf));
+	      ++num_records;
+	    }
+
+      std::vector<list_scan *> nonempty_lists;
+      for(std::vector<list_scan>::iterator it = lists.begin();
+	  it != lists.end(); ++it)
+	if(!it->records.empty())
+	  {
+	    std::sort(it->records.begin(), it->records.end(), location_compare());
+	    nonempty_lists.push_back(&*it);
+	  }
+
+      // Hand out the lists, largest first, to whichever slice has
+      // the fewest records so far.
+      const int num_threads = aptcfg->FindI(PACKAGE "::Record-Scan-Threads", 1);
+      const std::size_t num_slices =
+	std::max<std::size_t>(1, std::min<std::size_t>(std::max(num_threads, 1),
+						       nonempty_lists.size()));
+
+      std::sort(nonempty_lists.begin(), nonempty_lists.end(), larger_list());
+      std::vector<std::vector<list_scan *> > slices(num_slices);
+      std::vector<std::size_t> slice_sizes(num_slices, 0);
+      for(std::vector<list_scan *>::const_iterator it = nonempty_lists.begin();
+	  it != nonempty_lists.end(); ++it)
+	{
+	  const std::size_t smallest =
+	    std::min_element(slice_sizes.begin(), slice_sizes.end()) - slice_sizes.begin();
+	  slices[smallest].push_back(*it);
+	  slice_sizes[smallest] += (*it)->records.size();
+	}
+
+      LOG_TRACE(logger, "Reading " << num_records << " records from "
+		<< nonempty_lists.size() << " package lists in "
+		<< num_slices << " slices.");
+
+      progress.OverallProgress(0, num_records, 1, _("Reading package records"));
+
+      std::size_t records_done = 0;
+      {
+	// Each thread needs its own records, since the parsers keep
+	// their position in the list.
+	std::vector<boost::shared_ptr<pkgRecords> > thread_records;
+	std::vector<boost::shared_ptr<cw::threads::thread> > threads;
+	// Slices that couldn't be given a thread are read in the
+	// calling thread after the first one.
+	std::size_t first_unstarted = num_slices;
+
+	try
+	  {
+	    for(std::size_t i = 1; i < num_slices; ++i)
+	      {
+		first_unstarted = i;
+
+		thread_records.push_back(boost::make_shared<pkgRecords>(boost::ref(cache)));
+		scan_worker worker(fields, slices[i], *thread_records.back(),
+				   &records_done, num_records, NULL);
+		threads.push_back(boost::make_shared<cw::threads::thread>(worker));
+	      }
+
+	    first_unstarted = num_slices;
+	  }
+	catch(cw::threads::ThreadCreateException &)
+	  {
+	    LOG_WARN(logger, "Unable to start a thread to read package records; reading the remaining lists in the calling thread.");
+	  }
+
+	for(std::size_t i = 0; i < num_slices; ++i)
+	  {
+	    if(i != 0 && i < first_unstarted)
+	      continue;
+
+	    scan_worker(fields, slices[i], records,
+			&records_done, num_records, &progress)();
+	  }
+
+	for(std::vector<boost::shared_ptr<cw::threads::thread> >::const_iterator
+	      it = threads.begin(); it != threads.end(); ++it)
+	  (*it)->join();
+      }
+
+      progress.OverallProgress(num_records, num_records, 1, _("Reading package records"));
+      progress.Done();
+
+      // Pass on what was found, list by list, in the order the
+      // records appear on disk.
+      for(std::vector<list_scan>::iterator it = lists.begin();
+	  it != lists.end(); ++it)
+	{
+	  for(std::vector<found_field>::const_iterator found_it = it->found.begin();
+	      found_it != it->found.end(); ++found_it)
+	    slots[found_it->field](found_it->ver, found_it->value);
+
+	  // Release the values as soon as they've been passed on.
+	  std::vector<found_field>().swap(it->found);
+	}
+
+      finished();
+    }
+  }
+}
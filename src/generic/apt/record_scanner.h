@@ -0,0 +1,102 @@
+// record_scanner.h                                  -*-c++-*-
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#ifndef RECORD_SCANNER_H
+#define RECORD_SCANNER_H
+
+#include <apt-pkg/pkgcache.h>
+
+#include <sigc++/signal.h>
+#include <sigc++/slot.h>
+
+#include <string>
+#include <vector>
+
+class OpProgress;
+class pkgRecords;
+
+/** \brief Reads fields out of all the package records in one pass.
+ *
+ *  \file record_scanner.h
+ */
+
+namespace aptitude
+{
+  namespace apt
+  {
+    /** \brief Collects the fields that several modules want from the
+     *  package records, and reads all of them in a single pass.
+     *
+     *  Each module registers the fields it needs with add_field();
+     *  scan() then reads every record once, in the order the records
+     *  appear on disk, and hands each field it finds to the slots
+     *  registered for it.
+     *
+     *  The records of different package lists are independent, so
+     *  scan() can read them on several threads (see
+     *  Aptitude::Record-Scan-Threads).  The slots are always invoked
+     *  by the thread that called scan(), after the records have been
+     *  read, and in the order of the records on disk.
+     */
+    class record_scanner
+    {
+    public:
+      /** \brief A slot that receives a version and the value of a
+       *  field in its record.
+       */
+      typedef sigc::slot<void, const pkgCache::VerIterator &, const std::string &> field_slot;
+
+    private:
+      /** \brief The names of the fields to look for. */
+      std::vector<std::string> fields;
+
+      /** \brief The slot of each entry in fields. */
+      std::vector<field_slot> slots;
+
+    public:
+      /** \brief Emitted by scan() once every field it found has been
+       *  handed to its slots.
+       */
+      sigc::signal0<void> finished;
+
+      /** \brief Ask for a field to be read.
+       *
+       *  \param field  The name of the field.
+       *  \param slot   The slot to invoke with each version whose
+       *                record contains the field, and the field's
+       *                value.  If a version appears in several
+       *                package lists, the slot is invoked once for
+       *                each of them.
+       */
+      void add_field(const std::string &field, const field_slot &slot);
+
+      /** \brief Read the fields from every record in the cache.
+       *
+       *  \param cache     The cache whose records should be read.
+       *  \param records   The records of the cache.  Additional
+       *                   threads open their own records.
+       *  \param progress  Where to report progress.
+       */
+      void scan(pkgCache &cache, pkgRecords &records,
+		OpProgress &progress) const;
+    };
+  }
+}
+
+#endif // RECORD_SCANNER_H
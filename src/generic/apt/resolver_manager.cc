@@ -27,6 +27,7 @@
 #include "aptitude_resolver_universe.h"
 #include "config_signal.h"
 #include "dump_packages.h"
+#include "resolver_memo.h"
 
 #include <boost/format.hpp>
 #include <boost/make_shared.hpp>
@@ -34,6 +35,7 @@
 #include <loggers.h>
 
 #include <generic/problemresolver/problemresolver.h>
+#include <generic/util/profile.h>
 #include <generic/util/temp.h>
 #include <generic/util/undo.h>
 
@@ -170,6 +172,7 @@ resolver_manager::resolver_manager(aptitudeCacheFile *_cache_file,
 				   const imm::map<aptitude_resolver_package, aptitude_resolver_version> &_initial_installations)
   :cache_file(_cache_file),
    resolver(NULL),
+   resolver_out_of_date(false),
    undos(new undo_list),
    ticks_since_last_solution(0),
    solution_search_aborted(false),
@@ -183,12 +186,15 @@ resolver_manager::resolver_manager(aptitudeCacheFile *_cache_file,
    resolver_thread(NULL),
    mutex(cwidget::threads::mutex::attr(PTHREAD_MUTEX_RECURSIVE))
 {
-  (*cache_file)->pre_package_state_changed.connect(sigc::mem_fun(this, &resolver_manager::discard_resolver));
+  (*cache_file)->pre_package_state_changed.connect(sigc::mem_fun(this, &resolver_manager::invalidate_resolver));
   (*cache_file)->package_state_changed.connect(sigc::mem_fun(this, &resolver_manager::maybe_create_resolver));
 
   aptcfg->connect("Apt::Install-Recommends",
 		  sigc::mem_fun(this,
 				&resolver_manager::discard_resolver));
+  aptcfg->connect("Apt::Install-Recommends",
+		  sigc::mem_fun(this,
+				&resolver_manager::discard_compiled_universe));
 
   start_background_thread();
 
@@ -203,6 +209,8 @@ resolver_manager::~resolver_manager()
 
   kill_background_thread();
 
+  discard_compiled_universe();
+
   for(std::vector<const solution_information *>::const_iterator it =
 	solutions.begin(); it != solutions.end(); ++it)
     {
@@ -794,6 +802,17 @@ void resolver_manager::maybe_create_resolver()
 {
   cwidget::threads::mutex::lock l(mutex);
 
+  if(resolver_out_of_date)
+    {
+      // The changed packages are only known at the end of an action
+      // group; otherwise, start over.
+      const std::set<pkgCache::PkgIterator> *changed_packages =
+	(*cache_file)->get_changed_packages();
+
+      if(changed_packages == NULL || !update_resolver(*changed_packages))
+	discard_resolver();
+    }
+
   if(resolver == NULL && ((*cache_file)->BrokenCount() > 0 || !initial_installations.empty()))
     {
       {
@@ -830,8 +849,18 @@ void resolver_manager::discard_resolver()
 
   undos->clear_items();
 
+  save_memo();
+
   delete resolver;
+  resolver = NULL;
+  resolver_out_of_date = false;
+  score_tweaks.clear();
 
+  discard_solutions();
+}
+
+void resolver_manager::discard_solutions()
+{
   {
     cwidget::threads::mutex::lock l2(solutions_mutex);
     actions_since_last_solution.clear();
@@ -847,8 +876,6 @@ void resolver_manager::discard_resolver()
     selected_solution = 0;
   }
 
-  resolver = NULL;
-
   {
     cwidget::threads::mutex::lock l2(background_control_mutex);
     resolver_null = true;
@@ -857,11 +884,97 @@ void resolver_manager::discard_resolver()
   }
 }
 
+void resolver_manager::invalidate_resolver()
+{
+  cwidget::threads::mutex::lock l(mutex);
+
+  if(!aptcfg->FindB(PACKAGE "::ProblemResolver::Reuse-Resolver", true))
+    {
+      discard_resolver();
+      return;
+    }
+
+  if(resolver == NULL || resolver_out_of_date)
+    return;
+
+  background_suspender bs(*this);
+
+  undos->clear_items();
+
+  save_memo();
+
+  discard_solutions();
+
+  resolver_out_of_date = true;
+}
+
+bool resolver_manager::update_resolver(const std::set<pkgCache::PkgIterator> &changed_packages)
+{
+  cwidget::threads::mutex::lock l(mutex);
+  eassert(resolver != NULL);
+  eassert(resolver_out_of_date);
+
+  background_suspender bs(*this);
+
+  std::vector<aptitude_resolver_package> changed;
+  changed.reserve(changed_packages.size());
+  for(std::set<pkgCache::PkgIterator>::const_iterator it = changed_packages.begin();
+      it != changed_packages.end(); ++it)
+    changed.push_back(aptitude_resolver_package(*it, *cache_file));
+
+  if(!resolver->update_initial_state(changed))
+    return false;
+
+  // A new resolver wouldn't have the adjustments that were made with
+  // tweak_score().
+  for(std::vector<std::pair<aptitude_resolver_version, int> >::const_iterator
+	it = score_tweaks.begin(); it != score_tweaks.end(); ++it)
+    resolver->add_version_score(it->first, -it->second);
+  score_tweaks.clear();
+
+  resolver_out_of_date = false;
+
+  // As in maybe_create_resolver(), don't keep a resolver that has
+  // nothing to do.
+  if(resolver->get_initial_broken().empty())
+    {
+      discard_resolver();
+      return true;
+    }
+
+  load_memo();
+
+  {
+    cwidget::threads::mutex::lock l2(background_control_mutex);
+    resolver_null = false;
+    background_control_cond.wake_all();
+  }
+
+  return true;
+}
+
+void resolver_manager::discard_compiled_universe()
+{
+  cwidget::threads::mutex::lock l(mutex);
+
+  // Nothing can be iterating over the compiled universe unless a
+  // resolver exists; this is always called after discard_resolver().
+  eassert(resolver == NULL);
+
+  if(compiled_universe.get() != NULL &&
+     aptitude_compiled_universe::get_active(*cache_file) == compiled_universe.get())
+    aptitude_compiled_universe::activate(NULL);
+
+  compiled_universe.reset();
+}
+
 void resolver_manager::create_resolver()
 {
   cwidget::threads::mutex::lock l(mutex);
   eassert(resolver == NULL);
 
+  aptitude::util::profile_phase phase("create-resolver", Loggers::getAptitudeResolver());
+
   // \todo We should parse these once on startup to avoid duplicate
   // error messages, support modifying the list dynamically (for the
   // sake of GUI users), etc.
@@ -928,6 +1041,20 @@ void resolver_manager::create_resolver()
 
   aptitude_resolver_cost_settings cost_settings(cost_components);
 
+  // Since no resolver exists, nothing is iterating over the universe
+  // and it's safe to switch between the compiled and uncompiled
+  // iterators.
+  aptitude_compiled_universe::activate(NULL);
+  if(aptcfg->FindB(PACKAGE "::ProblemResolver::Compile-Universe", false))
+    {
+      if(compiled_universe.get() == NULL)
+	compiled_universe =
+	  aptitude_compiled_universe::compile(*cache_file,
+					      aptcfg->FindI(PACKAGE "::ProblemResolver::Threads", 1));
+
+      aptitude_compiled_universe::activate(compiled_universe.get());
+    }
+
 
   cost ignored_recommends_cost;
   {
@@ -946,7 +1073,8 @@ void resolver_manager::create_resolver()
                                  cost_settings,
 				 initial_installations,
 				 (*cache_file),
-				 cache_file->Policy);
+				 cache_file->Policy,
+				 aptcfg->FindI(PACKAGE "::ProblemResolver::Threads", 1));
 
   // Set auto flags for initial installations as if the installs were
   // done by the user.  i.e., if the package is currently installed,
@@ -1003,6 +1131,8 @@ void resolver_manager::create_resolver()
 				aptcfg->FindI(PACKAGE "::ProblemResolver::OptionalScore", 1),
 				aptcfg->FindI(PACKAGE "::ProblemResolver::ExtraScore", -1));
 
+  load_memo();
+
   {
     cwidget::threads::mutex::lock l2(background_control_mutex);
     resolver_null = false;
@@ -1010,6 +1140,58 @@ void resolver_manager::create_resolver()
   }
 }
 
+void resolver_manager::load_memo()
+{
+  cwidget::threads::mutex::lock l(mutex);
+  eassert(resolver != NULL);
+
+  memo_file = aptcfg->Find(PACKAGE "::ProblemResolver::Memo-File", "");
+  if(memo_file.empty())
+    return;
+
+  memo_key = aptitude::apt::get_resolver_memo_key(*(*cache_file),
+						  initial_installations);
+
+  int num_loaded, num_dropped;
+  if(aptitude::apt::load_resolver_memo(memo_file, memo_key, *resolver,
+				       num_loaded, num_dropped))
+    {
+      ++memo_stats.hits;
+      memo_stats.promotions_loaded += num_loaded;
+      memo_stats.promotions_dropped += num_dropped;
+    }
+  else
+    ++memo_stats.misses;
+}
+
+void resolver_manager::save_memo()
+{
+  cwidget::threads::mutex::lock l(mutex);
+
+  if(resolver == NULL || memo_file.empty())
+    return;
+
+  // Don't rewrite the memo if the resolver never ran; it can't have
+  // learned anything.
+  {
+    cwidget::threads::mutex::lock l2(solutions_mutex);
+    if(solutions.empty() && ticks_since_last_solution == 0)
+      return;
+  }
+
+  int num_saved;
+  if(aptitude::apt::save_resolver_memo(memo_file, memo_key, *resolver,
+				       num_saved))
+    memo_stats.promotions_saved += num_saved;
+}
+
+resolver_manager::memo_statistics resolver_manager::get_memo_statistics() const
+{
+  cwidget::threads::mutex::lock l(mutex);
+
+  return memo_stats;
+}
+
 void resolver_manager::set_resolver_trace_dir(const std::string &path)
 {
   cwidget::threads::mutex::lock l(background_control_mutex);
@@ -1030,7 +1212,7 @@ bool resolver_manager::resolver_exists() const
 {
   cwidget::threads::mutex::lock l(mutex);
 
-  return resolver != NULL;
+  return resolver != NULL && !resolver_out_of_date;
 }
 
 unsigned int resolver_manager::generated_solution_count() const
@@ -1095,14 +1277,14 @@ resolver_manager::state resolver_manager::state_snapshot()
 
   rval.selected_solution           = selected_solution;
   rval.generated_solutions         = solutions.size();
-  rval.resolver_exists             = (resolver != NULL);
+  rval.resolver_exists             = (resolver != NULL && !resolver_out_of_date);
   rval.background_thread_active    = !solution_search_aborted &&
                                         (!pending_jobs.empty() ||
 				         background_thread_in_resolver);
   rval.background_thread_aborted   = solution_search_aborted;
   rval.background_thread_abort_msg = solution_search_abort_msg;
 
-  if(resolver != NULL)
+  if(rval.resolver_exists)
     {
       aptitude_resolver::queue_counts c = resolver->get_counts();
 
@@ -1139,6 +1321,7 @@ resolver_manager::do_get_solution(int max_steps, unsigned int solution_num,
 
       try
 	{
+	  aptitude::util::profile_phase phase("find-next-solution", Loggers::getAptitudeResolverSearch());
 	  generic_solution<aptitude_universe> sol = resolver->find_next_solution(max_steps, &visited_packages);
 
 	  sol_l.acquire();
@@ -1675,6 +1858,7 @@ void resolver_manager::tweak_score(const pkgCache::PkgIterator &pkg,
     res_ver = aptitude_resolver_version::make_install(ver, *cache_file);
 
   resolver->add_version_score(res_ver, score);
+  score_tweaks.push_back(std::make_pair(res_ver, score));
 }
 
 void resolver_manager::dump(ostream &out)
@@ -53,6 +53,7 @@
  *  \file resolver_manager.h
  */
 
+class aptitude_compiled_universe;
 class aptitude_universe;
 class aptitude_resolver_package;
 class aptitude_resolver_version;
@@ -153,6 +154,45 @@ public:
     size_t conflicts_size;
   };
 
+  /** \brief Statistics on the use of the resolver memo.
+   *
+   *  \sa aptitude::apt::load_resolver_memo()
+   */
+  struct memo_statistics
+  {
+    /** \brief The number of resolvers that were started from a memo
+     *  with a matching key.
+     */
+    int hits;
+
+    /** \brief The number of resolvers for which no usable memo was
+     *  found.
+     */
+    int misses;
+
+    /** \brief The number of promotions that were loaded from the
+     *  memo.
+     */
+    int promotions_loaded;
+
+    /** \brief The number of memo entries that were dropped because
+     *  they referred to packages, versions or dependencies that no
+     *  longer exist.
+     */
+    int promotions_dropped;
+
+    /** \brief The number of promotions that were written to the
+     *  memo.
+     */
+    int promotions_saved;
+
+    memo_statistics()
+      : hits(0), misses(0),
+	promotions_loaded(0), promotions_dropped(0), promotions_saved(0)
+    {
+    }
+  };
+
 private:
   /** \brief Remembers a single user interaction with the resolver.
    *
@@ -204,6 +244,17 @@ private:
   /** The active resolver, or \b NULL if none is active. */
   aptitude_resolver *resolver;
 
+  /** \brief If \b true, package states have changed since the
+   *  resolver was set up, and it must be updated or discarded before
+   *  it is used again.
+   */
+  bool resolver_out_of_date;
+
+  /** \brief The score adjustments that were made with tweak_score(),
+   *  so they can be taken back when the resolver is updated.
+   */
+  std::vector<std::pair<aptitude_resolver_version, int> > score_tweaks;
+
   /** An undo list for resolver-specific items.  This is cleared
    *  whenever the resolver is discarded.
    */
@@ -335,6 +386,31 @@ private:
    */
   std::string resolver_trace_file;
 
+  /** \brief The file in which the resolver's promotions are
+   *  memoized between runs, or an empty string if the memo is
+   *  disabled.
+   *
+   *  Set when the resolver is created, from
+   *  Aptitude::ProblemResolver::Memo-File.
+   */
+  std::string memo_file;
+
+  /** \brief The memo key of the current resolver. */
+  std::string memo_key;
+
+  /** \brief Statistics on the use of the resolver memo. */
+  memo_statistics memo_stats;
+
+  /** \brief The precomputed solvers and reverse dependencies of the
+   *  cache, or \b NULL if they haven't been computed.
+   *
+   *  Built by the first resolver that is created while
+   *  Aptitude::ProblemResolver::Compile-Universe is enabled, and kept
+   *  until APT::Install-Recommends changes or this object is
+   *  destroyed.  Protected by mutex.
+   */
+  boost::shared_ptr<aptitude_compiled_universe> compiled_universe;
+
   /** The number of times the background thread has been suspended; it
    *  will only be allowed to run if this value is 0.
    */
@@ -381,6 +457,45 @@ private:
   void discard_resolver();
   void create_resolver();
 
+  /** \brief Throw away the solutions and stop the background thread
+   *  from running any more jobs.
+   *
+   *  Must be called with the background thread suspended.
+   */
+  void discard_solutions();
+
+  /** \brief Invoked before package states change: stop using the
+   *  resolver until it has been brought up to date.
+   *
+   *  If ProblemResolver::Reuse-Resolver is disabled, the resolver is
+   *  simply discarded.
+   */
+  void invalidate_resolver();
+
+  /** \brief Update the out-of-date resolver in place.
+   *
+   *  \param changed_packages  The packages whose states changed.
+   *
+   *  \return \b false if the resolver couldn't be updated; the
+   *  caller should discard it.
+   */
+  bool update_resolver(const std::set<pkgCache::PkgIterator> &changed_packages);
+
+  /** \brief Deactivate and throw away the compiled universe. */
+  void discard_compiled_universe();
+
+  /** \brief Load the promotions in the memo file, if any, into the
+   *  newly created resolver.
+   */
+  void load_memo();
+
+  /** \brief Write the promotions learned by the resolver to the
+   *  memo file, if any.
+   *
+   *  Must be called with the background thread suspended.
+   */
+  void save_memo();
+
   /** A class that bootstraps the routine below. */
   class background_thread_bootstrap;
   friend class background_thread_bootstrap;
@@ -454,7 +569,9 @@ private:
    */
   void unsuspend_background_thread();
 
-  /** Create a resolver if necessary. */
+  /** Bring an out-of-date resolver up to date, and create a resolver
+   *  if necessary.
+   */
   void maybe_create_resolver();
 
   /** Collects common code for the resolver manipulations such as
@@ -598,6 +715,11 @@ public:
    */
   state state_snapshot();
 
+  /** \brief Get statistics on the use of the resolver memo by this
+   *  manager.
+   */
+  memo_statistics get_memo_statistics() const;
+
 
 
   /** \brief Reject all versions that will break holds or install
@@ -0,0 +1,526 @@
+// resolver_memo.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#include "resolver_memo.h"
+
+#include <aptitude.h>
+#include "apt.h"
+#include "aptcache.h"
+#include "aptitude_resolver.h"
+#include "aptitude_resolver_universe.h"
+
+#include <loggers.h>
+
+#include <apt-pkg/configuration.h>
+
+#include <boost/functional/hash.hpp>
+
+#include <cwidget/generic/util/exception.h>
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using aptitude::Loggers;
+
+namespace aptitude
+{
+  namespace apt
+  {
+    namespace
+    {
+      /** \brief The version of the memo file format.
+       *
+       *  Bump this whenever the format changes or the resolver's
+       *  promotions change meaning; memos with a different version
+       *  are ignored.
+       */
+      const int memo_format_version = 1;
+
+      const char * const memo_header = "Aptitude-Resolver-Memo:";
+      const char * const memo_key_header = "Key:";
+
+      /** \brief The token used in place of a version string for the
+       *  version that removes a package.
+       */
+      const char * const removal_version_name = "-";
+
+      typedef aptitude_resolver::choice choice;
+      typedef aptitude_resolver::choice_set choice_set;
+      typedef aptitude_resolver::promotion promotion;
+
+      void hash_config_tree(std::size_t &seed, const Configuration::Item *root)
+      {
+	if(root == NULL)
+	  return;
+
+	boost::hash_combine(seed, root->FullTag());
+	boost::hash_combine(seed, root->Value);
+
+	for(const Configuration::Item *itm = root->Child;
+	    itm != NULL; itm = itm->Next)
+	  hash_config_tree(seed, itm);
+      }
+
+      /** \brief Return the offset of a version in the cache, or -1
+       *  for a NULL pointer.
+       */
+      long version_offset(pkgCache &cache, const pkgCache::Version *ver)
+      {
+	if(ver == NULL)
+	  return -1;
+	else
+	  return ver - cache.VerP;
+      }
+
+      /** \brief Hash everything besides the package cache that the
+       *  resolver's costs depend on.
+       */
+      std::size_t hash_problem(aptitudeDepCache &cache,
+			       const imm::map<aptitude_resolver_package, aptitude_resolver_version> &initial_installations)
+      {
+	std::size_t rval = 0;
+
+	hash_config_tree(rval, aptcfg->Tree(PACKAGE "::ProblemResolver"));
+	boost::hash_combine(rval, aptcfg->FindB("Apt::Install-Recommends", true));
+	boost::hash_combine(rval, aptcfg->FindB("Apt::Install-Suggests", false));
+
+	for(imm::map<aptitude_resolver_package, aptitude_resolver_version>::const_iterator
+	      it = initial_installations.begin();
+	    it != initial_installations.end(); ++it)
+	  {
+	    boost::hash_combine(rval, it->first.get_id());
+	    boost::hash_combine(rval, it->second.get_id());
+	  }
+
+	pkgCache &pkgcache(cache.GetCache());
+	for(pkgCache::PkgIterator p = cache.PkgBegin(); !p.end(); ++p)
+	  {
+	    const pkgDepCache::StateCache &state(cache[p]);
+	    const aptitudeDepCache::aptitude_state &ext_state(cache.get_ext_state(p));
+
+	    boost::hash_combine(rval, p->CurrentVer);
+	    boost::hash_combine(rval, p->CurrentState);
+	    boost::hash_combine(rval, version_offset(pkgcache, state.InstallVer));
+	    boost::hash_combine(rval, version_offset(pkgcache, state.CandidateVer));
+	    boost::hash_combine(rval, (state.Flags & pkgCache::Flag::Auto) != 0);
+	    boost::hash_combine(rval, (int)ext_state.selection_state);
+	    boost::hash_combine(rval, ext_state.forbidver);
+	    boost::hash_combine(rval, (int)ext_state.remove_reason);
+	  }
+
+	return rval;
+      }
+
+      // Writing memo entries.
+
+      void write_version(std::ostream &out, const aptitude_resolver_version &ver)
+      {
+	out << ' ' << ver.get_package().get_name() << ' ';
+	if(ver.get_ver().end())
+	  out << removal_version_name;
+	else
+	  out << ver.get_ver().VerStr();
+      }
+
+      /** \brief Write a dependency as its source version and its
+       *  position among that version's dependencies.
+       *
+       *  \return \b false if the dependency couldn't be found.
+       */
+      bool write_dep(std::ostream &out, const aptitude_resolver_dep &d)
+      {
+	const aptitude_resolver_version source(d.get_source());
+	int idx = 0;
+	for(aptitude_resolver_version::dep_iterator it = source.deps_begin();
+	    !it.end(); ++it, ++idx)
+	  if(*it == d)
+	    {
+	      write_version(out, source);
+	      out << ' ' << idx;
+	      return true;
+	    }
+
+	return false;
+      }
+
+      void write_cost(std::ostream &out, const cost &c)
+      {
+	typedef std::vector<std::pair<std::vector<level>::size_type, level> > user_level_list;
+	const user_level_list &levels(c.get_user_levels());
+
+	out << c.get_structural_level() << ' ' << levels.size();
+	for(user_level_list::const_iterator it = levels.begin();
+	    it != levels.end(); ++it)
+	  out << ' ' << it->first
+	      << ' ' << (it->second.get_state() == level::added ? 'a' : 'l')
+	      << ' ' << it->second.get_value();
+      }
+
+      class write_choice
+      {
+	std::ostream &out;
+	bool &ok;
+
+      public:
+	write_choice(std::ostream &_out, bool &_ok)
+	  : out(_out), ok(_ok)
+	{
+	}
+
+	bool operator()(const choice &c) const
+	{
+	  switch(c.get_type())
+	    {
+	    case choice::install_version:
+	      out << " i";
+	      write_version(out, c.get_ver());
+	      if(!c.get_has_dep())
+		out << " n";
+	      else
+		{
+		  out << (c.get_from_dep_source() ? " s" : " d");
+		  ok = write_dep(out, c.get_dep());
+		}
+	      break;
+
+	    case choice::break_soft_dep:
+	      out << " b";
+	      ok = write_dep(out, c.get_dep());
+	      break;
+	    }
+
+	  return ok;
+	}
+      };
+
+      // Reading memo entries.
+
+      bool read_version(std::istream &in, aptitudeDepCache &cache,
+			aptitude_resolver_version &out)
+      {
+	std::string pkg_name, ver_name;
+	if(!(in >> pkg_name >> ver_name))
+	  return false;
+
+	pkgCache::PkgIterator pkg(cache.GetCache().FindPkg(pkg_name));
+	if(pkg.end())
+	  return false;
+
+	aptitude_resolver_package resolver_pkg(pkg, &cache);
+	for(aptitude_resolver_package::version_iterator it = resolver_pkg.versions_begin();
+	    !it.end(); ++it)
+	  {
+	    const aptitude_resolver_version ver(*it);
+	    if(ver.get_ver().end()
+	       ? ver_name == removal_version_name
+	       : ver_name == ver.get_ver().VerStr())
+	      {
+		out = ver;
+		return true;
+	      }
+	  }
+
+	return false;
+      }
+
+      bool read_dep(std::istream &in, aptitudeDepCache &cache,
+		    aptitude_resolver_dep &out)
+      {
+	aptitude_resolver_version source;
+	int dep_idx;
+	if(!read_version(in, cache, source) || !(in >> dep_idx) ||
+	   source.get_ver().end())
+	  return false;
+
+	int idx = 0;
+	for(aptitude_resolver_version::dep_iterator it = source.deps_begin();
+	    !it.end(); ++it, ++idx)
+	  if(idx == dep_idx)
+	    {
+	      out = *it;
+	      return true;
+	    }
+
+	return false;
+      }
+
+      bool read_cost(std::istream &in, cost &out)
+      {
+	int structural_level;
+	std::size_t num_levels;
+	if(!(in >> structural_level >> num_levels))
+	  return false;
+
+	cost rval(cost::make_advance_structural_level(structural_level));
+	for(std::size_t i = 0; i < num_levels; ++i)
+	  {
+	    int idx, value;
+	    char state;
+	    if(!(in >> idx >> state >> value))
+	      return false;
+
+	    if(state == 'a')
+	      rval = rval + cost::make_add_to_user_level(idx, value);
+	    else if(state == 'l')
+	      rval = rval + cost::make_advance_user_level(idx, value);
+	    else
+	      return false;
+	  }
+
+	out = rval;
+	return true;
+      }
+
+      bool read_choice(std::istream &in, aptitudeDepCache &cache,
+		       choice &out)
+      {
+	std::string type;
+	if(!(in >> type))
+	  return false;
+
+	if(type == "i")
+	  {
+	    aptitude_resolver_version ver;
+	    std::string dep_mode;
+	    if(!read_version(in, cache, ver) || !(in >> dep_mode))
+	      return false;
+
+	    if(dep_mode == "n")
+	      {
+		out = choice::make_install_version(ver, 0);
+		return true;
+	      }
+
+	    aptitude_resolver_dep d;
+	    if(!read_dep(in, cache, d))
+	      return false;
+
+	    if(dep_mode == "d")
+	      out = choice::make_install_version(ver, d, 0);
+	    else if(dep_mode == "s")
+	      out = choice::make_install_version_from_dep_source(ver, d, 0);
+	    else
+	      return false;
+
+	    return true;
+	  }
+	else if(type == "b")
+	  {
+	    aptitude_resolver_dep d;
+	    if(!read_dep(in, cache, d))
+	      return false;
+
+	    out = choice::make_break_soft_dep(d, 0);
+	    return true;
+	  }
+	else
+	  return false;
+      }
+
+      bool read_promotion(const std::string &line, aptitudeDepCache &cache,
+			  promotion &out)
+      {
+	std::istringstream in(line);
+
+	cost promotion_cost;
+	std::size_t num_choices;
+	if(!read_cost(in, promotion_cost) || !(in >> num_choices) ||
+	   num_choices == 0)
+	  return false;
+
+	choice_set choices;
+	for(std::size_t i = 0; i < num_choices; ++i)
+	  {
+	    choice c;
+	    if(!read_choice(in, cache, c))
+	      return false;
+
+	    choices.insert_or_narrow(c);
+	  }
+
+	out = promotion(choices, promotion_cost);
+	return true;
+      }
+    }
+
+    std::string get_resolver_memo_key(aptitudeDepCache &cache,
+				       const imm::map<aptitude_resolver_package, aptitude_resolver_version> &initial_installations)
+    {
+      std::ostringstream out;
+      out << std::hex
+	  << hash_pkgcache(cache.GetCache())
+	  << '-'
+	  << hash_problem(cache, initial_installations);
+      return out.str();
+    }
+
+    bool load_resolver_memo(const std::string &filename,
+			    const std::string &key,
+			    aptitude_resolver &resolver,
+			    int &num_loaded,
+			    int &num_dropped)
+    {
+      logging::LoggerPtr logger(Loggers::getAptitudeResolver());
+
+      num_loaded = 0;
+      num_dropped = 0;
+
+      std::ifstream in(filename.c_str());
+      if(!in)
+	{
+	  LOG_DEBUG(logger, "No resolver memo found in \"" << filename << "\".");
+	  return false;
+	}
+
+      std::string header, file_key;
+      int version = -1;
+      in >> header >> version;
+      if(header != memo_header || version != memo_format_version)
+	{
+	  LOG_INFO(logger, "Ignoring the resolver memo in \"" << filename
+		   << "\": it has an unsupported format.");
+	  return false;
+	}
+
+      in >> header >> file_key;
+      if(header != memo_key_header || file_key != key)
+	{
+	  LOG_DEBUG(logger, "Ignoring the resolver memo in \"" << filename
+		    << "\": its key " << file_key
+		    << " doesn't match the current key " << key << ".");
+	  return false;
+	}
+
+      aptitudeDepCache &cache(*resolver.get_universe().get_cache());
+
+      std::string line;
+      std::getline(in, line);
+      while(std::getline(in, line))
+	{
+	  if(line.empty())
+	    continue;
+
+	  promotion p;
+	  bool ok;
+	  try
+	    {
+	      ok = read_promotion(line, cache, p);
+	    }
+	  catch(const cwidget::util::Exception &ex)
+	    {
+	      LOG_TRACE(logger, "Error reading a resolver memo entry: " << ex.errmsg());
+	      ok = false;
+	    }
+	  catch(const std::exception &ex)
+	    {
+	      LOG_TRACE(logger, "Error reading a resolver memo entry: " << ex.what());
+	      ok = false;
+	    }
+
+	  if(!ok)
+	    {
+	      LOG_TRACE(logger, "Dropping the resolver memo entry \"" << line << "\".");
+	      ++num_dropped;
+	    }
+	  else
+	    {
+	      resolver.add_promotion(p.get_choices(), p.get_cost());
+	      ++num_loaded;
+	    }
+	}
+
+      LOG_INFO(logger, "Loaded " << num_loaded << " promotions from the resolver memo in \""
+	       << filename << "\" (" << num_dropped << " dropped).");
+
+      return true;
+    }
+
+    bool save_resolver_memo(const std::string &filename,
+			    const std::string &key,
+			    const aptitude_resolver &resolver,
+			    int &num_saved)
+    {
+      logging::LoggerPtr logger(Loggers::getAptitudeResolver());
+
+      num_saved = 0;
+
+      std::vector<promotion> promotions;
+      resolver.get_unconditional_promotions(promotions);
+
+      const std::string tmp_filename = filename + ".new";
+      {
+	std::ofstream out(tmp_filename.c_str());
+	if(!out)
+	  {
+	    LOG_WARN(logger, "Can't write the resolver memo to \"" << tmp_filename << "\".");
+	    return false;
+	  }
+
+	out << memo_header << ' ' << memo_format_version << std::endl
+	    << memo_key_header << ' ' << key << std::endl;
+
+	for(std::vector<promotion>::const_iterator it = promotions.begin();
+	    it != promotions.end(); ++it)
+	  {
+	    std::ostringstream entry;
+	    write_cost(entry, it->get_cost());
+	    entry << ' ' << it->get_choices().size();
+
+	    bool ok = true;
+	    it->get_choices().for_each(write_choice(entry, ok));
+
+	    if(ok)
+	      {
+		out << entry.str() << std::endl;
+		++num_saved;
+	      }
+	    else
+	      LOG_TRACE(logger, "Not saving the promotion " << *it
+			<< " to the resolver memo: it refers to an unknown dependency.");
+	  }
+
+	if(!out)
+	  {
+	    LOG_WARN(logger, "Error writing the resolver memo to \"" << tmp_filename << "\".");
+	    unlink(tmp_filename.c_str());
+	    return false;
+	  }
+      }
+
+      if(rename(tmp_filename.c_str(), filename.c_str()) != 0)
+	{
+	  LOG_WARN(logger, "Can't rename \"" << tmp_filename << "\" to \""
+		   << filename << "\": " << strerror(errno));
+	  unlink(tmp_filename.c_str());
+	  return false;
+	}
+
+      LOG_INFO(logger, "Saved " << num_saved << " promotions to the resolver memo in \""
+	       << filename << "\".");
+
+      return true;
+    }
+  }
+}
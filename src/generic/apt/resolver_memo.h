@@ -0,0 +1,108 @@
+// resolver_memo.h                                   -*-c++-*-
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#ifndef RESOLVER_MEMO_H
+#define RESOLVER_MEMO_H
+
+#include <generic/util/immset.h>
+
+#include <string>
+
+/** \brief Save the promotions learned by the resolver so that later
+ *  runs on the same problem can start with them.
+ *
+ *  The memo is a text file.  It begins with a format version and a
+ *  key; the key combines a hash of the package cache (the index
+ *  files it was built from and its size) with a hash of everything
+ *  else that affects the costs the resolver computes: the
+ *  ProblemResolver configuration, the initial installations, and the
+ *  state of each package.  A memo whose version or key doesn't match
+ *  is ignored.  Each remaining line is a promotion; packages and
+ *  versions are recorded by name and dependencies by their position
+ *  in their source version's dependency list, so entries that refer
+ *  to something that no longer exists are dropped when the memo is
+ *  loaded.
+ *
+ *  \file resolver_memo.h
+ */
+
+class aptitudeDepCache;
+class aptitude_resolver;
+class aptitude_resolver_package;
+class aptitude_resolver_version;
+
+namespace aptitude
+{
+  namespace apt
+  {
+    /** \brief Compute the key under which a resolver's promotions
+     *  are memoized.
+     *
+     *  \param cache                  the cache the resolver will run on.
+     *  \param initial_installations  the initial installations that
+     *                                will be passed to the resolver.
+     */
+    std::string get_resolver_memo_key(aptitudeDepCache &cache,
+				       const imm::map<aptitude_resolver_package, aptitude_resolver_version> &initial_installations);
+
+    /** \brief Load memoized promotions into a resolver.
+     *
+     *  \param filename     the file to read the memo from.
+     *  \param key          the key of the resolver, as returned by
+     *                      get_resolver_memo_key().
+     *  \param resolver     the resolver that should receive the
+     *                      promotions.
+     *  \param num_loaded   set to the number of promotions that were
+     *                      added to the resolver.
+     *  \param num_dropped  set to the number of promotions that were
+     *                      discarded because they couldn't be read or
+     *                      referred to packages, versions or
+     *                      dependencies that no longer exist.
+     *
+     *  \return \b true if a memo with a matching key was found.
+     */
+    bool load_resolver_memo(const std::string &filename,
+			    const std::string &key,
+			    aptitude_resolver &resolver,
+			    int &num_loaded,
+			    int &num_dropped);
+
+    /** \brief Write a resolver's unconditional promotions to a memo.
+     *
+     *  The memo is written to a temporary file that is renamed over
+     *  the old memo, so a reader never sees a partially written file.
+     *
+     *  \param filename    the file to write the memo to.
+     *  \param key         the key of the resolver, as returned by
+     *                     get_resolver_memo_key().
+     *  \param resolver    the resolver whose promotions should be saved.
+     *                     It must not be running.
+     *  \param num_saved   set to the number of promotions that were
+     *                     written.
+     *
+     *  \return \b true if the memo was written.
+     */
+    bool save_resolver_memo(const std::string &filename,
+			    const std::string &key,
+			    const aptitude_resolver &resolver,
+			    int &num_saved);
+  }
+}
+
+#endif // RESOLVER_MEMO_H
@@ -32,6 +32,11 @@ namespace aptitude
 		 post_thunk_f post_thunk)
   {
     std::string uri, short_description;
+    // Thumbnails are requested for every package that a list or a
+    // summary shows, whether or not anyone looks at them; a
+    // full-size screenshot was asked for explicitly, so it shouldn't
+    // wait behind them.
+    download_priority priority = download_priority_prefetch;
     switch(key.get_type())
       {
       case screenshot_thumbnail:
@@ -48,11 +53,12 @@ namespace aptitude
 	       % key.get_package_name()).str();
 	short_description = (boost::format("Screenshot of %s")
 			     % key.get_package_name()).str();
+	priority = download_priority_visible;
 	break;
       }
 
     return queue_download(uri, short_description,
-			  callbacks, post_thunk);
+			  callbacks, post_thunk, priority);
   }
 
   std::ostream &operator<<(std::ostream &out, const screenshot_key &key)
@@ -118,6 +118,10 @@ namespace aptitude
    *  hook into cache_closing and wait for get_screenshot() to
    *  return before it allows cache_closing to return).
    *
+   *  Thumbnails are queued at download_priority_prefetch, so a
+   *  full-size screenshot that the user asked for is fetched before
+   *  the thumbnails of a long package list.
+   *
    *  \return a handle that can be used to cancel the download.
    */
   boost::shared_ptr<download_request>
@@ -0,0 +1,88 @@
+// symbol_table.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#include "symbol_table.h"
+
+namespace aptitude
+{
+  namespace apt
+  {
+    symbol_id symbol_table::intern(const std::string &name)
+    {
+      std::pair<boost::unordered_map<std::string, symbol_id>::iterator, bool>
+	inserted = ids.insert(std::make_pair(name, static_cast<symbol_id>(names.size())));
+
+      if(inserted.second)
+	names.push_back(name);
+
+      return inserted.first->second;
+    }
+
+    bool symbol_table::find(const std::string &name, symbol_id &out) const
+    {
+      boost::unordered_map<std::string, symbol_id>::const_iterator
+	found = ids.find(name);
+
+      if(found == ids.end())
+	return false;
+
+      out = found->second;
+      return true;
+    }
+
+    void symbol_table::clear()
+    {
+      std::vector<std::string>().swap(names);
+      ids.clear();
+    }
+
+    void symbol_membership::finish(std::size_t num_packages)
+    {
+      std::sort(pending.begin(), pending.end());
+      pending.erase(std::unique(pending.begin(), pending.end()),
+		    pending.end());
+
+      offsets.assign(num_packages + 1, 0);
+      members.clear();
+      members.reserve(pending.size());
+
+      // Count the IDs of each package in offsets[n + 1], then turn
+      // the counts into offsets.
+      for(std::vector<std::pair<unsigned long, symbol_id> >::const_iterator
+	    it = pending.begin(); it != pending.end(); ++it)
+	if(it->first < num_packages)
+	  {
+	    ++offsets[it->first + 1];
+	    members.push_back(it->second);
+	  }
+
+      for(std::size_t i = 1; i < offsets.size(); ++i)
+	offsets[i] += offsets[i - 1];
+
+      std::vector<std::pair<unsigned long, symbol_id> >().swap(pending);
+    }
+
+    void symbol_membership::clear()
+    {
+      std::vector<std::pair<unsigned long, symbol_id> >().swap(pending);
+      std::vector<std::size_t>().swap(offsets);
+      std::vector<symbol_id>().swap(members);
+    }
+  }
+}
@@ -0,0 +1,171 @@
+// symbol_table.h                                    -*-c++-*-
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#ifndef SYMBOL_TABLE_H
+#define SYMBOL_TABLE_H
+
+#include <boost/unordered_map.hpp>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** \brief Interned strings and per-package sets of them.
+ *
+ *  \file symbol_table.h
+ */
+
+namespace aptitude
+{
+  namespace apt
+  {
+    /** \brief The ID of a string in a symbol_table. */
+    typedef unsigned int symbol_id;
+
+    /** \brief Assigns a small integer ID to each distinct string
+     *  added to it.
+     *
+     *  IDs are handed out consecutively from 0, so they can be used
+     *  to index vectors.  Lookups may run concurrently with each
+     *  other, but not with intern() or clear().
+     */
+    class symbol_table
+    {
+      std::vector<std::string> names;
+      boost::unordered_map<std::string, symbol_id> ids;
+
+    public:
+      /** \brief Get the ID of a string, adding it to the table if
+       *  it isn't there yet.
+       */
+      symbol_id intern(const std::string &name);
+
+      /** \brief Look up the ID of a string.
+       *
+       *  \return \b false if the string isn't in the table.
+       */
+      bool find(const std::string &name, symbol_id &out) const;
+
+      /** \brief Get the string that has the given ID. */
+      const std::string &get_name(symbol_id id) const
+      {
+	return names[id];
+      }
+
+      /** \brief Get the number of strings in the table. */
+      std::size_t size() const
+      {
+	return names.size();
+      }
+
+      /** \brief Remove all the strings from the table. */
+      void clear();
+    };
+
+    /** \brief A sorted set of symbol IDs that belong to a package.
+     *
+     *  The set refers to storage owned by a symbol_membership, and is
+     *  only valid while that isn't modified.
+     */
+    class symbol_set
+    {
+      const symbol_id *first;
+      const symbol_id *last;
+
+    public:
+      typedef const symbol_id *const_iterator;
+
+      symbol_set()
+	: first(NULL), last(NULL)
+      {
+      }
+
+      symbol_set(const symbol_id *_first, const symbol_id *_last)
+	: first(_first), last(_last)
+      {
+      }
+
+      const_iterator begin() const { return first; }
+      const_iterator end() const { return last; }
+      bool empty() const { return first == last; }
+      std::size_t size() const { return last - first; }
+
+      /** \brief Test whether the given ID is in this set. */
+      bool contains(symbol_id id) const
+      {
+	return std::binary_search(first, last, id);
+      }
+    };
+
+    /** \brief Stores which symbols each package has.
+     *
+     *  Memberships are collected with add(); finish() then packs them
+     *  into a single array of IDs, sorted by package and then by ID,
+     *  plus the offset of each package's IDs in that array.  Until
+     *  finish() is called, every package has an empty set.
+     */
+    class symbol_membership
+    {
+      /** \brief The memberships added since the last finish(). */
+      std::vector<std::pair<unsigned long, symbol_id> > pending;
+
+      /** \brief The IDs of package n are members[offsets[n]] up to
+       *  members[offsets[n + 1]].
+       */
+      std::vector<std::size_t> offsets;
+      std::vector<symbol_id> members;
+
+    public:
+      /** \brief Record that a package has a symbol.
+       *
+       *  Adding the same membership twice is harmless.
+       */
+      void add(unsigned long package_id, symbol_id id)
+      {
+	pending.push_back(std::make_pair(package_id, id));
+      }
+
+      /** \brief Make the memberships added so far visible.
+       *
+       *  \param num_packages  The number of packages in the cache;
+       *                       memberships of packages with larger IDs
+       *                       are discarded.
+       */
+      void finish(std::size_t num_packages);
+
+      /** \brief Get the symbols of a package. */
+      symbol_set get(unsigned long package_id) const
+      {
+	if(package_id + 1 >= offsets.size() ||
+	   offsets[package_id] == offsets[package_id + 1])
+	  return symbol_set();
+
+	const symbol_id * const base = &members[0];
+	return symbol_set(base + offsets[package_id],
+			  base + offsets[package_id + 1]);
+      }
+
+      /** \brief Discard all the memberships. */
+      void clear();
+    };
+  }
+}
+
+#endif // SYMBOL_TABLE_H
@@ -25,6 +25,7 @@
 
 #include "apt.h"
 #include "config_signal.h"
+#include "record_scanner.h"
 
 #include <algorithm>
 #include <map>
@@ -36,7 +37,6 @@
 #include <sigc++/functors/mem_fun.h>
 
 #include <apt-pkg/error.h>
-#include <apt-pkg/pkgrecords.h>
 #include <apt-pkg/tagfile.h>
 
 #include <cwidget/generic/util/eassert.h>
@@ -149,27 +149,13 @@ typedef set<tag> db_entry;
 db_entry *tagDB;
 
 static void insert_tags(const pkgCache::VerIterator &ver,
-			const pkgCache::VerFileIterator &vf)
+			const std::string &tag_field)
 {
-  set<tag> *tags = tagDB + ver.ParentPkg()->ID;
-
-  const char *recstart=0, *recend=0;
-  const char *tagstart, *tagend;
-  pkgTagSection sec;
-
-  eassert(apt_package_records);
   eassert(tagDB);
 
-  apt_package_records->Lookup(vf).GetRec(recstart, recend);
-  if(!recstart || !recend)
-    return;
-  if(!sec.Scan(recstart, recend-recstart+1))
-    return;
-
-  if(!sec.Find("Tag", tagstart, tagend))
-    return;
+  set<tag> *tags = tagDB + ver.ParentPkg()->ID;
 
-  tag_list lst(tagstart, tagend);
+  tag_list lst(tag_field.data(), tag_field.data() + tag_field.size());
 
   for(tag_list::const_iterator t=lst.begin(); t!=lst.end(); ++t)
     tags->insert(*t);
@@ -190,9 +176,9 @@ const set<tag> *get_tags(const pkgCache::PkgIterator &pkg)
 }
 
 bool initialized_reset_signal;
-void load_tags(OpProgress &progress)
+void scan_tags(aptitude::apt::record_scanner &scanner)
 {
-  eassert(apt_cache_file && apt_package_records);
+  eassert(apt_cache_file);
 
   if(!initialized_reset_signal)
     {
@@ -203,29 +189,7 @@ void load_tags(OpProgress &progress)
 
   tagDB = new db_entry[(*apt_cache_file)->Head().PackageCount];
 
-  std::vector<loc_pair> verfiles;
-
-  for(pkgCache::PkgIterator p = (*apt_cache_file)->PkgBegin();
-      !p.end(); ++p)
-    for(pkgCache::VerIterator v = p.VersionList(); !v.end(); ++v)
-      for(pkgCache::VerFileIterator vf = v.FileList();
-	  !vf.end(); ++vf)
-	verfiles.push_back(loc_pair(v, vf));
-
-  sort(verfiles.begin(), verfiles.end(), location_compare());
-
-  progress.OverallProgress(0, verfiles.size(), 1,
-			   _("Building tag database"));
-  size_t n=0;
-  for(std::vector<loc_pair>::iterator i=verfiles.begin();
-      i!=verfiles.end(); ++i)
-    {
-      insert_tags(i->first, i->second);
-      ++n;
-      progress.OverallProgress(n, verfiles.size(), 1, _("Building tag database"));
-    }
-
-  progress.Done();
+  scanner.add_field("Tag", sigc::ptr_fun(&insert_tags));
 }
 
 
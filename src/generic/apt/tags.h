@@ -44,7 +44,13 @@
  *  \file tags.h
  */
 
-class OpProgress;
+namespace aptitude
+{
+  namespace apt
+  {
+    class record_scanner;
+  }
+}
 
 class tag
 {
@@ -209,8 +215,11 @@ public:
 // Grab the tags for the given package:
 const std::set<tag> *get_tags(const pkgCache::PkgIterator &pkg);
 
-// Load tags for all packages (call before get_tags)
-void load_tags(OpProgress &progress);
+/** \brief Set up the tag database and ask the given scanner to fill
+ *  it in; the tags are available from get_tags() once the scanner
+ *  has run.
+ */
+void scan_tags(aptitude::apt::record_scanner &scanner);
 
 
 
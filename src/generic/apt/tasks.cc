@@ -4,14 +4,15 @@
 
 #include "tasks.h"
 #include "apt.h"
+#include "record_scanner.h"
 
 #include <aptitude.h>
 
 #include <apt-pkg/error.h>
-#include <apt-pkg/pkgrecords.h>
 #include <apt-pkg/tagfile.h>
 
-#include <cwidget/generic/util/eassert.h>
+#include <sigc++/functors/ptr_fun.h>
+
 #include <errno.h>
 
 #include <ctype.h>
@@ -25,73 +26,63 @@ using namespace std;
 
 map<string, task> *task_list=new map<string, task>;
 
-// This is an array indexed by package ID, managed by load_tasks.
-// (as usual, it's initialized to NULL)
-set<string> *tasks_by_package;
+// The names of all the tasks that packages claim to belong to.  A
+// few hundred names are shared by tens of thousands of packages, so
+// the memberships are stored as IDs into this table.
+static aptitude::apt::symbol_table task_names;
+
+// The tasks of each package, managed by scan_tasks.
+static aptitude::apt::symbol_membership tasks_by_package;
 
-// Now this is just a wrapper, as you can see..
-std::set<std::string> *get_tasks(const pkgCache::PkgIterator &pkg)
+aptitude::apt::symbol_set get_tasks(const pkgCache::PkgIterator &pkg)
 {
-  if(!tasks_by_package)
-    return NULL;
+  return tasks_by_package.get(pkg->ID);
+}
 
-  return tasks_by_package+pkg->ID;
+const aptitude::apt::symbol_table &get_task_names()
+{
+  return task_names;
 }
 
-/** \brief Add any tasks found in the given version-file pointer to
- *  the tasks of the given package.
+/** \brief Add the tasks listed in the Task field of a version to
+ *  the tasks of its package.
  */
-static void append_tasks(const pkgCache::PkgIterator &pkg,
-			 const pkgCache::VerFileIterator &verfile)
+static void append_tasks(const pkgCache::VerIterator &ver,
+			 const string &tasks)
 {
-  // This should never be called before load_tasks has initialized the
-  // tasks structure.
-  eassert(tasks_by_package);
+  const unsigned long pkg_id = ver.ParentPkg()->ID;
 
-  if(strcmp(pkg.Name(), "kdeadmin") == 0)
-    eassert(pkg.Name());
+  string::size_type loc=0, firstcomma=0;
 
-  set<string> &task_set=tasks_by_package[pkg->ID];
+  // Strip leading whitespace
+  while(loc<tasks.size() && isspace(tasks[loc]))
+    ++loc;
 
-  if(apt_package_records)
+  while( (firstcomma=tasks.find(',', loc))!=tasks.npos)
     {
-      const char *start,*stop;
-      pkgTagSection sec;
-
-      // Pull out pointers to the underlying record.
-      apt_package_records->Lookup(verfile).GetRec(start, stop);
+      // Strip trailing whitespace
+      string::size_type loc2=firstcomma-1;
+      while(isspace(tasks[loc2]))
+	--loc2;
+      ++loc2;
 
-      // Parse it as a section.
-      sec.Scan(start, stop-start+1);
-
-      string tasks=sec.FindS("Task");
-
-      string::size_type loc=0, firstcomma=0;
+      string taskname(tasks, loc, loc2-loc);
+      tasks_by_package.add(pkg_id, task_names.intern(taskname));
+      loc=firstcomma+1;
 
       // Strip leading whitespace
       while(loc<tasks.size() && isspace(tasks[loc]))
 	++loc;
+    }
 
-      while( (firstcomma=tasks.find(',', loc))!=tasks.npos)
-	{
-	  // Strip trailing whitespace
-	  string::size_type loc2=firstcomma-1;
-	  while(isspace(tasks[loc2]))
-	    --loc2;
-	  ++loc2;
-
-	  string taskname(tasks, loc, loc2-loc);
-	  task_set.insert(taskname);
-	  loc=firstcomma+1;
-
-	  // Strip leading whitespace
-	  while(loc<tasks.size() && isspace(tasks[loc]))
-	    ++loc;
-	}
+  if(loc!=tasks.size())
+    tasks_by_package.add(pkg_id, task_names.intern(string(tasks, loc)));
+}
 
-      if(loc!=tasks.size())
-	task_set.insert(string(tasks, loc));
-    }
+/** \brief Pack the memberships collected by append_tasks. */
+static void finish_tasks()
+{
+  tasks_by_package.finish((*apt_cache_file)->Head().PackageCount);
 }
 
 bool task::keys_present()
@@ -101,6 +92,9 @@ bool task::keys_present()
 
   keys_present_cache_stale=false;
 
+  aptitude::apt::symbol_id id = 0;
+  const bool known = task_names.find(name, id);
+
   for(set<string>::const_iterator i=keys.begin(); i!=keys.end(); ++i)
     {
       pkgCache::PkgIterator pkg=(*apt_cache_file)->FindPkg(*i);
@@ -114,19 +108,10 @@ bool task::keys_present()
 	// Here it is assumed that all the tasks are loaded, because
 	// we're going to look them up.
 	{
-	  set<string> *tasks = get_tasks(pkg);
-
-	  if(!tasks)
-	    {
-	      keys_present_cache=false;
-	      return false;
-	    }
-
-	  if(tasks->find(name) == tasks->end())
+	  if(!known || !get_tasks(pkg).contains(id))
 	    {
 	      keys_present_cache=false;
 	      return false;
-	      break;
 	    }
 	}
     }
@@ -227,41 +212,19 @@ static string rfc822dgettext(string textdomain, string msgid)
   return msgstr;
 }
 
-void load_tasks(OpProgress &progress)
+void scan_tasks(aptitude::apt::record_scanner &scanner)
 {
-  // Build a list for each package of the tasks that package belongs to.
-  //
-  // Sorting by location on disk is *critical* -- otherwise, this operation
-  // will take ages.
-
-  // This is done prior to loading the task descriptions so that I can just
-  // bail if that fails.
-
-  vector<loc_pair> versionfiles;
-
-  for(pkgCache::PkgIterator pkg=(*apt_cache_file)->PkgBegin();
-      !pkg.end(); ++pkg)
-    {
-      for(pkgCache::VerIterator v = pkg.VersionList(); !v.end(); ++v)
-	{
-	  for(pkgCache::VerFileIterator vf = v.FileList(); !vf.end(); ++vf)
-	    {
-	      versionfiles.push_back(loc_pair(v, vf));
-	    }
-	}
-    }
-
-  sort(versionfiles.begin(), versionfiles.end(), location_compare());
+  // Start from an empty table of task information; the scanner
+  // records, for each package, the tasks that package belongs to.
+  task_names.clear();
+  tasks_by_package.clear();
 
-  // Allocate and set up the table of task information.
-  delete[] tasks_by_package;
-  tasks_by_package = new set<string>[(*apt_cache_file)->Head().PackageCount];
-
-  for(vector<loc_pair>::iterator i=versionfiles.begin();
-      i!=versionfiles.end();
-      ++i)
-    append_tasks(i->first.ParentPkg(), i->second);
+  scanner.add_field("Task", sigc::ptr_fun(&append_tasks));
+  scanner.finished.connect(sigc::ptr_fun(&finish_tasks));
+}
 
+void load_tasks(OpProgress &progress)
+{
   FileFd task_file;
 
   // Load the task descriptions:
@@ -334,6 +297,6 @@ void load_tasks(OpProgress &progress)
 void reset_tasks()
 {
   task_list->clear();
-  delete[] tasks_by_package;
-  tasks_by_package=NULL;
+  tasks_by_package.clear();
+  task_names.clear();
 }
@@ -8,6 +8,8 @@
 #include <map>
 #include <apt-pkg/pkgcache.h>
 
+#include "symbol_table.h"
+
 /** \brief Handles parsing the list of tasks and getting the task of a given
  *  package.
  * 
@@ -16,6 +18,14 @@
 
 class OpProgress;
 
+namespace aptitude
+{
+  namespace apt
+  {
+    class record_scanner;
+  }
+}
+
 class task
 {
 private:
@@ -42,14 +52,24 @@ public:
 
 /** \brief Get the set of tasks associated with the given package.
  *
- *  The caller should not delete this set; it's managed internally by
- *  the tasks module.
+ *  The tasks are IDs in get_task_names().  The set is empty until the
+ *  package records have been scanned, and is invalidated by the next
+ *  scan or by reset_tasks().
  */
-std::set<std::string> *get_tasks(const pkgCache::PkgIterator &pkg);
+aptitude::apt::symbol_set get_tasks(const pkgCache::PkgIterator &pkg);
+
+/** \brief Get the names of the tasks returned by get_tasks(). */
+const aptitude::apt::symbol_table &get_task_names();
 
 // Stores the various tasks.
 extern std::map<std::string, task> *task_list;
 
+/** \brief Set up the table of tasks by package and ask the given
+ *  scanner to fill it in; get_tasks() returns the tasks of a package
+ *  once the scanner has run.
+ */
+void scan_tasks(aptitude::apt::record_scanner &scanner);
+
 // (re)loads in the current list of available tasks.  Necessary after a
 // cache reload, for obvious reasons.  apt_reload_cache will call this.
 void load_tasks(OpProgress &progress);
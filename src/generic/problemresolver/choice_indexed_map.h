@@ -246,6 +246,14 @@ public:
       }
   }
 
+  /** \brief Remove all the bindings from this map. */
+  void clear()
+  {
+    install_version_objects = imm::map<version, version_info>();
+    break_dep_objects = imm::map<dep, ValueType>();
+    curr_size = 0;
+  }
+
   /** \brief Dump this map to a stream, if ValueType supports
    *  operator<<.
    */
@@ -27,6 +27,8 @@
 
 #include <iostream>
 
+#include <limits.h>
+
 #include <generic/util/compare3.h>
 
 template<typename PackageUniverse> class generic_choice_set;
@@ -61,6 +63,15 @@ std::ostream &operator<<(std::ostream &out, const generic_choice_set<PackageUniv
  *  first set is contained by a choice in the second set.  This class
  *  uses its knowledge of the structure of choices to accelerate that
  *  test.
+ *
+ *  Alongside the trees, each set keeps two machine words that are
+ *  updated as choices are added and removed: a signature with one
+ *  bit for each package ID (or dependency, for break_soft_dep
+ *  choices) that occurs in the set, and an order-independent hash of
+ *  its contents.  The signature lets containment tests reject most
+ *  non-matching sets with a single mask operation before walking any
+ *  trees; the hash makes hashing a set O(1) and lets comparisons of
+ *  unequal sets fail without walking the trees.
  */
 template<typename PackageUniverse>
 class generic_choice_set
@@ -149,6 +160,75 @@ private:
   // would be more efficient or not.
   imm::set<choice> not_install_version_choices;
 
+  // A bitmask with signature_bit(c) set for each choice c in this
+  // set.  Two choices can only contain one another if they have the
+  // same signature bit, so if this set contains another set, every
+  // bit in the other set's signature is set here.
+  std::size_t signature;
+
+  // The sum of element_hash(c) over each choice c in this set.
+  std::size_t hash;
+
+  static std::size_t signature_bit(const choice &c)
+  {
+    const std::size_t num_bits = sizeof(std::size_t) * CHAR_BIT;
+    std::size_t key;
+
+    switch(c.get_type())
+      {
+      case choice::install_version:
+	key = c.get_ver().get_package().get_id();
+	break;
+
+      default:
+	key = hash_value(c.get_dep());
+	break;
+      }
+
+    return static_cast<std::size_t>(1) << (key % num_bits);
+  }
+
+  static std::size_t element_hash(const choice &c)
+  {
+    // Scramble the choice's hash a bit so that summing the hashes of
+    // similar choices doesn't produce lots of collisions.
+    std::size_t h = hash_value(c);
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    return h;
+  }
+
+  void add_to_summary(const choice &c)
+  {
+    signature |= signature_bit(c);
+    hash += element_hash(c);
+  }
+
+  struct accumulate_signature
+  {
+    std::size_t &signature;
+
+    accumulate_signature(std::size_t &_signature)
+      : signature(_signature)
+    {
+    }
+
+    bool operator()(const choice &c) const
+    {
+      signature |= signature_bit(c);
+      return true;
+    }
+  };
+
+  // Called after removing a choice: other choices might share its
+  // signature bit, so the signature has to be rebuilt from scratch.
+  void rebuild_signature()
+  {
+    signature = 0;
+    for_each(accumulate_signature(signature));
+  }
+
 
   friend std::ostream &operator<< <PackageUniverse>(std::ostream &out, const generic_choice_set<PackageUniverse> &choices);
 
@@ -215,16 +295,24 @@ private:
 	      parent.install_version_choices.lookup(p);
 
 	    if(!n.isValid())
-	      parent.install_version_choices.put(p, c);
+	      {
+		parent.install_version_choices.put(p, c);
+		parent.add_to_summary(c);
+	      }
 	    else
 	      {
 		std::pair<package, choice> existing_choice_pair(n.getVal());
 		choice &existing_choice(existing_choice_pair.second);
 
 		if(existing_choice.contains(c))
-		  // Override the existing choice with the new one,
-		  // which is more specific.
-		  parent.install_version_choices.put(p, c);
+		  {
+		    // Override the existing choice with the new one,
+		    // which is more specific.  It has the same
+		    // package, so the signature doesn't change.
+		    parent.install_version_choices.put(p, c);
+		    parent.hash -= element_hash(existing_choice);
+		    parent.hash += element_hash(c);
+		  }
 		else if(c.contains(existing_choice))
 		  ; // c is more general than the existing choice.
 		else
@@ -236,7 +324,8 @@ private:
 	  break;
 
 	default:
-	  parent.not_install_version_choices.insert(c);
+	  if(parent.not_install_version_choices.insert(c))
+	    parent.add_to_summary(c);
 	  break;
 	}
 
@@ -292,14 +381,19 @@ private:
   };
 
   generic_choice_set(const imm::map<package, choice> &_install_version_choices,
-		     const imm::set<choice> &_not_install_version_choices)
+		     const imm::set<choice> &_not_install_version_choices,
+		     std::size_t _signature,
+		     std::size_t _hash)
     : install_version_choices(_install_version_choices),
-      not_install_version_choices(_not_install_version_choices)
+      not_install_version_choices(_not_install_version_choices),
+      signature(_signature),
+      hash(_hash)
   {
   }
 
 public:
   generic_choice_set()
+    : signature(0), hash(0)
   {
   }
 
@@ -365,13 +459,31 @@ public:
     switch(c.get_type())
       {
       case choice::install_version:
-	install_version_choices.erase(c.get_ver().get_package());
+	{
+	  typename imm::map<package, choice>::node n =
+	    install_version_choices.lookup(c.get_ver().get_package());
+	  if(!n.isValid())
+	    return;
+
+	  hash -= element_hash(n.getVal().second);
+	  install_version_choices.erase(c.get_ver().get_package());
+	}
 	break;
 
       default:
-	not_install_version_choices.erase(c);
+	{
+	  typename imm::set<choice>::node
+	    found = not_install_version_choices.find_node(c);
+	  if(!found.isValid())
+	    return;
+
+	  hash -= element_hash(found.getVal());
+	  not_install_version_choices.erase(c);
+	}
 	break;
       }
+
+    rebuild_signature();
   }
 
   /** \brief If a choice in this set contains c, store it in
@@ -482,9 +594,20 @@ public:
     return install_version_choices.size() + not_install_version_choices.size();
   }
 
+  /** \brief Retrieve a hash of the contents of this set.
+   *
+   *  The hash is maintained as the set is modified, so this is a
+   *  constant-time operation.
+   */
+  std::size_t get_hash_value() const
+  {
+    return hash;
+  }
+
   bool operator==(const generic_choice_set &other) const
   {
     return
+      hash == other.hash &&
       install_version_choices == other.install_version_choices &&
       not_install_version_choices == other.not_install_version_choices;
   }
@@ -517,6 +640,9 @@ public:
   {
     const choice_contains f;
 
+    if((other.signature & ~signature) != 0)
+      return false;
+
     return
       install_version_choices.is_supermap_of_under(other.install_version_choices, f) &&
       not_install_version_choices.contains(other.not_install_version_choices, f);
@@ -529,6 +655,9 @@ public:
   {
     const choice_is_contained_in f;
 
+    if((other.signature & ~signature) != 0)
+      return false;
+
     return
       install_version_choices.is_supermap_of_under(other.install_version_choices, f) &&
       not_install_version_choices.contains(other.not_install_version_choices, f);
@@ -553,7 +682,9 @@ public:
   generic_choice_set clone() const
   {
     return generic_choice_set(install_version_choices.clone(),
-			      not_install_version_choices.clone());
+			      not_install_version_choices.clone(),
+			      signature,
+			      hash);
   }
 
   /** \brief Retrieve the version, if any, that was chosen for the
@@ -580,6 +711,12 @@ public:
   }
 };
 
+template<typename PackageUniverse>
+std::size_t hash_value(const generic_choice_set<PackageUniverse> &choices)
+{
+  return choices.get_hash_value();
+}
+
 template<typename PackageUniverse>
 std::ostream &operator<<(std::ostream &out, const generic_choice_set<PackageUniverse> &choices)
 {
@@ -70,6 +70,8 @@ cost::cost_impl::cost_impl(const cost_impl &cost1, const cost_impl &cost2, combi
     actions.insert(actions.end(), it1, cost1.actions.end());
   else if(it2 != cost2.actions.end())
     actions.insert(actions.end(), it2, cost2.actions.end());
+
+  init_hash();
 }
 
 bool cost::cost_impl::is_above_or_equal(const cost_impl &other) const
@@ -203,6 +205,8 @@ cost::cost_impl::cost_impl(const cost_impl &cost1, const cost_impl &cost2, upper
   else if(it2 != end2)
     actions.insert(actions.end(),
 		   it2, end2);
+
+  init_hash();
 }
 
 cost::cost_impl::cost_impl(const cost_impl &cost1, const cost_impl &cost2, lower_bound_tag)
@@ -233,6 +237,8 @@ cost::cost_impl::cost_impl(const cost_impl &cost1, const cost_impl &cost2, lower
 	  ++it2;
 	}
     }
+
+  init_hash();
 }
 
 level cost::cost_impl::get_user_level(level_index idx) const
@@ -248,16 +254,36 @@ level cost::cost_impl::get_user_level(level_index idx) const
   return level();
 }
 
+const cost::cost_impl_flyweight &cost::get_minimum_impl()
+{
+  static const cost_impl_flyweight minimum((cost_impl()));
+
+  return minimum;
+}
+
 cost cost::least_upper_bound(const cost &cost1,
                              const cost &cost2)
 {
-  return cost(cost1, cost2, upper_bound_tag());
+  if(cost1.absorbs(cost2))
+    return cost1;
+  else if(cost2.absorbs(cost1))
+    return cost2;
+  else
+    return cost(cost1, cost2, upper_bound_tag());
 }
 
 cost cost::greatest_lower_bound(const cost &cost1,
                                 const cost &cost2)
 {
-  return cost(cost1, cost2, lower_bound_tag());
+  // If one cost only raises the structural level, and not above the
+  // other cost's structural level, it is the lower bound: the result
+  // keeps only the user levels that both costs modify.
+  if(cost2.absorbs(cost1))
+    return cost1;
+  else if(cost1.absorbs(cost2))
+    return cost2;
+  else
+    return cost(cost1, cost2, lower_bound_tag());
 }
 
 std::size_t hash_value(const cost &cost)
@@ -290,8 +290,7 @@ class cost
   class upper_bound_tag { };
 
   // \todo Should have an abstracted "key"" that covers the 3 ways of
-  // instantiating this object.  Also, should cache the hash value to
-  // avoid recomputing it over and over.
+  // instantiating this object.
   class cost_impl
   {
     typedef std::vector<level>::size_type level_index;
@@ -310,11 +309,25 @@ class cost
     // This vector is always sorted, and level numbers are unique.
     std::vector<std::pair<level_index, level> > actions;
 
+    // The hash of this cost, computed once when it's created: the
+    // flyweight factory hashes every cost that passes through it,
+    // and costs are created constantly during a search.
+    std::size_t hash;
+
+    void init_hash()
+    {
+      hash = 0;
+
+      boost::hash_combine(hash, structural_level);
+      boost::hash_combine(hash, actions);
+    }
+
   public:
     /** \brief Create a blank cost. */
     cost_impl()
       : structural_level(INT_MIN)
     {
+      init_hash();
     }
 
     /** \brief Create a cost in which only the structural level is
@@ -323,6 +336,7 @@ class cost
     explicit cost_impl(int _structural_level)
       : structural_level(_structural_level)
     {
+      init_hash();
     }
 
     /** \brief Create a cost in which a single non-structural level is
@@ -342,6 +356,7 @@ class cost
 	throw std::out_of_range("User level indices must be non-negative.");
 
       actions.push_back(std::make_pair(index, l));
+      init_hash();
     }
 
     /** \brief Create a cost that combines two other costs. */
@@ -372,12 +387,7 @@ class cost
      */
     std::size_t get_hash_value() const
     {
-      std::size_t rval = 0;
-
-      boost::hash_combine(rval, structural_level);
-      boost::hash_combine(rval, actions);
-
-      return rval;
+      return hash;
     }
 
     int get_structural_level() const
@@ -392,6 +402,11 @@ class cost
       return !actions.empty();
     }
 
+    const std::vector<std::pair<level_index, level> > &get_user_levels() const
+    {
+      return actions;
+    }
+
     /** \brief Test two costs for equality.
      *
      *  \note Relies on the fact that the level's equality comparison
@@ -400,6 +415,7 @@ class cost
     bool operator==(const cost_impl &other) const
     {
       return
+	hash == other.hash &&
 	structural_level == other.structural_level &&
 	actions == other.actions;
     }
@@ -429,6 +445,32 @@ class cost
 
   const cost_impl &get_impl() const { return impl_flyweight.get(); }
 
+  /** \brief Return the interned minimum cost.
+   *
+   *  Default-constructed costs are extremely common, so they copy
+   *  this handle instead of looking the minimum cost up in the
+   *  flyweight table every time.
+   */
+  static const cost_impl_flyweight &get_minimum_impl();
+
+  /** \brief Return \b true if combining this cost with other, either
+   *  with operator+ or with least_upper_bound(), produces this cost.
+   *
+   *  This holds whenever other only raises the structural level, and
+   *  not above this cost's structural level; the minimum cost is the
+   *  most common example.  Such combinations are very frequent while
+   *  searching, and recognizing them lets the result be returned
+   *  without building a new cost and interning it.
+   */
+  bool absorbs(const cost &other) const
+  {
+    const cost_impl &this_impl(get_impl()), &other_impl(other.get_impl());
+
+    return
+      !other_impl.get_has_user_levels() &&
+      other_impl.get_structural_level() <= this_impl.get_structural_level();
+  }
+
   /** \brief Create a cost in which only the structural level is set.
    */
   explicit cost(int structural_level)
@@ -478,7 +520,7 @@ public:
    *  operator+.
    */
   cost()
-    : impl_flyweight(cost_impl())
+    : impl_flyweight(get_minimum_impl())
   {
   }
 
@@ -553,7 +595,12 @@ public:
    */
   cost operator+(const cost &other) const
   {
-    return cost(*this, other);
+    if(absorbs(other))
+      return *this;
+    else if(other.absorbs(*this))
+      return other;
+    else
+      return cost(*this, other);
   }
 
   /** \brief Test whether two costs have the same level values. */
@@ -597,6 +644,14 @@ public:
     return get_impl().get_has_user_levels();
   }
 
+  /** \brief Get the user levels that are modified by this cost, as
+   *  (index, level) pairs sorted by index.
+   */
+  const std::vector<std::pair<std::vector<level>::size_type, level> > &get_user_levels() const
+  {
+    return get_impl().get_user_levels();
+  }
+
   std::size_t get_hash_value() const
   {
     return get_impl().get_hash_value();
@@ -612,13 +667,12 @@ public:
    */
   int compare(const cost &other) const
   {
-    const cost_impl &this_cost = get_impl(), &other_cost = other.get_impl();
-
-    // Rely on equality of flyweights being fast.
-    if(this_cost == other_cost)
+    // Rely on equality of flyweights being fast: interned costs are
+    // equal exactly when they are the same object.
+    if(impl_flyweight == other.impl_flyweight)
       return 0;
     else
-      return this_cost.compare(other_cost);
+      return get_impl().compare(other.get_impl());
   }
 };
 
@@ -26,6 +26,7 @@
 
 #include <generic/util/compare3.h>
 #include <generic/util/refcounted_base.h>
+#include <generic/util/small_object_pool.h>
 
 #include <algorithm>
 #include <set>
@@ -210,6 +211,23 @@ protected:
   }
 
 public:
+  /** \brief Expressions are small and the resolver builds a great
+   *  many of them, so they are drawn from a pool instead of the
+   *  general-purpose heap.
+   *
+   *  Because the destructor is virtual, the size passed to operator
+   *  delete is the size of the most-derived class.
+   */
+  static void *operator new(std::size_t size)
+  {
+    return aptitude::util::small_object_pool::allocate(size);
+  }
+
+  static void operator delete(void *p, std::size_t size)
+  {
+    aptitude::util::small_object_pool::deallocate(p, size);
+  }
+
   virtual ~expression()
   {
     for(typename std::set<expression_weak_ref_generic *>::const_iterator it =
@@ -57,6 +57,7 @@
 #include "solution.h"
 #include "resolver_undo.h"
 #include "search_graph.h"
+#include "step_queue.h"
 #include "cost.h"
 #include "cost_limits.h"
 
@@ -65,6 +66,8 @@
 
 #include <generic/util/dense_setset.h>
 #include <generic/util/maybe.h>
+#include <generic/util/profile.h>
+#include <generic/util/small_object_pool.h>
 
 #include <boost/flyweight.hpp>
 #include <boost/make_shared.hpp>
@@ -518,6 +521,7 @@ public:
   typedef generic_promotion<PackageUniverse> promotion;
   typedef generic_promotion_set<PackageUniverse> promotion_set;
   typedef generic_search_graph<PackageUniverse> search_graph;
+  typedef generic_step_queue<PackageUniverse> step_queue;
   typedef generic_compare_choices_by_effects<PackageUniverse> compare_choices_by_effects;
   typedef generic_promotion_queue_entry<PackageUniverse> promotion_queue_entry;
 
@@ -535,6 +539,28 @@ public:
      */
     size_t promotions;
 
+    /** \brief The number of steps in the search graph. */
+    size_t steps;
+
+    /** \brief The number of steps that have been taken out of the
+     *  queue and examined since the resolver was created.
+     */
+    size_t processed;
+
+    /** \brief The number of bytes occupied by the steps themselves,
+     *  not counting the sets and lists that they point to.
+     */
+    size_t step_bytes;
+
+    /** \brief The number of bytes reserved by the pool that tree
+     *  nodes and expressions are allocated from.
+     *
+     *  The pool is shared by all the resolvers in the process, and it
+     *  never shrinks, so this is a high-water mark rather than the
+     *  amount of memory that this search is using.
+     */
+    size_t pool_bytes;
+
     /** \b true if the resolver has finished searching for solutions.
      *  If open is empty, this member distinguishes between the start
      *  and the end of a search.
@@ -547,6 +573,7 @@ public:
 
     queue_counts()
       : open(0), closed(0), deferred(0), conflicts(0), promotions(0),
+	steps(0), processed(0), step_bytes(0), pool_bytes(0),
 	finished(false),
 	current_cost(cost_limits::minimum_cost)
     {
@@ -571,44 +598,6 @@ private:
 
   typedef ExtractPackageId PackageHash;
 
-  /** Compares steps according to their "goodness": their effective
-   *  cost, then thier score, then their contents.
-   *
-   *  The comparisons are reversed, so better solutions compare
-   *  "below" worse ones.
-   */
-  struct step_goodness_compare
-  {
-    const search_graph &graph;
-
-    step_goodness_compare(const search_graph &_graph)
-      : graph(_graph)
-    {
-    }
-
-    bool operator()(int step_num1, int step_num2) const
-    {
-      // Optimization: a step always equals itself.
-      if(step_num1 == step_num2)
-	return false;
-
-      const step &step1(graph.get_step(step_num1));
-      const step &step2(graph.get_step(step_num2));
-
-      // Note that *lower* costs come "before" higher costs, hence the
-      // reversed comparison there.
-      int cost_cmp = step1.final_step_cost.compare(step2.final_step_cost);
-      if(cost_cmp != 0)
-	return cost_cmp < 0;
-      else if(step2.score < step1.score)
-	return true;
-      else if(step1.score < step2.score)
-	return false;
-      else
-	return step2.actions < step1.actions;
-    }
-  };
-
   /** \brief Represents the "essential" information about a step.
    *
    *  This information consists of the step's scores and its actions.
@@ -631,28 +620,12 @@ private:
     choice_set actions;
     std::size_t hash;
 
-    struct combine_hashes
-    {
-      std::size_t &hash;
-
-      combine_hashes(std::size_t &_hash)
-	: hash(_hash)
-      {
-      }
-
-      bool operator()(const choice &c) const
-      {
-	boost::hash_combine(hash, c);
-	return true;
-      }
-    };
-
     void init_hash()
     {
       hash = 0;
       boost::hash_combine(hash, score);
       boost::hash_combine(hash, action_score);
-      actions.for_each(combine_hashes(hash));
+      boost::hash_combine(hash, actions.get_hash_value());
     }
 
   public:
@@ -790,6 +763,11 @@ private:
   /** If \b true, we have exhausted the list of solutions. */
   bool finished:1;
 
+  /** The total number of steps that find_next_solution() has
+   *  examined.
+   */
+  size_t num_steps_processed;
+
 
   // Multithreading support variables.
   //
@@ -828,7 +806,7 @@ private:
    *
    *  Steps are sorted by cost, then by score, then by their contents.
    */
-  std::set<int, step_goodness_compare> pending;
+  step_queue pending;
 
   /** \brief Counts how many steps are deferred. */
   int num_deferred;
@@ -839,7 +817,7 @@ private:
    *  The main reason this is persistent at the moment is so we don't
    *  lose solutions if find_next_solution() throws an exception.
    */
-  std::set<int, step_goodness_compare> pending_future_solutions;
+  step_queue pending_future_solutions;
 
   /** \brief Stores already-seen search nodes that had their
    *  successors generated.
@@ -1427,8 +1405,8 @@ private:
     LOG_TRACE(logger, "Setting the final cost of step " << step_num
 	      << " to " << new_final_step_cost);
 
-    bool was_in_pending =  (pending.erase(step_num) > 0);
-    bool was_in_pending_future_solutions =  (pending_future_solutions.erase(step_num) > 0);
+    bool was_in_pending = pending.contains(step_num);
+    bool was_in_pending_future_solutions = pending_future_solutions.contains(step_num);
 
 
     if(is_defer_cost(s.final_step_cost))
@@ -1443,9 +1421,9 @@ private:
 
 
     if(was_in_pending)
-      pending.insert(step_num);
+      pending.update(step_num);
     if(was_in_pending_future_solutions)
-      pending_future_solutions.insert(step_num);
+      pending_future_solutions.update(step_num);
 
 
     if(is_defer_cost(s.final_step_cost))
@@ -3724,6 +3702,227 @@ private:
     bestDepSolvers.for_each_solver(generate_successor_f);
   }
 
+  /** \brief Record a dependency that was found to be broken in the
+   *  initial state.
+   *
+   *  \param d             The broken dependency.
+   *  \param consistent    \b true if d is also broken when no actions
+   *                       are applied to the initial state.
+   */
+  void add_initial_broken(const dep &d, bool consistent)
+  {
+    if(!consistent)
+      LOG_ERROR(logger, "Internal error: the dependency "
+		<< d << " is claimed to be broken, but it doesn't appear to be broken in the initial state.");
+    else
+      {
+	LOG_INFO(logger, "Initially broken dependency: " << d);
+	initial_broken.insert(d);
+      }
+  }
+
+  /** \brief Add d to or remove it from the set of initially broken
+   *  dependencies, depending on whether it is broken in the initial
+   *  state now.
+   */
+  void update_initial_broken_dep(const dep &d)
+  {
+    if(universe.is_candidate_for_initial_set(d) &&
+       d.broken_under(initial_state))
+      {
+	if(!initial_broken.contains(d))
+	  {
+	    LOG_INFO(logger, "Initially broken dependency: " << d);
+	    initial_broken.insert(d);
+	  }
+      }
+    else if(initial_broken.erase(d))
+      LOG_INFO(logger, "No longer initially broken: " << d);
+  }
+
+  /** \brief Find all the dependencies that are broken in the initial
+   *  state, one at a time.
+   */
+  void find_initial_broken_serial()
+  {
+    // Used for sanity-checking below.
+    choice_set empty_choice_set;
+    choice_set_installation empty_step(empty_choice_set,
+				       initial_state);
+
+    for(typename PackageUniverse::dep_iterator di = universe.deps_begin();
+	!di.end(); ++di)
+      {
+	dep d(*di);
+
+	if(!universe.is_candidate_for_initial_set(d))
+	  {
+	    // This test is slow and only used for logging:
+	    if(logger->isEnabledFor(logging::TRACE_LEVEL))
+	      {
+		if(!d.broken_under(initial_state))
+		  LOG_TRACE(logger, "Not using " << d
+			    << " as an initially broken dependency because it is flagged as a dependency that shouldn't be in the initial set.");
+	      }
+	  }
+	else if(d.broken_under(initial_state))
+	  add_initial_broken(d, d.broken_under(empty_step));
+      }
+  }
+
+  /** \brief The output of a single initial_broken_scanner. */
+  struct initial_broken_scan_result
+  {
+    /** \brief Each broken dependency, paired with \b true if it is
+     *  also broken when no actions are applied.
+     */
+    std::vector<std::pair<dep, bool> > broken;
+
+    /** \brief Set to \b true if the scan threw an exception. */
+    bool failed;
+
+    initial_broken_scan_result()
+      : failed(false)
+    {
+    }
+  };
+
+  /** \brief Scans a contiguous range of packages for dependencies
+   *  that are broken in the initial state.
+   *
+   *  Scanners only read the universe and the initial state, so
+   *  several of them can run at once on disjoint ranges.  Each one
+   *  writes to its own result object, which is merged by the thread
+   *  that started it.
+   */
+  class initial_broken_scanner
+  {
+    const generic_problem_resolver &r;
+    typename std::vector<package>::const_iterator begin, end;
+    initial_broken_scan_result &result;
+
+  public:
+    initial_broken_scanner(const generic_problem_resolver &_r,
+			   typename std::vector<package>::const_iterator _begin,
+			   typename std::vector<package>::const_iterator _end,
+			   initial_broken_scan_result &_result)
+      : r(_r), begin(_begin), end(_end), result(_result)
+    {
+    }
+
+    void operator()() const
+    {
+      try
+	{
+	  choice_set empty_choice_set;
+	  choice_set_installation empty_step(empty_choice_set,
+					     r.initial_state);
+
+	  for(typename std::vector<package>::const_iterator it = begin;
+	      it != end; ++it)
+	    for(typename package::version_iterator vi = it->versions_begin();
+		!vi.end(); ++vi)
+	      for(typename version::dep_iterator di = (*vi).deps_begin();
+		  !di.end(); ++di)
+		{
+		  dep d(*di);
+
+		  if(r.universe.is_candidate_for_initial_set(d) &&
+		     d.broken_under(r.initial_state))
+		    result.broken.push_back(std::make_pair(d, d.broken_under(empty_step)));
+		}
+	}
+      catch(cwidget::util::Exception &)
+	{
+	  result.failed = true;
+	}
+      catch(std::exception &)
+	{
+	  result.failed = true;
+	}
+    }
+  };
+
+  /** \brief Find all the dependencies that are broken in the initial
+   *  state by splitting the package list between several threads.
+   *
+   *  The results are merged in package order, so the set of broken
+   *  dependencies and the order in which they are logged match the
+   *  serial scan.
+   *
+   *  \return \b false if the scan could not be completed; the caller
+   *  should fall back to find_initial_broken_serial().
+   */
+  bool find_initial_broken_parallel(int num_threads)
+  {
+    std::vector<package> packages;
+    packages.reserve(universe.get_package_count());
+    for(typename PackageUniverse::package_iterator pi = universe.packages_begin();
+	!pi.end(); ++pi)
+      packages.push_back(*pi);
+
+    if(packages.empty())
+      return false;
+
+    const std::size_t num_slices =
+      std::min<std::size_t>(num_threads, packages.size());
+    const std::size_t slice_size =
+      (packages.size() + num_slices - 1) / num_slices;
+
+    LOG_DEBUG(logger, "Scanning " << packages.size()
+	      << " packages for broken dependencies in "
+	      << num_slices << " threads.");
+
+    std::vector<initial_broken_scan_result> results(num_slices);
+    bool all_started = true;
+
+    {
+      std::vector<boost::shared_ptr<cwidget::threads::thread> > threads;
+      try
+	{
+	  for(std::size_t i = 0; i < num_slices; ++i)
+	    {
+	      const std::size_t first = std::min(i * slice_size, packages.size());
+	      const std::size_t last = std::min(first + slice_size, packages.size());
+
+	      initial_broken_scanner
+		scanner(*this,
+			packages.begin() + first,
+			packages.begin() + last,
+			results[i]);
+	      threads.push_back(boost::make_shared<cwidget::threads::thread>(scanner));
+	    }
+	}
+      catch(cwidget::threads::ThreadCreateException &)
+	{
+	  LOG_WARN(logger, "Unable to start a thread to scan for broken dependencies; falling back to a serial scan.");
+	  all_started = false;
+	}
+
+      for(typename std::vector<boost::shared_ptr<cwidget::threads::thread> >::const_iterator
+	    it = threads.begin(); it != threads.end(); ++it)
+	(*it)->join();
+    }
+
+    if(!all_started)
+      return false;
+
+    for(std::size_t i = 0; i < num_slices; ++i)
+      if(results[i].failed)
+	{
+	  LOG_WARN(logger, "The parallel scan for broken dependencies failed; falling back to a serial scan.");
+	  return false;
+	}
+
+    for(typename std::vector<initial_broken_scan_result>::const_iterator
+	  it = results.begin(); it != results.end(); ++it)
+      for(typename std::vector<std::pair<dep, bool> >::const_iterator
+	    dIt = it->broken.begin(); dIt != it->broken.end(); ++dIt)
+	add_initial_broken(dIt->first, dIt->second);
+
+    return true;
+  }
+
   void do_log(const char *sourceName,
               int sourceLine,
               logging::log_level level,
@@ -3752,6 +3951,8 @@ public:
    *                          of the initial state (empty to just
    *                          use default versions for everything).
    *  \param _universe the universe in which we are working.
+   *  \param _threads  The number of threads to use when scanning the
+   *                   universe for initially broken dependencies.
    */
   generic_problem_resolver(int _step_score, int _broken_score,
 			   int _unfixed_soft_score,
@@ -3760,7 +3961,8 @@ public:
                            const cost &_unfixed_soft_cost,
 			   int _future_horizon,
 			   const imm::map<package, version> &_initial_state,
-			   const PackageUniverse &_universe)
+			   const PackageUniverse &_universe,
+			   int _threads = 1)
     :logger(aptitude::Loggers::getAptitudeResolverSearch()),
      debug(false),
      graph(promotions),
@@ -3771,11 +3973,11 @@ public:
      unfixed_soft_cost(_unfixed_soft_cost),
      minimum_score(-infinity),
      future_horizon(_future_horizon),
-     universe(_universe), finished(false),
+     universe(_universe), finished(false), num_steps_processed(0),
      solver_executing(false), solver_cancelled(false),
-     pending(step_goodness_compare(graph)),
+     pending(graph),
      num_deferred(0),
-     pending_future_solutions(step_goodness_compare(graph)),
+     pending_future_solutions(graph),
      closed(),
      promotions(_universe, *this),
      promotion_queue_tail(new promotion_queue_entry(0, 0)),
@@ -3789,41 +3991,14 @@ public:
 	      << ", infinity = " << infinity
 	      << ", full_solution_score = " << _full_solution_score
 	      << ", future_horizon = " << _future_horizon
-	      << ", initial_state = " << _initial_state);
-
-    // Used for sanity-checking below.
-    choice_set empty_choice_set;
-    choice_set_installation empty_step(empty_choice_set,
-				       initial_state);
-
-    // Find all the broken deps.
-    for(typename PackageUniverse::dep_iterator di = universe.deps_begin();
-	!di.end(); ++di)
-      {
-	dep d(*di);
-
-	if(!universe.is_candidate_for_initial_set(d))
-	  {
-	    // This test is slow and only used for logging:
-	    if(logger->isEnabledFor(logging::TRACE_LEVEL))
-	      {
-		if(!d.broken_under(initial_state))
-		  LOG_TRACE(logger, "Not using " << d
-			    << " as an initially broken dependency because it is flagged as a dependency that shouldn't be in the initial set.");
-	      }
-	  }
-	else if(d.broken_under(initial_state))
-	  {
-	    if(!d.broken_under(empty_step))
-	      LOG_ERROR(logger, "Internal error: the dependency "
-			<< d << " is claimed to be broken, but it doesn't appear to be broken in the initial state.");
-	    else
-	      {
-		LOG_INFO(logger, "Initially broken dependency: " << d);
-		initial_broken.insert(d);
-	      }
-	  }
-      }
+	      << ", initial_state = " << _initial_state
+	      << ", threads = " << _threads);
+
+    // The parallel scan can't reproduce the per-dependency trace
+    // messages of the serial one, so don't use it while tracing.
+    if(_threads <= 1 || logger->isEnabledFor(logging::TRACE_LEVEL) ||
+       !find_initial_broken_parallel(_threads))
+      find_initial_broken_serial();
   }
 
   ~generic_problem_resolver()
@@ -3889,6 +4064,89 @@ public:
       weights.version_scores[i]=0;
   }
 
+  /** \brief Prepare the resolver to search again after the initial
+   *  versions of some packages changed.
+   *
+   *  Throws away the search, the joint scores and the user's
+   *  constraints (rejections, mandates and hardened or approved
+   *  dependencies), as if the resolver had just been created.  Unlike
+   *  reset(), version scores and costs are kept; the caller is
+   *  responsible for updating the ones that depend on the initial
+   *  state, re-adding the joint scores, and calling
+   *  update_initial_broken().
+   *
+   *  Must not be invoked while the resolver is running.
+   *
+   *  \param keep_conflicts  If \b true, promotions that mark a set of
+   *                         choices as a conflict and don't depend on
+   *                         the user's constraints are kept; these
+   *                         follow from the dependencies alone.  All
+   *                         other promotions are discarded.
+   */
+  void restart(bool keep_conflicts)
+  {
+    finished = false;
+    pending.clear();
+    pending_future_solutions.clear();
+    num_deferred = 0;
+    promotion_queue_tail = boost::make_shared<promotion_queue_entry>(0, 0);
+    graph.clear();
+    closed.clear();
+
+    std::vector<promotion> kept_promotions;
+    if(keep_conflicts)
+      {
+	std::vector<promotion> unconditional_promotions;
+	get_unconditional_promotions(unconditional_promotions);
+
+	for(typename std::vector<promotion>::const_iterator it = unconditional_promotions.begin();
+	    it != unconditional_promotions.end(); ++it)
+	  {
+	    if(it->get_cost().get_structural_level() == cost_limits::conflict_structural_level)
+	      kept_promotions.push_back(*it);
+	  }
+      }
+
+    LOG_DEBUG(logger, "Restarting the resolver, keeping " << kept_promotions.size()
+	      << " of " << promotions.size() << " promotions.");
+
+    promotions.clear();
+    user_approved_or_rejected_versions.clear();
+    user_approved_or_rejected_broken_deps.clear();
+    memoized_is_deferred.clear();
+    weights.clear_joint_scores();
+
+    for(typename std::vector<promotion>::const_iterator it = kept_promotions.begin();
+	it != kept_promotions.end(); ++it)
+      add_promotion(*it);
+  }
+
+  /** \brief Recompute which dependencies are broken in the initial
+   *  state after the initial versions of the given packages changed.
+   *
+   *  Only the dependencies of the packages' versions and the
+   *  dependencies that those versions could satisfy are examined;
+   *  nothing else can have changed.
+   */
+  void update_initial_broken(const std::vector<package> &changed_packages)
+  {
+    for(typename std::vector<package>::const_iterator it = changed_packages.begin();
+	it != changed_packages.end(); ++it)
+      for(typename package::version_iterator vi = it->versions_begin();
+	  !vi.end(); ++vi)
+	{
+	  const version v(*vi);
+
+	  for(typename version::dep_iterator di = v.deps_begin();
+	      !di.end(); ++di)
+	    update_initial_broken_dep(*di);
+
+	  for(typename version::revdep_iterator rdi = v.revdeps_begin();
+	      !rdi.end(); ++rdi)
+	    update_initial_broken_dep(*rdi);
+	}
+  }
+
   /** \return \b true if no solutions have been examined yet.
    *  This implies that it is safe to modify package scores.
    */
@@ -3925,6 +4183,38 @@ public:
     add_promotion(promotion(choices, promotion_cost));
   }
 
+  /** \brief Retrieve the promotions that do not depend on the
+   *  constraints that are currently in effect.
+   *
+   *  This skips promotions with a validity condition, promotions that
+   *  defer solutions until the user's constraints change, and
+   *  promotions that exist to avoid regenerating a solution.  The
+   *  remaining promotions hold for any resolver that is set up the
+   *  same way as this one, so they can be handed to add_promotion()
+   *  on a fresh resolver.
+   *
+   *  Must not be invoked while the resolver is running.
+   *
+   *  \param out  A vector to which the promotions will be appended.
+   */
+  void get_unconditional_promotions(std::vector<promotion> &out) const
+  {
+    for(typename promotion_set::const_iterator it = promotions.begin();
+	it != promotions.end(); ++it)
+      {
+	const promotion &p(*it);
+	const int structural_level = p.get_cost().get_structural_level();
+
+	if(p.get_valid_condition().valid())
+	  continue;
+	else if(structural_level != cost_limits::conflict_structural_level &&
+		structural_level >= cost_limits::defer_structural_level)
+	  continue;
+	else
+	  out.push_back(p);
+      }
+  }
+
   /** Tells the resolver how highly to value a particular package
    *  version.  All scores are relative, and a higher score will
    *  result in a bias towards that version appearing in the final
@@ -4213,6 +4503,10 @@ public:
     counts.deferred   = get_num_deferred();
     counts.conflicts  = promotions.conflicts_size();
     counts.promotions = promotions.size() - counts.conflicts;
+    counts.steps      = graph.get_num_steps();
+    counts.processed  = num_steps_processed;
+    counts.step_bytes = counts.steps * sizeof(step);
+    counts.pool_bytes = aptitude::util::small_object_pool::get_reserved_bytes();
     counts.finished   = finished;
     counts.current_cost = get_current_search_cost();
   }
@@ -4240,7 +4534,7 @@ public:
     if(pending.empty())
       return cost_limits::minimum_cost;
     else
-      return graph.get_step(*pending.begin()).final_step_cost;
+      return graph.get_step(pending.top()).final_step_cost;
   }
 
 private:
@@ -4252,7 +4546,7 @@ private:
     if(pending.empty())
       return false;
 
-    const step &s = graph.get_step(*pending.begin());
+    const step &s = graph.get_step(pending.top());
 
     return
       !is_discard_cost(s.final_step_cost) &&
@@ -4267,7 +4561,7 @@ private:
     if(pending_future_solutions.empty())
       return false;
 
-    const step &s = graph.get_step(*pending_future_solutions.begin());
+    const step &s = graph.get_step(pending_future_solutions.top());
 
     return
       !is_discard_cost(s.final_step_cost) &&
@@ -4599,6 +4893,9 @@ public:
     // be to always return the first "future" solution that we find.
     int most_future_solution_steps = 0;
 
+    // Reported as "resolver-steps" by --profile.
+    static aptitude::util::profile_counter steps_counter("resolver-steps", "find-next-solution");
+
     if(finished)
       throw NoMoreSolutions();
 
@@ -4646,10 +4943,12 @@ public:
 	update_counts_cache();
 
 
-	int curr_step_num = *pending.begin();
-	pending.erase(pending.begin());
+	int curr_step_num = pending.top();
+	pending.pop();
 
 	++odometer;
+	++num_steps_processed;
+	steps_counter.increment();
 
 	process_step(curr_step_num, visited_packages);
 
@@ -4684,7 +4983,7 @@ public:
 
     if(pending_future_solutions_contains_candidate())
       {
-	int best_future_solution = *pending_future_solutions.begin();
+	int best_future_solution = pending_future_solutions.top();
 	step &best_future_solution_step = graph.get_step(best_future_solution);
 	if(!is_defer_cost(best_future_solution_step.final_step_cost) &&
            !is_discard_cost(best_future_solution_step.final_step_cost))
@@ -4702,11 +5001,14 @@ public:
 		     << "; closed: " << closed.size()
 		     << "; promotions: " << promotions.size()
 		     << "; deferred: " << get_num_deferred());
+	    LOG_INFO(logger, " *** steps: " << graph.get_num_steps()
+		     << " (" << graph.get_num_steps() * sizeof(step) << " bytes)"
+		     << "; node pool: " << aptitude::util::small_object_pool::get_reserved_bytes() << " bytes");
 
 	    LOG_INFO(logger, "--- Returning the future solution "
 		     << rval << " from step " << best_future_solution);
 
-	    pending_future_solutions.erase(pending_future_solutions.begin());
+	    pending_future_solutions.pop();
 
 	    return rval;
 	  }
@@ -4730,6 +5032,9 @@ public:
 	     << "; closed: " << closed.size()
 	     << "; promotions: " << promotions.size()
 	     << "; deferred: " << get_num_deferred());
+    LOG_INFO(logger, " *** steps: " << graph.get_num_steps()
+	     << " (" << graph.get_num_steps() * sizeof(step) << " bytes)"
+	     << "; node pool: " << aptitude::util::small_object_pool::get_reserved_bytes() << " bytes");
 
     throw NoMoreSolutions();
   }
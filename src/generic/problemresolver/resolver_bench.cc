@@ -0,0 +1,880 @@
+// resolver_bench.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.  You should have
+//   received a copy of the GNU General Public License along with this
+//   program; see the file COPYING.  If not, write to the Free
+//   Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+//   MA 02111-1307, USA.
+//
+// Measures the problem resolver on a corpus of universes without
+// needing an apt cache.  Each file named on the command line holds a
+// universe in the format written by "aptitude dump-resolver"; a
+// captured system state can be turned into one with
+//
+//   APT_ROOT_DIR=tests/resolver_inputs/apt-needs-downgrade aptitude dump-resolver > apt-needs-downgrade.universe
+//
+// "--synthetic N" adds a randomly generated universe of N packages to
+// the corpus, starting from a consistent installed state in which
+// about "--broken K" dependencies (20 by default) are then broken;
+// the generator is seeded with "--seed", so the same arguments always
+// produce the same universe.
+//
+// For each universe, the resolver is run with the default weights of
+// aptitude until it has found "--solutions" solutions or used up
+// "--steps" steps on one of them, and the time to the first solution,
+// the number of steps examined per second, the number of promotions
+// that were learned and the peak memory use are printed.  Each
+// universe is loaded and solved in a child process, so the peak
+// memory use only covers that universe.  "--repeat N" solves each
+// universe N times and reports the fastest run, which makes the
+// timings less noisy.  If the resolver gives up on a universe without
+// finding a solution and without running out of steps, the run fails.
+//
+// "--save-baseline FILE" writes the results to FILE;
+// "--baseline FILE" compares the results against a file written
+// that way and fails if the search rate, the time to the first
+// solution or the memory use got worse by more than "--tolerance"
+// percent.
+
+#include "dummy_universe.h"
+#include "problemresolver.h"
+
+#include <loggers.h>
+
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// As in test.cc, define the loggers here instead of linking in a
+// higher-level library.
+logging::LoggerPtr aptitude::Loggers::getAptitudeResolver()
+{
+  return logging::Logger::getLogger("aptitude.resolver");
+}
+
+logging::LoggerPtr aptitude::Loggers::getAptitudeResolverSearch()
+{
+  return logging::Logger::getLogger("aptitude.resolver.search");
+}
+
+logging::LoggerPtr aptitude::Loggers::getAptitudeResolverSearchGraph()
+{
+  return logging::Logger::getLogger("aptitude.resolver.search.graph");
+}
+
+logging::LoggerPtr aptitude::Loggers::getAptitudeResolverSearchCosts()
+{
+  return logging::Logger::getLogger("aptitude.resolver.search.costs");
+}
+
+namespace
+{
+  /** \brief The settings that every universe is solved with. */
+  struct bench_settings
+  {
+    int max_steps;
+    int num_solutions;
+    int threads;
+    /** \brief How many times to solve each universe; the fastest
+     *  run is reported.
+     */
+    int repeat;
+
+    bench_settings()
+      : max_steps(5000), num_solutions(3), threads(1), repeat(1)
+    {
+    }
+  };
+
+  /** \brief The measurements taken on one universe. */
+  struct bench_result
+  {
+    /** \brief The time taken to create the resolver, including the
+     *  search for initially broken dependencies, in seconds.
+     */
+    double setup_time;
+
+    /** \brief The time taken to find the first solution, in seconds,
+     *  or a negative number if no solution was found.
+     */
+    double first_solution_time;
+
+    /** \brief The time taken by all the calls to find_next_solution(),
+     *  in seconds.
+     */
+    double search_time;
+
+    int solutions;
+    bool out_of_time;
+    size_t initial_broken;
+    size_t steps_processed;
+    size_t promotions;
+    size_t conflicts;
+    size_t graph_steps;
+    size_t pool_bytes;
+    long peak_rss_kb;
+
+    bench_result()
+      : setup_time(0), first_solution_time(-1), search_time(0),
+	solutions(0), out_of_time(false), initial_broken(0),
+	steps_processed(0), promotions(0), conflicts(0),
+	graph_steps(0), pool_bytes(0), peak_rss_kb(0)
+    {
+    }
+
+    double steps_per_second() const
+    {
+      return search_time > 0 ? steps_processed / search_time : 0;
+    }
+  };
+
+  /** \brief A small deterministic random number generator, so that
+   *  synthetic universes can be reproduced exactly.
+   */
+  class lcg
+  {
+    unsigned long state;
+
+  public:
+    lcg(unsigned long seed)
+      : state(seed)
+    {
+    }
+
+    /** \brief Return a number in [0, n). */
+    int next(int n)
+    {
+      // Each step only yields 15 good bits, so use two of them to
+      // cover large universes.
+      unsigned long r = 0;
+      for(int i = 0; i < 2; ++i)
+	{
+	  state = state * 1103515245UL + 12345UL;
+	  r = (r << 15) | ((state / 65536UL) % 32768UL);
+	}
+      return (int)(r % n);
+    }
+  };
+
+  double now()
+  {
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+  }
+
+  long peak_rss_kb()
+  {
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+      return 0;
+    return usage.ru_maxrss;
+  }
+
+  dummy_universe_ref read_universe(istream &f)
+  {
+    string s;
+
+    f >> ws >> s >> ws;
+    if(s != "UNIVERSE")
+      throw ParseError("Expected 'UNIVERSE', got " + s);
+
+    f >> s >> ws;
+    if(s != "[")
+      throw ParseError("Expected '[' following UNIVERSE, got " + s);
+
+    return parse_universe_tail(f);
+  }
+
+  /** \brief A dependency of a synthetic universe. */
+  struct synthetic_dep
+  {
+    int package;
+    int version;
+    bool is_conflict;
+    bool is_soft;
+    /** \brief The target package; the dependency names its versions
+     *  from first_target_version up to, but not including,
+     *  end_target_version.
+     */
+    int target;
+    int first_target_version;
+    int end_target_version;
+  };
+
+  bool is_broken(const synthetic_dep &dep, const vector<int> &current)
+  {
+    if(current[dep.package] != dep.version)
+      return false;
+
+    const int target_version = current[dep.target];
+    const bool names_target = target_version >= dep.first_target_version &&
+      target_version < dep.end_target_version;
+    return dep.is_conflict ? names_target : !names_target;
+  }
+
+  /** \brief Count the broken dependencies among the given ones. */
+  int count_broken(const vector<synthetic_dep> &deps,
+		   const vector<int> &indices,
+		   const vector<int> &current)
+  {
+    int rval = 0;
+    for(vector<int>::const_iterator it = indices.begin();
+	it != indices.end(); ++it)
+      if(is_broken(deps[*it], current))
+	++rval;
+    return rval;
+  }
+
+  /** \brief Generate a random universe of num_packages packages.
+   *
+   *  Like a package in apt, each package has a version "v0" that
+   *  stands for the package not being installed, plus between one
+   *  and three real versions.  Each real version has up to three
+   *  dependencies on packages close to it in the list, so the
+   *  universe consists of overlapping clusters of related packages
+   *  rather than one big tangle.  About one dependency in eight is a
+   *  conflict and one in five is soft.  Dependencies and conflicts
+   *  only name real versions, so every problem can be solved by
+   *  removing packages.
+   *
+   *  The installed state is made consistent first: a random version
+   *  of each package is picked, and packages with broken
+   *  dependencies are removed until nothing is broken.  Then
+   *  packages are switched to other versions, as if the user had
+   *  asked for it, until num_broken dependencies are broken (or no
+   *  more switches can be found that don't overshoot).  This gives
+   *  the resolver a problem of a realistic size no matter how big
+   *  the universe is.
+   *
+   *  The universe is written out in the dump-resolver format and
+   *  parsed back, so that it goes through the same code as a real
+   *  capture.
+   */
+  dummy_universe_ref make_synthetic_universe(int num_packages,
+					     int num_broken,
+					     unsigned long seed)
+  {
+    lcg rng(seed);
+    vector<int> num_versions(num_packages);
+    for(int i = 0; i < num_packages; ++i)
+      num_versions[i] = 2 + rng.next(3);
+
+    vector<int> current(num_packages);
+    for(int i = 0; i < num_packages; ++i)
+      current[i] = rng.next(num_versions[i]);
+
+    const int neighborhood = 50;
+    vector<synthetic_dep> deps;
+    for(int i = 0; i < num_packages; ++i)
+      for(int v = 1; v < num_versions[i]; ++v)
+	{
+	  const int num_deps = rng.next(4);
+	  for(int d = 0; d < num_deps; ++d)
+	    {
+	      synthetic_dep dep;
+	      dep.package = i;
+	      dep.version = v;
+	      dep.target = (i + 1 + rng.next(neighborhood)) % num_packages;
+	      if(dep.target == i)
+		continue;
+
+	      dep.is_conflict = rng.next(8) == 0;
+	      dep.is_soft = !dep.is_conflict && rng.next(5) == 0;
+
+	      // A contiguous range of the target's versions, so that
+	      // no version is listed twice.
+	      dep.first_target_version = 1 + rng.next(num_versions[dep.target] - 1);
+	      dep.end_target_version = dep.first_target_version + 1 +
+		rng.next(num_versions[dep.target] - dep.first_target_version);
+	      deps.push_back(dep);
+	    }
+	}
+
+    // The dependencies that each package is the source or the target
+    // of.
+    vector<vector<int> > package_deps(num_packages);
+    for(int d = 0; d < (int)deps.size(); ++d)
+      {
+	package_deps[deps[d].package].push_back(d);
+	package_deps[deps[d].target].push_back(d);
+      }
+
+    // Remove the source of every broken dependency.  Removing a
+    // package can only break dependencies on it, so those are
+    // checked again.
+    vector<int> to_check;
+    for(int d = (int)deps.size() - 1; d >= 0; --d)
+      to_check.push_back(d);
+    while(!to_check.empty())
+      {
+	const synthetic_dep &dep = deps[to_check.back()];
+	to_check.pop_back();
+
+	if(!is_broken(dep, current))
+	  continue;
+
+	const int removed = dep.package;
+	current[removed] = 0;
+	for(vector<int>::const_iterator it = package_deps[removed].begin();
+	    it != package_deps[removed].end(); ++it)
+	  if(deps[*it].target == removed)
+	    to_check.push_back(*it);
+      }
+
+    int broken = 0;
+    const int max_attempts = 100 * num_broken + 100;
+    for(int attempt = 0; broken < num_broken && attempt < max_attempts; ++attempt)
+      {
+	const int p = rng.next(num_packages);
+	const int new_version = rng.next(num_versions[p]);
+	const int old_version = current[p];
+	if(new_version == old_version)
+	  continue;
+
+	const int broken_before = count_broken(deps, package_deps[p], current);
+	current[p] = new_version;
+	const int broken_after = count_broken(deps, package_deps[p], current);
+
+	if(broken_after <= broken_before ||
+	   broken + broken_after - broken_before > num_broken)
+	  current[p] = old_version;
+	else
+	  broken += broken_after - broken_before;
+      }
+
+    ostringstream out;
+    for(int i = 0; i < num_packages; ++i)
+      {
+	out << "PACKAGE p" << i << " < ";
+	for(int v = 0; v < num_versions[i]; ++v)
+	  out << "v" << v << " ";
+	out << "> v" << current[i] << "\n";
+      }
+
+    for(vector<synthetic_dep>::const_iterator it = deps.begin();
+	it != deps.end(); ++it)
+      {
+	out << (it->is_soft ? "SOFTDEP" : "DEP")
+	    << " p" << it->package << " v" << it->version
+	    << (it->is_conflict ? " !! < " : " -> < ");
+	for(int t = it->first_target_version; t < it->end_target_version; ++t)
+	  out << "p" << it->target << " v" << t << " ";
+	out << ">\n";
+      }
+    out << "]\n";
+
+    istringstream in(out.str());
+    return parse_universe_tail(in);
+  }
+
+  bench_result run_benchmark(const dummy_universe_ref &universe,
+			     const bench_settings &settings)
+  {
+    bench_result rval;
+
+    // These are the defaults that aptitude passes to the resolver.
+    const double setup_start = now();
+    dummy_resolver resolver(70, -100, -200, 1000000, 50,
+			    cost_limits::minimum_cost,
+			    50,
+			    imm::map<dummy_universe::package, dummy_universe::version>(),
+			    universe,
+			    settings.threads);
+    rval.setup_time = now() - setup_start;
+    rval.initial_broken = resolver.get_initial_broken().size();
+
+    const double search_start = now();
+    for(int i = 0; i < settings.num_solutions; ++i)
+      {
+	try
+	  {
+	    resolver.find_next_solution(settings.max_steps, NULL);
+	    ++rval.solutions;
+	    if(i == 0)
+	      rval.first_solution_time = now() - search_start;
+	  }
+	catch(const NoMoreSolutions &)
+	  {
+	    break;
+	  }
+	catch(const NoMoreTime &)
+	  {
+	    rval.out_of_time = true;
+	    break;
+	  }
+      }
+    rval.search_time = now() - search_start;
+
+    const dummy_resolver::queue_counts counts = resolver.get_counts();
+    rval.steps_processed = counts.processed;
+    rval.promotions = counts.promotions;
+    rval.conflicts = counts.conflicts;
+    rval.graph_steps = counts.steps;
+    rval.pool_bytes = counts.pool_bytes;
+    rval.peak_rss_kb = peak_rss_kb();
+
+    return rval;
+  }
+
+  void print_result(const bench_result &r)
+  {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+	     "  setup:          %.1f ms (%lu broken dependencies)\n"
+	     "  first solution: ",
+	     r.setup_time * 1000, (unsigned long)r.initial_broken);
+    cout << buf;
+    if(r.first_solution_time < 0)
+      cout << "none" << endl;
+    else
+      {
+	snprintf(buf, sizeof(buf), "%.1f ms", r.first_solution_time * 1000);
+	cout << buf << endl;
+      }
+
+    snprintf(buf, sizeof(buf),
+	     "  solutions:      %d%s\n"
+	     "  steps:          %lu in %.1f ms (%.0f steps/s)\n"
+	     "  promotions:     %lu (%lu conflicts)\n"
+	     "  search graph:   %lu steps, %lu bytes in the node pool\n"
+	     "  peak memory:    %ld kB\n",
+	     r.solutions, r.out_of_time ? " (ran out of steps)" : "",
+	     (unsigned long)r.steps_processed, r.search_time * 1000,
+	     r.steps_per_second(),
+	     (unsigned long)(r.promotions + r.conflicts),
+	     (unsigned long)r.conflicts,
+	     (unsigned long)r.graph_steps, (unsigned long)r.pool_bytes,
+	     r.peak_rss_kb);
+    cout << buf;
+  }
+
+  /** \brief The measurements that are saved in a baseline file. */
+  struct baseline_entry
+  {
+    double steps_per_second;
+    double first_solution_ms;
+    long peak_rss_kb;
+    size_t steps_processed;
+    size_t promotions;
+  };
+
+  /** \brief Read a baseline file.
+   *
+   *  Each line holds the name of a universe followed by the fields of
+   *  baseline_entry; lines starting with '#' are ignored.
+   */
+  bool read_baseline(const char *filename, map<string, baseline_entry> &out)
+  {
+    ifstream f(filename);
+    if(!f)
+      return false;
+
+    string line;
+    while(getline(f, line))
+      {
+	if(line.empty() || line[0] == '#')
+	  continue;
+
+	istringstream in(line);
+	string name;
+	baseline_entry entry;
+	if(in >> name >> entry.steps_per_second >> entry.first_solution_ms
+	   >> entry.peak_rss_kb >> entry.steps_processed >> entry.promotions)
+	  out[name] = entry;
+	else
+	  cerr << "Ignoring malformed baseline line: " << line << endl;
+      }
+
+    return true;
+  }
+
+  void write_baseline_entry(ostream &out, const string &name, const bench_result &r)
+  {
+    char buf[256];
+    snprintf(buf, sizeof(buf), " %.1f %.3f %ld %lu %lu",
+	     r.steps_per_second(),
+	     r.first_solution_time < 0 ? -1.0 : r.first_solution_time * 1000,
+	     r.peak_rss_kb,
+	     (unsigned long)r.steps_processed,
+	     (unsigned long)(r.promotions + r.conflicts));
+    out << name << buf << endl;
+  }
+
+  /** \brief Print the change in one measurement.
+   *
+   *  \return \b true if the change is a regression of more than
+   *  tolerance percent.
+   */
+  bool compare_measurement(const char *label, double baseline, double current,
+			   bool higher_is_better, double tolerance)
+  {
+    if(baseline <= 0 || current < 0)
+      return false;
+
+    const double change = (current - baseline) * 100 / baseline;
+    const bool regression = higher_is_better ? change < -tolerance : change > tolerance;
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "    %-16s %.1f -> %.1f (%+.1f%%)%s\n",
+	     label, baseline, current, change,
+	     regression ? "  REGRESSION" : "");
+    cout << buf;
+
+    return regression;
+  }
+
+  /** \brief Compare a result against its baseline entry.
+   *
+   *  \return \b true if there is a regression.
+   */
+  bool compare_result(const baseline_entry &b, const bench_result &r, double tolerance)
+  {
+    cout << "  compared to the baseline:" << endl;
+
+    bool regression = false;
+    regression = compare_measurement("steps/s:", b.steps_per_second,
+				     r.steps_per_second(), true, tolerance) || regression;
+    regression = compare_measurement("first solution:", b.first_solution_ms,
+				     r.first_solution_time < 0 ? -1 : r.first_solution_time * 1000,
+				     false, tolerance) || regression;
+    regression = compare_measurement("peak memory:", b.peak_rss_kb,
+				     r.peak_rss_kb, false, tolerance) || regression;
+
+    // The search is deterministic, so these only change if the
+    // resolver's behavior changed.
+    if(b.steps_processed != r.steps_processed ||
+       b.promotions != r.promotions + r.conflicts)
+      cout << "    note: the search took a different path (steps "
+	   << b.steps_processed << " -> " << r.steps_processed
+	   << ", promotions " << b.promotions << " -> "
+	   << r.promotions + r.conflicts << ")" << endl;
+
+    return regression;
+  }
+
+  /** \brief A universe to run the benchmark on.
+   *
+   *  Each universe is named by its file name or by how it was
+   *  generated; an empty file name marks a synthetic universe.
+   */
+  struct corpus_entry
+  {
+    string name;
+    string filename;
+    int num_packages;
+    int num_broken;
+    unsigned long seed;
+  };
+
+  /** \brief What the child process that benchmarks a universe sends
+   *  back to its parent.
+   */
+  struct child_report
+  {
+    /** \brief \b false if the universe couldn't be loaded; the child
+     *  has already said why.
+     */
+    bool loaded;
+    size_t num_packages;
+    size_t num_versions;
+    bench_result result;
+  };
+
+  /** \brief Load and solve a universe; runs in the child process.
+   *
+   *  The report is written to fd.
+   */
+  void run_child(const corpus_entry &entry, const bench_settings &settings, int fd)
+  {
+    child_report report;
+    report.loaded = false;
+    report.num_packages = 0;
+    report.num_versions = 0;
+
+    try
+      {
+	dummy_universe_ref universe;
+	if(entry.filename.empty())
+	  universe = make_synthetic_universe(entry.num_packages, entry.num_broken,
+					     entry.seed);
+	else
+	  {
+	    ifstream f(entry.filename.c_str());
+	    if(!f)
+	      throw ParseError("couldn't open the file");
+
+	    universe = read_universe(f);
+	  }
+
+	report.loaded = true;
+	report.num_packages = universe.get_package_count();
+	report.num_versions = universe.get_version_count();
+
+	// The search is deterministic, so the runs only differ in how
+	// long they took.
+	report.result = run_benchmark(universe, settings);
+	for(int i = 1; i < settings.repeat; ++i)
+	  {
+	    const bench_result again = run_benchmark(universe, settings);
+	    report.result.setup_time = std::min(report.result.setup_time, again.setup_time);
+	    report.result.first_solution_time = std::min(report.result.first_solution_time,
+							 again.first_solution_time);
+	    report.result.search_time = std::min(report.result.search_time, again.search_time);
+	    report.result.peak_rss_kb = again.peak_rss_kb;
+	  }
+      }
+    catch(const cwidget::util::Exception &e)
+      {
+	cerr << "Error reading " << entry.name << ": " << e.errmsg() << endl;
+      }
+
+    const char *buf = reinterpret_cast<const char *>(&report);
+    size_t written = 0;
+    while(written < sizeof(report))
+      {
+	const ssize_t amt = write(fd, buf + written, sizeof(report) - written);
+	if(amt < 0 && errno == EINTR)
+	  continue;
+	else if(amt <= 0)
+	  _exit(1);
+	written += amt;
+      }
+  }
+
+  /** \brief Benchmark a universe in a child process, so that its
+   *  memory use is measured on its own.
+   *
+   *  \return \b false if the child couldn't be run or didn't report
+   *  back.
+   */
+  bool run_in_child(const corpus_entry &entry, const bench_settings &settings,
+		    child_report &report)
+  {
+    int fds[2];
+    if(pipe(fds) != 0)
+      {
+	perror("pipe");
+	return false;
+      }
+
+    // Don't let the child inherit (and print again) buffered output.
+    cout.flush();
+    cerr.flush();
+
+    const pid_t pid = fork();
+    if(pid < 0)
+      {
+	perror("fork");
+	close(fds[0]);
+	close(fds[1]);
+	return false;
+      }
+    else if(pid == 0)
+      {
+	close(fds[0]);
+	run_child(entry, settings, fds[1]);
+	close(fds[1]);
+	_exit(0);
+      }
+
+    close(fds[1]);
+
+    char *buf = reinterpret_cast<char *>(&report);
+    size_t amt_read = 0;
+    while(amt_read < sizeof(report))
+      {
+	const ssize_t amt = read(fds[0], buf + amt_read, sizeof(report) - amt_read);
+	if(amt < 0 && errno == EINTR)
+	  continue;
+	else if(amt <= 0)
+	  break;
+	amt_read += amt;
+      }
+    close(fds[0]);
+
+    int status;
+    while(waitpid(pid, &status, 0) < 0)
+      if(errno != EINTR)
+	{
+	  perror("waitpid");
+	  return false;
+	}
+
+    if(amt_read != sizeof(report) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      {
+	cerr << "The benchmark of " << entry.name << " didn't finish." << endl;
+	return false;
+      }
+
+    return true;
+  }
+
+  void usage(const char *argv0)
+  {
+    cerr << "Usage: " << argv0 << " [options] [universe-file...]" << endl
+	 << "  --steps N            Step limit for each solution (default 5000)" << endl
+	 << "  --solutions N        Number of solutions to find (default 3)" << endl
+	 << "  --threads N          Threads for the initial broken-dependency scan" << endl
+	 << "  --repeat N           Solve each universe N times and report the fastest run" << endl
+	 << "  --seed N             Seed for the following synthetic universes (default 1)" << endl
+	 << "  --broken K           Broken dependencies in the following synthetic universes (default 20)" << endl
+	 << "  --synthetic N        Add a synthetic universe of N packages" << endl
+	 << "  --save-baseline FILE Write the results to FILE" << endl
+	 << "  --baseline FILE      Compare the results against FILE" << endl
+	 << "  --tolerance PERCENT  Allowed regression against the baseline (default 10)" << endl;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int rval = 0;
+  bench_settings settings;
+  unsigned long seed = 1;
+  int num_broken = 20;
+  const char *save_baseline = NULL;
+  const char *baseline_file = NULL;
+  double tolerance = 10;
+
+  vector<corpus_entry> corpus;
+
+  for(int i = 1; i < argc; ++i)
+    {
+      const bool has_arg = i + 1 < argc;
+
+      if(!strcmp(argv[i], "--steps") && has_arg)
+	settings.max_steps = atoi(argv[++i]);
+      else if(!strcmp(argv[i], "--solutions") && has_arg)
+	settings.num_solutions = atoi(argv[++i]);
+      else if(!strcmp(argv[i], "--threads") && has_arg)
+	settings.threads = atoi(argv[++i]);
+      else if(!strcmp(argv[i], "--repeat") && has_arg)
+	settings.repeat = std::max(1, atoi(argv[++i]));
+      else if(!strcmp(argv[i], "--seed") && has_arg)
+	seed = strtoul(argv[++i], NULL, 10);
+      else if(!strcmp(argv[i], "--broken") && has_arg)
+	num_broken = std::max(0, atoi(argv[++i]));
+      else if(!strcmp(argv[i], "--save-baseline") && has_arg)
+	save_baseline = argv[++i];
+      else if(!strcmp(argv[i], "--baseline") && has_arg)
+	baseline_file = argv[++i];
+      else if(!strcmp(argv[i], "--tolerance") && has_arg)
+	tolerance = atof(argv[++i]);
+      else if(!strcmp(argv[i], "--synthetic") && has_arg)
+	{
+	  corpus_entry entry;
+	  entry.num_packages = atoi(argv[++i]);
+	  entry.num_broken = num_broken;
+	  entry.seed = seed;
+
+	  ostringstream name;
+	  name << "synthetic-" << entry.num_packages << "-" << seed
+	       << "-" << num_broken;
+	  entry.name = name.str();
+	  corpus.push_back(entry);
+	}
+      else if(argv[i][0] == '-')
+	{
+	  usage(argv[0]);
+	  return -1;
+	}
+      else
+	{
+	  corpus_entry entry;
+	  entry.name = argv[i];
+	  entry.filename = argv[i];
+	  entry.num_packages = 0;
+	  entry.num_broken = 0;
+	  entry.seed = 0;
+	  corpus.push_back(entry);
+	}
+    }
+
+  if(corpus.empty())
+    {
+      usage(argv[0]);
+      return -1;
+    }
+
+  map<string, baseline_entry> baseline;
+  if(baseline_file != NULL && !read_baseline(baseline_file, baseline))
+    {
+      cerr << "Couldn't read the baseline from " << baseline_file << "." << endl;
+      return -1;
+    }
+
+  ofstream baseline_out;
+  if(save_baseline != NULL)
+    {
+      baseline_out.open(save_baseline);
+      if(!baseline_out)
+	{
+	  cerr << "Couldn't write the baseline to " << save_baseline << "." << endl;
+	  return -1;
+	}
+
+      baseline_out << "# name steps/s first-solution-ms peak-rss-kB steps promotions" << endl;
+    }
+
+  for(vector<corpus_entry>::const_iterator it = corpus.begin();
+      it != corpus.end(); ++it)
+    {
+      child_report report;
+      if(!run_in_child(*it, settings, report) || !report.loaded)
+	{
+	  rval = -1;
+	  continue;
+	}
+
+      const bench_result &result = report.result;
+
+      cout << it->name << ": " << report.num_packages << " packages, "
+	   << report.num_versions << " versions" << endl;
+      print_result(result);
+
+      if(result.solutions == 0 && !result.out_of_time)
+	{
+	  cout << "  error: the resolver gave up without finding a solution" << endl;
+	  rval = -1;
+	}
+
+      if(baseline_out.is_open())
+	write_baseline_entry(baseline_out, it->name, result);
+
+      if(baseline_file != NULL)
+	{
+	  map<string, baseline_entry>::const_iterator found = baseline.find(it->name);
+	  if(found == baseline.end())
+	    cout << "  not in the baseline" << endl;
+	  else if(compare_result(found->second, result, tolerance))
+	    rval = 1;
+	}
+    }
+
+  return rval;
+}
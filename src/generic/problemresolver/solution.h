@@ -852,6 +852,13 @@ public:
 					 typename solution_weights<PackageUniverse>::joint_score(choices, score)));
   }
 
+  /** \brief Throw away all the joint scores. */
+  void clear_joint_scores()
+  {
+    joint_scores.clear();
+    joint_scores_list.clear();
+  }
+
   const joint_score_set &get_joint_scores() const { return joint_scores; }
   const std::vector<std::pair<imm::set<version>, int> > &
   get_joint_scores_list() const { return joint_scores_list; }
@@ -0,0 +1,308 @@
+/** \file step_queue.h */    // -*-c++-*-
+
+
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#ifndef STEP_QUEUE_H
+#define STEP_QUEUE_H
+
+#include "search_graph.h"
+
+#include <cwidget/generic/util/eassert.h>
+
+#include <vector>
+
+/** \brief A priority queue of search steps, ordered by "goodness".
+ *
+ *  Steps are ordered by their final cost, then by their score
+ *  (higher scores first), then by their action sets, and finally by
+ *  their step numbers.  The best step is at the top of the queue.
+ *
+ *  This replaces a std::set of step numbers whose comparison
+ *  operator looked each step up in the search graph.  The queue is
+ *  an implicit 4-ary heap stored in a single vector.  Each entry
+ *  caches the parts of the step's sort key that can be compared
+ *  without touching the step itself (the structural level of its
+ *  cost and its score), along with a direct pointer to the step so
+ *  that the remaining comparisons don't need to go through the
+ *  bounds-checked search_graph::get_step().  A second vector maps
+ *  step numbers to heap positions, so arbitrary steps can be removed
+ *  or re-sorted in logarithmic time.
+ *
+ *  Unlike the std::set that this replaces, two distinct steps that
+ *  have the same cost, score and actions are both kept (they are
+ *  ordered by their step numbers); the set silently dropped the
+ *  second one, and erasing one of them could remove the other.
+ *
+ *  \note The entries point into the search graph, so the queue must
+ *  be cleared whenever the graph is.
+ *
+ *  \tparam PackageUniverse The universe that the steps belong to.
+ */
+template<typename PackageUniverse>
+class generic_step_queue
+{
+public:
+  typedef generic_search_graph<PackageUniverse> search_graph;
+  typedef typename search_graph::step step;
+
+private:
+  /** \brief A single entry in the heap. */
+  struct entry
+  {
+    const step *s;
+    int step_num;
+    /** \brief The structural level of the step's final cost. */
+    int structural_level;
+    /** \brief The score of the step. */
+    int score;
+
+    entry(const step &_s)
+      : s(&_s),
+	step_num(_s.step_num),
+	structural_level(_s.final_step_cost.get_structural_level()),
+	score(_s.score)
+    {
+    }
+  };
+
+  /** \brief The number of children of each node in the heap. */
+  static const std::size_t arity = 4;
+
+  const search_graph &graph;
+
+  /** \brief The entries of the heap, best first. */
+  std::vector<entry> heap;
+
+  /** \brief The position of each step in the heap, indexed by step
+   *  number, or -1 if the step is not in the queue.
+   */
+  std::vector<int> positions;
+
+  /** \brief Returns \b true if e1 should be removed from the queue
+   *  before e2.
+   */
+  static bool better(const entry &e1, const entry &e2)
+  {
+    // Note that *lower* costs come "before" higher costs.  The
+    // structural level is the first thing that costs are compared
+    // by, so checking the cached copy first gives the same result as
+    // comparing the whole cost.
+    if(e1.structural_level != e2.structural_level)
+      return e1.structural_level < e2.structural_level;
+
+    const cost &cost1(e1.s->final_step_cost);
+    const cost &cost2(e2.s->final_step_cost);
+    // Inequality of costs is just a pointer comparison.
+    if(cost1 != cost2)
+      {
+	const int cost_cmp = cost1.compare(cost2);
+	if(cost_cmp != 0)
+	  return cost_cmp < 0;
+      }
+
+    if(e1.score != e2.score)
+      return e2.score < e1.score;
+    else if(e2.s->actions < e1.s->actions)
+      return true;
+    else if(e1.s->actions < e2.s->actions)
+      return false;
+    else
+      return e1.step_num < e2.step_num;
+  }
+
+  /** \brief Store an entry at the given position in the heap. */
+  void place(std::size_t idx, const entry &e)
+  {
+    heap[idx] = e;
+    positions[e.step_num] = idx;
+  }
+
+  /** \brief Move the entry at the given position towards the top of
+   *  the heap until its parent is better than it.
+   *
+   *  \return the new position of the entry.
+   */
+  std::size_t sift_up(std::size_t idx)
+  {
+    const entry e(heap[idx]);
+
+    while(idx > 0)
+      {
+	const std::size_t parent_idx = (idx - 1) / arity;
+	if(!better(e, heap[parent_idx]))
+	  break;
+
+	place(idx, heap[parent_idx]);
+	idx = parent_idx;
+      }
+
+    place(idx, e);
+    return idx;
+  }
+
+  /** \brief Move the entry at the given position towards the bottom
+   *  of the heap until it is better than all its children.
+   */
+  void sift_down(std::size_t idx)
+  {
+    const entry e(heap[idx]);
+    const std::size_t size = heap.size();
+
+    while(true)
+      {
+	const std::size_t first_child = idx * arity + 1;
+	if(first_child >= size)
+	  break;
+
+	const std::size_t last_child = std::min(first_child + arity, size);
+	std::size_t best_child = first_child;
+	for(std::size_t child = first_child + 1; child < last_child; ++child)
+	  if(better(heap[child], heap[best_child]))
+	    best_child = child;
+
+	if(!better(heap[best_child], e))
+	  break;
+
+	place(idx, heap[best_child]);
+	idx = best_child;
+      }
+
+    place(idx, e);
+  }
+
+  /** \brief Restore the heap property around the given position. */
+  void restore(std::size_t idx)
+  {
+    if(sift_up(idx) == idx)
+      sift_down(idx);
+  }
+
+  int get_position(int step_num) const
+  {
+    if(step_num < 0 || (std::size_t)step_num >= positions.size())
+      return -1;
+    else
+      return positions[step_num];
+  }
+
+public:
+  /** \brief Create an empty queue of steps from the given graph. */
+  generic_step_queue(const search_graph &_graph)
+    : graph(_graph)
+  {
+  }
+
+  bool empty() const { return heap.empty(); }
+  std::size_t size() const { return heap.size(); }
+
+  /** \brief Return \b true if the given step is in the queue. */
+  bool contains(int step_num) const
+  {
+    return get_position(step_num) != -1;
+  }
+
+  /** \brief Return the number of the best step in the queue.
+   *
+   *  The queue must not be empty.
+   */
+  int top() const
+  {
+    eassert(!heap.empty());
+    return heap.front().step_num;
+  }
+
+  /** \brief Add a step to the queue.
+   *
+   *  \return \b true if the step was added, or \b false if it was
+   *  already in the queue.
+   */
+  bool insert(int step_num)
+  {
+    if(contains(step_num))
+      return false;
+
+    if((std::size_t)step_num >= positions.size())
+      positions.resize(std::max<std::size_t>(step_num + 1,
+					     positions.size() * 2),
+		       -1);
+
+    heap.push_back(entry(graph.get_step(step_num)));
+    positions[step_num] = heap.size() - 1;
+    sift_up(heap.size() - 1);
+
+    return true;
+  }
+
+  /** \brief Remove a step from the queue.
+   *
+   *  \return the number of steps that were removed (0 or 1).
+   */
+  std::size_t erase(int step_num)
+  {
+    const int idx = get_position(step_num);
+    if(idx == -1)
+      return 0;
+
+    positions[step_num] = -1;
+
+    const entry last(heap.back());
+    heap.pop_back();
+    if((std::size_t)idx < heap.size())
+      {
+	place(idx, last);
+	restore(idx);
+      }
+
+    return 1;
+  }
+
+  /** \brief Remove the best step from the queue.
+   *
+   *  The queue must not be empty.
+   */
+  void pop()
+  {
+    erase(top());
+  }
+
+  /** \brief Re-sort a step after its final cost has changed.
+   *
+   *  Steps must not have their cost changed while they are in the
+   *  queue unless this is invoked immediately afterwards.  Does
+   *  nothing if the step is not in the queue.
+   */
+  void update(int step_num)
+  {
+    const int idx = get_position(step_num);
+    if(idx == -1)
+      return;
+
+    heap[idx] = entry(graph.get_step(step_num));
+    restore(idx);
+  }
+
+  /** \brief Remove all the steps from the queue. */
+  void clear()
+  {
+    heap.clear();
+    positions.clear();
+  }
+};
+
+#endif // STEP_QUEUE_H
@@ -0,0 +1,383 @@
+// step_queue_bench.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.  You should have
+//   received a copy of the GNU General Public License along with this
+//   program; see the file COPYING.  If not, write to the Free
+//   Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+//   MA 02111-1307, USA.
+//
+// Compares the resolver's step queue against the std::set that it
+// replaced.  The versions of a universe read from a test script (in
+// the same format that "test" reads) are used to build a search
+// graph of synthetic steps with random costs, scores and actions; a
+// mix of insertions, removals and cost updates that resembles the
+// resolver's main loop is then run against both queues.  Both queues
+// must remove the steps in the same order.
+
+#include "dummy_universe.h"
+#include "search_graph.h"
+#include "step_queue.h"
+
+#include <loggers.h>
+
+#include <iostream>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+using namespace std;
+
+typedef generic_choice<dummy_universe_ref> choice;
+typedef generic_promotion<dummy_universe_ref> promotion;
+typedef generic_promotion_set<dummy_universe_ref> promotion_set;
+typedef generic_search_graph<dummy_universe_ref> search_graph;
+typedef search_graph::step step;
+typedef generic_step_queue<dummy_universe_ref> step_queue;
+
+// As in test.cc, define the loggers here instead of linking in a
+// higher-level library.
+logging::LoggerPtr aptitude::Loggers::getAptitudeResolver()
+{
+  return logging::Logger::getLogger("aptitude.resolver");
+}
+
+logging::LoggerPtr aptitude::Loggers::getAptitudeResolverSearchGraph()
+{
+  return logging::Logger::getLogger("aptitude.resolver.search.graph");
+}
+
+logging::LoggerPtr aptitude::Loggers::getAptitudeResolverSearchCosts()
+{
+  return logging::Logger::getLogger("aptitude.resolver.search.costs");
+}
+
+namespace
+{
+  /** \brief The promotion set wants somewhere to report retracted
+   *  promotions; the benchmark never inserts any.
+   */
+  class null_callbacks : public promotion_set_callbacks<dummy_universe_ref>
+  {
+    void promotion_retracted(const promotion &p)
+    {
+    }
+  };
+
+  /** \brief A small deterministic random number generator, so that
+   *  both runs see exactly the same workload.
+   */
+  class lcg
+  {
+    unsigned long state;
+
+  public:
+    lcg(unsigned long seed)
+      : state(seed)
+    {
+    }
+
+    /** \brief Return a number in [0, n). */
+    int next(int n)
+    {
+      state = state * 1103515245UL + 12345UL;
+      return (int)((state / 65536UL) % 32768UL) % n;
+    }
+  };
+
+  cost random_cost(lcg &rng)
+  {
+    cost rval = cost::make_advance_user_level(rng.next(3), rng.next(200));
+    if(rng.next(8) == 0)
+      rval = rval + cost::make_advance_structural_level(rng.next(3));
+    return rval;
+  }
+
+  /** \brief Fill the graph with num_steps random steps. */
+  void make_steps(search_graph &graph,
+		  const vector<dummy_universe_ref::version> &versions,
+		  int num_steps)
+  {
+    lcg rng(1);
+
+    for(int i = 0; i < num_steps; ++i)
+      {
+	step &s(graph.add_step());
+
+	const int num_actions = rng.next(5);
+	for(int j = 0; j < num_actions; ++j)
+	  {
+	    const dummy_universe_ref::version &ver =
+	      versions[rng.next(versions.size())];
+	    s.actions.insert_or_narrow(choice::make_install_version(ver, j));
+	  }
+
+	// Scores come from a small range so that ties are common.
+	s.score = rng.next(20);
+	s.final_step_cost = random_cost(rng);
+      }
+  }
+
+  /** \brief The comparison that the resolver used to sort its
+   *  std::set of pending steps, with the step number as a final
+   *  tie-breaker so that distinct steps are never dropped.
+   */
+  struct step_goodness_compare
+  {
+    const search_graph &graph;
+
+    step_goodness_compare(const search_graph &_graph)
+      : graph(_graph)
+    {
+    }
+
+    bool operator()(int step_num1, int step_num2) const
+    {
+      if(step_num1 == step_num2)
+	return false;
+
+      const step &step1(graph.get_step(step_num1));
+      const step &step2(graph.get_step(step_num2));
+
+      int cost_cmp = step1.final_step_cost.compare(step2.final_step_cost);
+      if(cost_cmp != 0)
+	return cost_cmp < 0;
+      else if(step2.score < step1.score)
+	return true;
+      else if(step1.score < step2.score)
+	return false;
+      else if(step2.actions < step1.actions)
+	return true;
+      else if(step1.actions < step2.actions)
+	return false;
+      else
+	return step_num1 < step_num2;
+    }
+  };
+
+  /** \brief Adapts the std::set to the interface used by run(). */
+  class set_queue
+  {
+    std::set<int, step_goodness_compare> s;
+
+  public:
+    set_queue(const search_graph &graph)
+      : s(step_goodness_compare(graph))
+    {
+    }
+
+    bool empty() const { return s.empty(); }
+    bool contains(int step_num) const { return s.count(step_num) > 0; }
+    void insert(int step_num) { s.insert(step_num); }
+    void erase(int step_num) { s.erase(step_num); }
+
+    int pop()
+    {
+      const int rval = *s.begin();
+      s.erase(s.begin());
+      return rval;
+    }
+
+    void before_update(int step_num) { s.erase(step_num); }
+    void after_update(int step_num) { s.insert(step_num); }
+  };
+
+  /** \brief Adapts the step queue to the interface used by run(). */
+  class heap_queue
+  {
+    step_queue q;
+
+  public:
+    heap_queue(const search_graph &graph)
+      : q(graph)
+    {
+    }
+
+    bool empty() const { return q.empty(); }
+    bool contains(int step_num) const { return q.contains(step_num); }
+    void insert(int step_num) { q.insert(step_num); }
+    void erase(int step_num) { q.erase(step_num); }
+
+    int pop()
+    {
+      const int rval = q.top();
+      q.pop();
+      return rval;
+    }
+
+    void before_update(int step_num) { }
+    void after_update(int step_num) { q.update(step_num); }
+  };
+
+  double now()
+  {
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+  }
+
+  /** \brief Run the workload against a queue.
+   *
+   *  Like the resolver's main loop, this repeatedly removes the best
+   *  step and queues up some of its "successors" (the next unused
+   *  steps in the graph).  Now and then a queued step has its cost
+   *  raised, as update_final_step_cost() does when a promotion
+   *  applies to it, or is dropped from the queue.
+   *
+   *  \return the time taken, in seconds.
+   */
+  template<typename Queue>
+  double run(search_graph &graph, Queue &queue, vector<int> &popped)
+  {
+    lcg rng(2);
+    const int num_steps = graph.get_num_steps();
+    int next_step = 0;
+
+    const double start = now();
+
+    queue.insert(next_step++);
+    while(!queue.empty())
+      {
+	popped.push_back(queue.pop());
+
+	const int num_successors = rng.next(4);
+	for(int i = 0; i < num_successors && next_step < num_steps; ++i)
+	  queue.insert(next_step++);
+
+	const int victim = rng.next(next_step);
+	switch(rng.next(8))
+	  {
+	  case 0:
+	    queue.erase(victim);
+	    break;
+
+	  case 1:
+	  case 2:
+	    if(queue.contains(victim))
+	      {
+		step &s(graph.get_step(victim));
+		queue.before_update(victim);
+		s.final_step_cost = s.final_step_cost + random_cost(rng);
+		queue.after_update(victim);
+	      }
+	    break;
+
+	  default:
+	    break;
+	  }
+
+	// Keep the queue from draining before most of the graph has
+	// been used.
+	if(queue.empty() && next_step < num_steps)
+	  queue.insert(next_step++);
+      }
+
+    return now() - start;
+  }
+
+  dummy_universe_ref read_universe(istream &f)
+  {
+    string s;
+
+    f >> ws >> s >> ws;
+    if(s != "UNIVERSE")
+      throw ParseError("Expected 'UNIVERSE', got " + s);
+
+    f >> s >> ws;
+    if(s != "[")
+      throw ParseError("Expected '[' following UNIVERSE, got " + s);
+
+    return parse_universe_tail(f);
+  }
+
+  bool run_benchmark(const dummy_universe_ref &universe, int num_steps)
+  {
+    vector<dummy_universe_ref::version> versions;
+    for(dummy_universe_ref::package_iterator p = universe.packages_begin();
+	!p.end(); ++p)
+      for(dummy_universe_ref::package::version_iterator v = (*p).versions_begin();
+	  !v.end(); ++v)
+	versions.push_back(*v);
+
+    null_callbacks callbacks;
+
+    promotion_set set_promotions(universe, callbacks);
+    search_graph set_graph(set_promotions);
+    make_steps(set_graph, versions, num_steps);
+    set_queue sq(set_graph);
+    vector<int> set_popped;
+    const double set_time = run(set_graph, sq, set_popped);
+
+    promotion_set heap_promotions(universe, callbacks);
+    search_graph heap_graph(heap_promotions);
+    make_steps(heap_graph, versions, num_steps);
+    heap_queue hq(heap_graph);
+    vector<int> heap_popped;
+    const double heap_time = run(heap_graph, hq, heap_popped);
+
+    cout << num_steps << " steps, " << set_popped.size() << " removed:" << endl
+	 << "  std::set:   " << set_time << "s" << endl
+	 << "  step_queue: " << heap_time << "s" << endl;
+
+    if(set_popped != heap_popped)
+      {
+	cerr << "The queues removed steps in different orders!" << endl;
+	return false;
+      }
+
+    return true;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int rval = 0;
+  int num_steps = 200000;
+
+  for(int i = 1; i < argc; ++i)
+    {
+      if(!strcmp(argv[i], "--steps") && i + 1 < argc)
+	{
+	  ++i;
+	  num_steps = atoi(argv[i]);
+	  continue;
+	}
+
+      ifstream f(argv[i]);
+
+      if(!f)
+	{
+	  cerr << "Couldn't read from file " << argv[i] << "." << endl;
+	  rval = -1;
+	  continue;
+	}
+
+      try
+	{
+	  cout << argv[i] << ": ";
+	  if(!run_benchmark(read_universe(f), num_steps))
+	    rval = -1;
+	}
+      catch(const cwidget::util::Exception &e)
+	{
+	  cerr << "Error reading " << argv[i] << ": " << e.errmsg() << endl;
+	  rval = -1;
+	}
+    }
+
+  return rval;
+}
@@ -29,7 +29,9 @@
 #include <cwidget/generic/util/ssprintf.h>
 
 #include <boost/format.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
@@ -40,11 +42,18 @@
 #include <boost/iostreams/stream.hpp>
 #include <boost/iostreams/write.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <deque>
+#include <fstream>
+#include <list>
+#include <vector>
 
 #include <loggers.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 using namespace aptitude::sqlite;
@@ -100,6 +109,217 @@ release upgrade23;							\
 
 	  store->exec(sql);
 	}
+
+	// Version 4 added the Codec column to the blobs table, which
+	// records how each blob was compressed.  All the blobs written
+	// by earlier versions were compressed with zlib.
+	void version_3_to_version_4(const boost::shared_ptr<db> &store)
+	{
+	  LOG_INFO(Loggers::getAptitudeDownloadCache(),
+		   "Upgrading the cache from version 3 to version 4.");
+
+	  store->exec("savepoint upgrade34");
+
+	  boost::shared_ptr<statement> get_version_statement =
+	    statement::prepare(*store, "select version from format");
+	  {
+	    statement::execution get_version_execution(*get_version_statement);
+	    if(!get_version_execution.step())
+	      throw FileCacheException("Can't read the cache version number.");
+	    else
+	      {
+		int database_version = get_version_statement->get_int(0);
+		if(database_version != 3)
+		  throw FileCacheException("Wrong database version number for this upgrade.");
+	      }
+	  }
+
+	  const char * const sql = "                                    \
+alter table blobs							\
+add column Codec  integer   default 1  not null;			\
+									\
+update format								\
+set version = 4;							\
+									\
+release upgrade34;							\
+";
+
+	  store->exec(sql);
+	}
+
+	// Version 5 added the LastUse column to the cache, which
+	// orders entries by how recently they were used; before it,
+	// each hit moved its entry to a new CacheId.  It also
+	// restricts the trigger that maintains the total size to
+	// updates of the BlobSize column, so that recording a use
+	// doesn't touch the globals table.
+	void version_4_to_version_5(const boost::shared_ptr<db> &store)
+	{
+	  LOG_INFO(Loggers::getAptitudeDownloadCache(),
+		   "Upgrading the cache from version 4 to version 5.");
+
+	  store->exec("savepoint upgrade45");
+
+	  boost::shared_ptr<statement> get_version_statement =
+	    statement::prepare(*store, "select version from format");
+	  {
+	    statement::execution get_version_execution(*get_version_statement);
+	    if(!get_version_execution.step())
+	      throw FileCacheException("Can't read the cache version number.");
+	    else
+	      {
+		int database_version = get_version_statement->get_int(0);
+		if(database_version != 4)
+		  throw FileCacheException("Wrong database version number for this upgrade.");
+	      }
+	  }
+
+	  const char * const sql = "                                    \
+alter table cache							\
+add column LastUse  integer   default 0  not null;			\
+									\
+update cache								\
+set LastUse = CacheId;							\
+									\
+create index cache_by_last_use on cache (LastUse);			\
+									\
+drop trigger u_cache_blob_size;						\
+									\
+create trigger u_cache_blob_size					\
+before update of BlobSize on cache					\
+for each row begin							\
+    update globals set TotalBlobSize = TotalBlobSize + NEW.BlobSize - OLD.BlobSize; \
+end;									\
+									\
+update format								\
+set version = 5;							\
+									\
+release upgrade45;							\
+";
+
+	  store->exec(sql);
+	}
+      }
+
+      /** \brief The ways in which a blob can be stored.
+       *
+       *  These values are written to the Codec column of the blobs
+       *  table, so they must never change.
+       */
+      enum blob_codec
+	{
+	  /** \brief The blob is the file's contents, uncompressed. */
+	  codec_stored = 0,
+	  /** \brief The blob is a zlib stream. */
+	  codec_zlib = 1
+	};
+
+      /** \brief The amount of a file that is test-compressed to decide
+       *  whether compressing it is worthwhile.
+       */
+      const std::streamsize compression_sample_size = 8 * 1024;
+
+      /** \brief Decide whether a file is worth compressing.
+       *
+       *  Compresses the start of the file with the fastest zlib level
+       *  and checks whether that saved at least a tenth of its size.
+       *  Files that are already compressed (screenshots, gzipped
+       *  data) fail this test, and storing them as they are saves
+       *  the time it takes to compress and decompress them.
+       */
+      bool is_compressible(const std::string &path)
+      {
+	std::string sample;
+	{
+	  io::file_source input(path, std::ios::in | std::ios::binary);
+	  if(!input.is_open())
+	    return true;
+
+	  sample.resize(compression_sample_size);
+	  const std::streamsize amt = io::read(input, &sample[0], compression_sample_size);
+	  sample.resize(amt < 0 ? 0 : amt);
+	}
+
+	if(sample.empty())
+	  return true;
+
+	std::string compressed;
+	{
+	  io::filtering_ostream out(io::zlib_compressor(io::zlib::best_speed) |
+				    io::back_inserter(compressed));
+	  io::write(out, sample.data(), sample.size());
+	}
+
+	return compressed.size() * 10 < sample.size() * 9;
+      }
+
+      /** \brief Write the decompressed contents of a blob to a sink.
+       *
+       *  \param codec      how the blob was stored.
+       *  \param blob_data  the contents of the blob.
+       *  \param sink       where to write the decompressed data.
+       */
+      template<typename Sink>
+      void decode_blob(int codec, const std::string &blob_data, const Sink &sink)
+      {
+	switch(codec)
+	  {
+	  case codec_stored:
+	    {
+	      io::filtering_ostream out(sink);
+	      io::write(out, blob_data.data(), blob_data.size());
+	    }
+	    break;
+
+	  case codec_zlib:
+	    {
+	      io::filtering_ostream out(io::zlib_decompressor() | sink);
+	      io::write(out, blob_data.data(), blob_data.size());
+	    }
+	    break;
+
+	  default:
+	    throw FileCacheException((boost::format("Unknown blob codec %d.") % codec).str());
+	  }
+      }
+
+      /** \brief Read a whole file into memory.
+       *
+       *  \throw FileCacheException if the file can't be read.
+       */
+      boost::shared_ptr<std::string> read_file_contents(const std::string &path)
+      {
+	io::file_source input(path, std::ios::in | std::ios::binary);
+	if(!input.is_open())
+	  throw FileCacheException((boost::format("Can't open \"%s\" to store it in the cache.") % path).str());
+
+	boost::shared_ptr<std::string> contents = boost::make_shared<std::string>();
+	if(io::copy(input, io::back_inserter(*contents)) < 0)
+	  throw FileCacheException((boost::format("Unable to read \"%s\".") % path).str());
+
+	return contents;
+      }
+
+      /** \brief Write the contents of a cache entry to a new
+       *  temporary file.
+       *
+       *  \throw FileCacheException if the file can't be written.
+       */
+      temp::name write_contents(const std::string &contents)
+      {
+	// TODO: I should consolidate the temporary directories
+	// aptitude creates.
+	temp::name rval("cacheExtracted");
+
+	std::ofstream out(rval.get_name().c_str(), std::ios::out | std::ios::binary);
+	out.write(contents.data(), contents.size());
+	out.close();
+
+	if(!out)
+	  throw FileCacheException((boost::format("Can't write \"%s\".")
+				    % rval.get_name()).str());
+
+	return rval;
       }
 
 
@@ -120,31 +340,298 @@ release upgrade23;							\
        *  The "format" table supports upgrades to the cache format; it
        *  contains a single row, which contains a single column
        *  holding the current version of the database schema.
+       *
+       *  The total size of the blobs is kept in the "globals" table
+       *  by triggers, so it never has to be recomputed.  Entries are
+       *  ordered by the indexed LastUse column, which holds a stamp
+       *  from a counter that increases with each insertion or hit.
+       *  Hits don't write to the database: their stamps are queued
+       *  in memory and written in batches, either by a background
+       *  maintenance thread or by the next insertion, which is a
+       *  write transaction anyway and needs the stamps to be up to
+       *  date before it evicts anything.  The maintenance thread
+       *  also vacuums the database once evictions have left enough
+       *  of it empty, on a separate connection and without holding
+       *  the store lock.
        */
       class file_cache_sqlite : public file_cache
       {
 	boost::shared_ptr<db> store;
 	std::string filename; // Used to report errors.
-	/** \brief The maximum size of the cache, in bytes.
-	 *
-	 *  \todo What's the best way to compute the current size?  I
-	 *  could store it in the database and update it as part of
-	 *  the transaction that inserts / removes blobs.  Or I could
-	 *  use triggers to keep it up-to-date.  Or perhaps there's an
-	 *  sqlite query that will return the number of data pages
-	 *  used by a table/column?
-	 *
-	 *  Also, I need to decide when to vacuum the database: after
-	 *  each update, after deletes, or what?
-	 */
+	/** \brief The maximum size of the cache, in bytes. */
 	int max_size;
 
+	/** \brief The zlib compression level of new blobs, or 0 to
+	 *  store them uncompressed.
+	 */
+	int compression_level;
+
 	// Used to ensure that only one thread is accessing the
 	// database connection at once.  Several sqlite3 functions
 	// (e.g., sqlite3_last_insert_rowid()) are not threadsafe.
 	cw::threads::mutex store_mutex;
 
-	static const int current_version_number = 3;
+	/** \brief The stamp that will be given to the next use of an
+	 *  entry.
+	 *
+	 *  Protected by store_mutex, like all the members below.
+	 */
+	sqlite3_int64 next_use;
+
+	/** \brief Uses that haven't been written to the database yet,
+	 *  as a map from CacheId to LastUse.
+	 */
+	boost::unordered_map<sqlite3_int64, sqlite3_int64> pending_uses;
+
+	/** \brief Set when entries have been evicted since the
+	 *  maintenance thread last checked whether to vacuum.
+	 */
+	bool vacuum_check_wanted;
+
+	/** \brief Set to tell the maintenance thread to exit. */
+	bool shutting_down;
+
+	/** \brief Signalled when the maintenance thread has work to do
+	 *  or should exit.
+	 */
+	cw::threads::condition maintenance_condition;
+
+	/** \brief The thread that writes queued uses and vacuums the
+	 *  database, or an invalid pointer if it couldn't be started.
+	 */
+	boost::shared_ptr<cw::threads::thread> maintenance_thread;
+
+	/** \brief The number of queued uses that makes the maintenance
+	 *  thread write them immediately.
+	 */
+	static const std::size_t use_batch_size = 256;
+
+	/** \brief How long, in seconds, a use can stay queued before
+	 *  the maintenance thread writes it.
+	 */
+	static const int use_flush_interval = 5;
+
+	/** \brief The database is vacuumed when this fraction of its
+	 *  pages are free (one in vacuum_free_page_ratio).
+	 */
+	static const sqlite3_int64 vacuum_free_page_ratio = 4;
+
+	/** \brief The database is never vacuumed to recover fewer
+	 *  than this many pages.
+	 */
+	static const sqlite3_int64 vacuum_min_free_pages = 64;
+
+	/** \brief How long, in milliseconds, the vacuum waits for
+	 *  other users of the database to let go of it.
+	 */
+	static const int vacuum_busy_timeout = 5000;
+
+	static const int current_version_number = 5;
+
+	/** \brief Runs the maintenance loop of a cache. */
+	class maintenance_thread_body
+	{
+	  file_cache_sqlite *parent;
+
+	public:
+	  maintenance_thread_body(file_cache_sqlite *_parent)
+	    : parent(_parent)
+	  {
+	  }
+
+	  void operator()() const
+	  {
+	    parent->run_maintenance();
+	  }
+	};
+
+	friend class maintenance_thread_body;
+
+	/** \brief Write the queued uses to the database.
+	 *
+	 *  The caller must hold store_mutex and must have begun a
+	 *  transaction.  Entries that were deleted since their use
+	 *  was queued are silently skipped.
+	 */
+	void write_pending_uses()
+	{
+	  if(pending_uses.empty())
+	    return;
+
+	  LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+		    boost::format("Recording %d uses of cache entries.")
+		    % pending_uses.size());
+
+	  sqlite::db::statement_proxy update_last_use_statement =
+	    store->get_cached_statement("update cache set LastUse = ? where CacheId = ?");
+
+	  for(boost::unordered_map<sqlite3_int64, sqlite3_int64>::const_iterator
+		it = pending_uses.begin(); it != pending_uses.end(); ++it)
+	    {
+	      update_last_use_statement->reset();
+	      update_last_use_statement->bind_int64(1, it->second);
+	      update_last_use_statement->bind_int64(2, it->first);
+	      update_last_use_statement->exec();
+	    }
+
+	  pending_uses.clear();
+	}
+
+	/** \brief Write the queued uses to the database in their own
+	 *  transaction.
+	 *
+	 *  The caller must hold store_mutex.  Failures are logged and
+	 *  the queued uses are dropped: they only affect which entries
+	 *  are evicted first.
+	 */
+	void flush_pending_uses()
+	{
+	  if(pending_uses.empty())
+	    return;
+
+	  try
+	    {
+	      store->exec("begin transaction");
+	      try
+		{
+		  write_pending_uses();
+		  store->exec("commit");
+		}
+	      catch(...)
+		{
+		  try
+		    {
+		      store->exec("rollback");
+		    }
+		  catch(...)
+		    {
+		    }
+
+		  throw;
+		}
+	    }
+	  catch(sqlite::exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       "Can't record the uses of cache entries: " << ex.errmsg());
+	      pending_uses.clear();
+	    }
+	}
+
+	/** \brief Return \b true if enough of the database is free
+	 *  to be worth vacuuming.
+	 *
+	 *  The caller must hold store_mutex.
+	 */
+	bool should_vacuum()
+	{
+	  try
+	    {
+	      sqlite3_int64 page_count = 0;
+	      sqlite3_int64 free_pages = 0;
+
+	      {
+		sqlite::db::statement_proxy page_count_statement =
+		  store->get_cached_statement("pragma page_count");
+		statement::execution page_count_execution(*page_count_statement);
+		if(page_count_execution.step())
+		  page_count = page_count_statement->get_int64(0);
+	      }
+
+	      {
+		sqlite::db::statement_proxy free_pages_statement =
+		  store->get_cached_statement("pragma freelist_count");
+		statement::execution free_pages_execution(*free_pages_statement);
+		if(free_pages_execution.step())
+		  free_pages = free_pages_statement->get_int64(0);
+	      }
+
+	      if(free_pages < vacuum_min_free_pages ||
+		 free_pages * vacuum_free_page_ratio < page_count)
+		return false;
+
+	      LOG_INFO(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Vacuuming the cache: %d of its %d pages are free.")
+		       % free_pages % page_count);
+
+	      return true;
+	    }
+	  catch(sqlite::exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       "Can't check whether to vacuum the cache: " << ex.errmsg());
+	      return false;
+	    }
+	}
+
+	/** \brief Vacuum the database.
+	 *
+	 *  The caller must \e not hold store_mutex.  VACUUM rewrites
+	 *  the whole file, so it runs on a connection of its own;
+	 *  lookups and insertions keep using the main connection, and
+	 *  SQLite's file locking only makes them wait (up to the busy
+	 *  timeout) while the rewritten database is copied back.
+	 *  VACUUM keeps the integer primary keys, so the ids that the
+	 *  main connection has queued uses for stay valid.
+	 */
+	void vacuum()
+	{
+	  try
+	    {
+	      boost::shared_ptr<db> vacuum_store(db::create(filename));
+	      vacuum_store->set_busy_timeout(vacuum_busy_timeout);
+	      vacuum_store->exec("vacuum");
+	    }
+	  catch(sqlite::exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       "Can't vacuum the cache: " << ex.errmsg());
+	    }
+	}
+
+	/** \brief The body of the maintenance thread.
+	 *
+	 *  Sleeps until there are uses to write or a vacuum to
+	 *  consider.  Uses are written as soon as a batch of them has
+	 *  been queued, or after use_flush_interval seconds.
+	 */
+	void run_maintenance()
+	{
+	  cw::threads::mutex::lock l(store_mutex);
+
+	  while(!shutting_down)
+	    {
+	      if(pending_uses.empty() && !vacuum_check_wanted)
+		maintenance_condition.wait(l);
+	      else if(pending_uses.size() < use_batch_size && !vacuum_check_wanted)
+		{
+		  timeval until;
+		  gettimeofday(&until, 0);
+
+		  timespec until_ts;
+		  until_ts.tv_sec = until.tv_sec + use_flush_interval;
+		  until_ts.tv_nsec = until.tv_usec * 1000;
+
+		  maintenance_condition.timed_wait(l, until_ts);
+		}
+
+	      if(shutting_down)
+		break;
+
+	      flush_pending_uses();
+
+	      if(vacuum_check_wanted)
+		{
+		  vacuum_check_wanted = false;
+		  if(should_vacuum())
+		    {
+		      l.release();
+		      vacuum();
+		      l.acquire();
+		    }
+		}
+	    }
+	}
 
 	void create_new_database()
 	{
@@ -163,15 +650,18 @@ create table globals ( TotalBlobSize integer not null );		\
 									\
 create table cache ( CacheId integer primary key,			\
                      ModificationTime datetime not null,                \
+                     LastUse integer not null,				\
                      BlobSize integer not null,				\
                      BlobId integer not null,				\
                      Key text not null );				\
 									\
 create table blobs ( BlobId integer primary key,			\
+                     Codec integer not null,				\
                      Data blob not null );				\
 									\
 create index cache_by_blob_id on cache (BlobId);			\
 create unique index cache_by_key on cache (Key);			\
+create index cache_by_last_use on cache (LastUse);			\
 									\
 									\
 create trigger i_cache_blob_size					\
@@ -181,7 +671,7 @@ for each row begin							\
 end;									\
 									\
 create trigger u_cache_blob_size					\
-before update on cache							\
+before update of BlobSize on cache					\
 for each row begin							\
     update globals set TotalBlobSize = TotalBlobSize + NEW.BlobSize - OLD.BlobSize; \
 end;									\
@@ -275,6 +765,12 @@ insert into globals(TotalBlobSize) values(0);				\
 			    upgrade::version_2_to_version_3(store);
 			    // Fallthrough.
 			  case 3:
+			    upgrade::version_3_to_version_4(store);
+			    // Fallthrough.
+			  case 4:
+			    upgrade::version_4_to_version_5(store);
+			    // Fallthrough.
+			  case 5:
 			    break;
 
 			  }
@@ -323,7 +819,7 @@ insert into globals(TotalBlobSize) values(0);				\
 			       % total_size % computed_total_size);
 
 		      boost::shared_ptr<statement> fix_total_size_statement =
-			statement::prepare(*store, "update globals set TotalSize = ?");
+			statement::prepare(*store, "update globals set TotalBlobSize = ?");
 		      fix_total_size_statement->bind_int64(1, computed_total_size);
 		      fix_total_size_statement->exec();
 		    }
@@ -353,10 +849,15 @@ insert into globals(TotalBlobSize) values(0);				\
 	}
 
       public:
-	file_cache_sqlite(const std::string &_filename, int _max_size)
+	file_cache_sqlite(const std::string &_filename, int _max_size,
+			  int _compression_level)
 	  : store(db::create(_filename)),
 	    filename(_filename),
-	    max_size(_max_size)
+	    max_size(_max_size),
+	    compression_level(_compression_level),
+	    next_use(0),
+	    vacuum_check_wanted(false),
+	    shutting_down(false)
 	{
 	  // Set up the database.  First, check the format:
 	  sqlite::db::statement_proxy check_for_format_statement =
@@ -375,47 +876,90 @@ insert into globals(TotalBlobSize) values(0);				\
 	    create_new_database();
 	  else
 	    sanity_check_database();
-	}
 
-	void putItem(const std::string &key,
-		     const std::string &path,
-		     time_t mtime)
-	{
-	  // NOTE: We wait until we've finished compressing the input
-	  // file to take the store mutex.
+	  {
+	    sqlite::db::statement_proxy get_last_use_statement =
+	      store->get_cached_statement("select max(LastUse) from cache");
+	    statement::execution get_last_use_execution(*get_last_use_statement);
+	    if(get_last_use_execution.step())
+	      next_use = get_last_use_statement->get_int64(0) + 1;
+	  }
+
 	  try
 	    {
-	      // Before anything else, we need to compress the input
-	      // file to a temporary location.  Without this step,
-	      // there's no way to know the size of the compressed
-	      // data, but we need that size in order to insert it
-	      // into the cache database.
-	      temp::name tn("cacheContentCompressed");
-
-	      const std::string compressed_path(tn.get_name());
-
-	      // The size of the input file -- used only for logging
+	      maintenance_thread =
+		boost::make_shared<cw::threads::thread>(maintenance_thread_body(this));
+	    }
+	  catch(cw::threads::ThreadCreateException &)
+	    {
+	      // Uses will be written by insertions, or when the cache
+	      // is closed.
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       "Can't start the cache maintenance thread.");
+	    }
+	}
+
+	~file_cache_sqlite()
+	{
+	  {
+	    cw::threads::mutex::lock l(store_mutex);
+	    shutting_down = true;
+	    maintenance_condition.wake_all();
+	  }
+
+	  if(maintenance_thread.get() != NULL)
+	    maintenance_thread->join();
+
+	  cw::threads::mutex::lock l(store_mutex);
+	  flush_pending_uses();
+	}
+
+	void putItem(const std::string &key,
+		     const std::string &path,
+		     time_t mtime)
+	{
+	  // NOTE: We wait until we've finished compressing the input
+	  // file to take the store mutex.
+	  try
+	    {
+	      // Before anything else, we need to decide how to store
+	      // the input file, and compress it to a temporary
+	      // location if it's worth compressing.  Without this
+	      // step, there's no way to know the size of the
+	      // compressed data, but we need that size in order to
+	      // insert it into the cache database.
+	      const blob_codec codec =
+		(compression_level > 0 && is_compressible(path))
+		? codec_zlib : codec_stored;
+
+	      temp::name tn;
+	      std::string compressed_path(path);
+
+	      // The size of the input file -- used only for logging
 	      // so we can see how well it was compressed.
 	      std::streamsize input_size = -1;
 
-	      // Compress the input file.
-	      //
-	      // TODO: make the compression level an option.  Maybe
-	      // also support other algorithms, although that needs a
-	      // schema change (an extra column in the blobs table
-	      // giving the compressor that was used).
-	      {
-		io::filtering_ostream compressed_out(io::zlib_compressor(9) | io::file_sink(compressed_path));
+	      if(codec == codec_zlib)
+		{
+		  tn = temp::name("cacheContentCompressed");
+		  compressed_path = tn.get_name();
 
-		input_size = io::copy(io::file(path), compressed_out);
-	      }
+		  {
+		    io::filtering_ostream compressed_out(io::zlib_compressor(compression_level) | io::file_sink(compressed_path));
 
-	      if(input_size < 0)
-		throw FileCacheException((boost::format("Unable to compress \"%s\" to \"%s\".")
-					  % path % compressed_path).str());
+		    input_size = io::copy(io::file(path), compressed_out);
+		  }
 
-	      LOG_TRACE(Loggers::getAptitudeDownloadCache(),
-			"Compressed \"" << path << "\" to \"" << compressed_path << "\"");
+		  if(input_size < 0)
+		    throw FileCacheException((boost::format("Unable to compress \"%s\" to \"%s\".")
+					      % path % compressed_path).str());
+
+		  LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+			    "Compressed \"" << path << "\" to \"" << compressed_path << "\"");
+		}
+	      else
+		LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+			  "Storing \"" << path << "\" without compressing it.");
 
 	      // Here's the plan:
 	      //
@@ -423,11 +967,13 @@ insert into globals(TotalBlobSize) values(0);				\
 	      // 2) If the file is too large to ever cache, return
 	      //    immediately (don't cache it).
 	      // 3) In an sqlite transaction:
-	      //    3.a) Retrieve and save the keys of entries,
-	      //         starting with the oldest, until removing
-	      //         all the stored keys would create enough
-	      //         space for the new entry.
-	      //    3.b) Delete the entries that were saved.
+	      //    3.a) Write the queued uses of entries, so that
+	      //         the least recently used entries are the ones
+	      //         that get evicted.  Then retrieve the last
+	      //         use of entries, starting with the oldest,
+	      //         until removing all the retrieved entries
+	      //         would create enough space for the new entry.
+	      //    3.b) Delete the entries that were retrieved.
 	      //    3.c) Place the new entry into the cache.
 
 
@@ -454,6 +1000,8 @@ insert into globals(TotalBlobSize) values(0);				\
 		}
 
 	      off_t compressed_size = buf.st_size;
+	      if(codec == codec_stored)
+		input_size = compressed_size;
 
 	      if(compressed_size == 0 && input_size > 0)
 		throw FileCacheException("Sanity-check failed: a non-empty file was compressed to zero bytes!.");
@@ -484,6 +1032,8 @@ insert into globals(TotalBlobSize) values(0);				\
 	      // Step 3)
 	      try
 		{
+		  write_pending_uses();
+
 		  sqlite::db::statement_proxy get_total_size_statement =
 		    store->get_cached_statement("select TotalBlobSize from globals");
 
@@ -503,13 +1053,13 @@ insert into globals(TotalBlobSize) values(0);				\
 				% (total_size + compressed_size) % max_size);
 
 		      bool first = true;
-		      sqlite3_int64 last_cache_id_dropped = -1;
+		      sqlite3_int64 last_use_dropped = -1;
 		      sqlite3_int64 amount_dropped = 0;
 		      int num_dropped = 0;
 
 		      // Step 3.a)
 		      db::statement_proxy read_entries_statement =
-			store->get_cached_statement("select CacheId, BlobSize from cache order by CacheId");
+			store->get_cached_statement("select LastUse, BlobSize from cache order by LastUse");
 		      {
 			statement::execution read_entries_execution(*read_entries_statement);
 
@@ -517,7 +1067,7 @@ insert into globals(TotalBlobSize) values(0);				\
 			      read_entries_execution.step())
 			  {
 			    first = false;
-			    last_cache_id_dropped = read_entries_statement->get_int64(0);
+			    last_use_dropped = read_entries_statement->get_int64(0);
 			    amount_dropped += read_entries_statement->get_int64(1);
 			    ++num_dropped;
 			  }
@@ -533,10 +1083,12 @@ insert into globals(TotalBlobSize) values(0);				\
 		      // Step 3.b)
 		      {
 			sqlite::db::statement_proxy delete_old_statement =
-			  store->get_cached_statement("delete from cache where CacheId <= ?");
-			delete_old_statement->bind_int64(1, last_cache_id_dropped);
+			  store->get_cached_statement("delete from cache where LastUse <= ?");
+			delete_old_statement->bind_int64(1, last_use_dropped);
 			delete_old_statement->exec();
 		      }
+
+		      vacuum_check_wanted = true;
 		    }
 
 		  // Step 3.c)
@@ -552,8 +1104,9 @@ insert into globals(TotalBlobSize) values(0);				\
 		    // incrementally.
 		    {
 		      sqlite::db::statement_proxy insert_blob_statement =
-			store->get_cached_statement("insert into blobs (Data) values (zeroblob(?))");
+			store->get_cached_statement("insert into blobs (Data, Codec) values (zeroblob(?), ?)");
 		      insert_blob_statement->bind_int64(1, compressed_size);
+		      insert_blob_statement->bind_int(2, codec);
 		      insert_blob_statement->exec();
 		    }
 
@@ -577,11 +1130,12 @@ insert into globals(TotalBlobSize) values(0);				\
 				boost::format("Inserting \"%s\" into the cache table.") % key);
 
 		      sqlite::db::statement_proxy insert_cache_statement =
-			store->get_cached_statement("insert into cache (BlobId, BlobSize, Key, ModificationTime) values (?, ?, ?, ?)");
+			store->get_cached_statement("insert into cache (BlobId, BlobSize, Key, ModificationTime, LastUse) values (?, ?, ?, ?, ?)");
 		      insert_cache_statement->bind_int64(1, inserted_blob_row);
 		      insert_cache_statement->bind_int64(2, compressed_size);
 		      insert_cache_statement->bind_string(3, key);
 		      insert_cache_statement->bind_int64(4, mtime);
+		      insert_cache_statement->bind_int64(5, next_use++);
 		      insert_cache_statement->exec();
 		    }
 
@@ -623,6 +1177,9 @@ insert into globals(TotalBlobSize) values(0);				\
 		  store->exec("commit");
 		  LOG_INFO(Loggers::getAptitudeDownloadCache(),
 			   boost::format("Cached \"%s\" as \"%s\"") % path % key);
+
+		  if(vacuum_check_wanted)
+		    maintenance_condition.wake_one();
 		}
 	      catch(...)
 		{
@@ -658,7 +1215,20 @@ insert into globals(TotalBlobSize) values(0);				\
 	    }
 	}
 
-	temp::name getItem(const std::string &key, time_t &mtime)
+	/** \brief Look up the blob of a cache entry, queueing a use of
+	 *  the entry.
+	 *
+	 *  \param key        the key to look up.
+	 *  \param mtime      set to the modification time of the entry.
+	 *  \param codec      set to the codec of the blob.
+	 *  \param blob_data  set to the contents of the blob.
+	 *
+	 *  \return \b false if there is no entry for the key.
+	 */
+	bool read_blob(const std::string &key,
+		       time_t &mtime,
+		       int &codec,
+		       std::string &blob_data)
 	{
 	  cw::threads::mutex::lock l(store_mutex);
 
@@ -670,135 +1240,394 @@ insert into globals(TotalBlobSize) values(0);				\
 	  // 1) In an sqlite transaction:
 	  //    1.a) Look up the cache entry corresponding
 	  //         to this key.
-	  //    1.a.i)  If there is no entry, return an invalid name.
+	  //    1.a.i)  If there is no entry, return false.
 	  //    1.a.ii) If there is an entry,
-	  //        1.a.ii.A) Update its last use field.
-	  //        1.a.ii.B) Extract it to a temporary file
-	  //                  and return it.
+	  //        1.a.ii.A) Queue a use of it.
+	  //        1.a.ii.B) Read its blob into memory.
+	  //
+	  // The transaction only reads from the database; the use is
+	  // written later, in a batch.  The blob is decoded by the
+	  // caller, after the store mutex has been released.
+	  store->exec("begin transaction");
+
 	  try
 	    {
-	      store->exec("begin transaction");
+	      sqlite::db::statement_proxy find_cache_entry_statement =
+		store->get_cached_statement("select cache.CacheId, cache.BlobId, cache.ModificationTime, blobs.Codec from cache join blobs on blobs.BlobId = cache.BlobId where cache.Key = ?");
+
+	      bool found = false;
+	      sqlite3_int64 cacheId = -1;
+	      sqlite3_int64 blobId = -1;
+	      find_cache_entry_statement->bind_string(1, key);
+	      {
+		statement::execution find_cache_entry_execution(*find_cache_entry_statement);
+		found = find_cache_entry_execution.step();
+
+		if(found)
+		  {
+		    cacheId    = find_cache_entry_statement->get_int64(0);
+		    blobId     = find_cache_entry_statement->get_int64(1);
+		    mtime      = find_cache_entry_statement->get_int64(2);
+		    codec      = find_cache_entry_statement->get_int(3);
+		  }
+		else
+		  // 1.a.i: no matching entry
+		  {
+		    LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+			      boost::format("No entry for \"%s\" found in the cache.") % key);
+
+		    store->exec("rollback");
+		    return false;
+		  }
+	      }
+
+	      // 1.a.ii.A: queue a use of the entry.
+	      pending_uses[cacheId] = next_use++;
+	      if(pending_uses.size() >= use_batch_size)
+		maintenance_condition.wake_one();
+
+	      // 1.a.ii.B: read the blob.
+	      {
+		boost::shared_ptr<sqlite::blob> blob =
+		  sqlite::blob::open(*store,
+				     "main",
+				     "blobs",
+				     "Data",
+				     blobId,
+				     false);
+
+		blob_data.resize(blob->size());
+		if(!blob_data.empty())
+		  blob->read(0, &blob_data[0], blob_data.size());
+	      }
+
+	      store->exec("commit");
 
+	      // Without a maintenance thread, write the batch here.
+	      if(maintenance_thread.get() == NULL &&
+		 pending_uses.size() >= use_batch_size)
+		flush_pending_uses();
+
+	      return true;
+	    }
+	  catch(...)
+	    {
+	      // Try to roll back, but don't throw a new exception if
+	      // that fails too.
 	      try
 		{
-		  sqlite::db::statement_proxy find_cache_entry_statement =
-		    store->get_cached_statement("select CacheId, BlobId, ModificationTime from cache where Key = ?");
+		  store->exec("rollback");
+		}
+	      catch(...)
+		{
+		}
 
-		  bool found = false;
-		  sqlite3_int64 oldCacheId = -1;
-		  sqlite3_int64 blobId = -1;
-		  find_cache_entry_statement->bind_string(1, key);
-		  {
-		    statement::execution find_cache_entry_execution(*find_cache_entry_statement);
-		    found = find_cache_entry_execution.step();
+	      throw;
+	    }
+	}
 
-		    if(found)
-		      {
-			oldCacheId = find_cache_entry_statement->get_int64(0);
-			blobId     = find_cache_entry_statement->get_int64(1);
-			mtime      = find_cache_entry_statement->get_int64(2);
-		      }
-		    else
-		      // 1.a.i: no matching entry
-		      {
-			LOG_TRACE(Loggers::getAptitudeDownloadCache(),
-				  boost::format("No entry for \"%s\" found in the cache.") % key);
+	temp::name getItem(const std::string &key, time_t &mtime)
+	{
+	  try
+	    {
+	      int codec;
+	      std::string blob_data;
+	      if(!read_blob(key, mtime, codec, blob_data))
+		return temp::name();
 
-			store->exec("rollback");
-			return temp::name();
-		      }
-		  }
+	      // TODO: I should consolidate the temporary
+	      // directories aptitude creates.
+	      temp::name rval("cacheExtracted");
 
-		  // 1.a.ii.A: update the last use field.
-		  {
-		    // WARNING: this might fail if the largest
-		    // cache ID has been used.  That should never
-		    // happen in aptitude (you'd need 10^18 get or
-		    // put calls), and trying to avoid it seems
-		    // like it would cause a lot of trouble.
-		    sqlite::db::statement_proxy update_last_use_statement =
-		      store->get_cached_statement("update cache set CacheId = (select max(CacheId) from cache) + 1 where CacheId = ?");
-		    update_last_use_statement->bind_int64(1, oldCacheId);
-		    update_last_use_statement->exec();
-		  }
+	      {
+		io::file_sink outfile(rval.get_name(), std::ios::out | std::ios::binary);
+		if(!outfile.is_open())
+		  throw FileCacheException(((boost::format("Can't open \"%s\" for writing"))
+					    % rval.get_name()).str());
+
+		// Decompress the data as it's written to the
+		// output file.
+		decode_blob(codec, blob_data, outfile);
+	      }
 
-		  // TODO: I should consolidate the temporary
-		  // directories aptitude creates.
-		  temp::name rval("cacheExtracted");
+	      LOG_INFO(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Extracted %d bytes corresponding to \"%s\" to \"%s\".")
+		       % blob_data.size() % key % rval.get_name());
 
-		  int extracted_size = -1;
-		  {
-		    // Decompress the data as it's written to the
-		    // output file.
-		    io::filtering_ostream outfile(io::zlib_decompressor() | io::file_sink(rval.get_name()));
-		    if(!outfile.good())
-		      throw FileCacheException(((boost::format("Can't open \"%s\" for writing"))
-						% rval.get_name()).str());
-
-		    boost::shared_ptr<sqlite::blob> blob_data =
-		      sqlite::blob::open(*store,
-					 "main",
-					 "blobs",
-					 "Data",
-					 blobId,
-					 false);
+	      return rval;
+	    }
+	  catch(cw::util::Exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't get the cache entry for \"%s\": %s")
+		       % key % ex.errmsg());
+	      return temp::name();
+	    }
+	  catch(std::exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't get the cache entry for \"%s\": %s")
+		       % key % ex.what());
+	      return temp::name();
+	    }
+	}
 
-		    static const int block_size = 16384;
-		    char buf[block_size];
+	boost::shared_ptr<const std::string>
+	getItemContents(const std::string &key, time_t &mtime)
+	{
+	  try
+	    {
+	      int codec;
+	      std::string blob_data;
+	      if(!read_blob(key, mtime, codec, blob_data))
+		return boost::shared_ptr<const std::string>();
+
+	      boost::shared_ptr<std::string> rval = boost::make_shared<std::string>();
+	      if(codec == codec_stored)
+		// The blob is the contents; don't copy it.
+		rval->swap(blob_data);
+	      else
+		decode_blob(codec, blob_data, io::back_inserter(*rval));
 
-		    int amount_to_read = blob_data->size();
-		    int blob_offset = 0;
+	      LOG_INFO(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Extracted %d bytes corresponding to \"%s\" into memory.")
+		       % rval->size() % key);
 
-		    LOG_TRACE(Loggers::getAptitudeDownloadCache(),
-			      boost::format("Extracting %d bytes to \"%s\".") % amount_to_read % rval.get_name());
+	      return rval;
+	    }
+	  catch(cw::util::Exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't get the cache entry for \"%s\": %s")
+		       % key % ex.errmsg());
+	      return boost::shared_ptr<const std::string>();
+	    }
+	  catch(std::exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't get the cache entry for \"%s\": %s")
+		       % key % ex.what());
+	      return boost::shared_ptr<const std::string>();
+	    }
+	}
+      };
 
-		    // Copy the blob into the temporary file.
-		    while(amount_to_read > 0)
-		      {
-			int curr_amt;
+      /** \brief An in-memory cache.
+       *
+       *  Entries hold the uncompressed contents of each file in a
+       *  reference-counted, immutable buffer, so a hit is a hash
+       *  lookup and a pointer copy.  The entries are split between
+       *  several shards, each with its own lock and its own list of
+       *  entries in order of use; every use is stamped with a global
+       *  counter, so when the cache is full the shard whose least
+       *  recently used entry is oldest gives up that entry.  This
+       *  drops entries in the same order as a single global list
+       *  would, without making every lookup take the same lock.
+       */
+      class file_cache_memory : public file_cache
+      {
+	struct entry
+	{
+	  std::string key;
+	  boost::shared_ptr<const std::string> contents;
+	  time_t mtime;
+	  /** \brief The value of the use counter when this entry was
+	   *  last stored or retrieved.
+	   */
+	  unsigned long last_use;
+	};
+
+	typedef std::list<entry> entry_list;
+
+	struct shard
+	{
+	  cw::threads::mutex mutex;
+	  /** \brief The entries of this shard, most recently used
+	   *  first.
+	   */
+	  entry_list entries;
+	  boost::unordered_map<std::string, entry_list::iterator> by_key;
+	};
 
-			if(amount_to_read < block_size)
-			  curr_amt = amount_to_read;
-			else
-			  curr_amt = block_size;
+	static const int num_shards = 16;
 
-			blob_data->read(blob_offset, buf, curr_amt);
-			std::streamsize amt_written = io::write(outfile, buf, curr_amt);
+	shard shards[num_shards];
 
-			blob_offset += amt_written;
-			amount_to_read -= amt_written;
-		      }
+	/** \brief The total size of all the entries.
+	 *
+	 *  Only modified with atomic operations.
+	 */
+	std::size_t total_size;
+	std::size_t max_size;
 
-		    extracted_size = blob_data->size();
-		  }
+	/** \brief Incremented and stamped onto an entry each time it
+	 *  is used.
+	 */
+	unsigned long use_counter;
 
-		  LOG_INFO(Loggers::getAptitudeDownloadCache(),
-			   boost::format("Extracted %d bytes corresponding to \"%s\" to \"%s\".")
-			   % extracted_size % key % rval.get_name());
+	shard &get_shard(const std::string &key)
+	{
+	  return shards[boost::hash<std::string>()(key) % num_shards];
+	}
 
-		  store->exec("commit");
-		  return rval;
-		}
-	      catch(...)
-		{
-		  // Try to roll back, but don't throw a new exception if
-		  // that fails too.
-		  try
-		    {
-		      store->exec("rollback");
-		    }
-		  catch(...)
-		    {
-		    }
+	/** \brief Remove an entry from its shard.
+	 *
+	 *  The shard's mutex must be held.
+	 */
+	void remove_entry(shard &s, entry_list::iterator it)
+	{
+	  __sync_fetch_and_sub(&total_size, it->contents->size());
+	  s.by_key.erase(it->key);
+	  s.entries.erase(it);
+	}
 
-		  // TODO: maybe instead of rethrowing the exception,
-		  // we should delete the cache tables and recreate
-		  // them?  But this should only happen if there was a
-		  // *database* error rather than an error, e.g.,
-		  // reading the file data to cache.
-		  throw;
+	/** \brief Drop the least recently used entry in the cache.
+	 *
+	 *  \return \b false if the cache is empty.
+	 */
+	bool drop_oldest()
+	{
+	  shard *oldest = NULL;
+	  unsigned long oldest_use = 0;
+
+	  for(int i = 0; i < num_shards; ++i)
+	    {
+	      cw::threads::mutex::lock l(shards[i].mutex);
+
+	      if(!shards[i].entries.empty() &&
+		 (oldest == NULL || shards[i].entries.back().last_use < oldest_use))
+		{
+		  oldest = &shards[i];
+		  oldest_use = shards[i].entries.back().last_use;
 		}
 	    }
+
+	  if(oldest == NULL)
+	    return false;
+
+	  // Another thread might have used or dropped the entry in
+	  // the meantime; if so, drop whatever is now last in the
+	  // shard.
+	  cw::threads::mutex::lock l(oldest->mutex);
+	  if(oldest->entries.empty())
+	    return true;
+
+	  LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+		    boost::format("Dropping \"%s\" from the in-memory cache.")
+		    % oldest->entries.back().key);
+	  remove_entry(*oldest, --oldest->entries.end());
+	  return true;
+	}
+
+      public:
+	explicit file_cache_memory(int _max_size)
+	  : total_size(0), max_size(_max_size), use_counter(0)
+	{
+	}
+
+	void putItem(const std::string &key,
+		     const std::string &path,
+		     time_t mtime)
+	{
+	  try
+	    {
+	      putItemContents(key, read_file_contents(path), mtime);
+	    }
+	  catch(cw::util::Exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't cache \"%s\" as \"%s\": %s")
+		       % path % key % ex.errmsg());
+	    }
+	  catch(std::exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't cache \"%s\" as \"%s\": %s")
+		       % path % key % ex.what());
+	    }
+	}
+
+	void putItemContents(const std::string &key,
+			     const boost::shared_ptr<const std::string> &contents,
+			     time_t mtime)
+	{
+	  if(contents->size() > max_size)
+	    {
+	      LOG_INFO(Loggers::getAptitudeDownloadCache(),
+		       "Refusing to cache \"" << key
+		       << "\" in memory: its size " << contents->size()
+		       << " is greater than the cache size limit " << max_size);
+	      return;
+	    }
+
+	  {
+	    shard &s = get_shard(key);
+	    cw::threads::mutex::lock l(s.mutex);
+
+	    boost::unordered_map<std::string, entry_list::iterator>::iterator
+	      found = s.by_key.find(key);
+	    if(found != s.by_key.end())
+	      remove_entry(s, found->second);
+
+	    entry new_entry;
+	    new_entry.key = key;
+	    new_entry.contents = contents;
+	    new_entry.mtime = mtime;
+	    new_entry.last_use = __sync_add_and_fetch(&use_counter, 1);
+
+	    s.entries.push_front(new_entry);
+	    s.by_key[key] = s.entries.begin();
+	    __sync_add_and_fetch(&total_size, contents->size());
+	  }
+
+	  while(__sync_fetch_and_add(&total_size, 0) > max_size &&
+		drop_oldest())
+	    ;
+
+	  LOG_INFO(Loggers::getAptitudeDownloadCache(),
+		   boost::format("Cached \"%s\" in memory (%d bytes)")
+		   % key % contents->size());
+	}
+
+	boost::shared_ptr<const std::string>
+	getItemContents(const std::string &key, time_t &mtime)
+	{
+	  shard &s = get_shard(key);
+	  cw::threads::mutex::lock l(s.mutex);
+
+	  boost::unordered_map<std::string, entry_list::iterator>::const_iterator
+	    found = s.by_key.find(key);
+	  if(found == s.by_key.end())
+	    {
+	      LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+			boost::format("No entry for \"%s\" found in the in-memory cache.") % key);
+	      return boost::shared_ptr<const std::string>();
+	    }
+
+	  const entry_list::iterator it = found->second;
+	  s.entries.splice(s.entries.begin(), s.entries, it);
+	  it->last_use = __sync_add_and_fetch(&use_counter, 1);
+
+	  mtime = it->mtime;
+	  return it->contents;
+	}
+
+	temp::name getItem(const std::string &key, time_t &mtime)
+	{
+	  boost::shared_ptr<const std::string> contents = getItemContents(key, mtime);
+	  if(contents.get() == NULL)
+	    return temp::name();
+
+	  try
+	    {
+	      temp::name rval(write_contents(*contents));
+
+	      LOG_INFO(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Extracted %d bytes corresponding to \"%s\" to \"%s\".")
+		       % contents->size() % key % rval.get_name());
+
+	      return rval;
+	    }
 	  catch(cw::util::Exception &ex)
 	    {
 	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
@@ -819,62 +1648,616 @@ insert into globals(TotalBlobSize) values(0);				\
       /** \brief A multilevel cache.
        *
        *  "get" requests are serviced from each sub-cache in turn,
-       *  failing if the object isn't found in any cache.
+       *  failing if the object isn't found in any cache.  Each
+       *  sub-cache does its own locking, so the first one is
+       *  searched without taking the lock of the multilevel cache;
+       *  only a miss there looks at the write queue and the slower
+       *  sub-caches.  An object that is found in a slower sub-cache
+       *  is copied into the faster ones, so the next request for it
+       *  is a memory hit.  Only one search of the slower sub-caches
+       *  for a given key runs at a time: a thread that asks for a
+       *  key that is already being searched for waits for that
+       *  search and shares its result.
+       *
+       *  "put" requests store the object in the first sub-cache
+       *  immediately and queue it for a background thread, which
+       *  stores it in the others.  The queue holds the contents of
+       *  each object, so "get" requests find queued objects before
+       *  they are written; once it holds more than max_queued_bytes,
+       *  "put" requests wait for it to drain.  The queue is drained
+       *  before the cache is destroyed.
        *
-       *  "put" requests are forwarded to all sub-caches.
+       *  The hits, misses and lookup time of each sub-cache are
+       *  counted and written to the aptitude.downloadCache.statistics
+       *  logger every statistics_log_interval searches, and when the
+       *  cache is destroyed.
        */
       class file_cache_multilevel : public file_cache
       {
-	std::vector<boost::shared_ptr<file_cache> > caches;
+	/** \brief A sub-cache and its counters. */
+	struct level
+	{
+	  boost::shared_ptr<file_cache> cache;
+	  /** \brief The name of this level in log messages. */
+	  std::string name;
+
+	  // The counters are only modified with atomic operations.
+	  unsigned long hits;
+	  unsigned long misses;
+	  /** \brief The total time spent looking up keys in this
+	   *  level, in microseconds.
+	   */
+	  unsigned long lookup_microseconds;
+
+	  level(const boost::shared_ptr<file_cache> &_cache,
+		const std::string &_name)
+	    : cache(_cache), name(_name),
+	      hits(0), misses(0), lookup_microseconds(0)
+	  {
+	  }
+	};
+
+	/** \brief The sub-caches, fastest first.
+	 *
+	 *  Not modified once the cache is in use.
+	 */
+	std::vector<level> levels;
+
+	/** \brief An object waiting to be stored in the slower levels. */
+	struct queued_write
+	{
+	  boost::shared_ptr<const std::string> contents;
+	  time_t mtime;
+	  /** \brief \b true if the key is in write_queue, \b false if
+	   *  the object is being written.
+	   */
+	  bool queued;
+	};
+
+	/** \brief A search of the levels for a key. */
+	struct search
+	{
+	  bool done;
+	  boost::shared_ptr<const std::string> contents;
+	  time_t mtime;
+
+	  search()
+	    : done(false), mtime(0)
+	  {
+	  }
+	};
+
+	/** \brief Protects the members below. */
+	cw::threads::mutex state_mutex;
+
+	/** \brief The objects that haven't been stored in the slower
+	 *  levels yet, by key.
+	 */
+	boost::unordered_map<std::string, queued_write> queued_writes;
+
+	/** \brief The keys of queued_writes whose writes haven't
+	 *  started, oldest first.
+	 */
+	std::deque<std::string> write_queue;
+
+	/** \brief The total size of the objects in queued_writes. */
+	std::size_t queued_bytes;
+
+	/** \brief The searches in progress, by key. */
+	boost::unordered_map<std::string, boost::shared_ptr<search> > searches;
+
+	/** \brief Incremented by each "put" request, so that a search
+	 *  can tell whether the object it found might be stale.
+	 */
+	unsigned long put_generation;
+
+	/** \brief Signalled when a key is added to write_queue, and
+	 *  when the writer thread should exit.
+	 */
+	cw::threads::condition write_queued;
+
+	/** \brief Signalled when a queued object has been written. */
+	cw::threads::condition write_finished;
+
+	/** \brief Signalled when a search finishes. */
+	cw::threads::condition search_finished;
+
+	/** \brief Set to tell the writer thread to exit once the queue
+	 *  is empty.
+	 */
+	bool shutting_down;
+
+	/** \brief The thread that stores queued objects in the slower
+	 *  levels.
+	 *
+	 *  Started by the first "put" request that needs it.
+	 */
+	boost::shared_ptr<cw::threads::thread> writer_thread;
+
+	/** \brief Set if the writer thread couldn't be started; "put"
+	 *  requests then store objects in every level themselves.
+	 */
+	bool writer_failed;
+
+	/** \brief The number of searches so far.
+	 *
+	 *  Only modified with atomic operations.
+	 */
+	unsigned long num_searches;
+
+	/** \brief The amount of memory that queued objects can use
+	 *  before "put" requests start waiting.
+	 */
+	static const std::size_t max_queued_bytes = 8 * 1024 * 1024;
+
+	/** \brief How many searches happen between each time the
+	 *  counters are logged.
+	 */
+	static const unsigned long statistics_log_interval = 1000;
+
+	/** \brief Runs the writer loop of a cache. */
+	class writer_thread_body
+	{
+	  file_cache_multilevel *parent;
+
+	public:
+	  writer_thread_body(file_cache_multilevel *_parent)
+	    : parent(_parent)
+	  {
+	  }
+
+	  void operator()() const
+	  {
+	    parent->run_writer();
+	  }
+	};
+
+	friend class writer_thread_body;
+
+	/** \brief The body of the writer thread. */
+	void run_writer()
+	{
+	  cw::threads::mutex::lock l(state_mutex);
+
+	  while(true)
+	    {
+	      while(write_queue.empty() && !shutting_down)
+		write_queued.wait(l);
+
+	      if(write_queue.empty())
+		break;
+
+	      const std::string key = write_queue.front();
+	      write_queue.pop_front();
+
+	      queued_write &w = queued_writes[key];
+	      w.queued = false;
+	      const boost::shared_ptr<const std::string> contents = w.contents;
+	      const time_t mtime = w.mtime;
+
+	      l.release();
+	      LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+			boost::format("Writing \"%s\" to the slower caches.") % key);
+	      for(std::vector<level>::size_type i = 1; i < levels.size(); ++i)
+		levels[i].cache->putItemContents(key, contents, mtime);
+	      l.acquire();
+
+	      // If the key was stored again while it was being
+	      // written, the new object is back in the queue; leave
+	      // it there.
+	      boost::unordered_map<std::string, queued_write>::iterator
+		found = queued_writes.find(key);
+	      if(found != queued_writes.end() && found->second.contents == contents)
+		{
+		  queued_bytes -= contents->size();
+		  queued_writes.erase(found);
+		}
+
+	      write_finished.wake_all();
+	    }
+	}
+
+	/** \brief Start the writer thread if it isn't running.
+	 *
+	 *  The caller must hold state_mutex.
+	 *
+	 *  \return \b true if the writer thread is running.
+	 */
+	bool start_writer()
+	{
+	  if(writer_thread.get() != NULL)
+	    return true;
+	  else if(writer_failed)
+	    return false;
+
+	  try
+	    {
+	      writer_thread =
+		boost::make_shared<cw::threads::thread>(writer_thread_body(this));
+	      return true;
+	    }
+	  catch(cw::threads::ThreadCreateException &)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       "Can't start the cache writer thread; writing to all the caches directly.");
+	      writer_failed = true;
+	      return false;
+	    }
+	}
+
+	static unsigned long microseconds_since(const timeval &start)
+	{
+	  timeval now;
+	  gettimeofday(&now, 0);
+
+	  return (now.tv_sec - start.tv_sec) * 1000000L
+	    + (now.tv_usec - start.tv_usec);
+	}
+
+	/** \brief Look a key up in one level, updating its counters.
+	 *
+	 *  Takes no lock of its own: each level does its own locking.
+	 */
+	boost::shared_ptr<const std::string>
+	find_in_level(level &lev, const std::string &key, time_t &mtime)
+	{
+	  timeval start;
+	  gettimeofday(&start, 0);
+
+	  boost::shared_ptr<const std::string> found =
+	    lev.cache->getItemContents(key, mtime);
+
+	  __sync_fetch_and_add(&lev.lookup_microseconds, microseconds_since(start));
+
+	  if(found.get() == NULL)
+	    __sync_fetch_and_add(&lev.misses, 1);
+	  else
+	    __sync_fetch_and_add(&lev.hits, 1);
+
+	  return found;
+	}
+
+	/** \brief Look a key up in each level after the fastest one in
+	 *  turn, copying it into the faster levels if it's found.
+	 *
+	 *  \param generation  the value of put_generation when the
+	 *                     search started.
+	 */
+	boost::shared_ptr<const std::string>
+	find_in_slower_levels(const std::string &key, time_t &mtime,
+			      unsigned long generation)
+	{
+	  for(std::vector<level>::size_type i = 1; i < levels.size(); ++i)
+	    {
+	      level &lev = levels[i];
+
+	      boost::shared_ptr<const std::string> found =
+		find_in_level(lev, key, mtime);
+
+	      if(found.get() == NULL)
+		continue;
+
+	      {
+		cw::threads::mutex::lock l(state_mutex);
+
+		// Don't overwrite an object that was stored while this
+		// one was being read.
+		if(put_generation == generation)
+		  {
+		    LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+			      boost::format("Copying \"%s\" from the %s cache into the faster caches.")
+			      % key % lev.name);
+
+		    for(std::vector<level>::size_type j = 0; j < i; ++j)
+		      levels[j].cache->putItemContents(key, found, mtime);
+		  }
+	      }
+
+	      return found;
+	    }
+
+	  return boost::shared_ptr<const std::string>();
+	}
+
+	/** \brief Write the counters of each level to the log. */
+	void log_statistics()
+	{
+	  for(std::vector<level>::iterator it = levels.begin();
+	      it != levels.end(); ++it)
+	    {
+	      const unsigned long hits = __sync_fetch_and_add(&it->hits, 0);
+	      const unsigned long misses = __sync_fetch_and_add(&it->misses, 0);
+	      const unsigned long microseconds = __sync_fetch_and_add(&it->lookup_microseconds, 0);
+	      const unsigned long lookups = hits + misses;
+
+	      LOG_INFO(Loggers::getAptitudeDownloadCacheStatistics(),
+		       boost::format("%s cache: %lu hits, %lu misses, %.1f microseconds per lookup")
+		       % it->name % hits % misses
+		       % (lookups == 0 ? 0.0 : (double)microseconds / lookups));
+	    }
+	}
 
       public:
 	file_cache_multilevel()
+	  : queued_bytes(0),
+	    put_generation(0),
+	    shutting_down(false),
+	    writer_failed(false),
+	    num_searches(0)
 	{
 	}
 
-	void push_back(const boost::shared_ptr<file_cache> &cache)
+	~file_cache_multilevel()
 	{
-	  caches.push_back(cache);
+	  {
+	    cw::threads::mutex::lock l(state_mutex);
+	    shutting_down = true;
+	    write_queued.wake_all();
+	  }
+
+	  if(writer_thread.get() != NULL)
+	    writer_thread->join();
+
+	  log_statistics();
+	}
+
+	void push_back(const boost::shared_ptr<file_cache> &cache,
+		       const std::string &name)
+	{
+	  levels.push_back(level(cache, name));
 	}
 
 
 	void putItem(const std::string &key, const std::string &path,
 		     time_t mtime)
 	{
-	  for(std::vector<boost::shared_ptr<file_cache> >::const_iterator
-		it = caches.begin(); it != caches.end(); ++it)
-	    (*it)->putItem(key, path, mtime);
+	  if(levels.size() < 2)
+	    {
+	      // There's nothing to write behind, so there's no need
+	      // to read the file into memory here.
+	      for(std::vector<level>::const_iterator it = levels.begin();
+		  it != levels.end(); ++it)
+		it->cache->putItem(key, path, mtime);
+	      return;
+	    }
+
+	  boost::shared_ptr<const std::string> contents;
+	  try
+	    {
+	      contents = read_file_contents(path);
+	    }
+	  catch(cw::util::Exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't cache \"%s\" as \"%s\": %s")
+		       % path % key % ex.errmsg());
+	      return;
+	    }
+	  catch(std::exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't cache \"%s\" as \"%s\": %s")
+		       % path % key % ex.what());
+	      return;
+	    }
+
+	  putItemContents(key, contents, mtime);
+	}
+
+	void putItemContents(const std::string &key,
+			     const boost::shared_ptr<const std::string> &contents,
+			     time_t mtime)
+	{
+	  if(levels.empty())
+	    return;
+
+	  {
+	    cw::threads::mutex::lock l(state_mutex);
+	    ++put_generation;
+	  }
+
+	  levels.front().cache->putItemContents(key, contents, mtime);
+
+	  if(levels.size() < 2)
+	    return;
+
+	  cw::threads::mutex::lock l(state_mutex);
+
+	  if(!start_writer())
+	    {
+	      l.release();
+	      for(std::vector<level>::size_type i = 1; i < levels.size(); ++i)
+		levels[i].cache->putItemContents(key, contents, mtime);
+	      return;
+	    }
+
+	  // An object that is larger than the whole queue is let in
+	  // once the queue is empty.
+	  while(queued_bytes > 0 &&
+		queued_bytes + contents->size() > max_queued_bytes)
+	    write_finished.wait(l);
+
+	  boost::unordered_map<std::string, queued_write>::iterator
+	    found = queued_writes.find(key);
+	  if(found == queued_writes.end())
+	    {
+	      queued_write w;
+	      w.contents = contents;
+	      w.mtime = mtime;
+	      w.queued = true;
+	      queued_writes[key] = w;
+	      write_queue.push_back(key);
+	    }
+	  else
+	    {
+	      queued_bytes -= found->second.contents->size();
+	      found->second.contents = contents;
+	      found->second.mtime = mtime;
+	      if(!found->second.queued)
+		{
+		  found->second.queued = true;
+		  write_queue.push_back(key);
+		}
+	    }
+
+	  queued_bytes += contents->size();
+	  write_queued.wake_one();
 	}
 
 	temp::name getItem(const std::string &key, time_t &mtime)
 	{
-	  for(std::vector<boost::shared_ptr<file_cache> >::const_iterator
-		it = caches.begin(); it != caches.end(); ++it)
+	  boost::shared_ptr<const std::string> contents = getItemContents(key, mtime);
+	  if(contents.get() == NULL)
+	    return temp::name();
+
+	  try
 	    {
-	      temp::name found = (*it)->getItem(key, mtime);
-	      if(found.valid())
+	      temp::name rval(write_contents(*contents));
+
+	      LOG_INFO(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Extracted %d bytes corresponding to \"%s\" to \"%s\".")
+		       % contents->size() % key % rval.get_name());
+
+	      return rval;
+	    }
+	  catch(cw::util::Exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't get the cache entry for \"%s\": %s")
+		       % key % ex.errmsg());
+	      return temp::name();
+	    }
+	  catch(std::exception &ex)
+	    {
+	      LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		       boost::format("Can't get the cache entry for \"%s\": %s")
+		       % key % ex.what());
+	      return temp::name();
+	    }
+	}
+
+	boost::shared_ptr<const std::string>
+	getItemContents(const std::string &key, time_t &mtime)
+	{
+	  if(levels.empty())
+	    return boost::shared_ptr<const std::string>();
+
+	  // Most lookups hit the fastest level, which does its own
+	  // locking, so try it before taking state_mutex.  "put"
+	  // requests store objects there before queuing them for the
+	  // slower levels, so the write queue can't hold anything
+	  // newer than what this finds.
+	  {
+	    time_t found_mtime = 0;
+	    boost::shared_ptr<const std::string> found =
+	      find_in_level(levels.front(), key, found_mtime);
+
+	    if(found.get() != NULL)
+	      {
+		if(__sync_add_and_fetch(&num_searches, 1) % statistics_log_interval == 0)
+		  log_statistics();
+
+		mtime = found_mtime;
 		return found;
+	      }
+	  }
+
+	  if(levels.size() < 2)
+	    {
+	      if(__sync_add_and_fetch(&num_searches, 1) % statistics_log_interval == 0)
+		log_statistics();
+
+	      return boost::shared_ptr<const std::string>();
+	    }
+
+	  boost::shared_ptr<search> my_search;
+	  unsigned long generation;
+
+	  {
+	    cw::threads::mutex::lock l(state_mutex);
+
+	    boost::unordered_map<std::string, queued_write>::const_iterator
+	      found_write = queued_writes.find(key);
+	    if(found_write != queued_writes.end())
+	      {
+		LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+			  boost::format("Found \"%s\" in the write queue.") % key);
+		mtime = found_write->second.mtime;
+		return found_write->second.contents;
+	      }
+
+	    boost::unordered_map<std::string, boost::shared_ptr<search> >::const_iterator
+	      found_search = searches.find(key);
+	    if(found_search != searches.end())
+	      {
+		const boost::shared_ptr<search> other = found_search->second;
+
+		LOG_TRACE(Loggers::getAptitudeDownloadCache(),
+			  boost::format("Waiting for another search for \"%s\".") % key);
+		while(!other->done)
+		  search_finished.wait(l);
+
+		if(other->contents.get() != NULL)
+		  mtime = other->mtime;
+		return other->contents;
+	      }
+
+	    my_search = boost::make_shared<search>();
+	    searches[key] = my_search;
+	    generation = put_generation;
+	  }
+
+	  boost::shared_ptr<const std::string> rval;
+	  time_t found_mtime = 0;
+	  try
+	    {
+	      rval = find_in_slower_levels(key, found_mtime, generation);
+	    }
+	  catch(...)
+	    {
+	      cw::threads::mutex::lock l(state_mutex);
+	      my_search->done = true;
+	      searches.erase(key);
+	      search_finished.wake_all();
+	      throw;
 	    }
 
-	  return temp::name();
+	  {
+	    cw::threads::mutex::lock l(state_mutex);
+	    my_search->contents = rval;
+	    my_search->mtime = found_mtime;
+	    my_search->done = true;
+	    searches.erase(key);
+	    search_finished.wake_all();
+	  }
+
+	  if(__sync_add_and_fetch(&num_searches, 1) % statistics_log_interval == 0)
+	    log_statistics();
+
+	  if(rval.get() != NULL)
+	    mtime = found_mtime;
+	  return rval;
 	}
       };
     }
 
     boost::shared_ptr<file_cache> file_cache::create(const std::string &filename,
 						     int memory_size,
-						     int disk_size)
+						     int disk_size,
+						     int compression_level)
     {
+      if(compression_level < 0)
+	compression_level = 0;
+      else if(compression_level > 9)
+	compression_level = 9;
+
       boost::shared_ptr<file_cache_multilevel> rval = boost::make_shared<file_cache_multilevel>();
 
       if(memory_size > 0)
 	{
 	  try
 	    {
-	      // \note A boost::multi_index_container might be more
-	      // efficient for the in-memory cache.  OTOH, it would
-	      // require more code.
-	      rval->push_back(boost::make_shared<file_cache_sqlite>(":memory:", memory_size));
+	      rval->push_back(boost::make_shared<file_cache_memory>(memory_size), "memory");
 	    }
 	  catch(const cw::util::Exception &ex)
 	    {
@@ -891,7 +2274,7 @@ insert into globals(TotalBlobSize) values(0);				\
 	{
 	  try
 	    {
-	      rval->push_back(boost::make_shared<file_cache_sqlite>(filename, disk_size));
+	      rval->push_back(boost::make_shared<file_cache_sqlite>(filename, disk_size, compression_level), "disk");
 	    }
 	  catch(const cw::util::Exception &ex)
 	    {
@@ -906,6 +2289,27 @@ insert into globals(TotalBlobSize) values(0);				\
       return rval;
     }
 
+    void file_cache::putItemContents(const std::string &key,
+				     const boost::shared_ptr<const std::string> &contents,
+				     time_t mtime)
+    {
+      try
+	{
+	  temp::name tn(write_contents(*contents));
+	  putItem(key, tn.get_name(), mtime);
+	}
+      catch(cw::util::Exception &ex)
+	{
+	  LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		   boost::format("Can't cache \"%s\": %s") % key % ex.errmsg());
+	}
+      catch(std::exception &ex)
+	{
+	  LOG_WARN(Loggers::getAptitudeDownloadCache(),
+		   boost::format("Can't cache \"%s\": %s") % key % ex.what());
+	}
+    }
+
     file_cache::~file_cache()
     {
     }
@@ -21,6 +21,8 @@
 
 #include <boost/shared_ptr.hpp>
 
+#include <string>
+
 #include <time.h>
 
 #include "temp.h"
@@ -84,6 +86,22 @@ namespace aptitude
 	putItem(key, path, 0);
       }
 
+      /** \brief Store the contents of a file in the cache.
+       *
+       *  \param key      The key under which the contents are to be
+       *                  stored.
+       *  \param contents The contents to store.  The cache may keep
+       *                  a reference to the buffer instead of
+       *                  copying it.
+       *  \param mtime    The last modified time of the item to insert.
+       *
+       *  The default implementation writes the contents to a
+       *  temporary file and passes it to putItem().
+       */
+      virtual void putItemContents(const std::string &key,
+				   const boost::shared_ptr<const std::string> &contents,
+				   time_t mtime);
+
       /** \brief Retrieve a file from the cache.
        *
        *  As a side effect, marks the file as recently visited, so it
@@ -109,6 +127,35 @@ namespace aptitude
 	return getItem(key, mtime);
       }
 
+      /** \brief Retrieve the contents of a file from the cache.
+       *
+       *  Like getItem(), but returns the contents in memory instead
+       *  of extracting them to a temporary file.  Items that are in
+       *  the in-memory cache are returned without copying them or
+       *  touching the filesystem.
+       *
+       *  \param key   The key under which the file was stored.
+       *  \param mtime Set to the most recent date and time at which
+       *               the given key was modified.
+       *
+       *  \return the contents of the file, or an invalid pointer if
+       *  the key isn't in the cache.  The buffer may be shared with
+       *  the cache and with other callers.
+       */
+      virtual boost::shared_ptr<const std::string>
+      getItemContents(const std::string &key, time_t &mtime) = 0;
+
+      /** \brief Retrieve the contents of a file from the cache.
+       *
+       *  \param key   The key under which the file was stored.
+       */
+      boost::shared_ptr<const std::string>
+      getItemContents(const std::string &key)
+      {
+	time_t mtime;
+	return getItemContents(key, mtime);
+      }
+
       /** \brief Open or create a new file cache with the given
        *  parameters.
        *
@@ -116,14 +163,27 @@ namespace aptitude
        *                        stored.
        *  \param memory_size    The maximum allowed size in bytes of the in-memory
        *                        cache. (if zero, only an on-disk cache
-       *                        will be used)
+       *                        will be used)  Unlike the on-disk
+       *                        cache, the in-memory cache stores
+       *                        files uncompressed.
        *  \param disk_size      The maximum allowed size in bytes of the on-disk
        *                        cache.  (if zero, only a memory cache
        *                        will be used)
+       *  \param compression_level  The zlib compression level (1-9)
+       *                        of files stored in the on-disk cache,
+       *                        or 0 to store them uncompressed.
+       *                        Files that don't compress well are
+       *                        always stored uncompressed.
+       *
+       *  When both caches are enabled, items found on disk are
+       *  copied into memory, and items are stored on disk by a
+       *  background thread after they have been stored in memory.
+       *  Concurrent lookups of the same key share a single search.
        */
       static boost::shared_ptr<file_cache> create(const std::string &filename,
 						  int memory_size,
-						  int disk_size);
+						  int disk_size,
+						  int compression_level = 6);
 
       virtual ~file_cache();
     };
@@ -29,6 +29,7 @@
 #include <boost/compressed_pair.hpp>
 
 #include "compare3.h"
+#include "small_object_pool.h"
 
 /** \brief A class to represent immutable sets
  *
@@ -169,6 +170,20 @@ namespace imm
       {
       }
 
+      /** Tree nodes are small and the resolver creates and destroys
+       *  huge numbers of them, so they are drawn from a pool instead
+       *  of the general-purpose heap.
+       */
+      static void *operator new(std::size_t size)
+      {
+	return aptitude::util::small_object_pool::allocate(size);
+      }
+
+      static void operator delete(void *p, std::size_t size)
+      {
+	aptitude::util::small_object_pool::deallocate(p, size);
+      }
+
       impl *clone(const AccumOps &ops) const
       {
 	return new impl(val, left.clone(ops), right.clone(ops), ops);
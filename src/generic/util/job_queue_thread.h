@@ -18,9 +18,16 @@
 // the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
 // Boston, MA 02111-1307, USA.
 
+#ifndef JOB_QUEUE_THREAD_H
+#define JOB_QUEUE_THREAD_H
+
+#include <algorithm>
 #include <deque>
+#include <map>
+#include <vector>
 
 #include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include <cwidget/generic/threads/threads.h>
 
@@ -30,32 +37,136 @@ namespace aptitude
 {
   namespace util
   {
-    /** \brief Base class for threads that work by processing a single
-     *  job at a time.
+    /** \brief The lanes of a job_queue_thread.
+     *
+     *  A waiting job is never started while there are jobs waiting
+     *  in a higher lane.
+     */
+    enum job_priority
+      {
+	/** \brief Jobs whose results the user is waiting for. */
+	job_priority_high,
+	/** \brief Ordinary jobs. */
+	job_priority_normal,
+	/** \brief Jobs whose results might never be needed. */
+	job_priority_low,
+	/** \brief The number of lanes. */
+	num_job_priorities
+      };
+
+    /** \brief Lets whoever queued a job cancel it.
+     *
+     *  A canceled job that hasn't started yet is dropped from the
+     *  queue; a job that is already running is told about the
+     *  cancellation only if it polls
+     *  job_queue_thread::get_job_cancelled().  cancel() may be
+     *  invoked from any thread.
+     */
+    class job_handle
+    {
+      volatile int cancelled;
+
+    public:
+      job_handle()
+	: cancelled(0)
+      {
+      }
+
+      /** \brief Cancel the job. */
+      void cancel()
+      {
+	__sync_lock_test_and_set(&cancelled, 1);
+      }
+
+      /** \brief Test whether the job was canceled. */
+      bool get_cancelled() const
+      {
+	__sync_synchronize();
+	return cancelled != 0;
+      }
+    };
+
+    /** \brief A snapshot of the state of a job_queue_thread. */
+    struct job_queue_metrics
+    {
+      /** \brief The number of jobs waiting in each lane. */
+      std::size_t queued[num_job_priorities];
+      /** \brief The largest number of jobs that were ever waiting at
+       *  once.
+       */
+      std::size_t max_queued;
+      /** \brief The number of jobs being processed. */
+      std::size_t running;
+      /** \brief The number of worker threads. */
+      std::size_t workers;
+      /** \brief The number of jobs that have been processed. */
+      unsigned long completed;
+      /** \brief The number of jobs that were merged into a job that
+       *  was already waiting.
+       */
+      unsigned long coalesced;
+      /** \brief The number of jobs that were dropped because they
+       *  were canceled before they started.
+       */
+      unsigned long cancelled;
+
+      job_queue_metrics()
+	: max_queued(0), running(0), workers(0),
+	  completed(0), coalesced(0), cancelled(0)
+      {
+	std::fill(queued, queued + num_job_priorities, 0);
+      }
+    };
+
+    /** \brief Base class for threads that work by processing a
+     *  queue of jobs.
+     *
+     *  Jobs are run by up to Subclass::get_max_workers() worker
+     *  threads, each with its own instance of Subclass.  Workers are
+     *  started when jobs are added and exit when the queue is empty.
      *
      *  \tparam Subclass The class that will be derived from
      *  job_queue.  Must be default-constructable and must define a
      *  static method get_log_category() returning the category under
-     *  which messages should be logged.
+     *  which messages should be logged.  It may also hide
+     *  get_max_workers() and merge_job() to change how many jobs run
+     *  at once and which jobs are coalesced.
      *
      *  \tparam Job The type that represents jobs in the queue.  Must
-     *  be copy-constructable, default-constructable, and support
-     *  output to ostreams via operator<<.
-     *
-     *  \todo Add support for running up to a fixed number of jobs at
-     *  the same time?
+     *  be copy-constructable and support output to ostreams via
+     *  operator<<.
      */
     template<typename Subclass, typename Job>
     class job_queue_thread
     {
-      // The jobs waiting to be run.
-      static std::deque<Job> jobs;
+      /** \brief A job waiting to be run. */
+      struct queued_job
+      {
+	Job job;
+	boost::shared_ptr<job_handle> handle;
+
+	queued_job(const Job &_job,
+		   const boost::shared_ptr<job_handle> &_handle)
+	  : job(_job), handle(_handle)
+	{
+	}
+      };
+
+      // The jobs waiting to be run, one queue per priority.
+      static std::deque<queued_job> jobs[num_job_priorities];
+
+      // The active worker threads, indexed by an ID assigned when
+      // each one is started.
+      typedef std::map<unsigned int, boost::shared_ptr<cwidget::threads::thread> > worker_map;
+      static worker_map workers;
 
-      // The single instance of this class.
-      static boost::shared_ptr<job_queue_thread> active_instance;
+      // The ID of the next worker to be started.
+      static unsigned int next_worker_id;
 
-      // The active thread, or NULL if there isn't one.
-      static boost::shared_ptr<cwidget::threads::thread> active_thread;
+      // The counters reported by get_metrics().  The queue lengths
+      // and the number of workers are filled in when the metrics are
+      // retrieved.
+      static job_queue_metrics metrics;
 
       // Set to true if the thread is currently stopped.  This causes
       // the job-processing loop to exit and prevents the thread from
@@ -66,28 +177,103 @@ namespace aptitude
       // job.
       static cwidget::threads::mutex state_mutex;
 
+      // The handle of the job this worker is processing, if any.
+      boost::shared_ptr<job_handle> current_job;
+
       class bootstrap
       {
 	boost::shared_ptr<job_queue_thread> target;
+	unsigned int id;
 
       public:
-	bootstrap(const boost::shared_ptr<job_queue_thread> &_target)
-	  : target(_target)
+	bootstrap(const boost::shared_ptr<job_queue_thread> &_target,
+		  unsigned int _id)
+	  : target(_target), id(_id)
 	{
 	}
 
 	void operator()() const
 	{
-	  target->run();
+	  target->run(id);
 	}
       };
 
+      /** \brief Count the jobs waiting in all the lanes.
+       *
+       *  The caller must hold state_mutex.
+       */
+      static std::size_t count_queued()
+      {
+	std::size_t rval = 0;
+	for(int lane = 0; lane < num_job_priorities; ++lane)
+	  rval += jobs[lane].size();
+
+	return rval;
+      }
+
+      /** \brief Find the highest lane that has waiting jobs.
+       *
+       *  The caller must hold state_mutex.
+       *
+       *  \return the lane, or num_job_priorities if no jobs are
+       *  waiting.
+       */
+      static int first_nonempty_lane()
+      {
+	int lane = 0;
+	while(lane < num_job_priorities && jobs[lane].empty())
+	  ++lane;
+
+	return lane;
+      }
+
+    protected:
+      /** \brief Test whether the job that this worker is processing
+       *  has been canceled.
+       *
+       *  Long-running jobs can poll this from process_job() to give
+       *  up early.
+       */
+      bool get_job_cancelled() const
+      {
+	return current_job.get() != NULL && current_job->get_cancelled();
+      }
+
     public:
       // Instance members first:
       job_queue_thread()
       {
       }
 
+      virtual ~job_queue_thread()
+      {
+      }
+
+      /** \brief Get the largest number of jobs that may run at once.
+       *
+       *  The default is 1, which processes the jobs serially in the
+       *  order of their lanes.
+       */
+      static unsigned int get_max_workers()
+      {
+	return 1;
+      }
+
+      /** \brief Try to merge a new job into one that is already
+       *  waiting.
+       *
+       *  \param pending   A job in the queue.
+       *  \param incoming  The job being added.
+       *
+       *  \return \b true if pending now does the work of incoming as
+       *  well, in which case incoming isn't queued.  The default
+       *  never merges jobs.
+       */
+      static bool merge_job(Job &pending, const Job &incoming)
+      {
+	return false;
+      }
+
       /** \brief Test whether there are more jobs in the thread's
        *  input queue.
        */
@@ -95,7 +281,7 @@ namespace aptitude
       {
 	cwidget::threads::mutex::lock l(state_mutex);
 
-	return jobs.empty();
+	return count_queued() == 0;
       }
 
       /** \brief Test whether the queue has been stopped by a call to
@@ -108,29 +294,74 @@ namespace aptitude
 	return stopped;
       }
 
+      /** \brief Retrieve the current state of the queue. */
+      static job_queue_metrics get_metrics()
+      {
+	cwidget::threads::mutex::lock l(state_mutex);
+
+	job_queue_metrics rval(metrics);
+	for(int lane = 0; lane < num_job_priorities; ++lane)
+	  rval.queued[lane] = jobs[lane].size();
+	rval.workers = workers.size();
+
+	return rval;
+      }
+
       /** \brief Add a new job to the queue of jobs for this thread to
        *  run.
        *
-       *  If the background thread isn't stopped, starts it.
+       *  If the background thread isn't stopped, starts it.  If the
+       *  job is merged into a waiting job, that job is moved up to
+       *  the given priority if it was in a lower lane.
+       *
+       *  \return a handle that can be used to cancel the job.  If the
+       *  job was merged, this is the handle of the job it was merged
+       *  into.
        */
-      static void add_job(const Job &job)
+      static boost::shared_ptr<job_handle>
+      add_job(const Job &job, job_priority priority = job_priority_normal)
       {
 	cwidget::threads::mutex::lock l(state_mutex);
 
+	for(int lane = 0; lane < num_job_priorities; ++lane)
+	  for(typename std::deque<queued_job>::iterator it = jobs[lane].begin();
+	      it != jobs[lane].end(); ++it)
+	    if(!it->handle->get_cancelled() &&
+	       Subclass::merge_job(it->job, job))
+	      {
+		LOG_TRACE(Subclass::get_log_category(),
+			  "Merged a job into one that was already queued: " << job);
+
+		++metrics.coalesced;
+
+		const boost::shared_ptr<job_handle> rval(it->handle);
+		if(priority < lane)
+		  {
+		    jobs[priority].push_back(*it);
+		    jobs[lane].erase(it);
+		  }
+
+		return rval;
+	      }
+
 	LOG_TRACE(Subclass::get_log_category(),
 		  "Adding a job to the queue: " << job);
 
-	jobs.push_back(job);
+	const boost::shared_ptr<job_handle> rval(boost::make_shared<job_handle>());
+	jobs[priority].push_back(queued_job(job, rval));
+	metrics.max_queued = std::max(metrics.max_queued, count_queued());
 
 	if(!stopped)
 	  start();
+
+	return rval;
       }
 
-      /** \brief Stop the active thread if there is one.
+      /** \brief Stop the active threads if there are any.
        *
-       *  The background thread will only be stopped between jobs.
+       *  The background threads will only be stopped between jobs.
        *
-       *  Blocks until the thread exits.  Until start() is invoked, no
+       *  Blocks until the threads exit.  Until start() is invoked, no
        *  jobs will be processed.
        */
       static void stop()
@@ -138,25 +369,30 @@ namespace aptitude
 	cwidget::threads::mutex::lock l(state_mutex);
 
 	LOG_TRACE(Subclass::get_log_category(),
-		  "Pausing the background thread.");
+		  "Pausing the background threads.");
 
 	stopped = true;
 
-	// Copy this since it'll be zeroed out when the thread exits,
-	// which can happen as soon as the lock is released below.
-	boost::shared_ptr<cwidget::threads::thread> active_thread_copy(active_thread);
+	// Copy the threads since they'll be dropped from the map when
+	// they exit, which can happen as soon as the lock is released
+	// below.
+	std::vector<boost::shared_ptr<cwidget::threads::thread> > workers_copy;
+	for(typename worker_map::const_iterator it = workers.begin();
+	    it != workers.end(); ++it)
+	  workers_copy.push_back(it->second);
 
 	l.release();
 
-	if(active_thread_copy.get() != NULL)
-	  active_thread_copy->join();
+	for(std::vector<boost::shared_ptr<cwidget::threads::thread> >::const_iterator
+	      it = workers_copy.begin(); it != workers_copy.end(); ++it)
+	  (*it)->join();
       }
 
-      /** \brief Start the background thread if it has jobs to
-       *  process.
+      /** \brief Start background threads for the jobs that are
+       *  waiting.
        *
-       *  Has no effect if there are no jobs or if a thread is already
-       *  running.
+       *  Has no effect if there are no jobs or if enough threads are
+       *  already running.
        */
       static void start()
       {
@@ -164,38 +400,86 @@ namespace aptitude
 
 	stopped = false;
 
-	if(active_thread != NULL)
-	  LOG_TRACE(Subclass::get_log_category(),
-		    "Not starting the background thread: it's already running.");
-	else if(empty())
-	  LOG_TRACE(Subclass::get_log_category(),
-		    "Not starting the background thread: it has no jobs.");
-	else
+	const std::size_t max_workers =
+	  std::max<std::size_t>(1, Subclass::get_max_workers());
+	const std::size_t queued = count_queued();
+
+	if(queued == 0)
 	  {
-	    LOG_TRACE(Subclass::get_log_category(), "Starting the background thread.");
+	    LOG_TRACE(Subclass::get_log_category(),
+		      "Not starting a background thread: there are no jobs.");
+	    return;
+	  }
 
-	    active_instance = boost::make_shared<Subclass>();
-	    active_thread = boost::make_shared<cwidget::threads::thread>(bootstrap(active_instance));
+	// Workers that aren't processing a job are about to take one
+	// from the queue, so only the jobs that are left over need a
+	// new worker.
+	if(workers.size() >= max_workers ||
+	   workers.size() >= queued + metrics.running)
+	  {
+	    LOG_TRACE(Subclass::get_log_category(),
+		      "Not starting a background thread: "
+		      << workers.size() << " are already running.");
+	    return;
+	  }
+
+	while(workers.size() < max_workers &&
+	      workers.size() < queued + metrics.running)
+	  {
+	    const unsigned int id = next_worker_id++;
+
+	    LOG_TRACE(Subclass::get_log_category(),
+		      "Starting background thread " << id << ".");
+
+	    try
+	      {
+		boost::shared_ptr<job_queue_thread> instance =
+		  boost::make_shared<Subclass>();
+		workers[id] = boost::make_shared<cwidget::threads::thread>(bootstrap(instance, id));
+	      }
+	    catch(cwidget::threads::ThreadCreateException &)
+	      {
+		LOG_WARN(Subclass::get_log_category(),
+			 "Unable to start a background thread; "
+			 << workers.size() << " are running.");
+		workers.erase(id);
+		break;
+	      }
 	  }
       }
 
-      /** \brief Process a single job serially. */
+      /** \brief Process a single job. */
       virtual void process_job(const Job &job) = 0;
 
     private:
       /** \brief Dequeue and process jobs until the queue is empty or
        *  the thread is stopped.
+       *
+       *  \param id  The key of this worker in the workers map.
        */
-      void run()
+      void run(unsigned int id)
       {
 	try
 	  {
 	    cwidget::threads::mutex::lock l(state_mutex);
 
-	    while(!jobs.empty() && !stopped)
+	    int lane;
+	    while(!stopped &&
+		  (lane = first_nonempty_lane()) != num_job_priorities)
 	      {
-		Job next(jobs.front());
-		jobs.pop_front();
+		queued_job next(jobs[lane].front());
+		jobs[lane].pop_front();
+
+		if(next.handle->get_cancelled())
+		  {
+		    LOG_TRACE(Subclass::get_log_category(),
+			      "Dropping a canceled job: " << next.job);
+		    ++metrics.cancelled;
+		    continue;
+		  }
+
+		current_job = next.handle;
+		++metrics.running;
 
 		// Unlock the state mutex, so that jobs can be
 		// inserted without blocking while this job is being
@@ -204,7 +488,7 @@ namespace aptitude
 
 		try
 		  {
-		    process_job(next);
+		    process_job(next.job);
 		  }
 		catch(const std::exception &ex)
 		  {
@@ -220,10 +504,13 @@ namespace aptitude
 		  }
 
 		l.acquire();
+
+		current_job.reset();
+		--metrics.running;
+		++metrics.completed;
 	      }
 
-	    active_thread.reset();
-	    active_instance.reset();
+	    workers.erase(id);
 	    return; // Unless there's an unlikely error, we exit here;
 	            // otherwise we try some last-chance error
 	            // handling below.
@@ -245,20 +532,24 @@ namespace aptitude
 	// that can't be processed!
 	{
 	  cwidget::threads::mutex::lock l(state_mutex);
-	  active_thread.reset();
+	  workers.erase(id);
 	}
       }
     };
 
     // Instantiate static members:
     template<typename Subclass, typename Job>
-    std::deque<Job> job_queue_thread<Subclass, Job>::jobs;
+    std::deque<typename job_queue_thread<Subclass, Job>::queued_job>
+    job_queue_thread<Subclass, Job>::jobs[num_job_priorities];
 
     template<typename Subclass, typename Job>
-    boost::shared_ptr<job_queue_thread<Subclass, Job> > job_queue_thread<Subclass, Job>::active_instance;
+    typename job_queue_thread<Subclass, Job>::worker_map job_queue_thread<Subclass, Job>::workers;
 
     template<typename Subclass, typename Job>
-    boost::shared_ptr<cwidget::threads::thread> job_queue_thread<Subclass, Job>::active_thread;
+    unsigned int job_queue_thread<Subclass, Job>::next_worker_id = 0;
+
+    template<typename Subclass, typename Job>
+    job_queue_metrics job_queue_thread<Subclass, Job>::metrics;
 
     template<typename Subclass, typename Job>
     bool job_queue_thread<Subclass, Job>::stopped = false;
@@ -267,3 +558,5 @@ namespace aptitude
     cwidget::threads::mutex job_queue_thread<Subclass, Job>::state_mutex((cwidget::threads::mutex::attr(PTHREAD_MUTEX_RECURSIVE)));
   }
 }
+
+#endif // JOB_QUEUE_THREAD_H
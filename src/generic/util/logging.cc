@@ -29,7 +29,13 @@
 
 #include <cwidget/generic/threads/threads.h>
 
+#include <fstream>
 #include <iostream>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
 
 using boost::enable_shared_from_this;
 using boost::make_shared;
@@ -42,6 +48,7 @@ using boost::multi_index::tag;
 using boost::optional;
 using boost::shared_ptr;
 using boost::weak_ptr;
+using cwidget::threads::condition;
 using cwidget::threads::mutex;
 
 namespace aptitude
@@ -80,7 +87,7 @@ namespace aptitude
         // instance.
         const weak_ptr<LoggingSystem::Impl> loggingSystemWeak;
 
-        sigc::signal<void, const char *, int, log_level, LoggerPtr, std::string>
+        sigc::signal<void, const char *, int, log_level, LoggerPtr, const std::string &>
         signal_message_logged;
 
         static log_level getDefaultLevel() { return ERROR_LEVEL; }
@@ -109,7 +116,7 @@ namespace aptitude
                                  int,
                                  log_level,
                                  LoggerPtr,
-                                 std::string> &slot);
+                                 const std::string &> &slot);
       };
 
       Logger::Impl::Impl(const std::string &_category,
@@ -129,25 +136,29 @@ namespace aptitude
                              log_level logLevel,
                              const std::string &msg)
       {
-        // \note shared_from_this() could be costly; it would be more
-        // efficient to receive the logger as a parameter, but that
-        // would clutter the interface.
-
-
         // We emit this log message at each level of the hierarchy,
         // but the logger passed along always refers to where the
         // message started.
-        const boost::shared_ptr<Impl> self = shared_from_this();
-        boost::shared_ptr<Impl> logger = self;
-        while(logger.get() != NULL)
+        //
+        // Usually only the root logger has anything connected, so
+        // the hierarchy is walked without touching reference counts
+        // and shared_from_this() is only invoked for a logger that
+        // has a slot to call.
+        boost::shared_ptr<Impl> self;
+        for(const Impl *logger = this; logger != NULL;
+            logger = logger->parent.get())
           {
+            if(logger->signal_message_logged.empty())
+              continue;
+
+            if(self.get() == NULL)
+              self = shared_from_this();
+
             logger->signal_message_logged(sourceFilename,
                                           sourceLineNumber,
                                           logLevel,
                                           self,
                                           msg);
-
-            logger = logger->parent;
           }
       }
 
@@ -227,7 +238,7 @@ namespace aptitude
         void recursiveSetEffectiveLevel(const shared_ptr<Logger::Impl> &logger,
                                         log_level effectiveLevel)
         {
-          logger->effectiveLevel = effectiveLevel;
+          logger->setEffectiveLevel(effectiveLevel);
           std::pair<child_iterator, child_iterator> children =
             find_children(logger);
 
@@ -375,15 +386,15 @@ namespace aptitude
                                              int,
                                              log_level,
                                              LoggerPtr,
-                                             std::string> &slot)
+                                             const std::string &> &slot)
       {
         return signal_message_logged.connect(slot);
       }
 
 
       Logger::Logger(log_level _effectiveLevel)
-        : effectiveLevel(_effectiveLevel)
       {
+        setEffectiveLevel(_effectiveLevel);
       }
 
       Logger::~Logger()
@@ -399,6 +410,410 @@ namespace aptitude
       {
         return LoggingSystem::Impl::create();
       }
+
+      LogSink::~LogSink()
+      {
+      }
+
+      namespace
+      {
+        /** \brief Read a counter that other threads modify; reads
+         *  that follow it see everything that was written before the
+         *  value was stored.
+         */
+        unsigned long load_counter(unsigned long &counter)
+        {
+          return __sync_fetch_and_add(&counter, 0);
+        }
+
+        /** \brief Change a counter that other threads read, after
+         *  everything that was written before it.
+         *
+         *  Only the calling thread may be able to change the counter,
+         *  so the compare-and-swap (which is used for its full
+         *  barrier) always succeeds.
+         */
+        void store_counter(unsigned long &counter,
+                           unsigned long old_value,
+                           unsigned long new_value)
+        {
+          __sync_val_compare_and_swap(&counter, old_value, new_value);
+        }
+
+        /** \brief A message waiting to be written by an
+         *  AsyncLogSink.
+         */
+        struct queued_message
+        {
+          time_t time;
+          pthread_t thread;
+          const char *sourceFilename;
+          int sourceLineNumber;
+          log_level level;
+          LoggerPtr logger;
+          std::string msg;
+        };
+
+        /** \brief A slot in the ring buffer of an AsyncLogSink.
+         *
+         *  The sequence number says what the slot is waiting for: if
+         *  it is equal to the position of a message, the message can
+         *  be stored in it; if it is one more, the message has been
+         *  stored and can be written.  Once the message is written,
+         *  the slot waits for the message one lap of the ring later.
+         */
+        struct ring_cell
+        {
+          unsigned long sequence;
+          queued_message message;
+        };
+
+        /** \brief Writes log messages from a background thread.
+         *
+         *  The ring buffer is a bounded multi-producer queue: a
+         *  logging thread claims a position by advancing enqueue_pos
+         *  with compare-and-swap, fills in the slot, and publishes it
+         *  by advancing the slot's sequence number.  Only the writer
+         *  thread removes messages, so it can advance dequeue_pos
+         *  without synchronizing with anyone.
+         *
+         *  state_mutex is never taken by a logging thread unless the
+         *  ring is full, in which case the thread sleeps until the
+         *  writer has made room.
+         */
+        class AsyncLogSink : public LogSink
+        {
+          std::ofstream file;
+          std::ostream &out;
+
+          std::vector<ring_cell> ring;
+          const unsigned long mask;
+
+          unsigned long enqueue_pos;
+          unsigned long dequeue_pos;
+
+          // Protects the members below.
+          mutex state_mutex;
+
+          // Signalled to wake the writer thread up.
+          condition writer_wakeup;
+
+          // Signalled when the writer thread has written some
+          // messages; flush() and logging threads that found the ring
+          // full wait on it.
+          condition messages_written;
+
+          // How many messages have been written.
+          unsigned long written_pos;
+
+          bool shutting_down;
+
+          // Nonzero if messages are written by the thread that logs
+          // them: either the writer thread couldn't be started, or
+          // make_synchronous() stopped it.  Only changed with
+          // state_mutex held, but read without it.
+          unsigned long synchronous;
+
+          boost::shared_ptr<cwidget::threads::thread> writer_thread;
+
+          // How long the writer sleeps when there is nothing to write
+          // before it checks again, in milliseconds.  Logging threads
+          // don't wake it up, since that would need the lock.
+          static const long poll_interval = 50;
+
+          static std::size_t round_capacity(std::size_t capacity)
+          {
+            std::size_t rval = 1;
+            while(rval < capacity)
+              rval *= 2;
+            return rval;
+          }
+
+          class writer_thread_body
+          {
+            AsyncLogSink *parent;
+
+          public:
+            writer_thread_body(AsyncLogSink *_parent)
+              : parent(_parent)
+            {
+            }
+
+            void operator()() const
+            {
+              parent->run_writer();
+            }
+          };
+
+          friend class writer_thread_body;
+
+          void write_message(const queued_message &m)
+          {
+            struct tm local_time;
+            localtime_r(&m.time, &local_time);
+
+            char time_buf[64];
+            if(strftime(time_buf, sizeof(time_buf), "%F %T", &local_time) == 0)
+              time_buf[0] = '\0';
+
+            out << time_buf
+                << " [" << m.thread << "] "
+                << m.sourceFilename << ":" << m.sourceLineNumber
+                << " " << describe_log_level(m.level)
+                << " " << m.logger->getCategory()
+                << " - " << m.msg << '\n';
+          }
+
+          /** \brief Try to store a message in the ring buffer.
+           *
+           *  \return \b false if the ring is full.
+           */
+          bool try_enqueue(const char *sourceFilename,
+                           int sourceLineNumber,
+                           log_level level,
+                           const LoggerPtr &logger,
+                           const std::string &msg)
+          {
+            unsigned long pos = load_counter(enqueue_pos);
+            ring_cell *cell;
+
+            while(true)
+              {
+                cell = &ring[pos & mask];
+                const long diff = (long)load_counter(cell->sequence) - (long)pos;
+
+                if(diff == 0)
+                  {
+                    if(__sync_bool_compare_and_swap(&enqueue_pos, pos, pos + 1))
+                      break;
+                    pos = load_counter(enqueue_pos);
+                  }
+                else if(diff < 0)
+                  // The slot still holds the message from the last
+                  // lap of the ring.
+                  return false;
+                else
+                  // Another thread claimed this position.
+                  pos = load_counter(enqueue_pos);
+              }
+
+            queued_message &m(cell->message);
+            m.time = time(NULL);
+            m.thread = pthread_self();
+            m.sourceFilename = sourceFilename;
+            m.sourceLineNumber = sourceLineNumber;
+            m.level = level;
+            m.logger = logger;
+            // Assigning into the old string reuses its buffer.
+            m.msg = msg;
+
+            store_counter(cell->sequence, pos, pos + 1);
+            return true;
+          }
+
+          /** \brief Return \b true if the next message has been
+           *  stored.  Only called by the thread that writes messages.
+           */
+          bool message_ready()
+          {
+            return load_counter(ring[dequeue_pos & mask].sequence) == dequeue_pos + 1;
+          }
+
+          /** \brief Write all the messages that have been stored.
+           *  Only called by the thread that writes messages.
+           */
+          void write_ready_messages()
+          {
+            bool wrote_any = false;
+
+            while(message_ready())
+              {
+                ring_cell &cell(ring[dequeue_pos & mask]);
+
+                write_message(cell.message);
+                cell.message.logger.reset();
+
+                store_counter(cell.sequence, dequeue_pos + 1, dequeue_pos + mask + 1);
+                ++dequeue_pos;
+                wrote_any = true;
+              }
+
+            if(wrote_any)
+              out << std::flush;
+          }
+
+          /** \brief The body of the writer thread. */
+          void run_writer()
+          {
+            while(true)
+              {
+                write_ready_messages();
+
+                mutex::lock l(state_mutex);
+
+                written_pos = dequeue_pos;
+                messages_written.wake_all();
+
+                if(message_ready())
+                  continue;
+                else if(shutting_down)
+                  break;
+
+                timeval now;
+                gettimeofday(&now, 0);
+
+                timespec until;
+                until.tv_sec = now.tv_sec + poll_interval / 1000;
+                until.tv_nsec = (now.tv_usec + (poll_interval % 1000) * 1000) * 1000;
+                if(until.tv_nsec >= 1000000000)
+                  {
+                    until.tv_sec += 1;
+                    until.tv_nsec -= 1000000000;
+                  }
+
+                writer_wakeup.timed_wait(l, until);
+              }
+          }
+
+        public:
+          AsyncLogSink(const std::string &filename, std::size_t capacity)
+            : file(),
+              out(filename == "-" ? std::cout : static_cast<std::ostream &>(file)),
+              ring(round_capacity(capacity)),
+              mask(ring.size() - 1),
+              enqueue_pos(0),
+              dequeue_pos(0),
+              written_pos(0),
+              shutting_down(false),
+              synchronous(0)
+          {
+            if(filename != "-")
+              // Since logging is just for debugging, nothing is done
+              // if the log file can't be opened; the messages are
+              // discarded by the stream.
+              file.open(filename.c_str(), std::ios::app);
+
+            for(std::vector<ring_cell>::size_type i = 0; i < ring.size(); ++i)
+              ring[i].sequence = i;
+
+            try
+              {
+                writer_thread =
+                  boost::make_shared<cwidget::threads::thread>(writer_thread_body(this));
+              }
+            catch(cwidget::threads::ThreadCreateException &)
+              {
+                synchronous = 1;
+              }
+          }
+
+          ~AsyncLogSink()
+          {
+            stop_writer();
+          }
+
+          /** \brief Stop the writer thread, if it's running, once it
+           *  has written the messages that are ready.
+           */
+          void stop_writer()
+          {
+            if(writer_thread.get() != NULL)
+              {
+                {
+                  mutex::lock l(state_mutex);
+                  shutting_down = true;
+                  writer_wakeup.wake_all();
+                }
+
+                writer_thread->join();
+                writer_thread.reset();
+              }
+          }
+
+          /** \brief Write the messages that are ready from the
+           *  logging thread; state_mutex must be held.
+           */
+          void write_synchronously()
+          {
+            write_ready_messages();
+            written_pos = dequeue_pos;
+            messages_written.wake_all();
+          }
+
+          void message_logged(const char *sourceFilename,
+                              int sourceLineNumber,
+                              log_level level,
+                              LoggerPtr logger,
+                              const std::string &msg)
+          {
+            if(load_counter(synchronous) == 0 &&
+               try_enqueue(sourceFilename, sourceLineNumber,
+                           level, logger, msg))
+              {
+                // If the sink became synchronous while the message
+                // was being stored, it might have missed the message.
+                if(load_counter(synchronous) != 0)
+                  {
+                    mutex::lock l(state_mutex);
+                    write_synchronously();
+                  }
+                return;
+              }
+
+            // The ring is full: wake the writer up and sleep until it
+            // has written something.  The writer frees slots before
+            // it takes the lock to announce them, so a slot that is
+            // still taken when the retry below fails will be
+            // announced after this thread starts waiting.
+            mutex::lock l(state_mutex);
+            while(synchronous == 0)
+              {
+                if(try_enqueue(sourceFilename, sourceLineNumber,
+                               level, logger, msg))
+                  return;
+
+                writer_wakeup.wake_all();
+                messages_written.wait(l);
+              }
+
+            // The ring can only be full now if other threads have
+            // claimed every slot and not finished storing their
+            // messages yet; they do that without the lock.
+            while(!try_enqueue(sourceFilename, sourceLineNumber,
+                               level, logger, msg))
+              write_synchronously();
+            write_synchronously();
+          }
+
+          void flush()
+          {
+            const unsigned long target = load_counter(enqueue_pos);
+
+            mutex::lock l(state_mutex);
+
+            while(written_pos < target && synchronous == 0)
+              {
+                writer_wakeup.wake_all();
+                messages_written.wait(l);
+              }
+          }
+
+          void make_synchronous()
+          {
+            stop_writer();
+
+            mutex::lock l(state_mutex);
+            store_counter(synchronous, synchronous, 1);
+            write_synchronously();
+          }
+        };
+      }
+
+      boost::shared_ptr<LogSink> createAsyncLogSink(const std::string &filename,
+                                                    std::size_t capacity)
+      {
+        return make_shared<AsyncLogSink>(filename, capacity);
+      }
     }
   }
 }
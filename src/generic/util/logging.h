@@ -28,7 +28,7 @@
 
 #include <sstream>
 
-#include <limits.h> // For INT_MIN
+#include <limits.h> // For INT_MIN and INT_MAX
 
 namespace aptitude
 {
@@ -85,6 +85,24 @@ namespace aptitude
         // that "is logging enabled?" tests can be inlined.
         log_level effectiveLevel;
 
+        // The lowest level that will be logged: the effective level,
+        // or INT_MAX if the logger is OFF.  isEnabledFor() runs for
+        // every disabled message too, including in the resolver's
+        // inner loops, so it compares against this cached value
+        // instead of testing for OFF first.  It is only written with
+        // the logging system's lock held; reading it while it is
+        // being changed returns either the old or the new level.
+        int threshold;
+
+        /** \brief Set the effective level and the threshold that
+         *  caches it.
+         */
+        void setEffectiveLevel(log_level l)
+        {
+          effectiveLevel = l;
+          threshold = (l == OFF_LEVEL) ? INT_MAX : l;
+        }
+
         class Impl;
 
         Logger(log_level _effectiveLevel);
@@ -110,9 +128,7 @@ namespace aptitude
          */
         bool isEnabledFor(log_level l) const
         {
-          return
-            effectiveLevel != OFF_LEVEL &&
-            l >= effectiveLevel;
+          return l >= threshold;
         }
 
         /** \brief Retrieve the effective log level of this logger. */
@@ -151,7 +167,9 @@ namespace aptitude
          *
          *  This is one of the places where I compromise efficiency
          *  (maybe) to get a simple implementation and a simple
-         *  interface.
+         *  interface.  Loggers that have no slots connected are
+         *  skipped when a message is passed up the hierarchy, so
+         *  connecting a single slot at the root is cheapest.
          *
          *  The parameters to the slot are:
          *
@@ -175,7 +193,7 @@ namespace aptitude
                                  int,
                                  log_level,
                                  LoggerPtr,
-                                 std::string> &slot) = 0;
+                                 const std::string &> &slot) = 0;
 
         /** \brief Retrieve a logger for the given category, creating
          * it if necessary.
@@ -190,12 +208,17 @@ namespace aptitude
         static LoggerPtr getLogger(const std::string &category);
       };
 
+      // The logger is bound to a reference rather than copied, so
+      // that a disabled message costs one load and one comparison
+      // instead of two atomic reference count updates; the branch is
+      // marked as unlikely to keep the formatting code out of the
+      // caller's hot path.
 #define LOG_LEVEL(level, logger, msg)                                   \
       do                                                                \
         {                                                               \
-          ::aptitude::util::logging::log_level __aptitude_util_logging_level = (level); \
-          ::aptitude::util::logging::LoggerPtr __aptitude_util_logging_logger = (logger); \
-          if(__aptitude_util_logging_logger->isEnabledFor(__aptitude_util_logging_level)) \
+          const ::aptitude::util::logging::log_level __aptitude_util_logging_level = (level); \
+          const ::aptitude::util::logging::LoggerPtr &__aptitude_util_logging_logger = (logger); \
+          if(__builtin_expect(__aptitude_util_logging_logger->isEnabledFor(__aptitude_util_logging_level), 0)) \
             {                                                           \
               std::ostringstream __aptitude_util_logging_stream;        \
               __aptitude_util_logging_stream << msg;                    \
@@ -249,6 +272,65 @@ namespace aptitude
 
       /** \brief Create a new, local logging system. */
       boost::shared_ptr<LoggingSystem> createLoggingSystem();
+
+      /** \brief A destination for log messages. */
+      class LogSink
+      {
+      public:
+        virtual ~LogSink();
+
+        /** \brief Write a message to this sink.
+         *
+         *  The arguments are those of the slots passed to
+         *  Logger::connect_message_logged(), so this can be connected
+         *  to a logger directly.  Thread-safe.
+         */
+        virtual void message_logged(const char *sourceFilename,
+                                    int sourceLineNumber,
+                                    log_level level,
+                                    LoggerPtr logger,
+                                    const std::string &msg) = 0;
+
+        /** \brief Wait until every message passed to message_logged()
+         *  so far has been written.
+         */
+        virtual void flush() = 0;
+
+        /** \brief Write every buffered message, and write the
+         *  messages that are logged later before message_logged()
+         *  returns.
+         *
+         *  This is meant for the moment the program starts exiting:
+         *  after it returns, nothing is lost if the process ends
+         *  without destroying the sink, even if more messages are
+         *  logged (for instance, by atexit handlers or global
+         *  destructors).
+         */
+        virtual void make_synchronous() = 0;
+      };
+
+      /** \brief Create a sink that writes messages to a file from a
+       *  background thread.
+       *
+       *  message_logged() stores the message in a fixed-size ring
+       *  buffer without taking a lock; the background thread formats
+       *  each message with the time it was logged, the thread that
+       *  logged it, its source location, level, and category, and
+       *  appends it to the file.  If the buffer is full,
+       *  message_logged() waits for the background thread to make
+       *  room, so messages are never dropped.
+       *
+       *  Destroying the sink or calling make_synchronous() writes the
+       *  messages that are still buffered.  The sink must be
+       *  disconnected from any loggers before it is destroyed.
+       *
+       *  \param filename  The file to append to, or "-" to write to
+       *                   standard output.
+       *  \param capacity  How many messages can be buffered; rounded
+       *                   up to a power of two.
+       */
+      boost::shared_ptr<LogSink> createAsyncLogSink(const std::string &filename,
+                                                    std::size_t capacity = 4096);
     }
   }
 }
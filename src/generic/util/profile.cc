@@ -0,0 +1,315 @@
+// profile.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#include "profile.h"
+
+#include <cstring>
+#include <iomanip>
+#include <locale>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <stdio.h>
+
+namespace aptitude
+{
+  namespace util
+  {
+    /** \brief A phase in the profile tree. */
+    class profile_node
+    {
+    public:
+      const char *name;
+      profile_node *parent;
+      std::vector<profile_node *> children;
+
+      unsigned long calls;
+      unsigned long long total_usec;
+
+      profile_node(const char *_name, profile_node *_parent)
+	: name(_name), parent(_parent), calls(0), total_usec(0)
+      {
+      }
+
+      /** \brief Find or create the child with the given name. */
+      profile_node *get_child(const char *child_name)
+      {
+	for(std::vector<profile_node *>::const_iterator it = children.begin();
+	    it != children.end(); ++it)
+	  if(std::strcmp((*it)->name, child_name) == 0)
+	    return *it;
+
+	profile_node *rval = new profile_node(child_name, this);
+	children.push_back(rval);
+	return rval;
+      }
+    };
+
+    namespace
+    {
+      bool enabled = false;
+      struct timeval enabled_time;
+
+      /** \brief The root of the profile tree; phases that start
+       *  outside any other phase are its children.
+       *
+       *  The tree is never freed, so that it can still be reported
+       *  from an atexit() handler.  It is protected by tree_mutex.
+       */
+      profile_node root("", NULL);
+      pthread_mutex_t tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+      /** \brief The innermost phase of each thread, or NULL if the
+       *  thread is not in any phase.
+       */
+      __thread profile_node *current_node;
+
+      /** \brief The list of all the counters; only modified with
+       *  atomic operations.
+       */
+      profile_counter *counters = NULL;
+
+      unsigned long long usec_since(const struct timeval &start)
+      {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	const long long diff =
+	  (now.tv_sec - start.tv_sec) * 1000000LL + (now.tv_usec - start.tv_usec);
+	return diff < 0 ? 0 : diff;
+      }
+
+      void write_string(std::ostream &out, const char *s)
+      {
+	out << '"';
+	for(const char *c = s; *c != 0; ++c)
+	  {
+	    if(*c == '"' || *c == '\\')
+	      out << '\\' << *c;
+	    else if(static_cast<unsigned char>(*c) < 0x20)
+	      {
+		char buf[8];
+		snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned char>(*c));
+		out << buf;
+	      }
+	    else
+	      out << *c;
+	  }
+	out << '"';
+      }
+
+      // The report is written to a stream in the classic locale, so
+      // these never use a decimal comma or digit grouping.
+      void write_msec(std::ostream &out, unsigned long long usec)
+      {
+	out << std::fixed << std::setprecision(3) << usec / 1000.0;
+      }
+
+      void write_indent(std::ostream &out, int depth)
+      {
+	for(int i = 0; i < depth; ++i)
+	  out << "  ";
+      }
+
+      void write_phases(std::ostream &out, const profile_node &node, int depth)
+      {
+	out << '[';
+	for(std::vector<profile_node *>::const_iterator it = node.children.begin();
+	    it != node.children.end(); ++it)
+	  {
+	    if(it != node.children.begin())
+	      out << ',';
+	    out << '\n';
+	    write_indent(out, depth + 1);
+	    out << "{\"name\": ";
+	    write_string(out, (*it)->name);
+	    out << ", \"calls\": " << (*it)->calls
+		<< ", \"total_ms\": ";
+	    write_msec(out, (*it)->total_usec);
+	    if(!(*it)->children.empty())
+	      {
+		out << ", \"phases\": ";
+		write_phases(out, **it, depth + 1);
+	      }
+	    out << '}';
+	  }
+	if(!node.children.empty())
+	  {
+	    out << '\n';
+	    write_indent(out, depth);
+	  }
+	out << ']';
+      }
+
+      /** \brief Add up the time spent in all the phases with the given
+       *  name.
+       *
+       *  Nested phases with the same name are only counted once.
+       */
+      unsigned long long phase_usec(const profile_node &node, const char *name)
+      {
+	unsigned long long rval = 0;
+	for(std::vector<profile_node *>::const_iterator it = node.children.begin();
+	    it != node.children.end(); ++it)
+	  {
+	    if(std::strcmp((*it)->name, name) == 0)
+	      rval += (*it)->total_usec;
+	    else
+	      rval += phase_usec(**it, name);
+	  }
+	return rval;
+      }
+    }
+
+    void enable_profiling()
+    {
+      gettimeofday(&enabled_time, NULL);
+      enabled = true;
+    }
+
+    bool profiling_enabled()
+    {
+      return enabled;
+    }
+
+    profile_phase::profile_phase(const char *_name, const logging::LoggerPtr &_logger)
+      : name(_name), logger(_logger), node(NULL),
+	active(enabled || logger->isEnabledFor(logging::DEBUG_LEVEL))
+    {
+      if(!active)
+	return;
+
+      if(enabled)
+	{
+	  profile_node *parent = current_node == NULL ? &root : current_node;
+
+	  pthread_mutex_lock(&tree_mutex);
+	  node = parent->get_child(name);
+	  pthread_mutex_unlock(&tree_mutex);
+
+	  current_node = node;
+	}
+
+      gettimeofday(&start, NULL);
+    }
+
+    profile_phase::~profile_phase()
+    {
+      if(!active)
+	return;
+
+      const unsigned long long usec = usec_since(start);
+
+      if(node != NULL)
+	{
+	  pthread_mutex_lock(&tree_mutex);
+	  ++node->calls;
+	  node->total_usec += usec;
+	  pthread_mutex_unlock(&tree_mutex);
+
+	  current_node = node->parent == &root ? NULL : node->parent;
+	}
+
+      LOG_DEBUG(logger, "Phase " << name << " took " << usec / 1000 << " ms.");
+    }
+
+    profile_counter::profile_counter(const char *_name, const char *_rate_phase)
+      : name(_name), rate_phase(_rate_phase), value(0), next(NULL)
+    {
+      profile_counter *head;
+      do
+	{
+	  head = counters;
+	  next = head;
+	}
+      while(!__sync_bool_compare_and_swap(&counters, head, this));
+    }
+
+    void write_profile_report(std::ostream &real_out)
+    {
+      // The program runs in the user's locale, which might use
+      // decimal commas; JSON numbers must not.
+      std::ostringstream out;
+      out.imbue(std::locale::classic());
+
+      const unsigned long long wall_usec = enabled ? usec_since(enabled_time) : 0;
+
+      // Merge the counters that share a name, keeping them in the
+      // order in which they were registered.
+      std::vector<profile_counter *> ordered;
+      for(profile_counter *c = counters; c != NULL; c = c->next)
+	ordered.push_back(c);
+
+      std::vector<std::string> names;
+      std::map<std::string, unsigned long long> values;
+      std::map<std::string, const char *> rate_phases;
+      for(std::vector<profile_counter *>::const_reverse_iterator it = ordered.rbegin();
+	  it != ordered.rend(); ++it)
+	{
+	  const std::string name((*it)->name);
+	  if(values.find(name) == values.end())
+	    names.push_back(name);
+
+	  values[name] += __sync_fetch_and_add(&(*it)->value, 0);
+	  if((*it)->rate_phase != NULL)
+	    rate_phases[name] = (*it)->rate_phase;
+	}
+
+      pthread_mutex_lock(&tree_mutex);
+
+      out << "{\n  \"wall_time_ms\": ";
+      write_msec(out, wall_usec);
+      out << ",\n  \"phases\": ";
+      write_phases(out, root, 1);
+      out << ",\n  \"counters\": {";
+      for(std::vector<std::string>::const_iterator it = names.begin();
+	  it != names.end(); ++it)
+	{
+	  if(it != names.begin())
+	    out << ',';
+	  out << "\n    ";
+	  write_string(out, it->c_str());
+	  out << ": {\"value\": " << values[*it];
+
+	  std::map<std::string, const char *>::const_iterator found =
+	    rate_phases.find(*it);
+	  if(found != rate_phases.end())
+	    {
+	      const unsigned long long usec = phase_usec(root, found->second);
+	      if(usec > 0)
+		out << ", \"per_second\": " << std::fixed << std::setprecision(1)
+		    << values[*it] * 1000000.0 / usec;
+	    }
+
+	  out << '}';
+	}
+      if(!names.empty())
+	out << "\n  ";
+      out << "}\n}\n";
+
+      pthread_mutex_unlock(&tree_mutex);
+
+      real_out << out.str();
+    }
+  }
+}
@@ -0,0 +1,156 @@
+// profile.h   -*-c++-*-
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#ifndef APTITUDE_UTIL_PROFILE_H
+#define APTITUDE_UTIL_PROFILE_H
+
+#include "logging.h"
+
+#include <iosfwd>
+
+#include <sys/time.h>
+
+namespace aptitude
+{
+  namespace util
+  {
+    class profile_node;
+
+    /** \brief Start collecting the phase timings and counters that
+     *  write_profile_report() prints.
+     *
+     *  This should be called once, before any threads are started;
+     *  the wall-clock time in the report is measured from the moment
+     *  it is called.
+     */
+    void enable_profiling();
+
+    /** \brief Return \b true if enable_profiling() has been called. */
+    bool profiling_enabled();
+
+    /** \brief Write a JSON report of the phases and counters that
+     *  were recorded since enable_profiling() was called.
+     *
+     *  The report is an object with three members: "wall_time_ms",
+     *  the time since profiling was enabled; "phases", the tree of
+     *  phases with the number of times each one ran and the total
+     *  time spent in it; and "counters", the value of each counter
+     *  and, for counters that have a rate phase, the value per second
+     *  spent in that phase.
+     */
+    void write_profile_report(std::ostream &out);
+
+    /** \brief Time a phase of a program run for as long as this
+     *  object is in scope.
+     *
+     *  Phases that are entered while another phase is active in the
+     *  same thread are recorded as its children; phases with the same
+     *  name and parent are merged.  When the phase ends, its duration
+     *  is also written to the given logger at the DEBUG level, so the
+     *  timings of each part of the program can be turned on with the
+     *  usual logging categories.
+     *
+     *  If profiling is disabled and the logger would discard DEBUG
+     *  messages, constructing a phase only checks those two flags.
+     *
+     *  Phases are meant to delimit large operations (loading the
+     *  cache, running the resolver, downloading); don't put them in
+     *  inner loops.
+     */
+    class profile_phase
+    {
+      const char *name;
+      logging::LoggerPtr logger;
+      /** \brief The node of this phase in the profile tree, or NULL
+       *  if profiling is disabled.
+       */
+      profile_node *node;
+      bool active;
+      struct timeval start;
+
+      profile_phase(const profile_phase &);
+      profile_phase &operator=(const profile_phase &);
+
+    public:
+      /** \brief Enter a phase.
+       *
+       *  \param name    The name of the phase; must be a string
+       *                 constant.
+       *  \param logger  The logger that the phase's duration is
+       *                 written to.
+       */
+      profile_phase(const char *name, const logging::LoggerPtr &logger);
+
+      /** \brief Leave the phase. */
+      ~profile_phase();
+    };
+
+    /** \brief A named count of events (bytes downloaded, records
+     *  looked up, ...) that is included in the profile report.
+     *
+     *  Counters should be objects with static storage duration; they
+     *  register themselves in a global list when they are
+     *  constructed.  Several counters may share a name (for instance,
+     *  the same static counter in different instantiations of a
+     *  template), in which case the report prints their sum.
+     */
+    class profile_counter
+    {
+      const char *name;
+      const char *rate_phase;
+      unsigned long long value;
+      profile_counter *next;
+
+      friend void write_profile_report(std::ostream &out);
+
+      profile_counter(const profile_counter &);
+      profile_counter &operator=(const profile_counter &);
+
+    public:
+      /** \brief Create and register a counter.
+       *
+       *  \param name        The name of the counter in the report;
+       *                     must be a string constant.
+       *  \param rate_phase  If not NULL, the name of a phase; the
+       *                     report will also include the counter's
+       *                     value per second spent in all the
+       *                     phases with this name.
+       */
+      profile_counter(const char *name, const char *rate_phase = NULL);
+
+      /** \brief Add to the counter if profiling is enabled.
+       *
+       *  This may be called from any thread.
+       */
+      void add(unsigned long long amount)
+      {
+	if(profiling_enabled())
+	  __sync_fetch_and_add(&value, amount);
+      }
+
+      /** \brief Add one to the counter if profiling is enabled. */
+      void increment()
+      {
+	add(1);
+      }
+    };
+  }
+}
+
+#endif // APTITUDE_UTIL_PROFILE_H
@@ -0,0 +1,191 @@
+// small_object_pool.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#include "small_object_pool.h"
+
+#include <pthread.h>
+
+namespace aptitude
+{
+  namespace util
+  {
+    namespace
+    {
+      /** \brief The total size of all the chunks allocated so far.
+       *
+       *  Only modified with atomic operations; chunks are allocated
+       *  rarely enough that this doesn't matter.
+       */
+      std::size_t reserved_bytes = 0;
+
+      /** \brief Batches of blocks that threads handed back to the
+       *  pool, indexed by size class.
+       *
+       *  Each entry is the first block of the first batch; the blocks
+       *  of a batch are linked through free_block::next and the
+       *  batches through free_block::next_batch.  Protected by
+       *  orphans_mutex.
+       */
+      small_object_pool::free_block *orphans[small_object_pool::num_size_classes];
+      pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+      /** \brief A thread-specific key whose destructor returns the
+       *  exiting thread's free lists to the orphan lists.
+       *
+       *  The key's value is never read; it is set to a non-NULL value
+       *  the first time a thread refills a free list, so that the
+       *  destructor runs for exactly the threads that have used the
+       *  pool.
+       */
+      pthread_key_t thread_exit_key;
+      pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;
+
+      /** \brief Return the number of blocks in a batch of the given
+       *  size class.
+       */
+      std::size_t get_batch_blocks(std::size_t size_class)
+      {
+	return small_object_pool::chunk_size /
+	  ((size_class + 1) * small_object_pool::granularity);
+      }
+
+      /** \brief Cut up to one batch of blocks off the front of a free
+       *  list and push it onto the shared list.
+       *
+       *  The caller must hold orphans_mutex.
+       *
+       *  \return the number of blocks that were moved.
+       */
+      std::size_t push_batch(small_object_pool::free_block *&list,
+			     std::size_t size_class)
+      {
+	small_object_pool::free_block * const head = list;
+	small_object_pool::free_block *tail = head;
+	std::size_t count = 1;
+	const std::size_t batch_blocks = get_batch_blocks(size_class);
+	while(count < batch_blocks && tail->next != NULL)
+	  {
+	    tail = tail->next;
+	    ++count;
+	  }
+
+	list = tail->next;
+	tail->next = NULL;
+
+	head->next_batch = orphans[size_class];
+	orphans[size_class] = head;
+
+	return count;
+      }
+    }
+
+    const std::size_t small_object_pool::granularity;
+    const std::size_t small_object_pool::max_object_size;
+    const std::size_t small_object_pool::num_size_classes;
+    const std::size_t small_object_pool::chunk_size;
+
+    __thread small_object_pool::free_block *
+    small_object_pool::free_lists[small_object_pool::num_size_classes];
+
+    __thread std::size_t
+    small_object_pool::free_counts[small_object_pool::num_size_classes];
+
+    void small_object_pool::spill(std::size_t size_class)
+    {
+      pthread_mutex_lock(&orphans_mutex);
+      const std::size_t moved = push_batch(free_lists[size_class], size_class);
+      pthread_mutex_unlock(&orphans_mutex);
+
+      // The count is only an upper bound, so reset it if the list
+      // turned out to be shorter than it claimed.
+      if(free_lists[size_class] == NULL)
+	free_counts[size_class] = 0;
+      else
+	free_counts[size_class] -= moved;
+    }
+
+    void small_object_pool::release_thread_blocks(void *)
+    {
+      pthread_mutex_lock(&orphans_mutex);
+      for(std::size_t i = 0; i < num_size_classes; ++i)
+	{
+	  while(free_lists[i] != NULL)
+	    push_batch(free_lists[i], i);
+	  free_counts[i] = 0;
+	}
+      pthread_mutex_unlock(&orphans_mutex);
+    }
+
+    void small_object_pool::create_thread_exit_key()
+    {
+      pthread_key_create(&thread_exit_key, &release_thread_blocks);
+    }
+
+    void *small_object_pool::refill(std::size_t size_class)
+    {
+      pthread_once(&thread_exit_key_once, &create_thread_exit_key);
+      if(pthread_getspecific(thread_exit_key) == NULL)
+	pthread_setspecific(thread_exit_key, &free_lists);
+
+      // Adopt a batch of blocks that another thread handed back, if
+      // there is one.  Batches that were left behind by exiting
+      // threads may be short, so the count is only an upper bound.
+      pthread_mutex_lock(&orphans_mutex);
+      free_block * const adopted = orphans[size_class];
+      if(adopted != NULL)
+	orphans[size_class] = adopted->next_batch;
+      pthread_mutex_unlock(&orphans_mutex);
+
+      if(adopted != NULL)
+	{
+	  free_lists[size_class] = adopted->next;
+	  free_counts[size_class] = get_batch_blocks(size_class) - 1;
+	  return adopted;
+	}
+
+      const std::size_t block_size = (size_class + 1) * granularity;
+      const std::size_t num_blocks = chunk_size / block_size;
+
+      // The global operator new returns memory that is suitably
+      // aligned for any object, and every block size is a multiple of
+      // the granularity, so every block is aligned too.
+      char * const chunk = static_cast<char *>(::operator new(num_blocks * block_size));
+      __sync_fetch_and_add(&reserved_bytes, num_blocks * block_size);
+
+      // Thread the blocks after the first one onto the free list, in
+      // address order, and hand out the first one.
+      free_block *head = NULL;
+      for(std::size_t i = num_blocks - 1; i > 0; --i)
+	{
+	  free_block * const block = reinterpret_cast<free_block *>(chunk + i * block_size);
+	  block->next = head;
+	  head = block;
+	}
+      free_lists[size_class] = head;
+      free_counts[size_class] = num_blocks - 1;
+
+      return chunk;
+    }
+
+    std::size_t small_object_pool::get_reserved_bytes()
+    {
+      return __sync_fetch_and_add(&reserved_bytes, 0);
+    }
+  }
+}
@@ -0,0 +1,179 @@
+// small_object_pool.h   -*-c++-*-
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program; see the file COPYING.  If not, write to
+//   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+//   Boston, MA 02111-1307, USA.
+
+#ifndef APTITUDE_UTIL_SMALL_OBJECT_POOL_H
+#define APTITUDE_UTIL_SMALL_OBJECT_POOL_H
+
+#include <cstddef>
+#include <new>
+
+namespace aptitude
+{
+  namespace util
+  {
+    /** \brief A fast allocator for the small, short-lived nodes that
+     *  the resolver creates by the million (tree nodes and expression
+     *  nodes).
+     *
+     *  Objects are grouped into size classes of 16 bytes each.  Each
+     *  thread has its own free list for each size class, so
+     *  allocation and deallocation are a few instructions and never
+     *  take a lock.  Free lists are refilled by carving up large
+     *  chunks, so objects that are allocated together end up next to
+     *  each other in memory, and there is no per-object malloc
+     *  header.
+     *
+     *  Memory is never returned to the system: a freed object goes
+     *  onto the free list of the thread that freed it and is reused
+     *  by the next allocation of the same size class on that thread.
+     *  Each thread only keeps a couple of chunks' worth of free
+     *  blocks per size class; when it frees more than that, the
+     *  excess is handed to a shared list in chunk-sized batches, and
+     *  threads draw from the shared list before they allocate new
+     *  chunks.  This matters because the resolver allocates its nodes
+     *  in the background thread and the UI thread frees them when it
+     *  discards the resolver; without the shared list, every search
+     *  would reserve fresh chunks.  When a thread exits, its
+     *  remaining free blocks are handed to the shared list as well.
+     *  Objects larger than max_object_size are passed through to the
+     *  global operator new.
+     *
+     *  Classes opt in by defining their own operator new and operator
+     *  delete in terms of allocate() and deallocate(); see
+     *  imm::wtree_node for an example.
+     */
+    class small_object_pool
+    {
+    public:
+      /** \brief The granularity of the size classes. */
+      static const std::size_t granularity = 16;
+
+      /** \brief The largest object that will be allocated from the
+       *  pool.
+       */
+      static const std::size_t max_object_size = 256;
+
+      /** \brief The number of size classes. */
+      static const std::size_t num_size_classes = max_object_size / granularity;
+
+      /** \brief The size of each chunk that is carved into blocks,
+       *  and of the batches of blocks that are moved to the shared
+       *  list.
+       */
+      static const std::size_t chunk_size = 64 * 1024;
+
+      /** \brief A freed block of memory. */
+      struct free_block
+      {
+	free_block *next;
+
+	/** \brief If this block is the first one of a batch on the
+	 *  shared list, the first block of the next batch.
+	 *
+	 *  Every block is at least granularity bytes long, so there is
+	 *  always room for this.
+	 */
+	free_block *next_batch;
+      };
+
+    private:
+      /** \brief The free lists of the current thread, indexed by size
+       *  class.
+       */
+      static __thread free_block *free_lists[num_size_classes];
+
+      /** \brief An upper bound on the length of each of the current
+       *  thread's free lists.
+       */
+      static __thread std::size_t free_counts[num_size_classes];
+
+      /** \brief Refill the current thread's free list for the given
+       *  size class, either from the shared list or from a new chunk,
+       *  and return one block.
+       */
+      static void *refill(std::size_t size_class);
+
+      /** \brief Move a batch of blocks from the current thread's free
+       *  list for the given size class to the shared list; called
+       *  when the thread has freed more blocks than it keeps.
+       */
+      static void spill(std::size_t size_class);
+
+      /** \brief Move the current thread's free lists to the shared
+       *  list; called when a thread that used the pool exits.
+       */
+      static void release_thread_blocks(void *);
+
+      static void create_thread_exit_key();
+
+      static std::size_t get_size_class(std::size_t size)
+      {
+	return size == 0 ? 0 : (size - 1) / granularity;
+      }
+
+    public:
+      /** \brief Allocate an object of the given size. */
+      static void *allocate(std::size_t size)
+      {
+	if(size > max_object_size)
+	  return ::operator new(size);
+
+	const std::size_t size_class = get_size_class(size);
+	free_block * const rval = free_lists[size_class];
+	if(rval == NULL)
+	  return refill(size_class);
+
+	free_lists[size_class] = rval->next;
+	--free_counts[size_class];
+	return rval;
+      }
+
+      /** \brief Free an object that was returned by allocate().
+       *
+       *  \param p     The object to free.
+       *  \param size  The size that was passed to allocate().
+       */
+      static void deallocate(void *p, std::size_t size)
+      {
+	if(p == NULL)
+	  return;
+	else if(size > max_object_size)
+	  {
+	    ::operator delete(p);
+	    return;
+	  }
+
+	const std::size_t size_class = get_size_class(size);
+	free_block * const block = static_cast<free_block *>(p);
+	block->next = free_lists[size_class];
+	free_lists[size_class] = block;
+
+	if(++free_counts[size_class] * (size_class + 1) * granularity > 2 * chunk_size)
+	  spill(size_class);
+      }
+
+      /** \brief Return the number of bytes that all threads have
+       *  reserved from the system for the pool.
+       */
+      static std::size_t get_reserved_bytes();
+    };
+  }
+}
+
+#endif // APTITUDE_UTIL_SMALL_OBJECT_POOL_H
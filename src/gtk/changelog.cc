@@ -417,6 +417,9 @@ namespace gui
 
       bool only_new;
 
+      // How soon the changelog is needed, if it has to be downloaded.
+      aptitude::download_priority priority;
+
       std::string binary_package_name;
 
       boost::shared_ptr<aptitude::apt::changelog_info> target_info;
@@ -430,12 +433,14 @@ namespace gui
 					  const Glib::RefPtr<Gtk::TextBuffer> &_text_buffer,
 					  sigc::slot<void, Gtk::Widget &, Glib::RefPtr<Gtk::TextBuffer::ChildAnchor> > _text_view_add_child_at_anchor,
 					  const pkgCache::VerIterator &ver,
-					  bool _only_new)
+					  bool _only_new,
+					  aptitude::download_priority _priority)
 	: text_view_add_child_at_anchor(_text_view_add_child_at_anchor),
 	  begin(_begin),
 	  end(_end),
 	  text_buffer(_text_buffer),
 	  only_new(_only_new),
+	  priority(_priority),
 	  binary_package_name(ver.ParentPkg().Name()),
 	  target_info(aptitude::apt::changelog_info::create(ver)),
 	  current_info(aptitude::apt::changelog_info::create(ver.ParentPkg().CurrentVer()))
@@ -452,6 +457,7 @@ namespace gui
       const Glib::RefPtr<Gtk::TextBuffer> &get_text_buffer() const { return text_buffer; }
       //Gtk::TextView *get_text_view() const { return text_view; }
       bool get_only_new() const { return only_new; }
+      aptitude::download_priority get_priority() const { return priority; }
       const std::string &get_binary_package_name() const { return binary_package_name; }
       const boost::shared_ptr<aptitude::apt::changelog_info> &get_target_info() const { return target_info; }
       const boost::shared_ptr<aptitude::apt::changelog_info> &get_current_info() const { return current_info; }
@@ -605,13 +611,13 @@ namespace gui
      *
      *  \param entry         The download job to process.
      *
-     *  \param digested_file The pre-digested changelog, if one is
-     *                       available.
+     *  \param digested_contents The pre-digested changelog, if one is
+     *                           available.
      *
      *  This function must be invoked in the main thread.
      */
     void process_changelog_job(const boost::shared_ptr<preprocessed_changelog_job> &entry,
-			       const temp::name &digested_file)
+			       const boost::shared_ptr<const std::string> &digested_contents)
     {
       logging::LoggerPtr logger = aptitude::Loggers::getAptitudeGtkChangelog();
 
@@ -675,10 +681,10 @@ namespace gui
 	  // However, if we have a pre-digested changelog, we can call
 	  // out to the parse thread directly, bypassing the download
 	  // process.
-	  if(digested_file.valid())
+	  if(digested_contents.get() != NULL)
 	    {
 	      LOG_TRACE(aptitude::Loggers::getAptitudeGtkChangelog(),
-			"Using a predigested file to display the changelog of "
+			"Using a predigested changelog to display the changelog of "
 			<< target_info->get_source_package() << " "
 			<< target_info->get_source_version());
 
@@ -717,13 +723,12 @@ namespace gui
 	      const safe_slot1<void, cw::util::ref_ptr<aptitude::apt::changelog> > finish_changelog_download_safe_slot =
 		make_safe_slot(finish_changelog_download_slot);
 
-	      parse_changelog_background(digested_file,
-					 finish_changelog_download_safe_slot,
-					 only_new ? current_info->get_source_version() : "",
-					 target_info->get_source_version(),
-					 target_info->get_source_package(),
-					 true,
-					 &post_thunk);
+	      parse_digested_changelog_background(digested_contents,
+						  finish_changelog_download_safe_slot,
+						  only_new ? current_info->get_source_version() : "",
+						  target_info->get_source_version(),
+						  target_info->get_source_package(),
+						  &post_thunk);
 	    }
 	  else
 	    {
@@ -778,7 +783,8 @@ namespace gui
 								 target_info->get_source_version(),
 								 progressBar);
 
-	      aptitude::apt::get_changelog(target_info, callbacks, &post_thunk);
+	      aptitude::apt::get_changelog(target_info, callbacks, &post_thunk,
+					   entry->get_priority());
 	    }
 	}
     }
@@ -843,7 +849,7 @@ namespace gui
 
 	const boost::shared_ptr<preprocessed_changelog_job> &req = job.get_request();
 
-	temp::name predigested_file;
+	boost::shared_ptr<const std::string> predigested_contents;
 
 	std::string uri;
 	if(!req->get_only_new())
@@ -864,19 +870,19 @@ namespace gui
 		  << " under the cache URI "
 		  << uri);
 
-	predigested_file = download_cache->getItem(uri);
-	if(predigested_file.valid())
+	predigested_contents = download_cache->getItemContents(uri);
+	if(predigested_contents.get() != NULL)
 	  LOG_TRACE(logger, "Changelog preparation thread: found a predigested changelog for "
 		    << req->get_target_info()->get_source_package()
 		    << " " << req->get_target_info()->get_source_version()
-		    << " in the file " << predigested_file.get_name());
+		    << " (" << predigested_contents->size() << " bytes)");
 
-	sigc::slot<void, boost::shared_ptr<preprocessed_changelog_job>, temp::name>
+	sigc::slot<void, boost::shared_ptr<preprocessed_changelog_job>, boost::shared_ptr<const std::string> >
 	  process_changelog_job_slot = sigc::ptr_fun(&process_changelog_job);
 
 	post_event(safe_bind(make_safe_slot(process_changelog_job_slot),
 			     req,
-			     predigested_file));
+			     predigested_contents));
       }
     };
     bool check_cache_for_parsed_changelogs_thread::signals_connected = false;
@@ -922,7 +928,8 @@ namespace gui
 						     const Glib::RefPtr<Gtk::TextBuffer> &text_buffer,
 						     Gtk::TextView *text_view,
 						     const Gtk::TextBuffer::iterator &where,
-						     bool only_new)
+						     bool only_new,
+						     aptitude::download_priority priority)
   {
     Glib::RefPtr<Gtk::TextBuffer::Mark> begin_mark =
       text_buffer->create_mark(where);
@@ -940,7 +947,7 @@ namespace gui
     boost::shared_ptr<preprocessed_changelog_job> preprocessed =
       boost::make_shared<preprocessed_changelog_job>(begin_mark, end_mark, text_buffer,
 						     text_view_add_child_at_anchor,
-						     ver, only_new);
+						     ver, only_new, priority);
 
     check_cache_for_parsed_changelogs_job job(preprocessed);
     check_cache_for_parsed_changelogs_thread::add_job(job);
@@ -30,6 +30,7 @@
 
 #include <cwidget/generic/util/ref_ptr.h>
 
+#include <generic/apt/download_queue.h>
 #include <generic/util/refcounted_base.h>
 #include <generic/util/temp.h>
 #include <generic/util/util.h>
@@ -91,6 +92,8 @@ namespace gui
    *                   Used to display a progress bar during the download.
    *  \param ver     The version whose changelog should be downloaded.
    *  \param only_new  If \b true, only new entries will be displayed.
+   *  \param priority  How soon the changelog is needed if it has to
+   *                   be downloaded.
    *
    *  \return An iterator following any text inserted by this routine.
    */
@@ -98,7 +101,8 @@ namespace gui
 						     const Glib::RefPtr<Gtk::TextBuffer> &text_buffer,
 						     Gtk::TextView *text_view,
 						     const Gtk::TextBuffer::iterator &where,
-						     bool only_new = false);
+						     bool only_new = false,
+						     aptitude::download_priority priority = aptitude::download_priority_visible);
 }
 
 #endif /* CHANGELOG_H_ */
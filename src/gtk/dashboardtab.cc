@@ -363,11 +363,14 @@ namespace gui
 
 	const Gtk::TextBuffer::iterator changelog_begin_iter = where;
 
+	// The changelogs of every upgrade are fetched as soon as the
+	// dashboard opens, before anyone scrolls down to them.
 	where = fetch_and_show_changelog(candver,
 					 text_buffer,
 					 upgrades_summary_textview,
 					 changelog_begin_iter,
-					 true);
+					 true,
+					 aptitude::download_priority_prefetch);
 
 	where = text_buffer->insert(where, "\n\n");
       }
@@ -40,6 +40,8 @@
 
 #include <sigc++/trackable.h>
 
+#include <algorithm>
+
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -95,6 +97,19 @@ namespace gui
 	return Loggers::getAptitudeGtkScreenshotCache();
       }
 
+      static unsigned int get_max_workers()
+      {
+	return std::max(aptcfg->FindI(PACKAGE "::Screenshot::Load-Threads", 1), 1);
+      }
+
+      // A screenshot that's already waiting to be loaded doesn't need
+      // to be loaded twice.
+      static bool merge_job(load_screenshot_job &pending,
+			    const load_screenshot_job &incoming)
+      {
+	return pending.get_cache_entry() == incoming.get_cache_entry();
+      }
+
       void process_job(const load_screenshot_job &job);
     };
 
@@ -130,6 +145,26 @@ namespace gui
       // weak references.
       boost::shared_ptr<download_request> request;
 
+      // The job that is loading the downloaded file in the
+      // background, if any.
+      boost::shared_ptr<aptitude::util::job_handle> load_job;
+
+      /** \brief Load the downloaded screenshot in the background.
+       *
+       *  Full-size screenshots are only requested when the user asks
+       *  to see them, so they go ahead of thumbnails.
+       */
+      void start_load_job(const temp::name &filename)
+      {
+	const aptitude::util::job_priority priority =
+	  key.get_type() == screenshot_full
+	  ? aptitude::util::job_priority_high
+	  : aptitude::util::job_priority_normal;
+
+	load_job = load_screenshot_thread::add_job(load_screenshot_job(filename, shared_from_this()),
+						   priority);
+      }
+
       // Tracks how much space the cache thinks this screenshot takes
       // up; used to ensure that the total cache size is correctly
       // computed.
@@ -309,6 +344,13 @@ namespace gui
       Glib::RefPtr<Gdk::Pixbuf> get_screenshot() { return image; }
       void cancel();
 
+      /** \brief Invoked when the image couldn't be loaded from a file. */
+      void load_failed(const std::string &msg)
+      {
+	load_job.reset();
+	get_signal_failed()(msg);
+      }
+
       /** \brief Invoked when the image was loaded directly from a file.
        */
       void image_loaded(const Glib::RefPtr<Gdk::Pixbuf> &new_image)
@@ -341,6 +383,7 @@ namespace gui
 	num_bytes_read = 0;
 	image = new_image;
 	request.reset();
+	load_job.reset();
 
 	get_signal_ready()();
       }
@@ -366,7 +409,7 @@ namespace gui
 		      << " from the file " << filename.get_name()
 		      << " in the background thread.");
 
-	    load_screenshot_thread::add_job(load_screenshot_job(filename, shared_from_this()));
+	    start_load_job(filename);
 	  }
 	else
 	  {
@@ -392,7 +435,7 @@ namespace gui
 			     << " from the file " << filename.get_name()
 			     << " failed, falling back to loading the whole file: "
 			     << ex.what());
-		    load_screenshot_thread::add_job(load_screenshot_job(filename, shared_from_this()));
+		    start_load_job(filename);
 		  }
 	      }
 	    else
@@ -402,7 +445,7 @@ namespace gui
 			 << " from the file " << filename.get_name()
 			 << " failed, falling back to loading the whole file.");
 
-		load_screenshot_thread::add_job(load_screenshot_job(filename, shared_from_this()));
+		start_load_job(filename);
 	      }
 	  }
       }
@@ -819,9 +862,13 @@ namespace gui
 
     void screenshot_cache_entry::cancel()
     {
-      if(request.get() != NULL)
+      if(request.get() != NULL || load_job.get() != NULL)
 	{
-	  request->cancel();
+	  if(request.get() != NULL)
+	    request->cancel();
+	  // The download might be finished and waiting to be loaded.
+	  if(load_job.get() != NULL)
+	    load_job->cancel();
 	  screenshot_cache::canceled(shared_from_this());
 	}
     }
@@ -831,7 +878,7 @@ namespace gui
     void emit_failed(const boost::shared_ptr<screenshot_cache_entry> &job,
 		     const std::string &msg)
     {
-      job->get_signal_failed()(msg);
+      job->load_failed(msg);
     }
 
     std::ostream &operator<<(std::ostream &out, const load_screenshot_job &job)
@@ -59,11 +59,21 @@ namespace aptitude
     return Logger::getLogger("aptitude.cmdline.throttle");
   }
 
+  LoggerPtr Loggers::getAptitudeDownload()
+  {
+    return Logger::getLogger("aptitude.download");
+  }
+
   LoggerPtr Loggers::getAptitudeDownloadCache()
   {
     return Logger::getLogger("aptitude.downloadCache");
   }
 
+  LoggerPtr Loggers::getAptitudeDownloadCacheStatistics()
+  {
+    return Logger::getLogger("aptitude.downloadCache.statistics");
+  }
+
   LoggerPtr Loggers::getAptitudeDownloadQueue()
   {
     return Logger::getLogger("aptitude.downloadQueue");
@@ -74,6 +84,11 @@ namespace aptitude
     return Logger::getLogger("aptitude.downloadQueue.cache");
   }
 
+  LoggerPtr Loggers::getAptitudeDpkg()
+  {
+    return Logger::getLogger("aptitude.dpkg");
+  }
+
   LoggerPtr Loggers::getAptitudeDpkgStatusPipe()
   {
     return Logger::getLogger("aptitude.dpkg.statusPipe");
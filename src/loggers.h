@@ -86,12 +86,23 @@ namespace aptitude
      */
     static logging::LoggerPtr getAptitudeCmdlineThrottle();
 
+    /** \brief The logger for downloading package lists and .debs.
+     *
+     *  Name: aptitude.download
+     */
+    static logging::LoggerPtr getAptitudeDownload();
+
     /** \brief The logger for events having to do with aptitude's
      *  caching of downloaded data (other than package lists and
      *  .debs).
      */
     static logging::LoggerPtr getAptitudeDownloadCache();
 
+    /** \brief The logger for the hit, miss and latency counters of
+     *  each level of the download cache.
+     */
+    static logging::LoggerPtr getAptitudeDownloadCacheStatistics();
+
     /** \brief The logger for events having to do with aptitude's
      *  background download queue.
      */
@@ -102,6 +113,12 @@ namespace aptitude
      */
     static logging::LoggerPtr getAptitudeDownloadQueueCache();
 
+    /** \brief The logger for running dpkg to install packages.
+     *
+     *  Name: aptitude.dpkg
+     */
+    static logging::LoggerPtr getAptitudeDpkg();
+
     /** \brief The logger for events having to do with the dpkg
      *  status pipe.
      */
@@ -41,6 +41,7 @@
 #include <generic/problemresolver/exceptions.h>
 
 #include <generic/util/logging.h>
+#include <generic/util/profile.h>
 #include <generic/util/temp.h>
 #include <generic/util/util.h>
 
@@ -76,6 +77,7 @@
 #include <cmdline/cmdline_why.h>
 #include <cmdline/terminal.h>
 
+#include <sigc++/functors/mem_fun.h>
 #include <sigc++/functors/ptr_fun.h>
 
 #include <apt-pkg/error.h>
@@ -84,6 +86,12 @@
 #include <boost/format.hpp>
 #include <boost/optional.hpp>
 
+#include <errno.h>
+#include <string.h>
+
+#include <fstream>
+#include <iostream>
+
 #ifdef HAVE_GTK
 #include "gtk/gui.h"
 #include "gtk/init.h"
@@ -93,7 +101,6 @@
 #include "qt/qt_main.h"
 #endif
 
-#include <fstream>
 
 #include "loggers.h"
 #include "progress.h"
@@ -289,6 +296,7 @@ enum {
   OPTION_LOG_FILE,
   OPTION_LOG_CONFIG_FILE,
   OPTION_LOG_RESOLVER,
+  OPTION_PROFILE,
   OPTION_SHOW_SUMMARY,
   OPTION_AUTOCLEAN_ON_STARTUP,
   OPTION_CLEAN_ON_STARTUP,
@@ -347,6 +355,7 @@ option opts[]={
   {"log-file", 1, &getopt_result, OPTION_LOG_FILE},
   {"log-config-file", 1, &getopt_result, OPTION_LOG_CONFIG_FILE},
   {"log-resolver", 0, &getopt_result, OPTION_LOG_RESOLVER},
+  {"profile", 1, &getopt_result, OPTION_PROFILE},
   {"show-summary", 2, &getopt_result, OPTION_SHOW_SUMMARY},
   {"autoclean-on-startup", 0, &getopt_result, OPTION_AUTOCLEAN_ON_STARTUP},
   {"clean-on-startup", 0, &getopt_result, OPTION_CLEAN_ON_STARTUP},
@@ -539,54 +548,50 @@ struct close_cache_on_exit
   }
 };
 
-void do_message_logged(std::ostream &out,
-                       const char *sourceFilename,
-                       int sourceLineNumber,
-                       log_level level,
-                       LoggerPtr logger,
-                       const std::string &msg)
+namespace
 {
-  time_t current_time = 0;
-  struct tm local_current_time;
-
-  time(&current_time);
-  localtime_r(&current_time, &local_current_time);
-
-  out << sstrftime("%F %T", &local_current_time)
-      << " [" << pthread_self() << "] "
-      << sourceFilename << ":" << sourceLineNumber
-      << " " << describe_log_level(level)
-      << " " << logger->getCategory()
-      << " - " << msg << std::endl << std::flush;
-}
+  /** \brief The sink that writes messages to the log file, if any.
+   *
+   *  Like the logging system itself, it is never destroyed, so that
+   *  messages logged by global destructors don't go to a deleted
+   *  object.  When the program starts exiting, the sink writes the
+   *  messages it is holding and switches to writing each message as
+   *  it is logged, so the messages of later atexit handlers and
+   *  global destructors aren't lost either.
+   */
+  boost::shared_ptr<logging::LogSink> *log_sink = NULL;
 
-void handle_message_logged(const char *sourceFilename,
-                           int sourceLineNumber,
-                           log_level level,
-                           LoggerPtr logger,
-                           const std::string &msg,
-                           const std::string &filename)
-{
-  if(filename == "-")
-    do_message_logged(std::cout,
-                      sourceFilename,
-                      sourceLineNumber,
-                      level,
-                      logger,
-                      msg);
-  else
-    {
-      std::ofstream f(filename.c_str(), std::ios::app);
-      if(f)
-        do_message_logged(f,
-                          sourceFilename,
-                          sourceLineNumber,
-                          level,
-                          logger,
-                          msg);
-      // Since logging is just for debugging, I don't do anything if
-      // the log file can't be opened.
-    }
+  void make_log_sink_synchronous()
+  {
+    if(log_sink != NULL)
+      (*log_sink)->make_synchronous();
+  }
+
+  /** \brief The file that the profile report is written to when the
+   *  program exits, or "-" to write it to standard output.
+   */
+  std::string *profile_file_name = NULL;
+
+  void write_profile_file()
+  {
+    if(profile_file_name == NULL)
+      return;
+
+    if(*profile_file_name == "-")
+      {
+	aptitude::util::write_profile_report(std::cout);
+	std::cout.flush();
+	return;
+      }
+
+    std::ofstream out(profile_file_name->c_str());
+    if(out)
+      aptitude::util::write_profile_report(out);
+
+    if(!out)
+      fprintf(stderr, _("Unable to write the profile report to %s: %s\n"),
+	      profile_file_name->c_str(), strerror(errno));
+  }
 }
 
 int main(int argc, char *argv[])
@@ -644,6 +649,9 @@ int main(int argc, char *argv[])
   // Set to a non-empty string to enable logging simplistically; set
   // to "-" to log to stdout.
   string log_file = aptcfg->Find(PACKAGE "::Logging::File", "");
+  // Set to a non-empty string to write a report of where the time was
+  // spent when the program exits; set to "-" to write it to stdout.
+  string profile_file = aptcfg->Find(PACKAGE "::Profile::File", "");
   bool simulate = aptcfg->FindB(PACKAGE "::CmdLine::Simulate", false) ||
     aptcfg->FindB(PACKAGE "::Simulate", false);
   bool download_only=aptcfg->FindB(PACKAGE "::CmdLine::Download-Only", false);;
@@ -933,6 +941,9 @@ int main(int argc, char *argv[])
 	    case OPTION_LOG_RESOLVER:
 	      enable_resolver_log();
 	      break;
+	    case OPTION_PROFILE:
+	      profile_file = optarg;
+	      break;
 
 	    case OPTION_SHOW_SUMMARY:
 	      if(optarg == NULL)
@@ -1038,9 +1049,19 @@ int main(int argc, char *argv[])
     }
 
   if(!log_file.empty())
-    Logger::getLogger("")
-      ->connect_message_logged(sigc::bind(sigc::ptr_fun(&handle_message_logged),
-                                          log_file));
+    {
+      log_sink = new boost::shared_ptr<logging::LogSink>(logging::createAsyncLogSink(log_file));
+      Logger::getLogger("")
+        ->connect_message_logged(sigc::mem_fun(**log_sink, &logging::LogSink::message_logged));
+      atexit(&make_log_sink_synchronous);
+    }
+
+  if(!profile_file.empty())
+    {
+      aptitude::util::enable_profiling();
+      profile_file_name = new std::string(profile_file);
+      atexit(&write_profile_file);
+    }
 
   temp::initialize("aptitude");
 
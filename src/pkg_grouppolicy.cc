@@ -554,7 +554,7 @@ public:
 
   virtual void add_package(const pkgCache::PkgIterator &pkg, pkg_subtree *root)
   {
-    if(matching::get_match(filter, pkg, search_info, *apt_cache_file, *apt_package_records).valid())
+    if(matching::test_match(filter, pkg, search_info, *apt_cache_file, *apt_package_records))
       chain->add_package(pkg, root);
   }
 
@@ -1008,7 +1008,10 @@ pkg_grouppolicy_hier_factory::~pkg_grouppolicy_hier_factory()
 
 class pkg_grouppolicy_task:public pkg_grouppolicy
 {
-  /** The subtrees are indexed by Task. */
+  /** The task subtrees are indexed by the ID of their Task. */
+  typedef std::map<aptitude::apt::symbol_id, pkg_subtree *> task_subtree_map;
+
+  /** The section subtrees are indexed by section name. */
   typedef std::map<string, pkg_subtree *> subtree_map;
 
   /** A list of [task,description] pairs. */
@@ -1017,7 +1020,8 @@ class pkg_grouppolicy_task:public pkg_grouppolicy
   // HACK: put all our stuff under this.
   pkg_subtree *tasks_subtree;
 
-  subtree_map task_children, section_children;
+  task_subtree_map task_children;
+  subtree_map section_children;
 
   pkg_grouppolicy *chain;
 
@@ -1079,20 +1083,20 @@ public:
 void pkg_grouppolicy_task::add_package(const pkgCache::PkgIterator &pkg,
 				       pkg_subtree *root)
 {
-  set<string> *tasks=get_tasks(pkg);
-
-  eassert(tasks);
+  const aptitude::apt::symbol_set tasks = get_tasks(pkg);
 
   chain->add_package(pkg, root);
 
-  for(set<string>::iterator i = tasks->begin(); i != tasks->end(); ++i)
+  for(aptitude::apt::symbol_set::const_iterator i = tasks.begin();
+      i != tasks.end(); ++i)
     {
-      subtree_map::iterator found=task_children.find(*i);
+      task_subtree_map::iterator found=task_children.find(*i);
 
       if(found==task_children.end())
 	{
+	  const string &taskname = get_task_names().get_name(*i);
 	  string section;
-	  map<string,task>::iterator taskfound=task_list->find(*i);
+	  map<string,task>::iterator taskfound=task_list->find(taskname);
 	  pkg_subtree *newtree, *sectiontree;
 
 	  if(taskfound==task_list->end())
@@ -1141,7 +1145,7 @@ void pkg_grouppolicy_task::add_package(const pkgCache::PkgIterator &pkg,
 				     get_desc_sig(),
 				     taskfound->second.relevance);
 	  else
-	    newtree=new task_subtree(cw::util::transcode(*i), L"",
+	    newtree=new task_subtree(cw::util::transcode(taskname), L"",
 				     get_desc_sig(), 5);
 
 	  task_children[*i]=newtree;
@@ -452,10 +452,10 @@ bool pkg_item::matches(const string &s) const
   cw::util::ref_ptr<aptitude::matching::search_cache> info =
     aptitude::matching::search_cache::create();
 
-  return aptitude::matching::get_match(p, package, visible_version(),
-				       info,
-				       *apt_cache_file,
-				       *apt_package_records).valid();
+  return aptitude::matching::test_match(p, package, visible_version(),
+					info,
+					*apt_cache_file,
+					*apt_package_records);
 }
 
 pkgCache::VerIterator pkg_item::visible_version(const pkgCache::PkgIterator &pkg)
@@ -0,0 +1,293 @@
+// download_queue_bench.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.  You should have
+//   received a copy of the GNU General Public License along with this
+//   program; see the file COPYING.  If not, write to the Free
+//   Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+//   MA 02111-1307, USA.
+//
+// Measures how quickly the download queue fetches a batch of small
+// files (like changelogs or screenshots) from a single server, for
+// several values of Aptitude::Download-Queue::Connections-Per-Host.
+// Every file is requested twice, so the number of requests the
+// server sees shows whether duplicate requests were merged.
+//
+// The server is a minimal HTTP/1.1 responder on the loopback
+// interface that waits a fixed time before answering each request,
+// standing in for the round trip to a real mirror.
+//
+// Usage: download_queue_bench [num_items [item_size [latency_ms]]]
+
+#include <aptitude.h>
+
+#include <generic/apt/apt.h>
+#include <generic/apt/config_signal.h>
+#include <generic/apt/download_queue.h>
+#include <generic/util/temp.h>
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+
+#include <boost/make_shared.hpp>
+
+#include <cwidget/generic/threads/threads.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace cw = cwidget;
+
+using aptitude::download_callbacks;
+using aptitude::download_request;
+
+namespace
+{
+  double now()
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+  }
+
+  // The server's settings and statistics.
+  std::string body;
+  int latency_ms = 20;
+  int requests_served = 0;
+  int connections_accepted = 0;
+
+  /** \brief Answer every request that arrives on a connection. */
+  void *serve_connection(void *arg)
+  {
+    const int fd = (int)(long)arg;
+    std::string buffer;
+    char chunk[4096];
+
+    while(true)
+      {
+	std::string::size_type end;
+	while((end = buffer.find("\r\n\r\n")) == std::string::npos)
+	  {
+	    const ssize_t amt = read(fd, chunk, sizeof(chunk));
+	    if(amt <= 0)
+	      {
+		close(fd);
+		return NULL;
+	      }
+	    buffer.append(chunk, amt);
+	  }
+
+	buffer.erase(0, end + 4);
+	__sync_fetch_and_add(&requests_served, 1);
+
+	usleep(latency_ms * 1000);
+
+	char header[256];
+	snprintf(header, sizeof(header),
+		 "HTTP/1.1 200 OK\r\n"
+		 "Content-Length: %lu\r\n"
+		 "Last-Modified: Sat, 01 Jan 2011 00:00:00 GMT\r\n"
+		 "Content-Type: application/octet-stream\r\n"
+		 "\r\n",
+		 (unsigned long)body.size());
+
+	const std::string response = header + body;
+	std::string::size_type written = 0;
+	while(written < response.size())
+	  {
+	    const ssize_t amt = write(fd, response.data() + written,
+				      response.size() - written);
+	    if(amt <= 0)
+	      {
+		close(fd);
+		return NULL;
+	      }
+	    written += amt;
+	  }
+      }
+  }
+
+  void *accept_connections(void *arg)
+  {
+    const int listen_fd = (int)(long)arg;
+
+    while(true)
+      {
+	const int fd = accept(listen_fd, NULL, NULL);
+	if(fd < 0)
+	  return NULL;
+
+	__sync_fetch_and_add(&connections_accepted, 1);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, &serve_connection, (void *)(long)fd);
+	pthread_detach(thread);
+      }
+  }
+
+  /** \brief Start the server on an unused loopback port.
+   *
+   *  \return the port number, or 0 on failure.
+   */
+  int start_server()
+  {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+      return 0;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    socklen_t len = sizeof(addr);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(fd, 64) != 0 ||
+       getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+      {
+	close(fd);
+	return 0;
+      }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, &accept_connections, (void *)(long)fd);
+    pthread_detach(thread);
+
+    return ntohs(addr.sin_port);
+  }
+
+  // Counts the downloads that have finished.
+  cw::threads::mutex finished_mutex;
+  cw::threads::condition finished_condition;
+  int num_succeeded = 0;
+  int num_failed = 0;
+
+  class counting_callbacks : public download_callbacks
+  {
+  public:
+    void success(const temp::name &)
+    {
+      cw::threads::mutex::lock l(finished_mutex);
+      ++num_succeeded;
+      finished_condition.wake_all();
+    }
+
+    void failure(const std::string &msg)
+    {
+      cw::threads::mutex::lock l(finished_mutex);
+      if(num_failed == 0)
+	std::cerr << "Download failed: " << msg << std::endl;
+      ++num_failed;
+      finished_condition.wake_all();
+    }
+  };
+
+  // There's no main loop, so events are handled in the download
+  // threads.
+  void run_inline(const sigc::slot<void> &thunk)
+  {
+    thunk();
+  }
+
+  void run(int port, int connections, int num_items)
+  {
+    aptcfg->SetNoUser(PACKAGE "::Download-Queue::Connections-Per-Host", connections);
+
+    {
+      cw::threads::mutex::lock l(finished_mutex);
+      num_succeeded = 0;
+      num_failed = 0;
+    }
+    const int requests_before = requests_served;
+    const int connections_before = connections_accepted;
+
+    const boost::shared_ptr<download_callbacks> callbacks =
+      boost::make_shared<counting_callbacks>();
+    std::vector<boost::shared_ptr<download_request> > requests;
+
+    const double start = now();
+    for(int i = 0; i < num_items; ++i)
+      {
+	char uri[128];
+	snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/%d/%d",
+		 port, connections, i);
+
+	for(int copy = 0; copy < 2; ++copy)
+	  requests.push_back(aptitude::queue_download(uri, "bench item",
+						      callbacks, &run_inline));
+      }
+
+    int finished;
+    {
+      cw::threads::mutex::lock l(finished_mutex);
+      while(num_succeeded + num_failed < 2 * num_items)
+	finished_condition.wait(l);
+      finished = num_succeeded;
+    }
+    const double elapsed = now() - start;
+
+    const double megabytes = (double)body.size() * num_items / (1024 * 1024);
+    printf("%d connections per host: %7.1f items/s %8.2f MB/s  (%d requests, %d connections)",
+	   connections, num_items / elapsed, megabytes / elapsed,
+	   requests_served - requests_before,
+	   connections_accepted - connections_before);
+    if(finished < 2 * num_items)
+      printf("  (%d downloads failed!)", 2 * num_items - finished);
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const int num_items = argc > 1 ? atoi(argv[1]) : 100;
+  const int item_size = argc > 2 ? atoi(argv[2]) : 16 * 1024;
+  latency_ms = argc > 3 ? atoi(argv[3]) : 20;
+
+  body.assign(item_size, 'x');
+
+  const int port = start_server();
+  if(port == 0)
+    {
+      perror("Unable to start the local server");
+      return 1;
+    }
+
+  temp::initialize("downloadQueueBench");
+  apt_preinit(NULL);
+  _error->DumpErrors();
+
+  // Don't send the requests through whatever proxy is configured.
+  _config->Set("Acquire::http::Proxy::127.0.0.1", "DIRECT");
+
+  const int connections[] = { 1, 2, 4, 8 };
+  const int num_connections = sizeof(connections) / sizeof(connections[0]);
+
+  for(int i = 0; i < num_connections; ++i)
+    run(port, connections[i], num_items);
+
+  aptitude::shutdown_download_queue();
+  temp::shutdown();
+
+  return 0;
+}
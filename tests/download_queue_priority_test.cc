@@ -0,0 +1,310 @@
+// download_queue_priority_test.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.  You should have
+//   received a copy of the GNU General Public License along with this
+//   program; see the file COPYING.  If not, write to the Free
+//   Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+//   MA 02111-1307, USA.
+//
+// Checks that a visible download overtakes the prefetches that were
+// queued before it.  A batch of prefetches is queued, followed by
+// one visible item, against a local server that answers one request
+// at a time after a delay; the program prints the order in which
+// the items finished and fails if the visible item finished after
+// most of the prefetches.
+//
+// This opens sockets and runs the real download threads, so it is
+// not part of "make check"; run it by hand after changing the
+// download queue.
+//
+// Usage: download_queue_priority_test [num_prefetches [latency_ms]]
+
+#include <aptitude.h>
+
+#include <generic/apt/apt.h>
+#include <generic/apt/config_signal.h>
+#include <generic/apt/download_queue.h>
+#include <generic/util/temp.h>
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+
+#include <boost/make_shared.hpp>
+
+#include <cwidget/generic/threads/threads.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace cw = cwidget;
+
+using aptitude::download_callbacks;
+using aptitude::download_priority_prefetch;
+using aptitude::download_priority_visible;
+using aptitude::download_request;
+
+namespace
+{
+  // How long the test server waits before answering each request.
+  int server_latency_ms = 50;
+
+  // How long to wait for all the downloads before giving up.
+  const int timeout_seconds = 60;
+
+  /** \brief Answer every request on a connection with a short body,
+   *  after a delay.
+   */
+  void *serve_connection(void *arg)
+  {
+    const int fd = (int)(long)arg;
+    std::string buffer;
+    char chunk[4096];
+
+    while(true)
+      {
+	std::string::size_type end;
+	while((end = buffer.find("\r\n\r\n")) == std::string::npos)
+	  {
+	    const ssize_t amt = read(fd, chunk, sizeof(chunk));
+	    if(amt <= 0)
+	      {
+		close(fd);
+		return NULL;
+	      }
+	    buffer.append(chunk, amt);
+	  }
+	buffer.erase(0, end + 4);
+
+	usleep(server_latency_ms * 1000);
+
+	const std::string response =
+	  "HTTP/1.1 200 OK\r\n"
+	  "Content-Length: 4\r\n"
+	  "Last-Modified: Sat, 01 Jan 2011 00:00:00 GMT\r\n"
+	  "Content-Type: application/octet-stream\r\n"
+	  "\r\n"
+	  "data";
+	if(write(fd, response.data(), response.size()) != (ssize_t)response.size())
+	  {
+	    close(fd);
+	    return NULL;
+	  }
+      }
+  }
+
+  void *accept_connections(void *arg)
+  {
+    const int listen_fd = (int)(long)arg;
+
+    while(true)
+      {
+	const int fd = accept(listen_fd, NULL, NULL);
+	if(fd < 0)
+	  return NULL;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, &serve_connection, (void *)(long)fd);
+	pthread_detach(thread);
+      }
+  }
+
+  /** \brief Start the server on an unused loopback port.
+   *
+   *  \return the port number, or 0 on failure.
+   */
+  int start_server()
+  {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0)
+      return 0;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    socklen_t len = sizeof(addr);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(fd, 16) != 0 ||
+       getsockname(fd, (struct sockaddr *)&addr, &len) != 0)
+      {
+	close(fd);
+	return 0;
+      }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, &accept_connections, (void *)(long)fd);
+    pthread_detach(thread);
+
+    return ntohs(addr.sin_port);
+  }
+
+  // The order in which the downloads finished, and the number of
+  // them that failed.
+  cw::threads::mutex finished_mutex;
+  cw::threads::condition finished_condition;
+  std::vector<int> finished;
+  int num_failed = 0;
+
+  class recording_callbacks : public download_callbacks
+  {
+    int id;
+
+    void record(bool failed)
+    {
+      cw::threads::mutex::lock l(finished_mutex);
+      finished.push_back(id);
+      if(failed)
+	++num_failed;
+      finished_condition.wake_all();
+    }
+
+  public:
+    explicit recording_callbacks(int _id)
+      : id(_id)
+    {
+    }
+
+    void success(const temp::name &)
+    {
+      record(false);
+    }
+
+    void failure(const std::string &)
+    {
+      record(true);
+    }
+  };
+
+  // There's no main loop, so events are handled in the download
+  // threads.
+  void run_inline(const sigc::slot<void> &thunk)
+  {
+    thunk();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const int num_prefetches = argc > 1 ? atoi(argv[1]) : 20;
+  server_latency_ms = argc > 2 ? atoi(argv[2]) : 50;
+
+  const int port = start_server();
+  if(port == 0)
+    {
+      perror("Unable to start the local server");
+      return 1;
+    }
+
+  temp::initialize("downloadQueuePriorityTest");
+  apt_preinit(NULL);
+  _error->DumpErrors();
+
+  // Download one item at a time, so the order in which the items are
+  // handed to the downloader is the order in which they finish.
+  _config->Set("Acquire::http::Proxy::127.0.0.1", "DIRECT");
+  _config->Set("Acquire::http::Pipeline-Depth", "0");
+  aptcfg->SetNoUser(PACKAGE "::Download-Queue::Connections-Per-Host", 1);
+
+  const int visible_id = num_prefetches;
+  std::vector<boost::shared_ptr<download_request> > requests;
+
+  for(int i = 0; i < num_prefetches; ++i)
+    {
+      char uri[128];
+      snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/prefetch/%d", port, i);
+      requests.push_back(aptitude::queue_download(uri, "prefetched item",
+						  boost::make_shared<recording_callbacks>(i),
+						  &run_inline,
+						  download_priority_prefetch));
+    }
+
+  char uri[128];
+  snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/visible", port);
+  requests.push_back(aptitude::queue_download(uri, "visible item",
+					      boost::make_shared<recording_callbacks>(visible_id),
+					      &run_inline,
+					      download_priority_visible));
+
+  timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += timeout_seconds;
+
+  std::vector<int> order;
+  int failures;
+  bool timed_out = false;
+  {
+    cw::threads::mutex::lock l(finished_mutex);
+    while(finished.size() < requests.size() && !timed_out)
+      timed_out = !finished_condition.timed_wait(l, until);
+    order = finished;
+    failures = num_failed;
+  }
+
+  aptitude::shutdown_download_queue();
+  temp::shutdown();
+
+  std::cout << "Finished:";
+  for(std::vector<int>::const_iterator it = order.begin();
+      it != order.end(); ++it)
+    {
+      if(*it == visible_id)
+	std::cout << " visible";
+      else
+	std::cout << " " << *it;
+    }
+  std::cout << std::endl;
+
+  if(timed_out && order.size() < requests.size())
+    {
+      std::cerr << "Only " << order.size() << " of " << requests.size()
+		<< " downloads finished within " << timeout_seconds
+		<< " seconds." << std::endl;
+      return 1;
+    }
+
+  if(failures > 0)
+    {
+      std::cerr << failures << " downloads failed." << std::endl;
+      return 1;
+    }
+
+  // A few prefetches may have reached the downloader before the
+  // visible request was made, but it must not wait behind the rest
+  // of them.
+  const std::vector<int>::size_type position =
+    std::find(order.begin(), order.end(), visible_id) - order.begin();
+  if(position >= order.size() || position >= (std::vector<int>::size_type)num_prefetches / 2)
+    {
+      std::cerr << "The visible item finished in position " << position + 1
+		<< ", after most of the prefetches." << std::endl;
+      return 1;
+    }
+
+  std::cout << "The visible item finished in position " << position + 1
+	    << "." << std::endl;
+  return 0;
+}
@@ -0,0 +1,153 @@
+// file_cache_bench.cc
+//
+//   Copyright (C) 2011 Daniel Burrows
+//
+//   This program is free software; you can redistribute it and/or
+//   modify it under the terms of the GNU General Public License as
+//   published by the Free Software Foundation; either version 2 of
+//   the License, or (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+//   General Public License for more details.  You should have
+//   received a copy of the GNU General Public License along with this
+//   program; see the file COPYING.  If not, write to the Free
+//   Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+//   MA 02111-1307, USA.
+//
+// Measures the put and get throughput of the on-disk file cache at
+// several compression levels, for text that compresses well (like a
+// changelog) and for data that doesn't compress at all (like a
+// screenshot).
+//
+// Usage: file_cache_bench [num_items [item_size]]
+
+#include <generic/util/file_cache.h>
+#include <generic/util/temp.h>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+using aptitude::util::file_cache;
+
+namespace
+{
+  double now()
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+  }
+
+  /** \brief Generate text that looks vaguely like a changelog. */
+  std::string make_text(int size)
+  {
+    static const char * const words[] =
+      { "fix", "the", "upload", "new", "upstream", "release", "debian/control:",
+	"bump", "standards-version", "closes:", "patch", "build-depends", "\n  * " };
+    const int num_words = sizeof(words) / sizeof(words[0]);
+
+    std::string rval;
+    unsigned long state = 1;
+    while((int)rval.size() < size)
+      {
+	state = state * 1103515245UL + 12345UL;
+	rval += words[(state >> 16) % num_words];
+	rval += ' ';
+      }
+
+    rval.resize(size);
+    return rval;
+  }
+
+  /** \brief Generate data that doesn't compress. */
+  std::string make_random(int size)
+  {
+    std::string rval;
+    unsigned long state = 1;
+    for(int i = 0; i < size; ++i)
+      {
+	state = state * 1103515245UL + 12345UL;
+	rval.push_back((char)(state >> 16));
+      }
+
+    return rval;
+  }
+
+  void run(const char *data_name, const std::string &data,
+	   int level, int num_items)
+  {
+    temp::name input("benchInput");
+    {
+      std::ofstream out(input.get_name().c_str());
+      out << data;
+    }
+
+    temp::name cache_name("benchCache");
+    const int disk_size = (int)data.size() * (num_items + 1) * 2;
+    boost::shared_ptr<file_cache> cache(file_cache::create(cache_name.get_name(),
+							   0, disk_size, level));
+
+    std::vector<std::string> keys;
+    for(int i = 0; i < num_items; ++i)
+      {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "bench://%d", i);
+	keys.push_back(buf);
+      }
+
+    const double put_start = now();
+    for(std::vector<std::string>::const_iterator it = keys.begin();
+	it != keys.end(); ++it)
+      cache->putItem(*it, input.get_name());
+    const double put_time = now() - put_start;
+
+    int misses = 0;
+    const double get_start = now();
+    for(std::vector<std::string>::const_iterator it = keys.begin();
+	it != keys.end(); ++it)
+      {
+	boost::shared_ptr<const std::string> contents = cache->getItemContents(*it);
+	if(contents.get() == NULL || *contents != data)
+	  ++misses;
+      }
+    const double get_time = now() - get_start;
+
+    const double megabytes = (double)data.size() * num_items / (1024 * 1024);
+    printf("%-8s level %d: put %8.2f MB/s  get %8.2f MB/s",
+	   data_name, level, megabytes / put_time, megabytes / get_time);
+    if(misses > 0)
+      printf("  (%d items missing or corrupt!)", misses);
+    printf("\n");
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const int num_items = argc > 1 ? atoi(argv[1]) : 200;
+  const int item_size = argc > 2 ? atoi(argv[2]) : 64 * 1024;
+
+  temp::initialize("fileCacheBench");
+
+  const std::string text = make_text(item_size);
+  const std::string random = make_random(item_size);
+
+  const int levels[] = { 0, 1, 6, 9 };
+  const int num_levels = sizeof(levels) / sizeof(levels[0]);
+
+  for(int i = 0; i < num_levels; ++i)
+    run("text", text, levels[i], num_items);
+  for(int i = 0; i < num_levels; ++i)
+    run("random", random, levels[i], num_items);
+
+  temp::shutdown();
+
+  return 0;
+}
@@ -0,0 +1,162 @@
+/** \file test_aptitude_resolver.cc */
+
+// Copyright (C) 2011 Daniel Burrows
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; see the file COPYING.  If not, write to
+// the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+// Boston, MA 02111-1307, USA.
+
+#include <aptitude.h>
+
+#include <generic/apt/apt.h>
+#include <generic/apt/aptcache.h>
+#include <generic/apt/aptitude_resolver.h>
+#include <generic/apt/aptitude_resolver_cost_settings.h>
+#include <generic/apt/aptitude_resolver_cost_syntax.h>
+#include <generic/apt/aptitude_resolver_universe.h>
+#include <generic/apt/config_signal.h>
+#include <generic/util/undo.h>
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+#include <apt-pkg/progress.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+  /** \brief Load the captured apt state in resolver_inputs/name. */
+  struct apt_root_fixture
+  {
+    explicit apt_root_fixture(const std::string &name)
+    {
+      const std::string rootdir = std::string(SRCDIR) + "/resolver_inputs/" + name;
+
+      apt_preinit(rootdir.c_str());
+      _error->Discard();
+
+      // Build the cache in memory instead of writing it to the
+      // source tree.
+      _config->Set("Dir::Cache::pkgcache", "");
+      _config->Set("Dir::Cache::srcpkgcache", "");
+
+      OpProgress progress;
+      apt_init(&progress, false, NULL);
+    }
+
+    ~apt_root_fixture()
+    {
+      apt_close_cache();
+    }
+  };
+
+  /** \brief Create a resolver with the default settings, the way
+   *  resolver_manager::create_resolver() does.
+   */
+  aptitude_resolver *make_resolver()
+  {
+    aptitude_resolver_cost_settings cost_settings(parse_cost_settings("safety,priority"));
+    const cost ignored_recommends_cost =
+      cost_settings.add_to_cost(cost_settings.get_or_create_component("ignored-recommends",
+									aptitude_resolver_cost_settings::additive),
+				1);
+
+    aptitude_resolver *rval =
+      new aptitude_resolver(70, -100, -200, 1000000, 50,
+			    ignored_recommends_cost, 50,
+			    cost_settings,
+			    imm::map<aptitude_resolver_package, aptitude_resolver_version>(),
+			    *apt_cache_file,
+			    apt_cache_file->Policy);
+
+    rval->add_action_scores(60, 0, -300, 0, -20, 0, -40, -100000,
+			    500, -500, -300, false, 400,
+			    std::map<aptitude_resolver_package, bool>(),
+			    std::vector<aptitude_resolver::hint>());
+    rval->add_priority_scores(5, 4, 3, 1, -1);
+
+    return rval;
+  }
+
+  /** \brief Return the scores of a resolver, one per line, in a
+   *  canonical order.
+   */
+  std::vector<std::string> get_scores(aptitude_resolver &resolver)
+  {
+    std::ostringstream out;
+    resolver.dump_scores(out);
+
+    std::vector<std::string> rval;
+    std::istringstream in(out.str());
+    std::string line;
+    while(std::getline(in, line))
+      rval.push_back(line);
+
+    std::sort(rval.begin(), rval.end());
+    return rval;
+  }
+}
+
+BOOST_AUTO_TEST_CASE(aptitudeResolverUpdateInitialState)
+{
+  apt_root_fixture root("apt-needs-downgrade");
+  BOOST_REQUIRE(apt_cache_file != NULL);
+  BOOST_REQUIRE(!_error->PendingError());
+
+  pkgCache::PkgIterator apt_pkg((*apt_cache_file)->FindPkg("apt"));
+  BOOST_REQUIRE(!apt_pkg.end());
+
+  boost::shared_ptr<aptitude_resolver> updated(make_resolver());
+  const std::vector<std::string> scores_before(get_scores(*updated));
+  const imm::set<aptitude_resolver_dep> broken_before(updated->get_initial_broken());
+
+  // Removing apt without fixing its reverse dependencies changes the
+  // action scores of apt and of the packages that depend on it, and
+  // breaks those dependencies.
+  undo_group undo;
+  (*apt_cache_file)->mark_delete(apt_pkg, false, false, &undo);
+
+  std::vector<aptitude_resolver_package> changed;
+  changed.push_back(aptitude_resolver_package(apt_pkg, *apt_cache_file));
+  BOOST_REQUIRE(updated->update_initial_state(changed));
+
+  boost::shared_ptr<aptitude_resolver> fresh(make_resolver());
+
+  const std::vector<std::string> updated_scores(get_scores(*updated));
+  const std::vector<std::string> fresh_scores(get_scores(*fresh));
+  BOOST_CHECK(updated_scores != scores_before);
+  BOOST_CHECK_EQUAL_COLLECTIONS(updated_scores.begin(), updated_scores.end(),
+				fresh_scores.begin(), fresh_scores.end());
+
+  BOOST_CHECK(!(fresh->get_initial_broken() == broken_before));
+  BOOST_CHECK_EQUAL(updated->get_initial_broken(), fresh->get_initial_broken());
+  BOOST_CHECK_EQUAL(updated->get_keep_all_solution(), fresh->get_keep_all_solution());
+
+  // Putting the package back must restore the original state of the
+  // resolver.
+  undo.undo();
+  BOOST_REQUIRE(updated->update_initial_state(changed));
+
+  const std::vector<std::string> restored_scores(get_scores(*updated));
+  BOOST_CHECK_EQUAL_COLLECTIONS(restored_scores.begin(), restored_scores.end(),
+				scores_before.begin(), scores_before.end());
+  BOOST_CHECK_EQUAL(updated->get_initial_broken(), broken_before);
+}
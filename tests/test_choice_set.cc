@@ -48,6 +48,7 @@ class Choice_Set_Test : public CppUnit::TestFixture
   CPPUNIT_TEST(testClone);
   CPPUNIT_TEST(testContainsChoice);
   CPPUNIT_TEST(testContainsChoiceSet);
+  CPPUNIT_TEST(testHashAndSignature);
   // No test for for_each(), because it's tested in testInsertNarrow
   // (at each step, we learn what's really in the set using
   // for_each())
@@ -462,6 +463,59 @@ public:
 	    CPPUNIT_ASSERT_MESSAGE(msg.str(), !sets[i].contains(sets[j]));
 	}
   }
+
+  // Check that the hash and signature that are maintained as a set
+  // is modified stay in step with its contents.
+  void testHashAndSignature()
+  {
+    const choice c1(make_install_version(av1));
+    const choice c2(make_install_version_from_dep_source(av1, av2d1));
+    const choice c3(make_install_version(bv3));
+    const choice c4(make_break_soft_dep(av2d1));
+    const choice c5(make_break_soft_dep(bv2d1));
+
+    // The same contents reached in different orders, and with a
+    // narrowed choice, hash the same way.
+    choice_set s1;
+    s1.insert_or_narrow(c1);
+    s1.insert_or_narrow(c3);
+    s1.insert_or_narrow(c4);
+    s1.insert_or_narrow(c2);
+
+    choice_set s2;
+    s2.insert_or_narrow(c4);
+    s2.insert_or_narrow(c2);
+    s2.insert_or_narrow(c3);
+    s2.insert_or_narrow(c4);
+
+    CPPUNIT_ASSERT_EQUAL(s1, s2);
+    CPPUNIT_ASSERT_EQUAL(s1.get_hash_value(), s2.get_hash_value());
+    CPPUNIT_ASSERT_EQUAL(s1.get_hash_value(), s1.clone().get_hash_value());
+
+    // Removing everything returns the set to the empty hash.
+    choice_set s3(s1);
+    s3.remove_overlaps(c2);
+    s3.remove_overlaps(c3);
+    s3.remove_overlaps(c4);
+    CPPUNIT_ASSERT_EQUAL(choice_set(), s3);
+    CPPUNIT_ASSERT_EQUAL(choice_set().get_hash_value(), s3.get_hash_value());
+
+    // After a removal, the signature must not keep the removed
+    // choice's bit, or containment tests against the smaller set
+    // would reject sets that really contain it.
+    choice_set s4;
+    s4.insert_or_narrow(c3);
+    s4.insert_or_narrow(c5);
+    s4.remove_overlaps(c5);
+
+    choice_set s5;
+    s5.insert_or_narrow(c1);
+    s5.insert_or_narrow(c3);
+
+    CPPUNIT_ASSERT(s5.contains(s4));
+    CPPUNIT_ASSERT(s4.subset_is_contained_in(s4));
+    CPPUNIT_ASSERT(!s4.contains(s5));
+  }
 };
 
 dummy_universe_ref Choice_Set_Test::u(parseUniverse(dummy_universe_1));
@@ -6,6 +6,7 @@
 #include <boost/test/unit_test.hpp>
 
 #include <generic/util/file_cache.h>
+#include <generic/util/sqlite.h>
 #include <generic/util/temp.h>
 
 #include <sys/stat.h>
@@ -380,7 +381,171 @@ BOOST_FIXTURE_TEST_CASE(fileCacheDropLeastRecentlyUsedDisk, usingTemp)
   temp::name tn("cache");
 
   runDropLeastRecentlyUsedTest(boost::lambda::bind(&file_cache::create,
-						   boost::lambda::_1, 0, 1000));
+						   boost::lambda::_1, 0, 1000, 6));
+}
+
+BOOST_FIXTURE_TEST_CASE(fileCacheDropLeastRecentlyUsedMemory, usingTemp)
+{
+  runDropLeastRecentlyUsedTest(boost::lambda::bind(&file_cache::create,
+						   boost::lambda::_1, 1000, 0, 6));
+}
+
+// Check that the uses of entries in the on-disk cache, which are
+// queued in memory, are written out when the cache is closed.
+BOOST_FIXTURE_TEST_CASE(fileCacheDiskUsesPersist, usingTemp)
+{
+  temp::name tn("cache");
+  fileCacheTestInfo testInfo;
+
+  {
+    boost::shared_ptr<file_cache> cache(file_cache::create(tn.get_name(), 0, 1000));
+    setupFileCacheTest(cache, testInfo);
+
+    CHECK_CACHED_VALUE(cache, testInfo.key2, testInfo.infileData2, testInfo.time2);
+    CHECK_CACHED_VALUE(cache, testInfo.key3, testInfo.infileData3, testInfo.time3);
+    CHECK_CACHED_VALUE(cache, testInfo.key1, testInfo.infileData1, testInfo.time1);
+  }
+
+  boost::shared_ptr<file_cache> cache(file_cache::create(tn.get_name(), 0, 1000));
+  cache->putItem("key4", testInfo.infilename1.get_name(), testInfo.time1);
+
+  CHECK_CACHED_VALUE(cache, testInfo.key1, testInfo.infileData1, testInfo.time1);
+  CHECK_CACHED_VALUE(cache, testInfo.key3, testInfo.infileData3, testInfo.time3);
+  CHECK_CACHED_VALUE(cache, "key4", testInfo.infileData1, testInfo.time1);
+  BOOST_CHECK(!cache->getItem(testInfo.key2).valid());
+}
+
+// Check that an item that is found on disk is copied into memory, so
+// the next lookup shares the in-memory buffer.
+BOOST_FIXTURE_TEST_CASE(fileCachePromoteDiskHits, usingTemp)
+{
+  temp::name tn("cache");
+  fileCacheTestInfo testInfo;
+
+  {
+    boost::shared_ptr<file_cache> cache(file_cache::create(tn.get_name(), 0, 1000));
+    setupFileCacheTest(cache, testInfo);
+  }
+
+  boost::shared_ptr<file_cache> cache(file_cache::create(tn.get_name(), 1000, 1000));
+
+  time_t mtime = 0;
+  boost::shared_ptr<const std::string> contents =
+    cache->getItemContents(testInfo.key2, mtime);
+  BOOST_REQUIRE(contents.get() != NULL);
+  BOOST_CHECK_EQUAL(mtime, testInfo.time2);
+  BOOST_CHECK_EQUAL_COLLECTIONS(contents->begin(), contents->end(),
+				testInfo.infileData2.begin(), testInfo.infileData2.end());
+
+  BOOST_CHECK_EQUAL(cache->getItemContents(testInfo.key2).get(), contents.get());
+}
+
+// Check that items stored in both caches reach the disk once the
+// cache is closed, even though they are written in the background.
+BOOST_FIXTURE_TEST_CASE(fileCacheWriteBehind, usingTemp)
+{
+  temp::name tn("cache");
+  fileCacheTestInfo testInfo;
+
+  {
+    boost::shared_ptr<file_cache> cache(file_cache::create(tn.get_name(), 1000, 1000));
+    setupFileCacheTest(cache, testInfo);
+  }
+
+  boost::shared_ptr<file_cache> cache(file_cache::create(tn.get_name(), 0, 1000));
+  CHECK_CACHED_VALUE(cache, testInfo.key1, testInfo.infileData1, testInfo.time1);
+  CHECK_CACHED_VALUE(cache, testInfo.key2, testInfo.infileData2, testInfo.time2);
+  CHECK_CACHED_VALUE(cache, testInfo.key3, testInfo.infileData3, testInfo.time3);
+}
+
+// Read the codec that a cache file recorded for a key's blob.
+int getStoredCodec(const std::string &cacheFile, const std::string &key)
+{
+  using aptitude::sqlite::db;
+  using aptitude::sqlite::statement;
+
+  boost::shared_ptr<db> store(db::create(cacheFile));
+  boost::shared_ptr<statement> get_codec =
+    statement::prepare(*store, "select blobs.Codec from cache join blobs on blobs.BlobId = cache.BlobId where cache.Key = ?");
+  get_codec->bind_string(1, key);
+
+  statement::execution get_codec_execution(*get_codec);
+  BOOST_REQUIRE(get_codec_execution.step());
+  return get_codec->get_int(0);
+}
+
+// Check that data that doesn't compress is stored as it is, and that
+// both kinds of blob come back out intact.
+BOOST_FIXTURE_TEST_CASE(fileCacheCodecs, usingTemp)
+{
+  temp::name incompressible_name("testInFile");
+  temp::name compressible_name("testInFile");
+
+  std::string incompressible_data;
+  std::string compressible_data;
+
+  unsigned long state = 1;
+  for(int i = 0; i < 5000; ++i)
+    {
+      state = state * 1103515245UL + 12345UL;
+      incompressible_data.push_back((char)(state >> 16));
+      compressible_data.push_back("abcd\n"[i % 5]);
+    }
+
+  {
+    std::ofstream incompressible(incompressible_name.get_name().c_str());
+    incompressible << incompressible_data;
+    std::ofstream compressible(compressible_name.get_name().c_str());
+    compressible << compressible_data;
+  }
+
+  for(int level = 0; level <= 9; level += 3)
+    {
+      temp::name tn("cache");
+
+      {
+	boost::shared_ptr<file_cache> cache(file_cache::create(tn.get_name(), 0, 100000, level));
+	cache->putItem("incompressible", incompressible_name.get_name(), 1);
+	cache->putItem("compressible", compressible_name.get_name(), 2);
+
+	CHECK_CACHED_VALUE(cache, "incompressible", incompressible_data, 1);
+	CHECK_CACHED_VALUE(cache, "compressible", compressible_data, 2);
+
+	boost::shared_ptr<const std::string> contents =
+	  cache->getItemContents("compressible");
+	BOOST_REQUIRE(contents.get() != NULL);
+	BOOST_CHECK_EQUAL(*contents, compressible_data);
+      }
+
+      // Codec 0 stores the data as it is and codec 1 is zlib.  Data
+      // that doesn't compress is never run through zlib.
+      BOOST_CHECK_EQUAL(getStoredCodec(tn.get_name(), "incompressible"), 0);
+      BOOST_CHECK_EQUAL(getStoredCodec(tn.get_name(), "compressible"),
+			level > 0 ? 1 : 0);
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(fileCacheGetItemContents, usingTemp)
+{
+  temp::name tn("cache");
+
+  boost::shared_ptr<file_cache> cache(file_cache::create(tn.get_name(), 1000, 0));
+
+  fileCacheTestInfo testInfo;
+  setupFileCacheTest(cache, testInfo);
+
+  time_t mtime = 0;
+  boost::shared_ptr<const std::string> contents =
+    cache->getItemContents(testInfo.key2, mtime);
+  BOOST_REQUIRE(contents.get() != NULL);
+  BOOST_CHECK_EQUAL(mtime, testInfo.time2);
+  BOOST_CHECK_EQUAL_COLLECTIONS(contents->begin(), contents->end(),
+				testInfo.infileData2.begin(), testInfo.infileData2.end());
+
+  // A second lookup shares the cached buffer instead of copying it.
+  BOOST_CHECK_EQUAL(cache->getItemContents(testInfo.key2).get(), contents.get());
+
+  BOOST_CHECK(cache->getItemContents("key4").get() == NULL);
 }
 
 // The changelog that's expected to be in the upgrade test database.
@@ -427,7 +592,7 @@ Changes: \n\
 // cache format and didn't provide an upgrade path, so it isn't
 // included in the test.
 const int min_database_test_upgrade_version = 2;
-const int max_database_test_upgrade_version = 3;
+const int max_database_test_upgrade_version = 5;
 
 extern char *argv0;
 
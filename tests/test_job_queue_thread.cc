@@ -0,0 +1,210 @@
+/** \file test_job_queue_thread.cc */
+
+// Copyright (C) 2011 Daniel Burrows
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; see the file COPYING.  If not, write to
+// the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+// Boston, MA 02111-1307, USA.
+
+#include <generic/util/job_queue_thread.h>
+
+#include <loggers.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <set>
+#include <vector>
+
+#include <unistd.h>
+
+namespace cw = cwidget;
+
+using aptitude::util::job_handle;
+using aptitude::util::job_priority_high;
+using aptitude::util::job_priority_low;
+using aptitude::util::job_priority_normal;
+using aptitude::util::job_queue_metrics;
+using aptitude::util::job_queue_thread;
+using aptitude::util::num_job_priorities;
+
+namespace
+{
+  // The state shared between the test cases and the queues.
+  cw::threads::mutex processed_mutex;
+  std::vector<int> processed;
+  int running = 0;
+  int max_running = 0;
+
+  void reset_processed()
+  {
+    cw::threads::mutex::lock l(processed_mutex);
+    processed.clear();
+    running = 0;
+    max_running = 0;
+  }
+
+  std::vector<int> get_processed()
+  {
+    cw::threads::mutex::lock l(processed_mutex);
+    return processed;
+  }
+
+  /** \brief Records each job, taking a little while over it. */
+  template<typename Subclass>
+  class recording_queue : public job_queue_thread<Subclass, int>
+  {
+  public:
+    static aptitude::util::logging::LoggerPtr get_log_category()
+    {
+      return aptitude::util::logging::Logger::getLogger("test.jobQueue");
+    }
+
+    void process_job(const int &job)
+    {
+      {
+	cw::threads::mutex::lock l(processed_mutex);
+	++running;
+	max_running = std::max(max_running, running);
+      }
+
+      usleep(20000);
+
+      cw::threads::mutex::lock l(processed_mutex);
+      --running;
+      processed.push_back(job);
+    }
+  };
+
+  class serial_queue : public recording_queue<serial_queue>
+  {
+  public:
+    // Jobs with the same value do the same work.
+    static bool merge_job(int &pending, const int &incoming)
+    {
+      return pending == incoming;
+    }
+  };
+
+  class parallel_queue : public recording_queue<parallel_queue>
+  {
+  public:
+    static unsigned int get_max_workers()
+    {
+      return 4;
+    }
+  };
+
+  /** \brief Wait until the given queue has no jobs left. */
+  template<typename Queue>
+  job_queue_metrics wait_for(int num_completed)
+  {
+    for(int i = 0; i < 500; ++i)
+      {
+	const job_queue_metrics metrics = Queue::get_metrics();
+	if(metrics.completed + metrics.cancelled >= (unsigned long)num_completed &&
+	   metrics.workers == 0)
+	  return metrics;
+
+	usleep(10000);
+      }
+
+    return Queue::get_metrics();
+  }
+}
+
+BOOST_AUTO_TEST_CASE(jobQueueRunsLanesInPriorityOrder)
+{
+  reset_processed();
+
+  // Stop the queue so that all the jobs are waiting when it starts.
+  serial_queue::stop();
+  serial_queue::add_job(1, job_priority_low);
+  serial_queue::add_job(2, job_priority_normal);
+  serial_queue::add_job(3, job_priority_high);
+  serial_queue::add_job(4, job_priority_normal);
+
+  const job_queue_metrics waiting = serial_queue::get_metrics();
+  BOOST_CHECK_EQUAL(waiting.queued[job_priority_high], 1U);
+  BOOST_CHECK_EQUAL(waiting.queued[job_priority_normal], 2U);
+  BOOST_CHECK_EQUAL(waiting.queued[job_priority_low], 1U);
+  BOOST_CHECK_EQUAL(waiting.workers, 0U);
+
+  const unsigned long completed_before = waiting.completed;
+  serial_queue::start();
+  const job_queue_metrics done = wait_for<serial_queue>(completed_before + 4);
+
+  BOOST_CHECK_EQUAL(done.completed, completed_before + 4);
+  BOOST_CHECK(serial_queue::empty());
+
+  const std::vector<int> order(get_processed());
+  BOOST_REQUIRE_EQUAL(order.size(), 4U);
+  BOOST_CHECK_EQUAL(order[0], 3);
+  BOOST_CHECK_EQUAL(order[1], 2);
+  BOOST_CHECK_EQUAL(order[2], 4);
+  BOOST_CHECK_EQUAL(order[3], 1);
+}
+
+BOOST_AUTO_TEST_CASE(jobQueueCoalescesAndCancels)
+{
+  reset_processed();
+
+  serial_queue::stop();
+  const job_queue_metrics before = serial_queue::get_metrics();
+
+  const boost::shared_ptr<job_handle> low = serial_queue::add_job(10, job_priority_low);
+  serial_queue::add_job(11, job_priority_normal);
+  // Merged into the waiting job, which moves up to the high lane.
+  const boost::shared_ptr<job_handle> merged = serial_queue::add_job(10, job_priority_high);
+  const boost::shared_ptr<job_handle> cancelled = serial_queue::add_job(12, job_priority_normal);
+
+  BOOST_CHECK(merged == low);
+  cancelled->cancel();
+
+  const job_queue_metrics waiting = serial_queue::get_metrics();
+  BOOST_CHECK_EQUAL(waiting.coalesced, before.coalesced + 1);
+  BOOST_CHECK_EQUAL(waiting.queued[job_priority_high], 1U);
+  BOOST_CHECK_EQUAL(waiting.queued[job_priority_low], 0U);
+
+  serial_queue::start();
+  const job_queue_metrics done = wait_for<serial_queue>(before.completed + before.cancelled + 3);
+
+  BOOST_CHECK_EQUAL(done.completed, before.completed + 2);
+  BOOST_CHECK_EQUAL(done.cancelled, before.cancelled + 1);
+
+  const std::vector<int> order(get_processed());
+  BOOST_REQUIRE_EQUAL(order.size(), 2U);
+  BOOST_CHECK_EQUAL(order[0], 10);
+  BOOST_CHECK_EQUAL(order[1], 11);
+}
+
+BOOST_AUTO_TEST_CASE(jobQueueRunsSeveralWorkers)
+{
+  reset_processed();
+
+  parallel_queue::stop();
+  for(int i = 0; i < 8; ++i)
+    parallel_queue::add_job(i);
+  parallel_queue::start();
+
+  const job_queue_metrics done = wait_for<parallel_queue>(8);
+  BOOST_CHECK_EQUAL(done.completed, 8U);
+  BOOST_CHECK_EQUAL(done.max_queued, 8U);
+
+  const std::vector<int> order(get_processed());
+  BOOST_CHECK_EQUAL(std::set<int>(order.begin(), order.end()).size(), 8U);
+
+  cw::threads::mutex::lock l(processed_mutex);
+  BOOST_CHECK(max_running > 1);
+  BOOST_CHECK(max_running <= 4);
+}
@@ -25,15 +25,27 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <boost/lexical_cast.hpp>
+
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 using aptitude::util::logging::DEBUG_LEVEL;
 using aptitude::util::logging::ERROR_LEVEL;
 using aptitude::util::logging::FATAL_LEVEL;
 using aptitude::util::logging::INFO_LEVEL;
+using aptitude::util::logging::LogSink;
 using aptitude::util::logging::LoggerPtr;
 using aptitude::util::logging::LoggingSystem;
 using aptitude::util::logging::OFF_LEVEL;
 using aptitude::util::logging::TRACE_LEVEL;
 using aptitude::util::logging::WARN_LEVEL;
+using aptitude::util::logging::createAsyncLogSink;
 using aptitude::util::logging::createLoggingSystem;
 using aptitude::util::logging::log_level;
 using boost::shared_ptr;
@@ -503,3 +515,171 @@ TEST_F(LoggingTest, testLogTrace)
   root->setLevel(TRACE_LEVEL);
   LOG_TRACE(root, msg1);
 }
+
+namespace
+{
+  /** \brief Read the lines of a file. */
+  std::vector<std::string> read_lines(const std::string &filename)
+  {
+    std::vector<std::string> rval;
+    std::ifstream in(filename.c_str());
+    std::string line;
+    while(std::getline(in, line))
+      rval.push_back(line);
+
+    return rval;
+  }
+
+  /** \brief A log file that is deleted when the test ends. */
+  struct AsyncLogSinkTest : public LoggingTest
+  {
+    std::string filename;
+
+    AsyncLogSinkTest()
+    {
+      char name[] = "/tmp/test_logging.XXXXXX";
+      const int fd = mkstemp(name);
+      if(fd != -1)
+        close(fd);
+      filename = name;
+    }
+
+    ~AsyncLogSinkTest()
+    {
+      unlink(filename.c_str());
+    }
+  };
+
+  struct log_from_thread_info
+  {
+    shared_ptr<LogSink> sink;
+    LoggerPtr logger;
+    int thread_num;
+    int num_messages;
+  };
+
+  void *log_from_thread(void *arg)
+  {
+    const log_from_thread_info &info(*static_cast<log_from_thread_info *>(arg));
+
+    for(int i = 0; i < info.num_messages; ++i)
+      info.sink->message_logged("thread.cc", i, INFO_LEVEL, info.logger,
+                                boost::lexical_cast<std::string>(info.thread_num) + " " +
+                                boost::lexical_cast<std::string>(i));
+
+    return NULL;
+  }
+}
+
+TEST_F(AsyncLogSinkTest, testAsyncLogSinkWritesMessages)
+{
+  LoggerPtr logger = getLogger("aptitude.test");
+  // A small buffer, so that the logging thread has to wait for the
+  // writer.
+  shared_ptr<LogSink> sink = createAsyncLogSink(filename, 4);
+
+  const int num_messages = 100;
+  for(int i = 0; i < num_messages; ++i)
+    sink->message_logged(sourceFilename1, i, WARN_LEVEL, logger,
+                         "message " + boost::lexical_cast<std::string>(i));
+  sink->flush();
+
+  const std::vector<std::string> lines = read_lines(filename);
+  ASSERT_EQ(num_messages, (int)lines.size());
+  for(int i = 0; i < num_messages; ++i)
+    {
+      const std::string expected_suffix =
+        std::string(sourceFilename1) + ":" + boost::lexical_cast<std::string>(i)
+        + " WARN aptitude.test - message " + boost::lexical_cast<std::string>(i);
+
+      ASSERT_LE(expected_suffix.size(), lines[i].size());
+      EXPECT_EQ(expected_suffix,
+                lines[i].substr(lines[i].size() - expected_suffix.size()));
+    }
+}
+
+TEST_F(AsyncLogSinkTest, testAsyncLogSinkWritesRemainingMessagesWhenDestroyed)
+{
+  LoggerPtr logger = getLogger("");
+
+  {
+    shared_ptr<LogSink> sink = createAsyncLogSink(filename, 1024);
+    for(int i = 0; i < 10; ++i)
+      sink->message_logged(sourceFilename2, sourceLineNumber2, ERROR_LEVEL, logger, msg2);
+  }
+
+  EXPECT_EQ(10, (int)read_lines(filename).size());
+}
+
+TEST_F(AsyncLogSinkTest, testAsyncLogSinkMakeSynchronous)
+{
+  LoggerPtr logger = getLogger("aptitude.test");
+  shared_ptr<LogSink> sink = createAsyncLogSink(filename, 4);
+
+  for(int i = 0; i < 10; ++i)
+    sink->message_logged(sourceFilename1, i, WARN_LEVEL, logger, msg1);
+
+  // The buffered messages are written at once, and later messages
+  // are written before message_logged() returns.
+  sink->make_synchronous();
+  EXPECT_EQ(10, (int)read_lines(filename).size());
+
+  sink->message_logged(sourceFilename2, sourceLineNumber2, ERROR_LEVEL, logger, msg2);
+  const std::vector<std::string> lines = read_lines(filename);
+  ASSERT_EQ(11, (int)lines.size());
+  const std::string expected_suffix = " ERROR aptitude.test - " + msg2;
+  ASSERT_LE(expected_suffix.size(), lines.back().size());
+  EXPECT_EQ(expected_suffix,
+            lines.back().substr(lines.back().size() - expected_suffix.size()));
+}
+
+TEST_F(AsyncLogSinkTest, testAsyncLogSinkSeveralThreads)
+{
+  LoggerPtr logger = getLogger("aptitude");
+  shared_ptr<LogSink> sink = createAsyncLogSink(filename, 16);
+
+  const int num_threads = 4;
+  const int num_messages = 1000;
+
+  std::vector<log_from_thread_info> infos(num_threads);
+  std::vector<pthread_t> threads(num_threads);
+  for(int i = 0; i < num_threads; ++i)
+    {
+      infos[i].sink = sink;
+      infos[i].logger = logger;
+      infos[i].thread_num = i;
+      infos[i].num_messages = num_messages;
+      ASSERT_EQ(0, pthread_create(&threads[i], NULL, &log_from_thread, &infos[i]));
+    }
+
+  for(int i = 0; i < num_threads; ++i)
+    ASSERT_EQ(0, pthread_join(threads[i], NULL));
+
+  sink->flush();
+
+  // Every message is written once, and the messages of each thread
+  // are in the order it logged them.
+  const std::vector<std::string> lines = read_lines(filename);
+  ASSERT_EQ(num_threads * num_messages, (int)lines.size());
+
+  std::map<int, int> next_message;
+  for(std::vector<std::string>::const_iterator it = lines.begin();
+      it != lines.end(); ++it)
+    {
+      const std::string::size_type dash = it->rfind(" - ");
+      ASSERT_NE(std::string::npos, dash);
+
+      const std::string msg = it->substr(dash + 3);
+      const std::string::size_type space = msg.find(' ');
+      ASSERT_NE(std::string::npos, space);
+
+      const int thread_num = boost::lexical_cast<int>(msg.substr(0, space));
+      const int message_num = boost::lexical_cast<int>(msg.substr(space + 1));
+
+      EXPECT_EQ(next_message[thread_num], message_num);
+      next_message[thread_num] = message_num + 1;
+    }
+
+  for(int i = 0; i < num_threads; ++i)
+    EXPECT_EQ(num_messages, next_message[i]);
+}
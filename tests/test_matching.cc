@@ -19,14 +19,19 @@
 
 #include <cppunit/extensions/HelperMacros.h>
 
+#include <generic/apt/apt.h>
+#include <generic/apt/aptcache.h>
 #include <generic/apt/matching/compare_patterns.h>
+#include <generic/apt/matching/match.h>
 #include <generic/apt/matching/parse.h>
 #include <generic/apt/matching/pattern.h>
 #include <generic/apt/matching/serialize.h>
 
 #include <cwidget/generic/util/ssprintf.h>
 
+#include <apt-pkg/configuration.h>
 #include <apt-pkg/error.h>
+#include <apt-pkg/progress.h>
 
 using namespace aptitude::matching;
 using cwidget::util::ref_ptr;
@@ -809,6 +814,73 @@ namespace
   };
 
   const int num_test_patterns = sizeof(test_patterns) / sizeof(test_patterns[0]);
+
+  // Patterns that test_match() must answer the same way as
+  // get_match(), grouped by the part of the pattern compiler that
+  // they exercise.
+  const char * const test_match_patterns[] =
+    {
+      // Constant folding.
+      "?true",
+      "?false",
+      "?and(?true, ?name(apt))",
+      "?and(?false, ?name(apt))",
+      "?or(?false, ?name(apt))",
+      "?or(?true, ?broken)",
+      "?not(?true)",
+      "?and(?not(?false), ?installed)",
+      "?or(?and(?true, ?false), ?not(?or(?false, ?false)))",
+
+      // Reordering of ?and and ?or terms by cost.
+      "?and(?description(package), ?installed)",
+      "?and(?depends(?name(debconf)), ?name(^apt))",
+      "?or(?depends(?name(debconf)), ?name(^apt$))",
+      "?and(?name(apt), ?not(?section(admin)), ?priority(important))",
+      "?or(?maintainer(Burrows), ?installed, ?name(perl))",
+      "?and(?or(?section(devel), ?description(library)), ?not(?installed))",
+
+      // ?not.
+      "?not(?name(apt))",
+      "?not(?not(?installed))",
+      "!~i",
+      "?not(?and(?installed, ?name(apt)))",
+      "?not(?depends(?installed))",
+
+      // ?any-version and ?all-versions.
+      "?any-version(?version(^0\\.7))",
+      "?any-version(?archive(experimental))",
+      "?all-versions(?archive(unstable))",
+      "?all-versions(?not(?archive(experimental)))",
+      "?any-version(?and(?archive(unstable), ?version(CURRENT)))",
+      "?not(?all-versions(?installed))",
+
+      // ?narrow.
+      "?narrow(?archive(experimental), ?version(^0\\.7))",
+      "?narrow(?installed, ?name(apt))",
+      "?depends(?narrow(?installed, ?name(debconf)))",
+      "?not(?narrow(?archive(unstable), ?true))",
+
+      // ?widen.
+      "?widen(?version(CURRENT))",
+      "?narrow(?archive(unstable), ?widen(?archive(experimental)))",
+      "?any-version(?widen(?version(CANDIDATE)))",
+      "?and(?archive(unstable), ?widen(?installed))",
+
+      // Terms that depend on the version being tested.
+      "?version(CURRENT)",
+      "?version(CANDIDATE)",
+      "?version(TARGET)",
+      "?archive(experimental)",
+      "?origin(Debian)",
+      "?upgradable",
+      "?depends(apt)",
+      "?reverse-depends(?installed)",
+      "?installed",
+      "?broken"
+    };
+
+  const int num_test_match_patterns =
+    sizeof(test_match_patterns) / sizeof(test_match_patterns[0]);
 }
 
 class MatchingTest : public CppUnit::TestFixture
@@ -820,6 +892,7 @@ class MatchingTest : public CppUnit::TestFixture
   CPPUNIT_TEST(testParseThenSerialize);
   CPPUNIT_TEST(testSerialize);
   CPPUNIT_TEST(testSerializationParse);
+  CPPUNIT_TEST(testTestMatch);
 
   CPPUNIT_TEST_SUITE_END();
 
@@ -999,6 +1072,61 @@ public:
 						      test.expected_pattern));
       }
   }
+
+  // Check that test_match() gives the same answer as
+  // get_match().valid() for every package and version of a captured
+  // apt state.
+  void testTestMatch()
+  {
+    const std::string rootdir = std::string(SRCDIR) + "/resolver_inputs/apt-needs-downgrade";
+
+    apt_preinit(rootdir.c_str());
+    _error->Discard();
+
+    // Build the cache in memory instead of writing it to the source
+    // tree.
+    _config->Set("Dir::Cache::pkgcache", "");
+    _config->Set("Dir::Cache::srcpkgcache", "");
+
+    OpProgress progress;
+    apt_init(&progress, false, NULL);
+    CPPUNIT_ASSERT(apt_cache_file != NULL);
+    CPPUNIT_ASSERT(apt_package_records != NULL);
+
+    aptitudeDepCache &cache(**apt_cache_file);
+    pkgRecords &records(*apt_package_records);
+
+    for(int i = 0; i < num_test_match_patterns; ++i)
+      {
+	ref_ptr<pattern> p(parse(test_match_patterns[i]));
+	_error->DumpErrors();
+	CPPUNIT_ASSERT_MESSAGE(test_match_patterns[i], p.valid());
+
+	// The compiled program is stored in the search cache, so use
+	// the same one for every package, as a search would.
+	const ref_ptr<search_cache> test_info(search_cache::create());
+	const ref_ptr<search_cache> match_info(search_cache::create());
+
+	for(pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end(); ++pkg)
+	  {
+	    CPPUNIT_ASSERT_EQUAL_MESSAGE(ssprintf("Testing the package %s against %s",
+						  pkg.FullName().c_str(),
+						  test_match_patterns[i]),
+					 get_match(p, pkg, match_info, cache, records).valid(),
+					 test_match(p, pkg, test_info, cache, records));
+
+	    for(pkgCache::VerIterator ver = pkg.VersionList(); !ver.end(); ++ver)
+	      CPPUNIT_ASSERT_EQUAL_MESSAGE(ssprintf("Testing %s %s against %s",
+						    pkg.FullName().c_str(),
+						    ver.VerStr(),
+						    test_match_patterns[i]),
+					   get_match(p, pkg, ver, match_info, cache, records).valid(),
+					   test_match(p, pkg, ver, test_info, cache, records));
+	  }
+      }
+
+    apt_close_cache();
+  }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(MatchingTest);
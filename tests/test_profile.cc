@@ -0,0 +1,161 @@
+/** \file test_profile.cc */
+
+// Copyright (C) 2011 Daniel Burrows
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; see the file COPYING.  If not, write to
+// the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+// Boston, MA 02111-1307, USA.
+
+#include <generic/util/profile.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <clocale>
+#include <locale>
+#include <sstream>
+#include <string>
+
+#include <unistd.h>
+
+using aptitude::util::enable_profiling;
+using aptitude::util::profile_counter;
+using aptitude::util::profile_phase;
+using aptitude::util::write_profile_report;
+using aptitude::util::logging::Logger;
+
+namespace
+{
+  profile_counter test_steps("test-steps", "test-search");
+  profile_counter test_steps_again("test-steps");
+  profile_counter test_bytes("test-\"bytes\"");
+
+  /** \brief Number formatting with a decimal comma and grouped
+   *  thousands, as in the de_DE locale.
+   */
+  class comma_numpunct : public std::numpunct<char>
+  {
+  protected:
+    char do_decimal_point() const { return ','; }
+    char do_thousands_sep() const { return '.'; }
+    std::string do_grouping() const { return "\3"; }
+  };
+
+  /** \brief Check that every value of the given member in a report
+   *  is a JSON number.
+   */
+  void check_numbers(const std::string &report, const std::string &member)
+  {
+    const std::string key = "\"" + member + "\": ";
+    int found = 0;
+
+    for(std::string::size_type pos = report.find(key);
+	pos != std::string::npos; pos = report.find(key, pos + 1))
+      {
+	const std::string::size_type start = pos + key.size();
+	const std::string::size_type end = report.find_first_of(",}\n", start);
+	BOOST_REQUIRE(end != std::string::npos);
+	const std::string number(report, start, end - start);
+
+	std::istringstream in(number);
+	in.imbue(std::locale::classic());
+	double value;
+	in >> value;
+	BOOST_CHECK_MESSAGE(in && in.peek() == EOF,
+			    member << " is not a JSON number: " << number);
+	++found;
+      }
+
+    BOOST_CHECK(found > 0);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(profileReport)
+{
+  enable_profiling();
+
+  const aptitude::util::logging::LoggerPtr logger =
+    Logger::getLogger("test.profile");
+
+  for(int i = 0; i < 2; ++i)
+    {
+      profile_phase outer("test-outer", logger);
+      {
+	profile_phase search("test-search", logger);
+	usleep(10000);
+	test_steps.add(10);
+	test_steps_again.increment();
+      }
+    }
+
+  test_bytes.add(5);
+
+  std::ostringstream out;
+  write_profile_report(out);
+  const std::string report(out.str());
+
+  // Phases with the same name and parent are merged, and nested
+  // phases are recorded as children of the enclosing phase.
+  BOOST_CHECK(report.find("{\"name\": \"test-outer\", \"calls\": 2, ") != std::string::npos);
+  BOOST_CHECK(report.find("\"phases\": [\n      {\"name\": \"test-search\", \"calls\": 2, ") != std::string::npos);
+
+  // Counters with the same name are added up, and the rate is
+  // computed against the time spent in the rate phase (about 20 ms).
+  const std::string::size_type steps = report.find("\"test-steps\": {\"value\": 22, \"per_second\": ");
+  BOOST_REQUIRE(steps != std::string::npos);
+  std::istringstream rate_in(report.substr(steps + std::string("\"test-steps\": {\"value\": 22, \"per_second\": ").size()));
+  double rate = 0;
+  rate_in >> rate;
+  BOOST_CHECK(rate > 0);
+  BOOST_CHECK(rate <= 1100);
+
+  BOOST_CHECK(report.find("\"test-\\\"bytes\\\"\": {\"value\": 5}") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(profileReportIgnoresLocale)
+{
+  enable_profiling();
+
+  const aptitude::util::logging::LoggerPtr logger =
+    Logger::getLogger("test.profile");
+
+  {
+    profile_phase search("test-search", logger);
+    usleep(1000);
+    test_steps.add(1234567);
+  }
+
+  // Use a locale with a decimal comma both for the C library, if one
+  // is installed, and for C++ streams.
+  const std::string old_c_locale(setlocale(LC_ALL, NULL));
+  const char * const comma_locales[] = { "de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8" };
+  for(unsigned int i = 0; i < sizeof(comma_locales) / sizeof(comma_locales[0]); ++i)
+    if(setlocale(LC_ALL, comma_locales[i]) != NULL)
+      break;
+
+  const std::locale old_locale =
+    std::locale::global(std::locale(std::locale::classic(), new comma_numpunct));
+
+  std::ostringstream out;
+  write_profile_report(out);
+  const std::string report(out.str());
+
+  std::locale::global(old_locale);
+  setlocale(LC_ALL, old_c_locale.c_str());
+
+  check_numbers(report, "wall_time_ms");
+  check_numbers(report, "total_ms");
+  check_numbers(report, "calls");
+  check_numbers(report, "value");
+  check_numbers(report, "per_second");
+}
@@ -207,6 +207,9 @@ class ResolverTest : public CppUnit::TestFixture
   CPPUNIT_TEST(testJointScores);
   CPPUNIT_TEST(testDropSolutionSupersets);
   CPPUNIT_TEST(testBreakSoftDepCost);
+  CPPUNIT_TEST(testParallelInitialBroken);
+  CPPUNIT_TEST(testReusePromotions);
+  CPPUNIT_TEST(testRestartAfterStateChange);
 
   CPPUNIT_TEST_SUITE_END();
 
@@ -1271,6 +1274,30 @@ private:
 	    CPPUNIT_ASSERT_EQUAL_MESSAGE("sum" + wheremsg, sums[i][j], boost::lexical_cast<std::string>(cost1 + cost2));
           }
       }
+
+    LOG_TRACE(logger, "Testing operations on costs that only raise the structural level.");
+
+    // These take a shortcut that avoids building a new cost, so make
+    // sure that they agree with the general case.
+    const cost minimum;
+    const cost structural50(cost::make_advance_structural_level(50));
+
+    CPPUNIT_ASSERT_EQUAL(ops[1], ops[1] + minimum);
+    CPPUNIT_ASSERT_EQUAL(ops[1], minimum + ops[1]);
+    CPPUNIT_ASSERT_EQUAL(ops[0], ops[0] + structural50);
+    CPPUNIT_ASSERT_EQUAL(ops[0], structural50 + ops[0]);
+    CPPUNIT_ASSERT_EQUAL(std::string("(advance: 50, add: 2, add: 4)"),
+			 boost::lexical_cast<std::string>(ops[1] + structural50));
+    CPPUNIT_ASSERT_EQUAL(std::string("(advance: 50, add: 2, add: 4)"),
+			 boost::lexical_cast<std::string>(cost::least_upper_bound(structural50, ops[1])));
+    CPPUNIT_ASSERT_EQUAL(std::string("(advance: 50)"),
+			 boost::lexical_cast<std::string>(cost::greatest_lower_bound(ops[0], structural50)));
+    CPPUNIT_ASSERT_EQUAL(std::string("(nop)"),
+			 boost::lexical_cast<std::string>(cost::greatest_lower_bound(ops[1], minimum)));
+    CPPUNIT_ASSERT_EQUAL(std::string("(nop)"),
+			 boost::lexical_cast<std::string>(cost::greatest_lower_bound(structural50, ops[1])));
+    CPPUNIT_ASSERT_EQUAL(cost(), minimum + minimum);
+    CPPUNIT_ASSERT_EQUAL(cost().get_hash_value(), cost_limits::minimum_cost.get_hash_value());
   }
 
   void testCostOperations()
@@ -1599,6 +1626,165 @@ private:
       CPPUNIT_ASSERT_EQUAL(cost::make_add_to_user_level(0, 1), sols[1].get_cost());
     }
   }
+
+  // Check that scanning for the initially broken dependencies in
+  // several threads finds the same dependencies as a serial scan.
+  void testParallelInitialBroken()
+  {
+    const char *universes[] = { dummy_universe_1, dummy_universe_2,
+				dummy_universe_3, dummy_universe_4,
+				dummy_universe_5, dummy_universe_6 };
+
+    for(std::size_t i = 0; i < sizeof(universes) / sizeof(universes[0]); ++i)
+      {
+	dummy_universe_ref u = parseUniverse(universes[i]);
+
+	dummy_resolver serial(10, -300, -100, 100000, 50000,
+			      cost_limits::minimum_cost,
+			      50,
+			      imm::map<dummy_universe::package, dummy_universe::version>(),
+			      u);
+
+	// Include more threads than there are packages.
+	for(int threads = 2; threads <= 5; ++threads)
+	  {
+	    dummy_resolver parallel(10, -300, -100, 100000, 50000,
+				    cost_limits::minimum_cost,
+				    50,
+				    imm::map<dummy_universe::package, dummy_universe::version>(),
+				    u,
+				    threads);
+
+	    CPPUNIT_ASSERT_EQUAL(serial.get_initial_broken(),
+				 parallel.get_initial_broken());
+	  }
+      }
+  }
+
+  // Check that the unconditional promotions learned by one resolver
+  // can be handed to a fresh resolver without changing its output.
+  void testReusePromotions()
+  {
+    const char *universes[] = { dummy_universe_1, dummy_universe_2,
+				dummy_universe_3, dummy_universe_4,
+				dummy_universe_5, dummy_universe_6 };
+
+    for(std::size_t i = 0; i < sizeof(universes) / sizeof(universes[0]); ++i)
+      {
+	dummy_universe_ref u = parseUniverse(universes[i]);
+
+	dummy_resolver r1(10, -300, -100, 100000, 50000,
+			  cost_limits::minimum_cost,
+			  50,
+			  imm::map<dummy_universe::package, dummy_universe::version>(),
+			  u);
+
+	std::vector<solution> solutions1;
+	try
+	  {
+	    find_all_solutions(r1, 1000, NULL, solutions1);
+	  }
+	catch(NoMoreTime)
+	  {
+	    CPPUNIT_FAIL("No more time to find a solution.");
+	  }
+
+	std::vector<dummy_resolver::promotion> promotions;
+	r1.get_unconditional_promotions(promotions);
+
+	dummy_resolver r2(10, -300, -100, 100000, 50000,
+			  cost_limits::minimum_cost,
+			  50,
+			  imm::map<dummy_universe::package, dummy_universe::version>(),
+			  u);
+
+	for(std::vector<dummy_resolver::promotion>::const_iterator it =
+	      promotions.begin(); it != promotions.end(); ++it)
+	  {
+	    CPPUNIT_ASSERT(!it->get_valid_condition().valid());
+	    CPPUNIT_ASSERT(it->get_cost().get_structural_level() < cost_limits::defer_structural_level ||
+			   it->get_cost().get_structural_level() == cost_limits::conflict_structural_level);
+
+	    r2.add_promotion(it->get_choices(), it->get_cost());
+	  }
+
+	std::vector<solution> solutions2;
+	try
+	  {
+	    find_all_solutions(r2, 1000, NULL, solutions2);
+	  }
+	catch(NoMoreTime)
+	  {
+	    CPPUNIT_FAIL("No more time to find a solution.");
+	  }
+
+	CPPUNIT_ASSERT_EQUAL(solutions1.size(), solutions2.size());
+	for(std::size_t j = 0; j < solutions1.size(); ++j)
+	  assertSameEffect(solutions1[j].get_choices(),
+			   solutions2[j].get_choices());
+      }
+  }
+
+  // Check that a resolver that is restarted after the current version
+  // of a package changed behaves like a resolver created from the new
+  // state.
+  void testRestartAfterStateChange()
+  {
+    dummy_universe_ref u = parseUniverse(dummy_universe_1);
+
+    dummy_resolver r1(10, -300, -100, 100000, 50000,
+		      cost_limits::minimum_cost,
+		      50,
+		      imm::map<dummy_universe::package, dummy_universe::version>(),
+		      u);
+
+    std::vector<solution> solutions1;
+    try
+      {
+	find_all_solutions(r1, 1000, NULL, solutions1);
+      }
+    catch(NoMoreTime)
+      {
+	CPPUNIT_FAIL("No more time to find a solution.");
+      }
+
+    package b = u.find_package("b");
+    version bv3 = b.version_from_name("v3");
+    r1.reject_version(bv3);
+
+    u.set_current_version("b", "v2");
+
+    std::vector<package> changed;
+    changed.push_back(b);
+    r1.restart(true);
+    r1.update_initial_broken(changed);
+
+    CPPUNIT_ASSERT(!r1.is_rejected(bv3));
+
+    dummy_resolver r2(10, -300, -100, 100000, 50000,
+		      cost_limits::minimum_cost,
+		      50,
+		      imm::map<dummy_universe::package, dummy_universe::version>(),
+		      u);
+
+    CPPUNIT_ASSERT_EQUAL(r2.get_initial_broken(), r1.get_initial_broken());
+
+    std::vector<solution> solutions2, solutions3;
+    try
+      {
+	find_all_solutions(r1, 1000, NULL, solutions2);
+	find_all_solutions(r2, 1000, NULL, solutions3);
+      }
+    catch(NoMoreTime)
+      {
+	CPPUNIT_FAIL("No more time to find a solution.");
+      }
+
+    CPPUNIT_ASSERT_EQUAL(solutions3.size(), solutions2.size());
+    for(std::size_t i = 0; i < solutions2.size(); ++i)
+      assertSameEffect(solutions3[i].get_choices(),
+		       solutions2[i].get_choices());
+  }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(ResolverTest);
@@ -0,0 +1,212 @@
+/** \file test_small_object_pool.cc */
+
+// Copyright (C) 2011 Daniel Burrows
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; see the file COPYING.  If not, write to
+// the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+// Boston, MA 02111-1307, USA.
+
+#include <generic/util/small_object_pool.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <set>
+#include <vector>
+
+#include <pthread.h>
+#include <semaphore.h>
+
+using aptitude::util::small_object_pool;
+
+BOOST_AUTO_TEST_CASE(smallObjectPoolReusesFreedBlocks)
+{
+  void * const p = small_object_pool::allocate(24);
+  BOOST_REQUIRE(p != NULL);
+  small_object_pool::deallocate(p, 24);
+
+  // Sizes in the same size class share a free list, so the block
+  // that was just freed should be handed out again.
+  void * const q = small_object_pool::allocate(32);
+  BOOST_CHECK_EQUAL(p, q);
+  small_object_pool::deallocate(q, 32);
+}
+
+BOOST_AUTO_TEST_CASE(smallObjectPoolDistinctBlocks)
+{
+  std::set<char *> blocks;
+  const std::size_t size = 48;
+
+  for(int i = 0; i < 5000; ++i)
+    {
+      char * const p = static_cast<char *>(small_object_pool::allocate(size));
+      BOOST_CHECK_EQUAL(reinterpret_cast<std::size_t>(p) % sizeof(void *), 0);
+
+      // No live block may overlap another one.
+      std::set<char *>::const_iterator found = blocks.lower_bound(p);
+      if(found != blocks.end())
+	BOOST_CHECK(*found >= p + size);
+      if(found != blocks.begin())
+	{
+	  --found;
+	  BOOST_CHECK(*found + size <= p);
+	}
+
+      blocks.insert(p);
+    }
+
+  for(std::set<char *>::const_iterator it = blocks.begin();
+      it != blocks.end(); ++it)
+    small_object_pool::deallocate(*it, size);
+}
+
+BOOST_AUTO_TEST_CASE(smallObjectPoolReservedBytes)
+{
+  const std::size_t before = small_object_pool::get_reserved_bytes();
+
+  // Allocate more than one chunk's worth of the largest pooled size,
+  // which forces the pool to reserve more memory.
+  std::set<void *> blocks;
+  for(int i = 0; i < 1000; ++i)
+    blocks.insert(small_object_pool::allocate(small_object_pool::max_object_size));
+
+  const std::size_t after = small_object_pool::get_reserved_bytes();
+  BOOST_CHECK_GE(after - before,
+		 1000 * small_object_pool::max_object_size);
+
+  for(std::set<void *>::const_iterator it = blocks.begin();
+      it != blocks.end(); ++it)
+    small_object_pool::deallocate(*it, small_object_pool::max_object_size);
+
+  // Freeing memory doesn't return it to the system, and reusing it
+  // doesn't reserve any more.
+  BOOST_CHECK_EQUAL(small_object_pool::get_reserved_bytes(), after);
+  void * const p = small_object_pool::allocate(small_object_pool::max_object_size);
+  BOOST_CHECK_EQUAL(small_object_pool::get_reserved_bytes(), after);
+  small_object_pool::deallocate(p, small_object_pool::max_object_size);
+}
+
+BOOST_AUTO_TEST_CASE(smallObjectPoolLargeObjects)
+{
+  const std::size_t before = small_object_pool::get_reserved_bytes();
+  void * const p = small_object_pool::allocate(small_object_pool::max_object_size + 1);
+  BOOST_CHECK(p != NULL);
+  small_object_pool::deallocate(p, small_object_pool::max_object_size + 1);
+  BOOST_CHECK_EQUAL(small_object_pool::get_reserved_bytes(), before);
+}
+
+namespace
+{
+  const std::size_t thread_block_size = 160;
+
+  void *allocate_and_free_in_thread(void *)
+  {
+    small_object_pool::deallocate(small_object_pool::allocate(thread_block_size),
+				  thread_block_size);
+    return NULL;
+  }
+}
+
+BOOST_AUTO_TEST_CASE(smallObjectPoolThreadExit)
+{
+  // The blocks that a thread leaves behind when it exits should be
+  // reused by the next thread, so running threads one after another
+  // only reserves one chunk for the size class.
+  pthread_t thread;
+  BOOST_REQUIRE_EQUAL(pthread_create(&thread, NULL, &allocate_and_free_in_thread, NULL), 0);
+  BOOST_REQUIRE_EQUAL(pthread_join(thread, NULL), 0);
+
+  const std::size_t after_first = small_object_pool::get_reserved_bytes();
+
+  for(int i = 0; i < 10; ++i)
+    {
+      BOOST_REQUIRE_EQUAL(pthread_create(&thread, NULL, &allocate_and_free_in_thread, NULL), 0);
+      BOOST_REQUIRE_EQUAL(pthread_join(thread, NULL), 0);
+    }
+
+  BOOST_CHECK_EQUAL(small_object_pool::get_reserved_bytes(), after_first);
+}
+
+namespace
+{
+  const std::size_t cross_thread_block_size = 208;
+  const int cross_thread_blocks = 5000;
+
+  /** \brief A thread that allocates blocks on request, like the
+   *  resolver's background thread; the main thread frees them.
+   */
+  struct cross_thread_allocator
+  {
+    sem_t allocate_requested;
+    sem_t allocated;
+    bool done;
+    std::vector<void *> blocks;
+  };
+
+  void *allocate_on_request(void *arg)
+  {
+    cross_thread_allocator * const allocator =
+      static_cast<cross_thread_allocator *>(arg);
+
+    while(true)
+      {
+	sem_wait(&allocator->allocate_requested);
+	if(allocator->done)
+	  return NULL;
+
+	for(int i = 0; i < cross_thread_blocks; ++i)
+	  allocator->blocks.push_back(small_object_pool::allocate(cross_thread_block_size));
+
+	sem_post(&allocator->allocated);
+      }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(smallObjectPoolCrossThreadFree)
+{
+  // Blocks that are allocated in one long-lived thread and freed in
+  // another should make their way back to the allocating thread, so
+  // repeating the cycle doesn't keep reserving new chunks.
+  cross_thread_allocator allocator;
+  sem_init(&allocator.allocate_requested, 0, 0);
+  sem_init(&allocator.allocated, 0, 0);
+  allocator.done = false;
+
+  pthread_t thread;
+  BOOST_REQUIRE_EQUAL(pthread_create(&thread, NULL, &allocate_on_request, &allocator), 0);
+
+  std::size_t after_warmup = 0;
+  for(int cycle = 0; cycle < 20; ++cycle)
+    {
+      sem_post(&allocator.allocate_requested);
+      sem_wait(&allocator.allocated);
+
+      for(std::vector<void *>::const_iterator it = allocator.blocks.begin();
+	  it != allocator.blocks.end(); ++it)
+	small_object_pool::deallocate(*it, cross_thread_block_size);
+      allocator.blocks.clear();
+
+      // The first two cycles fill the free lists of both threads.
+      if(cycle == 1)
+	after_warmup = small_object_pool::get_reserved_bytes();
+    }
+
+  BOOST_CHECK_LE(small_object_pool::get_reserved_bytes(),
+		 after_warmup + 2 * small_object_pool::chunk_size);
+
+  allocator.done = true;
+  sem_post(&allocator.allocate_requested);
+  BOOST_REQUIRE_EQUAL(pthread_join(thread, NULL), 0);
+  sem_destroy(&allocator.allocate_requested);
+  sem_destroy(&allocator.allocated);
+}
@@ -0,0 +1,89 @@
+/** \file test_symbol_table.cc */
+
+// Copyright (C) 2011 Daniel Burrows
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; see the file COPYING.  If not, write to
+// the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+// Boston, MA 02111-1307, USA.
+
+#include <generic/apt/symbol_table.h>
+
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+using aptitude::apt::symbol_id;
+using aptitude::apt::symbol_membership;
+using aptitude::apt::symbol_set;
+using aptitude::apt::symbol_table;
+
+BOOST_AUTO_TEST_CASE(symbolTableInternsStrings)
+{
+  symbol_table table;
+
+  const symbol_id desktop = table.intern("desktop");
+  const symbol_id server = table.intern("server");
+
+  BOOST_CHECK_EQUAL(desktop, 0U);
+  BOOST_CHECK_EQUAL(server, 1U);
+  BOOST_CHECK_EQUAL(table.intern("desktop"), desktop);
+  BOOST_CHECK_EQUAL(table.size(), 2U);
+  BOOST_CHECK_EQUAL(table.get_name(server), "server");
+
+  symbol_id found = 99;
+  BOOST_CHECK(table.find("server", found));
+  BOOST_CHECK_EQUAL(found, server);
+  BOOST_CHECK(!table.find("laptop", found));
+
+  table.clear();
+  BOOST_CHECK_EQUAL(table.size(), 0U);
+  BOOST_CHECK(!table.find("desktop", found));
+}
+
+BOOST_AUTO_TEST_CASE(symbolMembershipPacksSortedSets)
+{
+  symbol_membership membership;
+
+  membership.add(2, 5);
+  membership.add(0, 3);
+  membership.add(2, 1);
+  membership.add(2, 5);
+  membership.add(7, 4);
+
+  // Nothing is visible before finish().
+  BOOST_CHECK(membership.get(2).empty());
+
+  membership.finish(4);
+
+  const symbol_set pkg0 = membership.get(0);
+  BOOST_CHECK_EQUAL(pkg0.size(), 1U);
+  BOOST_CHECK(pkg0.contains(3));
+
+  BOOST_CHECK(membership.get(1).empty());
+
+  // Duplicates are dropped and the IDs are sorted.
+  const symbol_set pkg2 = membership.get(2);
+  const std::vector<symbol_id> ids(pkg2.begin(), pkg2.end());
+  BOOST_REQUIRE_EQUAL(ids.size(), 2U);
+  BOOST_CHECK_EQUAL(ids[0], 1U);
+  BOOST_CHECK_EQUAL(ids[1], 5U);
+  BOOST_CHECK(!pkg2.contains(3));
+
+  // Packages outside the cache have no symbols.
+  BOOST_CHECK(membership.get(7).empty());
+  BOOST_CHECK(membership.get(100).empty());
+
+  membership.clear();
+  BOOST_CHECK(membership.get(0).empty());
+}